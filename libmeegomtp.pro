@@ -30,6 +30,10 @@ mts_protocol_tests.subdir = mts/protocol/unittests
 mts_protocol_tests.target = sub-mts-protocol-tests
 mts_protocol_tests.depends = sub-mts
 
+mts_transport_tests.subdir = mts/transport/usb/unittests
+mts_transport_tests.target = sub-mts-transport-tests
+mts_transport_tests.depends = sub-mts
+
 service.subdir = service
 service.target = sub-service
 service.depends = sub-mts
@@ -46,6 +50,7 @@ SUBDIRS += \
     mts_fsstorage_tests \
     mts_deviceinfo_tests \
     mts_protocol_tests \
+    mts_transport_tests \
     service \
     systemd
 
@@ -0,0 +1,218 @@
+/*
+* This file is part of libmeegomtp package
+*
+* Copyright (C) 2010 Nokia Corporation. All rights reserved.
+*
+* Contact: Deepak Kodihalli <deepak.kodihalli@nokia.com>
+*
+* Redistribution and use in source and binary forms, with or without modification,
+* are permitted provided that the following conditions are met:
+*
+* Redistributions of source code must retain the above copyright notice, this list
+* of conditions and the following disclaimer. Redistributions in binary form must
+* reproduce the above copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of Nokia Corporation nor the names of its contributors may be
+* used to endorse or promote products derived from this software without specific
+* prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+* INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+* BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+* LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+* OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+* OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <QtCore/QMutexLocker>
+
+#include "bufferpool.h"
+
+using namespace meegomtp1dot0;
+
+// Sits in front of every buffer handed out. It is 16 bytes so that the
+// buffer keeps malloc's alignment.
+struct BufferPool::Header
+{
+    quint32 capacity;   ///< Usable bytes after the header
+    qint32 sizeClass;   ///< Index into the free lists, -1 if oversized
+    Header *next;       ///< Next on the free list
+#if QT_POINTER_SIZE == 4
+    quint32 padding;
+#endif
+};
+
+BufferPool* BufferPool::instance()
+{
+    static BufferPool pool;
+    return &pool;
+}
+
+BufferPool::BufferPool()
+{
+    for (int i = 0; i < CLASS_COUNT; i++)
+    {
+        m_free[i] = 0;
+        m_freeCount[i] = 0;
+    }
+    memset(&m_stats, 0, sizeof(m_stats));
+}
+
+BufferPool::~BufferPool()
+{
+    trim();
+}
+
+BufferPool::Header* BufferPool::header(const quint8 *buffer)
+{
+    return reinterpret_cast<Header*>(const_cast<quint8*>(buffer) - sizeof(Header));
+}
+
+int BufferPool::sizeClass(quint32 size)
+{
+    if (size > MAX_CLASS_SIZE)
+    {
+        return -1;
+    }
+    int index = 0;
+    quint32 classSize = MIN_CLASS_SIZE;
+    while (classSize < size)
+    {
+        classSize <<= 1;
+        index++;
+    }
+    return index;
+}
+
+quint8* BufferPool::allocate(quint32 size)
+{
+    int index = sizeClass(size);
+    quint32 capacity = index < 0 ? size : MIN_CLASS_SIZE << index;
+    Header *h = 0;
+
+    {
+        QMutexLocker locker(&m_lock);
+        m_stats.allocations++;
+        if (index < 0)
+        {
+            m_stats.oversized++;
+        }
+        else if (m_free[index])
+        {
+            h = m_free[index];
+            m_free[index] = h->next;
+            m_freeCount[index]--;
+            m_stats.bytesCached -= capacity;
+            m_stats.hits++;
+        }
+        m_stats.bytesInUse += capacity;
+        if (m_stats.bytesInUse > m_stats.peakBytesInUse)
+        {
+            m_stats.peakBytesInUse = m_stats.bytesInUse;
+        }
+    }
+
+    if (!h)
+    {
+        h = static_cast<Header*>(malloc(sizeof(Header) + capacity));
+        h->capacity = capacity;
+        h->sizeClass = index;
+    }
+    h->next = 0;
+    return reinterpret_cast<quint8*>(h + 1);
+}
+
+quint8* BufferPool::reallocate(quint8 *buffer, quint32 size)
+{
+    if (!buffer)
+    {
+        return allocate(size);
+    }
+    quint32 oldCapacity = capacity(buffer);
+    if (size <= oldCapacity)
+    {
+        return buffer;
+    }
+    quint8 *newBuffer = allocate(size);
+    memcpy(newBuffer, buffer, oldCapacity);
+    release(buffer);
+    return newBuffer;
+}
+
+void BufferPool::release(quint8 *buffer)
+{
+    if (!buffer)
+    {
+        return;
+    }
+    Header *h = header(buffer);
+
+    {
+        QMutexLocker locker(&m_lock);
+        m_stats.bytesInUse -= h->capacity;
+        if (h->sizeClass >= 0 && m_freeCount[h->sizeClass] < MAX_CACHED_PER_CLASS &&
+            m_stats.bytesCached + h->capacity <= MAX_CACHED_BYTES)
+        {
+            h->next = m_free[h->sizeClass];
+            m_free[h->sizeClass] = h;
+            m_freeCount[h->sizeClass]++;
+            m_stats.bytesCached += h->capacity;
+            return;
+        }
+    }
+
+    free(h);
+}
+
+quint32 BufferPool::capacity(const quint8 *buffer)
+{
+    return buffer ? header(buffer)->capacity : 0;
+}
+
+BufferPool::Stats BufferPool::stats() const
+{
+    QMutexLocker locker(&m_lock);
+    return m_stats;
+}
+
+void BufferPool::resetStats()
+{
+    QMutexLocker locker(&m_lock);
+    m_stats.allocations = 0;
+    m_stats.hits = 0;
+    m_stats.oversized = 0;
+    m_stats.peakBytesInUse = m_stats.bytesInUse;
+}
+
+void BufferPool::trim()
+{
+    Header *lists[CLASS_COUNT];
+
+    {
+        QMutexLocker locker(&m_lock);
+        for (int i = 0; i < CLASS_COUNT; i++)
+        {
+            lists[i] = m_free[i];
+            m_free[i] = 0;
+            m_freeCount[i] = 0;
+        }
+        m_stats.bytesCached = 0;
+    }
+
+    for (int i = 0; i < CLASS_COUNT; i++)
+    {
+        while (lists[i])
+        {
+            Header *next = lists[i]->next;
+            free(lists[i]);
+            lists[i] = next;
+        }
+    }
+}
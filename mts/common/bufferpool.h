@@ -0,0 +1,118 @@
+/*
+* This file is part of libmeegomtp package
+*
+* Copyright (C) 2010 Nokia Corporation. All rights reserved.
+*
+* Contact: Deepak Kodihalli <deepak.kodihalli@nokia.com>
+*
+* Redistribution and use in source and binary forms, with or without modification,
+* are permitted provided that the following conditions are met:
+*
+* Redistributions of source code must retain the above copyright notice, this list
+* of conditions and the following disclaimer. Redistributions in binary form must
+* reproduce the above copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of Nokia Corporation nor the names of its contributors may be
+* used to endorse or promote products derived from this software without specific
+* prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+* INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+* BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+* LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+* OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+* OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <QtCore/QMutex>
+
+#include "mtptypes.h"
+
+/// \brief BufferPool hands out reusable buffers for containers and transfers.
+///
+/// Buffers are grouped in size classes, powers of two from MIN_CLASS_SIZE up to MAX_CLASS_SIZE. A released
+/// buffer goes back onto the free list of its class, so that once the transfers of a session have warmed the
+/// pool up, the containers, the GetObject segments and the transport work without touching the heap. Buffers
+/// larger than MAX_CLASS_SIZE are allocated and freed directly. The pool is shared and can be used from any
+/// thread; it keeps statistics on its hit rate and peak usage. This class is a singleton.
+namespace meegomtp1dot0
+{
+class BufferPool
+{
+    public:
+        /// Usage statistics
+        struct Stats
+        {
+            quint64 allocations;    ///< Buffers handed out, including reallocations to a larger class
+            quint64 hits;           ///< Allocations served from a free list
+            quint64 oversized;      ///< Allocations too large to be pooled
+            quint64 bytesInUse;     ///< Capacity of the buffers currently handed out
+            quint64 peakBytesInUse; ///< Highest bytesInUse seen since the last resetStats()
+            quint64 bytesCached;    ///< Capacity of the buffers on the free lists
+        };
+
+        static const quint32 MIN_CLASS_SIZE = 512;          ///< The smallest size class
+        static const quint32 MAX_CLASS_SIZE = 1024 * 1024;  ///< The largest size class
+        static const int MAX_CACHED_PER_CLASS = 8;          ///< Free buffers kept per size class
+        static const quint32 MAX_CACHED_BYTES = 8 * 1024 * 1024; ///< Free bytes kept over all classes
+
+        /// Returns the pool shared by the whole stack.
+        static BufferPool* instance();
+
+        /// Returns a buffer with room for at least size bytes. Its contents are undefined.
+        /// \param size [in] The number of bytes needed.
+        quint8* allocate(quint32 size);
+
+        /// Like realloc(): returns a buffer with room for at least size bytes, holding the contents of
+        /// buffer. buffer itself is returned if it is large enough already.
+        /// \param buffer [in] A buffer from this pool, or 0.
+        /// \param size [in] The number of bytes needed.
+        quint8* reallocate(quint8 *buffer, quint32 size);
+
+        /// Gives a buffer back to the pool.
+        /// \param buffer [in] A buffer from this pool, or 0.
+        void release(quint8 *buffer);
+
+        /// Returns the number of bytes buffer has room for.
+        static quint32 capacity(const quint8 *buffer);
+
+        /// Returns a snapshot of the usage statistics.
+        Stats stats() const;
+
+        /// Clears the counters and restarts peak tracking from the current usage.
+        void resetStats();
+
+        /// Frees all the buffers on the free lists.
+        void trim();
+
+    private:
+        BufferPool();
+        ~BufferPool();
+
+        static const int CLASS_COUNT = 12; ///< MIN_CLASS_SIZE << (CLASS_COUNT - 1) == MAX_CLASS_SIZE
+
+        struct Header;
+
+        static Header* header(const quint8 *buffer);
+        static int sizeClass(quint32 size);
+
+        mutable QMutex m_lock;            ///< Protects everything below
+        Header *m_free[CLASS_COUNT];      ///< Free lists, one per size class
+        int m_freeCount[CLASS_COUNT];     ///< Length of each free list
+        Stats m_stats;
+
+        // Not copyable
+        BufferPool(const BufferPool&);
+        BufferPool& operator=(const BufferPool&);
+};
+}
+
+#endif
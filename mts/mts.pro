@@ -46,9 +46,11 @@ INCLUDEPATH += . \
 headers.files += mts.h common/trace.h common/mtptypes.h
 HEADERS += mts.h \
            common/trace.h \
+           common/bufferpool.h \
            protocol/mtpresponder.h \
            protocol/propertypod.h \
            protocol/objectpropertycache.h \
+           protocol/segmentring.h \
            protocol/mtpextensionmanager.h \
            protocol/mtpcontainer.h \
            protocol/mtpcontainerwrapper.h \
@@ -62,13 +64,16 @@ HEADERS += mts.h \
            transport/usb/mtptransporterusb.h \
            transport/usb/threadio.h \
            transport/dummy/mtptransporterdummy.h \
+           platform/storage/eventscheduler.h \
            platform/storage/storagefactory.h \
            platform/storage/storageplugin.h
 
 SOURCES += mts.cpp \
+           common/bufferpool.cpp \
            protocol/mtpresponder.cpp \
            protocol/propertypod.cpp \
            protocol/objectpropertycache.cpp \
+           protocol/segmentring.cpp \
            protocol/mtpextensionmanager.cpp \
            protocol/mtpcontainer.cpp \
            protocol/mtpcontainerwrapper.cpp \
@@ -79,6 +84,7 @@ SOURCES += mts.cpp \
            platform/deviceinfo/deviceinfo.cpp \
            platform/deviceinfo/deviceinfoprovider.cpp \
            platform/deviceinfo/xmlhandler.cpp \
+           platform/storage/eventscheduler.cpp \
            platform/storage/storagefactory.cpp \
            platform/storage/storageplugin.cpp \
            transport/usb/descriptor.c \
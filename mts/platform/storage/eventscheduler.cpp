@@ -0,0 +1,413 @@
+/*
+* This file is part of libmeegomtp package
+*
+* Copyright (C) 2010 Nokia Corporation. All rights reserved.
+*
+* Contact: Deepak Kodihalli <deepak.kodihalli@nokia.com>
+*
+* Redistribution and use in source and binary forms, with or without modification,
+* are permitted provided that the following conditions are met:
+*
+* Redistributions of source code must retain the above copyright notice, this list
+* of conditions and the following disclaimer. Redistributions in binary form must
+* reproduce the above copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of Nokia Corporation nor the names of its contributors may be
+* used to endorse or promote products derived from this software without specific
+* prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+* INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+* BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+* LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+* OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+* OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#include "eventscheduler.h"
+#include "trace.h"
+
+using namespace meegomtp1dot0;
+
+/// Object events allowed to wait before they're replaced by a rescan hint.
+static const int DEFAULT_BACKLOG_LIMIT = 256;
+/// Delay before the first event of a burst goes out; gives the coalescing
+/// rules something to work with.
+static const int DISPATCH_INTERVAL = 10;
+/// Events handed to the transport per dispatch round, to keep the interrupt
+/// endpoint queue short and the event loop responsive.
+static const int DISPATCH_BATCH = 8;
+
+/*******************************************************
+ * EventScheduler::EventScheduler
+ ******************************************************/
+EventScheduler::EventScheduler( QObject *parent ) : QObject( parent ),
+    m_nextSeq( 0 ), m_backlogLimit( DEFAULT_BACKLOG_LIMIT ), m_overflowed( false )
+{
+    m_dispatchTimer.setSingleShot( true );
+    m_dispatchTimer.setInterval( DISPATCH_INTERVAL );
+    connect( &m_dispatchTimer, SIGNAL(timeout()), this, SLOT(dispatchPending()) );
+}
+
+/*******************************************************
+ * EventScheduler::~EventScheduler
+ ******************************************************/
+EventScheduler::~EventScheduler()
+{
+}
+
+/*******************************************************
+ * void EventScheduler::setBacklogLimit
+ ******************************************************/
+void EventScheduler::setBacklogLimit( int limit )
+{
+    m_backlogLimit = qMax( limit, 1 );
+}
+
+/*******************************************************
+ * int EventScheduler::backlogLimit
+ ******************************************************/
+int EventScheduler::backlogLimit() const
+{
+    return m_backlogLimit;
+}
+
+/*******************************************************
+ * int EventScheduler::pendingEvents
+ ******************************************************/
+int EventScheduler::pendingEvents() const
+{
+    return m_storageEvents.size() + m_objectEvents.size();
+}
+
+/*******************************************************
+ * void EventScheduler::postEvent
+ ******************************************************/
+void EventScheduler::postEvent( MTPEventCode event, const QVector<quint32> &params,
+                                ObjHandle parentHandle, quint32 storageId )
+{
+    switch( event )
+    {
+        case MTP_EV_ObjectAdded:
+        case MTP_EV_ObjectRemoved:
+        case MTP_EV_ObjectInfoChanged:
+        case MTP_EV_ObjectPropChanged:
+            if( params.isEmpty() )
+            {
+                MTP_LOG_WARNING("Dropping object event without a handle" << event);
+                return;
+            }
+            postObjectEvent( event, params, parentHandle, storageId );
+            break;
+        case MTP_EV_StoreRemoved:
+            if( !params.isEmpty() )
+            {
+                dropStoreEvents( params[0] );
+            }
+            postStorageEvent( event, params );
+            break;
+        default:
+            postStorageEvent( event, params );
+            break;
+    }
+    scheduleDispatch();
+}
+
+/*******************************************************
+ * void EventScheduler::postStorageEvent
+ ******************************************************/
+void EventScheduler::postStorageEvent( MTPEventCode event, const QVector<quint32> &params )
+{
+    // Only the latest of identical events is kept, so that it still
+    // follows the object events posted before it.
+    for( int i = 0; i < m_storageEvents.size(); ++i )
+    {
+        if( m_storageEvents[i].code == event && m_storageEvents[i].params == params )
+        {
+            m_storageEvents.removeAt( i );
+            break;
+        }
+    }
+
+    PendingEvent pending;
+    pending.code = event;
+    pending.params = params;
+    pending.parentHandle = 0;
+    pending.storageId = 0;
+    pending.barrier = m_nextSeq;
+    m_storageEvents.append( pending );
+}
+
+/*******************************************************
+ * void EventScheduler::postObjectEvent
+ ******************************************************/
+void EventScheduler::postObjectEvent( MTPEventCode event, const QVector<quint32> &params,
+                                      ObjHandle parentHandle, quint32 storageId )
+{
+    if( m_overflowed )
+    {
+        // The initiator is going to rescan anyway.
+        return;
+    }
+
+    const ObjHandle handle = params[0];
+    switch( event )
+    {
+        case MTP_EV_ObjectInfoChanged:
+        {
+            if( m_added.contains( handle ) || m_infoChanged.contains( handle ) )
+            {
+                return;
+            }
+            // The initiator refetches the whole object, which covers any
+            // property change still waiting.
+            const QHash<MTPObjPropertyCode, quint64> props = m_propChanged.value( handle );
+            foreach( quint64 seq, props )
+            {
+                dropObjectEvent( seq );
+            }
+            break;
+        }
+        case MTP_EV_ObjectPropChanged:
+        {
+            if( m_added.contains( handle ) || m_infoChanged.contains( handle ) )
+            {
+                return;
+            }
+            if( params.size() > 1 && m_propChanged.value( handle ).contains( params[1] ) )
+            {
+                return;
+            }
+            break;
+        }
+        case MTP_EV_ObjectRemoved:
+        {
+            if( m_infoChanged.contains( handle ) )
+            {
+                dropObjectEvent( m_infoChanged.value( handle ) );
+            }
+            const QHash<MTPObjPropertyCode, quint64> props = m_propChanged.value( handle );
+            foreach( quint64 seq, props )
+            {
+                dropObjectEvent( seq );
+            }
+
+            // Children are removed before their parent, so by now the
+            // removals of the whole subtree are waiting under this handle.
+            // Removing the root is enough for the initiator.
+            const QList<quint64> children = m_removedByParent.values( handle );
+            foreach( quint64 seq, children )
+            {
+                dropObjectEvent( seq );
+            }
+
+            if( m_added.contains( handle ) )
+            {
+                // The initiator never heard of this object.
+                dropObjectEvent( m_added.value( handle ) );
+                return;
+            }
+            break;
+        }
+        default:
+            break;
+    }
+
+    if( m_objectEvents.size() >= m_backlogLimit )
+    {
+        overflow();
+        return;
+    }
+
+    PendingEvent pending;
+    pending.code = event;
+    pending.params = params;
+    pending.parentHandle = parentHandle;
+    pending.storageId = storageId;
+    pending.barrier = 0;
+    appendObjectEvent( pending );
+}
+
+/*******************************************************
+ * void EventScheduler::dropStoreEvents
+ ******************************************************/
+void EventScheduler::dropStoreEvents( quint32 storageId )
+{
+    // The initiator forgets the store's objects along with the store.
+    QList<quint64> dropped;
+    for( QMap<quint64, PendingEvent>::const_iterator i = m_objectEvents.constBegin();
+         i != m_objectEvents.constEnd(); ++i )
+    {
+        if( i.value().storageId == storageId )
+        {
+            dropped.append( i.key() );
+        }
+    }
+    foreach( quint64 seq, dropped )
+    {
+        dropObjectEvent( seq );
+    }
+
+    QList<PendingEvent>::iterator i = m_storageEvents.begin();
+    while( i != m_storageEvents.end() )
+    {
+        if( MTP_EV_StorageInfoChanged == i->code && !i->params.isEmpty() && i->params[0] == storageId )
+        {
+            i = m_storageEvents.erase( i );
+        }
+        else
+        {
+            ++i;
+        }
+    }
+}
+
+/*******************************************************
+ * void EventScheduler::appendObjectEvent
+ ******************************************************/
+void EventScheduler::appendObjectEvent( const PendingEvent &pending )
+{
+    const quint64 seq = m_nextSeq++;
+    const ObjHandle handle = pending.params[0];
+    m_objectEvents.insert( seq, pending );
+
+    switch( pending.code )
+    {
+        case MTP_EV_ObjectAdded:
+            m_added.insert( handle, seq );
+            break;
+        case MTP_EV_ObjectInfoChanged:
+            m_infoChanged.insert( handle, seq );
+            break;
+        case MTP_EV_ObjectPropChanged:
+            if( pending.params.size() > 1 )
+            {
+                m_propChanged[handle].insert( pending.params[1], seq );
+            }
+            break;
+        case MTP_EV_ObjectRemoved:
+            if( pending.parentHandle )
+            {
+                m_removedByParent.insert( pending.parentHandle, seq );
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/*******************************************************
+ * void EventScheduler::dropObjectEvent
+ ******************************************************/
+void EventScheduler::dropObjectEvent( quint64 seq )
+{
+    QMap<quint64, PendingEvent>::iterator i = m_objectEvents.find( seq );
+    if( i == m_objectEvents.end() )
+    {
+        return;
+    }
+    unindexObjectEvent( seq, i.value() );
+    m_objectEvents.erase( i );
+}
+
+/*******************************************************
+ * void EventScheduler::unindexObjectEvent
+ ******************************************************/
+void EventScheduler::unindexObjectEvent( quint64 seq, const PendingEvent &pending )
+{
+    const ObjHandle handle = pending.params[0];
+    switch( pending.code )
+    {
+        case MTP_EV_ObjectAdded:
+            m_added.remove( handle );
+            break;
+        case MTP_EV_ObjectInfoChanged:
+            m_infoChanged.remove( handle );
+            break;
+        case MTP_EV_ObjectPropChanged:
+            if( pending.params.size() > 1 )
+            {
+                QHash<ObjHandle, QHash<MTPObjPropertyCode, quint64> >::iterator props =
+                    m_propChanged.find( handle );
+                if( props != m_propChanged.end() )
+                {
+                    props->remove( pending.params[1] );
+                    if( props->isEmpty() )
+                    {
+                        m_propChanged.erase( props );
+                    }
+                }
+            }
+            break;
+        case MTP_EV_ObjectRemoved:
+            m_removedByParent.remove( pending.parentHandle, seq );
+            break;
+        default:
+            break;
+    }
+}
+
+/*******************************************************
+ * void EventScheduler::overflow
+ ******************************************************/
+void EventScheduler::overflow()
+{
+    MTP_LOG_WARNING("More than" << m_backlogLimit << "object events pending, asking the initiator to rescan");
+
+    m_objectEvents.clear();
+    m_added.clear();
+    m_infoChanged.clear();
+    m_propChanged.clear();
+    m_removedByParent.clear();
+    m_overflowed = true;
+
+    postStorageEvent( MTP_EV_DeviceInfoChanged, QVector<quint32>() );
+}
+
+/*******************************************************
+ * void EventScheduler::scheduleDispatch
+ ******************************************************/
+void EventScheduler::scheduleDispatch()
+{
+    if( !m_dispatchTimer.isActive() && pendingEvents() )
+    {
+        m_dispatchTimer.start();
+    }
+}
+
+/*******************************************************
+ * void EventScheduler::dispatchPending
+ ******************************************************/
+void EventScheduler::dispatchPending()
+{
+    for( int sent = 0; sent < DISPATCH_BATCH && pendingEvents(); ++sent )
+    {
+        // A storage event waits for the object events posted before it.
+        if( !m_storageEvents.isEmpty() &&
+            (m_objectEvents.isEmpty() || m_objectEvents.firstKey() >= m_storageEvents.first().barrier) )
+        {
+            PendingEvent pending = m_storageEvents.takeFirst();
+            if( MTP_EV_DeviceInfoChanged == pending.code )
+            {
+                // Anything that happens after the hint is sent is news to
+                // the initiator again.
+                m_overflowed = false;
+            }
+            emit eventReady( pending.code, pending.params );
+            continue;
+        }
+
+        QMap<quint64, PendingEvent>::iterator i = m_objectEvents.begin();
+        PendingEvent pending = i.value();
+        unindexObjectEvent( i.key(), pending );
+        m_objectEvents.erase( i );
+        emit eventReady( pending.code, pending.params );
+    }
+
+    scheduleDispatch();
+}
@@ -0,0 +1,160 @@
+/*
+* This file is part of libmeegomtp package
+*
+* Copyright (C) 2010 Nokia Corporation. All rights reserved.
+*
+* Contact: Deepak Kodihalli <deepak.kodihalli@nokia.com>
+*
+* Redistribution and use in source and binary forms, with or without modification,
+* are permitted provided that the following conditions are met:
+*
+* Redistributions of source code must retain the above copyright notice, this list
+* of conditions and the following disclaimer. Redistributions in binary form must
+* reproduce the above copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of Nokia Corporation nor the names of its contributors may be
+* used to endorse or promote products derived from this software without specific
+* prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+* INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+* BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+* LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+* OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+* OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#ifndef EVENTSCHEDULER_H
+#define EVENTSCHEDULER_H
+
+#include <QHash>
+#include <QList>
+#include <QMap>
+#include <QMultiHash>
+#include <QObject>
+#include <QTimer>
+#include <QVector>
+
+#include "mtptypes.h"
+
+/// EventScheduler sits between the storage plug-ins and the responder and
+/// paces the MTP events sent over the interrupt endpoint.
+
+/// Events go out in the order they were posted. Storage level events
+/// (StoreAdded, StoreRemoved, StorageInfoChanged, DeviceInfoChanged) are
+/// deduplicated, and StoreRemoved discards whatever is still waiting about
+/// the removed store. Object events are coalesced while they wait:
+/// ObjectInfoChanged and ObjectPropChanged are sent once per object, changes
+/// to an object that is about to be announced or removed are dropped, and
+/// removing a directory tree leaves only the removal of its root. Posting
+/// never blocks; once more than backlogLimit() object events are waiting they
+/// are all discarded and a single DeviceInfoChanged tells the initiator to
+/// rescan instead.
+
+namespace meegomtp1dot0
+{
+class EventScheduler : public QObject
+{
+    Q_OBJECT
+
+public:
+    /// Constructor.
+    /// \param parent [in] the parent object.
+    explicit EventScheduler( QObject *parent = 0 );
+
+    /// Destructor.
+    ~EventScheduler();
+
+    /// Queues an MTP event for dispatch.
+    /// \param event [in] an MTP event code.
+    /// \param params [in] the event parameters.
+    /// \param parentHandle [in] for ObjectRemoved, the handle of the removed
+    /// object's parent association, 0 if it was in a storage root or unknown.
+    /// \param storageId [in] for object events, the store the object is in,
+    /// 0 if unknown.
+    void postEvent( MTPEventCode event, const QVector<quint32> &params,
+                    ObjHandle parentHandle = 0, quint32 storageId = 0 );
+
+    /// Sets how many object events may wait before they get replaced by a
+    /// rescan hint.
+    /// \param limit [in] the number of pending object events.
+    void setBacklogLimit( int limit );
+
+    /// \return the number of pending object events that may wait before
+    /// they get replaced by a rescan hint.
+    int backlogLimit() const;
+
+    /// \return the number of events waiting for dispatch.
+    int pendingEvents() const;
+
+Q_SIGNALS:
+    /// Emitted for every event that should be sent to the initiator.
+    /// \param event [in] an MTP event code.
+    /// \param params [in] the event parameters.
+    void eventReady( MTPEventCode event, const QVector<quint32> &params );
+
+private Q_SLOTS:
+    /// Sends out the next few pending events.
+    void dispatchPending();
+
+private:
+    struct PendingEvent
+    {
+        MTPEventCode code;
+        QVector<quint32> params;
+        ObjHandle parentHandle;
+        quint32 storageId; ///< store of an object event, 0 if unknown.
+        quint64 barrier; ///< storage events: object events with a lower sequence go first.
+    };
+
+    /// Queues a storage level event, dropping it if an identical one is
+    /// already waiting.
+    void postStorageEvent( MTPEventCode event, const QVector<quint32> &params );
+
+    /// Queues an object level event, coalescing it with the waiting ones.
+    void postObjectEvent( MTPEventCode event, const QVector<quint32> &params,
+                          ObjHandle parentHandle, quint32 storageId );
+
+    /// Discards the waiting events about a store that went away.
+    void dropStoreEvents( quint32 storageId );
+
+    /// Queues an object event without any coalescing and indexes it.
+    void appendObjectEvent( const PendingEvent &pending );
+
+    /// Removes a waiting object event together with its index entries.
+    void dropObjectEvent( quint64 seq );
+
+    /// Removes the index entries pointing to a waiting object event.
+    void unindexObjectEvent( quint64 seq, const PendingEvent &pending );
+
+    /// Discards all waiting object events and asks the initiator to rescan.
+    void overflow();
+
+    void scheduleDispatch();
+
+    QList<PendingEvent> m_storageEvents; ///< storage level events in posting order.
+    QMap<quint64, PendingEvent> m_objectEvents; ///< object level events in posting order.
+    quint64 m_nextSeq; ///< sequence number of the next object event.
+
+    QHash<ObjHandle, quint64> m_added; ///< pending ObjectAdded by handle.
+    QHash<ObjHandle, quint64> m_infoChanged; ///< pending ObjectInfoChanged by handle.
+    /// pending ObjectPropChanged by handle and property code.
+    QHash<ObjHandle, QHash<MTPObjPropertyCode, quint64> > m_propChanged;
+    QMultiHash<ObjHandle, quint64> m_removedByParent; ///< pending ObjectRemoved by parent handle.
+
+    int m_backlogLimit;
+    bool m_overflowed; ///< object events are dropped until the rescan hint goes out.
+    QTimer m_dispatchTimer;
+
+#ifdef UT_ON
+    friend class StorageFactory_test;
+#endif
+};
+}
+
+#endif
@@ -0,0 +1,336 @@
+/*
+* This file is part of libmeegomtp package
+*
+* Copyright (C) 2010 Nokia Corporation. All rights reserved.
+*
+* Contact: Deepak Kodihalli <deepak.kodihalli@nokia.com>
+*
+* Redistribution and use in source and binary forms, with or without modification,
+* are permitted provided that the following conditions are met:
+*
+* Redistributions of source code must retain the above copyright notice, this list
+* of conditions and the following disclaimer. Redistributions in binary form must
+* reproduce the above copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of Nokia Corporation nor the names of its contributors may be
+* used to endorse or promote products derived from this software without specific
+* prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+* INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+* BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+* LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+* OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+* OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#include "fscopyengine.h"
+#include "trace.h"
+
+#include <QFile>
+#include <QThread>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+using namespace meegomtp1dot0;
+
+static const int MAX_COPY_THREADS = 4;
+// Bytes copied in one go before a worker looks for a cancel.
+static const size_t COPY_CHUNK_SIZE = 8 * 1024 * 1024;
+// Pipe size asked for when copying with splice().
+static const int SPLICE_PIPE_SIZE = 1024 * 1024;
+
+namespace meegomtp1dot0
+{
+class FSCopyEngineThread : public QThread
+{
+public:
+    explicit FSCopyEngineThread( FSCopyEngine *engine ) : m_engine(engine) {}
+
+protected:
+    void run() { m_engine->work(); }
+
+private:
+    FSCopyEngine *m_engine;
+};
+}
+
+/**************************************************
+ * FSCopyEngine::FSCopyEngine
+ *************************************************/
+FSCopyEngine::FSCopyEngine( int threadCount ) :
+    m_jobCount(0), m_finishedJobs(0), m_bytesCopied(0), m_noMoreJobs(false), m_cancelled(false)
+{
+    if( threadCount <= 0 )
+    {
+        threadCount = qBound( 1, QThread::idealThreadCount(), MAX_COPY_THREADS );
+    }
+    for( int i = 0; i < threadCount; ++i )
+    {
+        m_threads.append( new FSCopyEngineThread( this ) );
+    }
+}
+
+/**************************************************
+ * FSCopyEngine::~FSCopyEngine
+ *************************************************/
+FSCopyEngine::~FSCopyEngine()
+{
+    m_lock.lock();
+    m_cancelled = true;
+    m_noMoreJobs = true;
+    m_workAvailable.wakeAll();
+    m_lock.unlock();
+
+    foreach( QThread *thread, m_threads )
+    {
+        thread->wait();
+        delete thread;
+    }
+}
+
+/**************************************************
+ * void FSCopyEngine::start
+ *************************************************/
+void FSCopyEngine::start()
+{
+    foreach( QThread *thread, m_threads )
+    {
+        thread->start();
+    }
+}
+
+/**************************************************
+ * void FSCopyEngine::addJob
+ *************************************************/
+void FSCopyEngine::addJob( const FSCopyJob &job )
+{
+    QMutexLocker locker( &m_lock );
+    m_pendingJobs.enqueue( job );
+    ++m_jobCount;
+    m_workAvailable.wakeOne();
+}
+
+/**************************************************
+ * void FSCopyEngine::finishJobs
+ *************************************************/
+void FSCopyEngine::finishJobs()
+{
+    QMutexLocker locker( &m_lock );
+    m_noMoreJobs = true;
+    m_workAvailable.wakeAll();
+    m_progress.wakeAll();
+}
+
+/**************************************************
+ * void FSCopyEngine::cancel
+ *************************************************/
+void FSCopyEngine::cancel()
+{
+    QMutexLocker locker( &m_lock );
+    m_cancelled = true;
+}
+
+/**************************************************
+ * int FSCopyEngine::jobCount
+ *************************************************/
+int FSCopyEngine::jobCount() const
+{
+    QMutexLocker locker( &m_lock );
+    return m_jobCount;
+}
+
+/**************************************************
+ * quint64 FSCopyEngine::bytesCopied
+ *************************************************/
+quint64 FSCopyEngine::bytesCopied() const
+{
+    QMutexLocker locker( &m_lock );
+    return m_bytesCopied;
+}
+
+/**************************************************
+ * bool FSCopyEngine::takeFinished
+ *************************************************/
+bool FSCopyEngine::takeFinished( QList<FSCopyResult> &results, unsigned long timeout )
+{
+    QMutexLocker locker( &m_lock );
+    bool done = m_noMoreJobs && m_finishedJobs == m_jobCount;
+    if( m_finished.isEmpty() && !done )
+    {
+        m_progress.wait( &m_lock, timeout );
+        done = m_noMoreJobs && m_finishedJobs == m_jobCount;
+    }
+    results += m_finished;
+    m_finished.clear();
+    return done;
+}
+
+/**************************************************
+ * void FSCopyEngine::work
+ *************************************************/
+void FSCopyEngine::work()
+{
+    forever
+    {
+        m_lock.lock();
+        while( m_pendingJobs.isEmpty() && !m_noMoreJobs )
+        {
+            m_workAvailable.wait( &m_lock );
+        }
+        if( m_pendingJobs.isEmpty() )
+        {
+            m_lock.unlock();
+            return;
+        }
+        FSCopyJob job = m_pendingJobs.dequeue();
+        bool cancelled = m_cancelled;
+        m_lock.unlock();
+
+        FSCopyResult result = { job.handle, !cancelled && copy( job ) };
+
+        m_lock.lock();
+        m_finished.append( result );
+        ++m_finishedJobs;
+        m_progress.wakeAll();
+        m_lock.unlock();
+    }
+}
+
+/**************************************************
+ * bool FSCopyEngine::copy
+ *************************************************/
+bool FSCopyEngine::copy( const FSCopyJob &job )
+{
+    QByteArray sourcePath = QFile::encodeName( job.sourcePath );
+    QByteArray destinationPath = QFile::encodeName( job.destinationPath );
+    int in = open( sourcePath.constData(), O_RDONLY | O_CLOEXEC );
+    if( -1 == in )
+    {
+        MTP_LOG_WARNING("Can't open" << job.sourcePath << "for copying:" << errno);
+        return false;
+    }
+    int out = open( destinationPath.constData(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666 );
+    if( -1 == out )
+    {
+        MTP_LOG_WARNING("Can't open" << job.destinationPath << "for copying:" << errno);
+        close( in );
+        return false;
+    }
+
+    bool copied = true;
+    if( -1 == ioctl( out, FICLONE, in ) )
+    {
+        bool useSplice = false;
+        int pipeFds[2] = { -1, -1 };
+        forever
+        {
+            ssize_t chunk = kernelCopy( in, out, COPY_CHUNK_SIZE, useSplice, pipeFds );
+            if( chunk < 0 )
+            {
+                MTP_LOG_WARNING("Copying" << job.sourcePath << "failed:" << errno);
+                copied = false;
+                break;
+            }
+            if( !chunk )
+            {
+                break;
+            }
+
+            QMutexLocker locker( &m_lock );
+            m_bytesCopied += chunk;
+            if( m_cancelled )
+            {
+                copied = false;
+                break;
+            }
+        }
+        if( -1 != pipeFds[0] )
+        {
+            close( pipeFds[0] );
+            close( pipeFds[1] );
+        }
+    }
+    else
+    {
+        struct stat st;
+        if( 0 == fstat( in, &st ) )
+        {
+            QMutexLocker locker( &m_lock );
+            m_bytesCopied += st.st_size;
+        }
+    }
+    close( in );
+    close( out );
+    return copied;
+}
+
+/**************************************************
+ * ssize_t FSCopyEngine::kernelCopy
+ *************************************************/
+ssize_t FSCopyEngine::kernelCopy( int in, int out, size_t len, bool &useSplice, int pipeFds[2] )
+{
+    if( !useSplice )
+    {
+        ssize_t copied = copy_file_range( in, 0, out, 0, len, 0 );
+        if( copied >= 0 || ( EXDEV != errno && ENOSYS != errno &&
+                             EOPNOTSUPP != errno && EINVAL != errno ) )
+        {
+            return copied;
+        }
+        // Across file systems on older kernels, or not supported by one of them.
+        useSplice = true;
+    }
+
+    if( -1 == pipeFds[0] )
+    {
+        if( -1 == pipe2( pipeFds, O_CLOEXEC ) )
+        {
+            return -1;
+        }
+        // Best effort, the default 64 KB pipe works too.
+        fcntl( pipeFds[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE );
+    }
+
+    size_t total = 0;
+    while( total < len )
+    {
+        ssize_t piped = splice( in, 0, pipeFds[1], 0, qMin( len - total, (size_t)SPLICE_PIPE_SIZE ),
+                                SPLICE_F_MOVE );
+        if( piped < 0 && EINTR == errno )
+        {
+            continue;
+        }
+        if( piped <= 0 )
+        {
+            return piped < 0 ? -1 : (ssize_t)total;
+        }
+        while( piped )
+        {
+            ssize_t written = splice( pipeFds[0], 0, out, 0, piped, SPLICE_F_MOVE );
+            if( written < 0 )
+            {
+                if( EINTR == errno )
+                {
+                    continue;
+                }
+                return -1;
+            }
+            piped -= written;
+            total += written;
+        }
+    }
+    return total;
+}
@@ -0,0 +1,144 @@
+/*
+* This file is part of libmeegomtp package
+*
+* Copyright (C) 2010 Nokia Corporation. All rights reserved.
+*
+* Contact: Deepak Kodihalli <deepak.kodihalli@nokia.com>
+*
+* Redistribution and use in source and binary forms, with or without modification,
+* are permitted provided that the following conditions are met:
+*
+* Redistributions of source code must retain the above copyright notice, this list
+* of conditions and the following disclaimer. Redistributions in binary form must
+* reproduce the above copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of Nokia Corporation nor the names of its contributors may be
+* used to endorse or promote products derived from this software without specific
+* prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+* INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+* BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+* LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+* OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+* OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#ifndef FSCOPYENGINE_H
+#define FSCOPYENGINE_H
+
+#include <QList>
+#include <QMutex>
+#include <QQueue>
+#include <QString>
+#include <QWaitCondition>
+#include <sys/types.h>
+
+#include "mtptypes.h"
+
+class QThread;
+
+namespace meegomtp1dot0
+{
+/// A file to be copied by FSCopyEngine.
+struct FSCopyJob
+{
+    QString sourcePath; ///< absolute path of the file to copy.
+    QString destinationPath; ///< absolute path of the copy; it's created or truncated.
+    ObjHandle handle; ///< handle of the copy, passed back in FSCopyResult.
+};
+
+/// The outcome of an FSCopyJob.
+struct FSCopyResult
+{
+    ObjHandle handle; ///< handle from the job.
+    bool copied; ///< false if the copy failed or was cancelled.
+};
+
+/// FSCopyEngine copies files on a small pool of worker threads.
+
+/// File data doesn't pass through user space: a copy is reflinked to its
+/// source where the file system allows, written with copy_file_range() or
+/// spliced through a pipe otherwise. Jobs can be added while the workers are
+/// already copying, and finished jobs are handed back in batches, so the
+/// caller's per-file work overlaps with the copying. A cancel stops every
+/// copy between two chunks.
+class FSCopyEngine
+{
+public:
+    /// Constructor.
+    /// \param threadCount [in] number of worker threads, 0 picks one per core (up to 4).
+    explicit FSCopyEngine( int threadCount = 0 );
+
+    /// Destructor, cancels the remaining jobs and waits for the workers.
+    ~FSCopyEngine();
+
+    /// Starts the worker threads.
+    void start();
+
+    /// Queues a file for copying.
+    /// \param job [in] the file to copy.
+    void addJob( const FSCopyJob &job );
+
+    /// Tells the workers that no more jobs will be added.
+    void finishJobs();
+
+    /// Makes the workers give up their current copies and fail the rest.
+    void cancel();
+
+    /// Moves the results of finished jobs to the caller, waiting for some if
+    /// there are none yet.
+    /// \param results [out] the results are appended here.
+    /// \param timeout [in] how long to wait in ms.
+    /// \return true when every job has finished and its result has been
+    /// taken, which can only happen after finishJobs().
+    bool takeFinished( QList<FSCopyResult> &results, unsigned long timeout );
+
+    /// \return the number of jobs added so far.
+    int jobCount() const;
+
+    /// \return the number of bytes copied so far over all jobs.
+    quint64 bytesCopied() const;
+
+    /// Copies up to len bytes from one file to another at their file offsets,
+    /// in the kernel: with copy_file_range() where the file systems allow it,
+    /// otherwise with splice() through a pipe that is created in pipeFds on
+    /// first use.
+    /// \param in [in] file descriptor to read from.
+    /// \param out [in] file descriptor to write to.
+    /// \param len [in] the number of bytes to copy at most.
+    /// \param useSplice [in, out] set once copy_file_range() turns out not to work.
+    /// \param pipeFds [in, out] the pipe used by splice(), -1 until it's needed.
+    /// \return the number of bytes copied, 0 at the end of in, -1 on errors.
+    static ssize_t kernelCopy( int in, int out, size_t len, bool &useSplice, int pipeFds[2] );
+
+private:
+    friend class FSCopyEngineThread;
+
+    /// Worker thread body: copies files until the last job is done.
+    void work();
+
+    /// Copies the file of a single job.
+    /// \return true if the whole file was copied.
+    bool copy( const FSCopyJob &job );
+
+    QList<QThread*> m_threads;
+    mutable QMutex m_lock; ///< protects everything below.
+    QWaitCondition m_workAvailable;
+    QWaitCondition m_progress;
+    QQueue<FSCopyJob> m_pendingJobs; ///< jobs waiting for a worker.
+    QList<FSCopyResult> m_finished; ///< results waiting for takeFinished().
+    int m_jobCount; ///< jobs added.
+    int m_finishedJobs; ///< jobs done, including their taken results.
+    quint64 m_bytesCopied;
+    bool m_noMoreJobs;
+    bool m_cancelled;
+};
+}
+
+#endif
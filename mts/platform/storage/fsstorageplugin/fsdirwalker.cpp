@@ -0,0 +1,398 @@
+/*
+* This file is part of libmeegomtp package
+*
+* Copyright (C) 2010 Nokia Corporation. All rights reserved.
+*
+* Contact: Deepak Kodihalli <deepak.kodihalli@nokia.com>
+*
+* Redistribution and use in source and binary forms, with or without modification,
+* are permitted provided that the following conditions are met:
+*
+* Redistributions of source code must retain the above copyright notice, this list
+* of conditions and the following disclaimer. Redistributions in binary form must
+* reproduce the above copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of Nokia Corporation nor the names of its contributors may be
+* used to endorse or promote products derived from this software without specific
+* prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+* INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+* BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+* LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+* OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+* OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#include "fsdirwalker.h"
+#include "trace.h"
+
+#include <QAtomicInt>
+#include <QFile>
+#include <QThread>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace meegomtp1dot0;
+
+// Matches the layout the kernel uses for getdents64().
+struct linux_dirent64
+{
+    quint64 d_ino;
+    qint64 d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static const int DENTS_BUFFER_SIZE = 32 * 1024;
+static const int MAX_WALKER_THREADS = 4;
+
+namespace meegomtp1dot0
+{
+class FSDirWalkerThread : public QThread
+{
+public:
+    explicit FSDirWalkerThread( FSDirWalker *walker ) : m_walker(walker) {}
+
+protected:
+    void run() { m_walker->work(); }
+
+private:
+    FSDirWalker *m_walker;
+};
+}
+
+/**************************************************
+ * FSDirWalker::FSDirWalker
+ *************************************************/
+FSDirWalker::FSDirWalker( const QString &rootPath, const QStringList &excludePaths,
+                          int threadCount, QObject *parent ) :
+    QObject(parent), m_rootPath(rootPath), m_excludePaths(excludePaths), m_sniff(false),
+    m_busyWorkers(0), m_done(false), m_stop(false)
+{
+    if( threadCount <= 0 )
+    {
+        threadCount = qBound( 1, QThread::idealThreadCount(), MAX_WALKER_THREADS );
+    }
+    for( int i = 0; i < threadCount; ++i )
+    {
+        m_threads.append( new FSDirWalkerThread( this ) );
+    }
+}
+
+/**************************************************
+ * FSDirWalker::~FSDirWalker
+ *************************************************/
+FSDirWalker::~FSDirWalker()
+{
+    m_lock.lock();
+    m_stop = true;
+    m_workAvailable.wakeAll();
+    m_lock.unlock();
+
+    foreach( QThread *thread, m_threads )
+    {
+        thread->wait();
+        delete thread;
+    }
+}
+
+/**************************************************
+ * void FSDirWalker::addRoot
+ *************************************************/
+void FSDirWalker::addRoot( const QString &path )
+{
+    QMutexLocker locker( &m_lock );
+    m_pendingDirs.enqueue( path );
+}
+
+/**************************************************
+ * void FSDirWalker::start
+ *************************************************/
+void FSDirWalker::start()
+{
+    m_lock.lock();
+    m_pendingDirs.enqueue( m_rootPath );
+    m_lock.unlock();
+
+    foreach( QThread *thread, m_threads )
+    {
+        thread->start();
+    }
+}
+
+/**************************************************
+ * bool FSDirWalker::takeEntries
+ *************************************************/
+bool FSDirWalker::takeEntries( QVector<FSDirEntry> &entries, int maxEntries )
+{
+    QMutexLocker locker( &m_lock );
+    while( !m_batches.isEmpty() && entries.size() < maxEntries )
+    {
+        entries += m_batches.dequeue();
+    }
+    return m_done && m_batches.isEmpty();
+}
+
+/**************************************************
+ * void FSDirWalker::work
+ *************************************************/
+void FSDirWalker::work()
+{
+    forever
+    {
+        QString dirPath;
+        m_lock.lock();
+        while( !m_stop && !m_done && m_pendingDirs.isEmpty() )
+        {
+            m_workAvailable.wait( &m_lock );
+        }
+        if( m_stop || m_done )
+        {
+            m_lock.unlock();
+            return;
+        }
+        dirPath = m_pendingDirs.dequeue();
+        ++m_busyWorkers;
+        m_lock.unlock();
+
+        QVector<FSDirEntry> batch;
+        listDirectory( dirPath, batch, m_sniff );
+
+        m_lock.lock();
+        bool wasEmpty = m_batches.isEmpty();
+        if( !batch.isEmpty() )
+        {
+            m_batches.enqueue( batch );
+        }
+        // Queue subdirectories only after their own entries, so that
+        // parents are always delivered first.
+        foreach( const FSDirEntry &entry, batch )
+        {
+            if( entry.isDir && !m_excludePaths.contains( entry.path ) )
+            {
+                m_pendingDirs.enqueue( entry.path );
+            }
+        }
+        --m_busyWorkers;
+        if( m_pendingDirs.isEmpty() && !m_busyWorkers )
+        {
+            m_done = true;
+        }
+        bool notify = m_done || ( wasEmpty && !batch.isEmpty() );
+        m_workAvailable.wakeAll();
+        m_lock.unlock();
+
+        if( notify )
+        {
+            emit entriesAvailable();
+        }
+    }
+}
+
+/**************************************************
+ * void FSDirWalker::setContentSniffing
+ *************************************************/
+void FSDirWalker::setContentSniffing( bool sniff )
+{
+    m_sniff = sniff;
+}
+
+/**************************************************
+ * bool FSDirWalker::statEntry
+ *************************************************/
+bool FSDirWalker::statEntry( int dirFd, const char *name, FSDirEntry &entry )
+{
+    entry.sniffed = false;
+    entry.contentFormat = MTP_OBF_FORMAT_Undefined;
+    entry.strongSignature = false;
+#ifdef STATX_BASIC_STATS
+    // Ask only for what the storage keeps; some file systems have to do
+    // extra work for the rest.
+    // Shared by all walker threads; once one of them finds statx()
+    // missing, the others stop trying too.
+    static QAtomicInt haveStatx( 1 );
+    if( haveStatx.load() )
+    {
+        struct statx stx;
+        if( !statx( dirFd, name, AT_STATX_SYNC_AS_STAT,
+                    STATX_TYPE | STATX_INO | STATX_SIZE | STATX_MTIME | STATX_CTIME, &stx ) )
+        {
+            if( !S_ISDIR( stx.stx_mode ) && !S_ISREG( stx.stx_mode ) )
+            {
+                return false;
+            }
+            entry.isDir = S_ISDIR( stx.stx_mode );
+            entry.size = entry.isDir ? 0 : stx.stx_size;
+            entry.mtime = (qint64)stx.stx_mtime.tv_sec * 1000000000LL + stx.stx_mtime.tv_nsec;
+            entry.ctime = (qint64)stx.stx_ctime.tv_sec * 1000000000LL + stx.stx_ctime.tv_nsec;
+            entry.ino = stx.stx_ino;
+            return true;
+        }
+        if( ENOSYS != errno )
+        {
+            return false;
+        }
+        haveStatx.store( 0 );
+    }
+#endif
+    struct stat st;
+    if( fstatat( dirFd, name, &st, 0 ) || ( !S_ISDIR( st.st_mode ) && !S_ISREG( st.st_mode ) ) )
+    {
+        return false;
+    }
+    entry.isDir = S_ISDIR( st.st_mode );
+    entry.size = entry.isDir ? 0 : st.st_size;
+    entry.mtime = (qint64)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    entry.ctime = (qint64)st.st_ctim.tv_sec * 1000000000LL + st.st_ctim.tv_nsec;
+    entry.ino = st.st_ino;
+    return true;
+}
+
+/**************************************************
+ * void FSDirWalker::listDirectory
+ *************************************************/
+void FSDirWalker::listDirectory( const QString &dirPath, QVector<FSDirEntry> &batch,
+                                 bool sniff )
+{
+    QByteArray ba = QFile::encodeName( dirPath );
+    int dirFd = open( ba.constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+    if( -1 == dirFd )
+    {
+        MTP_LOG_WARNING("Cannot open directory" << dirPath);
+        return;
+    }
+
+    char buffer[DENTS_BUFFER_SIZE];
+    forever
+    {
+        long bytesRead = syscall( SYS_getdents64, dirFd, buffer, sizeof(buffer) );
+        if( bytesRead <= 0 )
+        {
+            break;
+        }
+        for( long pos = 0; pos < bytesRead; )
+        {
+            struct linux_dirent64 *dent = reinterpret_cast<struct linux_dirent64*>( buffer + pos );
+            pos += dent->d_reclen;
+
+            const char *name = dent->d_name;
+            if( '.' == name[0] && ( '\0' == name[1] || ( '.' == name[1] && '\0' == name[2] ) ) )
+            {
+                continue;
+            }
+
+            // Symbolic links and unknown types still need a stat to be
+            // told apart, everything else can be decided from d_type.
+            if( DT_FIFO == dent->d_type || DT_SOCK == dent->d_type ||
+                DT_CHR == dent->d_type || DT_BLK == dent->d_type )
+            {
+                continue;
+            }
+
+            FSDirEntry entry;
+            if( !statEntry( dirFd, name, entry ) )
+            {
+                continue;
+            }
+            if( sniff && !entry.isDir && entry.size )
+            {
+                entry.contentFormat = formatByContent( dirFd, name, entry.strongSignature );
+                entry.sniffed = true;
+            }
+            entry.path = dirPath + '/' + QFile::decodeName( name );
+            batch.append( entry );
+        }
+    }
+    close( dirFd );
+}
+
+/**************************************************
+ * MTPObjFormatCode FSDirWalker::formatByContent
+ *************************************************/
+MTPObjFormatCode FSDirWalker::formatByContent( int dirFd, const char *name, bool &strong )
+{
+    strong = true;
+    int fd = openat( dirFd, name, O_RDONLY | O_CLOEXEC | O_NOCTTY );
+    if( -1 == fd )
+    {
+        return MTP_OBF_FORMAT_Undefined;
+    }
+    char buf[12];
+    ssize_t len = read( fd, buf, sizeof(buf) );
+    close( fd );
+    const uchar *b = reinterpret_cast<const uchar*>( buf );
+    if( len >= 3 && 0xFF == b[0] && 0xD8 == b[1] && 0xFF == b[2] )
+    {
+        return MTP_OBF_FORMAT_EXIF_JPEG;
+    }
+    if( len >= 8 && !memcmp( buf, "\x89PNG\r\n\x1a\n", 8 ) )
+    {
+        return MTP_OBF_FORMAT_PNG;
+    }
+    if( len >= 4 && !memcmp( buf, "GIF8", 4 ) )
+    {
+        return MTP_OBF_FORMAT_GIF;
+    }
+    if( len >= 4 && ( !memcmp( buf, "II*\0", 4 ) || !memcmp( buf, "MM\0*", 4 ) ) )
+    {
+        return MTP_OBF_FORMAT_TIFF;
+    }
+    if( len >= 4 && !memcmp( buf, "OggS", 4 ) )
+    {
+        return MTP_OBF_FORMAT_OGG;
+    }
+    if( len >= 12 && !memcmp( buf, "RIFF", 4 ) )
+    {
+        if( !memcmp( buf + 8, "WAVE", 4 ) )
+        {
+            return MTP_OBF_FORMAT_WAV;
+        }
+        if( !memcmp( buf + 8, "AVI ", 4 ) )
+        {
+            return MTP_OBF_FORMAT_AVI;
+        }
+    }
+    if( len >= 12 && !memcmp( buf + 4, "ftyp", 4 ) )
+    {
+        return !memcmp( buf + 8, "3gp", 3 ) ? MTP_OBF_FORMAT_3GP_Container : MTP_OBF_FORMAT_MP4_Container;
+    }
+    if( len >= 3 && !memcmp( buf, "ID3", 3 ) )
+    {
+        return MTP_OBF_FORMAT_MP3;
+    }
+
+    // What follows is short enough to show up in text or random data.
+    strong = false;
+    if( len >= 6 && !memcmp( buf, "BM", 2 ) )
+    {
+        // The header's file size field is not checked, many writers get it wrong.
+        return MTP_OBF_FORMAT_BMP;
+    }
+    // MPEG audio frame sync, with the header fields that have reserved
+    // values checked: layer III is MP3, layer "0" is an ADTS AAC stream.
+    if( len >= 3 && 0xFF == b[0] && 0xE0 == ( b[1] & 0xE0 ) )
+    {
+        if( 0x02 == ( b[1] & 0x06 ) && 0x08 != ( b[1] & 0x18 ) &&
+            0xF0 != ( b[2] & 0xF0 ) && 0x00 != ( b[2] & 0xF0 ) && 0x0C != ( b[2] & 0x0C ) )
+        {
+            return MTP_OBF_FORMAT_MP3;
+        }
+        if( 0xF0 == ( b[1] & 0xF6 ) && ( ( b[2] >> 2 ) & 0x0F ) < 13 )
+        {
+            return MTP_OBF_FORMAT_AAC;
+        }
+    }
+    return MTP_OBF_FORMAT_Undefined;
+}
@@ -0,0 +1,157 @@
+/*
+* This file is part of libmeegomtp package
+*
+* Copyright (C) 2010 Nokia Corporation. All rights reserved.
+*
+* Contact: Deepak Kodihalli <deepak.kodihalli@nokia.com>
+*
+* Redistribution and use in source and binary forms, with or without modification,
+* are permitted provided that the following conditions are met:
+*
+* Redistributions of source code must retain the above copyright notice, this list
+* of conditions and the following disclaimer. Redistributions in binary form must
+* reproduce the above copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of Nokia Corporation nor the names of its contributors may be
+* used to endorse or promote products derived from this software without specific
+* prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+* INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+* BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+* LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+* OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+* OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#ifndef FSDIRWALKER_H
+#define FSDIRWALKER_H
+
+#include <QObject>
+#include <QList>
+#include <QMutex>
+#include <QQueue>
+#include <QStringList>
+#include <QVector>
+#include <QWaitCondition>
+
+#include "mtptypes.h"
+
+class QThread;
+
+namespace meegomtp1dot0
+{
+/// A file system entry found by FSDirWalker, or the metadata of a single
+/// path read with FSDirWalker::statEntry().
+struct FSDirEntry
+{
+    QString path; ///< absolute path of the entry.
+    bool isDir; ///< true for directories, false for regular files.
+    quint64 size; ///< size in bytes.
+    qint64 mtime; ///< modification time in ns.
+    qint64 ctime; ///< status change time in ns.
+    quint64 ino; ///< inode number.
+    bool sniffed; ///< true if the content fields below were filled in.
+    MTPObjFormatCode contentFormat; ///< format told by the first bytes, Undefined if not recognized.
+    bool strongSignature; ///< true if contentFormat comes from a signature of three bytes or more.
+};
+
+/// FSDirWalker enumerates a directory tree on a pool of worker threads.
+
+/// Each worker lists one directory at a time with getdents64() and stats the
+/// entries with statx() relative to the directory fd. Entries whose d_type
+/// already rules them out (devices, fifos, sockets) are skipped unstat'ed. The entries of a
+/// directory are queued as one batch before any of its subdirectories is
+/// handed to a worker, so takeEntries() always returns a directory before
+/// its contents. Only regular files and directories are reported, symbolic
+/// links are followed.
+class FSDirWalker : public QObject
+{
+    Q_OBJECT
+
+public:
+    /// Constructor.
+    /// \param rootPath [in] the directory to walk; it is not reported itself.
+    /// \param excludePaths [in] directories that are reported but not descended into.
+    /// \param threadCount [in] number of worker threads, 0 picks one per core (up to 4).
+    FSDirWalker( const QString &rootPath, const QStringList &excludePaths,
+                 int threadCount = 0, QObject *parent = 0 );
+
+    /// Destructor, stops the walk if it is still running.
+    ~FSDirWalker();
+
+    /// Makes the workers read the first bytes of every non-empty regular
+    /// file, see formatByContent(). Must be called before start().
+    /// \param sniff [in] true to sniff file contents.
+    void setContentSniffing( bool sniff );
+
+    /// Walks another directory along with the root; like the root, it is
+    /// not reported itself. Must be called before start().
+    /// \param path [in] the directory.
+    void addRoot( const QString &path );
+
+    /// Starts the worker threads.
+    void start();
+
+    /// Moves found entries to the caller, in discovery order.
+    /// \param entries [out] the entries are appended here.
+    /// \param maxEntries [in] stop after the batch that reaches this many entries.
+    /// \return true when the walk is complete and every entry has been taken.
+    bool takeEntries( QVector<FSDirEntry> &entries, int maxEntries );
+
+    /// Reads the type, size and times of a file system entry with a single
+    /// statx() call (fstatat() on kernels without it). Symbolic links are
+    /// followed. The path of the entry is left alone.
+    /// \param dirFd [in] directory name is relative to, or AT_FDCWD.
+    /// \param name [in] the entry's name or path.
+    /// \param entry [out] filled with the entry's metadata.
+    /// \return true for an existing regular file or directory.
+    static bool statEntry( int dirFd, const char *name, FSDirEntry &entry );
+
+    /// Lists one directory, reading each entry's metadata once.
+    /// \param dirPath [in] the directory.
+    /// \param batch [out] the regular files and directories found.
+    /// \param sniff [in] true to also fill in the content fields of files.
+    static void listDirectory( const QString &dirPath, QVector<FSDirEntry> &batch,
+                               bool sniff = false );
+
+    /// Tells the format of a file from its first bytes. Content without a
+    /// recognizable signature, e.g. text and playlists, is Undefined.
+    /// \param dirFd [in] directory name is relative to, or AT_FDCWD.
+    /// \param name [in] the file's name or path.
+    /// \param strong [out] false if the signature is short enough to turn up
+    /// by chance in other content (BMP, bare MPEG audio frames).
+    /// \return the detected format.
+    static MTPObjFormatCode formatByContent( int dirFd, const char *name, bool &strong );
+
+signals:
+    /// Emitted from a worker thread when entries become available
+    /// and once more when the walk completes.
+    void entriesAvailable();
+
+private:
+    friend class FSDirWalkerThread;
+
+    /// Worker thread body: lists directories until the walk is done.
+    void work();
+
+    QString m_rootPath;
+    QStringList m_excludePaths;
+    bool m_sniff; ///< workers fill in the content fields of files.
+    QList<QThread*> m_threads;
+    QMutex m_lock; ///< protects everything below.
+    QWaitCondition m_workAvailable;
+    QQueue<QString> m_pendingDirs; ///< directories waiting for a worker.
+    QQueue<QVector<FSDirEntry> > m_batches; ///< listed entries waiting for takeEntries().
+    int m_busyWorkers;
+    bool m_done;
+    bool m_stop;
+};
+}
+
+#endif
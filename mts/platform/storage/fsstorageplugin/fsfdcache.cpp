@@ -0,0 +1,265 @@
+/*
+* This file is part of libmeegomtp package
+*
+* Copyright (C) 2010 Nokia Corporation. All rights reserved.
+*
+* Contact: Deepak Kodihalli <deepak.kodihalli@nokia.com>
+*
+* Redistribution and use in source and binary forms, with or without modification,
+* are permitted provided that the following conditions are met:
+*
+* Redistributions of source code must retain the above copyright notice, this list
+* of conditions and the following disclaimer. Redistributions in binary form must
+* reproduce the above copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of Nokia Corporation nor the names of its contributors may be
+* used to endorse or promote products derived from this software without specific
+* prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+* INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+* BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+* LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+* OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+* OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#include "fsfdcache.h"
+
+#include <QFile>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace meegomtp1dot0;
+
+/// Read-ahead window of a newly detected sequential stream.
+static const quint32 MIN_READ_AHEAD = 128 * 1024;
+/// The window stops doubling here.
+static const quint32 MAX_READ_AHEAD = 4 * 1024 * 1024;
+/// Reads in a row that make a stream sequential.
+static const int SEQUENTIAL_THRESHOLD = 2;
+/// Files from this size on have their pages dropped behind the stream.
+static const quint64 DROP_BEHIND_MIN_SIZE = 64 * 1024 * 1024;
+/// Pages are dropped in chunks of this size, and never closer than one
+/// chunk behind the stream, so that a host re-reading the last segments
+/// still finds them cached.
+static const quint64 DROP_BEHIND_CHUNK = 8 * 1024 * 1024;
+
+/************************************************************
+ * FSFdCache::FSFdCache
+ ***********************************************************/
+FSFdCache::FSFdCache( int capacity ) :
+    m_capacity(qMax( capacity, 0 )), m_uncachedHandle(0), m_uncachedFd(-1)
+{
+}
+
+/************************************************************
+ * FSFdCache::~FSFdCache
+ ***********************************************************/
+FSFdCache::~FSFdCache()
+{
+    clear();
+}
+
+/************************************************************
+ * int FSFdCache::acquire
+ ***********************************************************/
+int FSFdCache::acquire( ObjHandle handle, const QString &path )
+{
+    QHash<ObjHandle, Entry>::const_iterator i = m_fds.constFind( handle );
+    if( i != m_fds.constEnd() )
+    {
+        if( m_lru.first() != handle )
+        {
+            m_lru.removeOne( handle );
+            m_lru.prepend( handle );
+        }
+        return i.value().fd;
+    }
+
+    int fd;
+    do
+    {
+        fd = open( QFile::encodeName( path ).constData(), O_RDONLY | O_CLOEXEC );
+    } while( -1 == fd && EINTR == errno );
+    if( -1 == fd )
+    {
+        return -1;
+    }
+
+    if( 0 == m_capacity )
+    {
+        release( m_uncachedHandle );
+        m_uncachedHandle = handle;
+        m_uncachedFd = fd;
+        return fd;
+    }
+
+    Entry entry;
+    struct stat st;
+    entry.fd = fd;
+    entry.size = 0 == fstat( fd, &st ) ? st.st_size : 0;
+    entry.lastOffset = 0;
+    entry.nextOffset = 0;
+    entry.stride = 0;
+    entry.sequentialReads = 0;
+    entry.window = MIN_READ_AHEAD;
+    entry.aheadEnd = 0;
+    entry.droppedEnd = 0;
+
+    shrink( m_capacity - 1 );
+    m_fds.insert( handle, entry );
+    m_lru.prepend( handle );
+    return fd;
+}
+
+/************************************************************
+ * void FSFdCache::release
+ ***********************************************************/
+void FSFdCache::release( ObjHandle handle )
+{
+    if( -1 != m_uncachedFd && handle == m_uncachedHandle )
+    {
+        close( m_uncachedFd );
+        m_uncachedFd = -1;
+        m_uncachedHandle = 0;
+    }
+}
+
+/************************************************************
+ * void FSFdCache::adviseRead
+ ***********************************************************/
+void FSFdCache::adviseRead( ObjHandle handle, quint64 offset, quint32 length )
+{
+    QHash<ObjHandle, Entry>::iterator i = m_fds.find( handle );
+    if( i != m_fds.end() )
+    {
+        advise( i.value(), offset, length );
+    }
+}
+
+/************************************************************
+ * void FSFdCache::advise
+ ***********************************************************/
+void FSFdCache::advise( Entry &entry, quint64 offset, quint32 length )
+{
+    quint64 end = offset + length;
+    qint64 stride = static_cast<qint64>( offset ) - static_cast<qint64>( entry.lastOffset );
+
+    if( offset == entry.nextOffset )
+    {
+        if( ++entry.sequentialReads == SEQUENTIAL_THRESHOLD )
+        {
+            posix_fadvise( entry.fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+        }
+    }
+    else
+    {
+        if( entry.sequentialReads >= SEQUENTIAL_THRESHOLD )
+        {
+            posix_fadvise( entry.fd, 0, 0, POSIX_FADV_NORMAL );
+        }
+        entry.sequentialReads = 0;
+        entry.window = MIN_READ_AHEAD;
+        entry.aheadEnd = end;
+        entry.droppedEnd = qMin( entry.droppedEnd, offset & ~( DROP_BEHIND_CHUNK - 1 ) );
+
+        // A host skipping through the file by the same distance every time,
+        // like a preview scanning a video, gets the next read prefetched.
+        if( offset > entry.nextOffset && stride == entry.stride )
+        {
+            posix_fadvise( entry.fd, offset + stride, length, POSIX_FADV_WILLNEED );
+        }
+    }
+    entry.stride = stride;
+    entry.lastOffset = offset;
+    entry.nextOffset = end;
+
+    if( entry.sequentialReads >= SEQUENTIAL_THRESHOLD )
+    {
+        // Refill once half of the window has been consumed, and grow the
+        // window as long as the stream keeps going.
+        if( end + entry.window / 2 >= entry.aheadEnd && entry.aheadEnd < entry.size )
+        {
+            quint64 start = qMax( entry.aheadEnd, end );
+            posix_fadvise( entry.fd, start, end + entry.window - start, POSIX_FADV_WILLNEED );
+            entry.aheadEnd = end + entry.window;
+            entry.window = qMin( entry.window * 2, MAX_READ_AHEAD );
+        }
+
+        if( entry.size >= DROP_BEHIND_MIN_SIZE &&
+            offset >= entry.droppedEnd + 2 * DROP_BEHIND_CHUNK )
+        {
+            quint64 dropEnd = ( offset - DROP_BEHIND_CHUNK ) & ~( DROP_BEHIND_CHUNK - 1 );
+            posix_fadvise( entry.fd, entry.droppedEnd, dropEnd - entry.droppedEnd, POSIX_FADV_DONTNEED );
+            entry.droppedEnd = dropEnd;
+        }
+    }
+}
+
+/************************************************************
+ * void FSFdCache::invalidate
+ ***********************************************************/
+void FSFdCache::invalidate( ObjHandle handle )
+{
+    release( handle );
+    QHash<ObjHandle, Entry>::iterator i = m_fds.find( handle );
+    if( i != m_fds.end() )
+    {
+        close( i.value().fd );
+        m_fds.erase( i );
+        m_lru.removeOne( handle );
+    }
+}
+
+/************************************************************
+ * void FSFdCache::clear
+ ***********************************************************/
+void FSFdCache::clear()
+{
+    release( m_uncachedHandle );
+    shrink( 0 );
+}
+
+/************************************************************
+ * void FSFdCache::setCapacity
+ ***********************************************************/
+void FSFdCache::setCapacity( int capacity )
+{
+    m_capacity = qMax( capacity, 0 );
+    shrink( m_capacity );
+}
+
+/************************************************************
+ * int FSFdCache::capacity
+ ***********************************************************/
+int FSFdCache::capacity() const
+{
+    return m_capacity;
+}
+
+/************************************************************
+ * int FSFdCache::count
+ ***********************************************************/
+int FSFdCache::count() const
+{
+    return m_fds.size();
+}
+
+/************************************************************
+ * void FSFdCache::shrink
+ ***********************************************************/
+void FSFdCache::shrink( int count )
+{
+    while( m_lru.size() > count )
+    {
+        close( m_fds.take( m_lru.takeLast() ).fd );
+    }
+}
@@ -0,0 +1,143 @@
+/*
+* This file is part of libmeegomtp package
+*
+* Copyright (C) 2010 Nokia Corporation. All rights reserved.
+*
+* Contact: Deepak Kodihalli <deepak.kodihalli@nokia.com>
+*
+* Redistribution and use in source and binary forms, with or without modification,
+* are permitted provided that the following conditions are met:
+*
+* Redistributions of source code must retain the above copyright notice, this list
+* of conditions and the following disclaimer. Redistributions in binary form must
+* reproduce the above copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of Nokia Corporation nor the names of its contributors may be
+* used to endorse or promote products derived from this software without specific
+* prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+* INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+* BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+* LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+* OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+* OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#ifndef FSFDCACHE_H
+#define FSFDCACHE_H
+
+#include "mtptypes.h"
+
+#include <QHash>
+#include <QList>
+#include <QString>
+
+namespace meegomtp1dot0
+{
+/// FSFdCache keeps a few files open for reading between data phases.
+
+/// GetObject and GetPartialObject read an object one segment at a time, and
+/// opening the file again for every segment costs a path lookup and a pair
+/// of syscalls each time. The cache hands out read-only descriptors keyed by
+/// object handle and closes the least recently used one when full. Callers
+/// read with pread(), so descriptors carry no file position between users.
+/// An entry must be invalidated whenever the path of its object stops
+/// naming the same file, or the file's size changes under it.
+///
+/// Each cached file also tracks how it's being read, see adviseRead().
+/// Sequential streams get a read-ahead window that doubles while the host
+/// keeps up, strided partial reads get the next stride prefetched, and
+/// pages behind a stream through a large file are dropped, so playing a
+/// movie doesn't push everything else out of the page cache.
+class FSFdCache
+{
+public:
+    /// Default number of files kept open.
+    static const int DEFAULT_CAPACITY = 8;
+
+    /// Constructor.
+    /// \param capacity [in] how many files may be kept open; 0 disables
+    /// the cache.
+    explicit FSFdCache( int capacity = DEFAULT_CAPACITY );
+
+    /// Destructor, closes every cached descriptor.
+    ~FSFdCache();
+
+    /// Returns a read-only descriptor for an object, opening its file if
+    /// needed. The descriptor stays owned by the cache; it's valid until
+    /// release() or invalidate() for the same handle.
+    /// \param handle [in] the object handle.
+    /// \param path [in] the object's path, used on a cache miss.
+    /// \return the descriptor, or -1 if the file can't be opened.
+    int acquire( ObjHandle handle, const QString &path );
+
+    /// Gives back a descriptor obtained from acquire(). With caching
+    /// disabled this closes it.
+    /// \param handle [in] the object handle it was acquired for.
+    void release( ObjHandle handle );
+
+    /// Tells the kernel what to expect around a read that's about to be
+    /// done on a cached descriptor. Does nothing if caching is disabled.
+    /// \param handle [in] the object handle.
+    /// \param offset [in] where the read starts.
+    /// \param length [in] how many bytes will be read.
+    void adviseRead( ObjHandle handle, quint64 offset, quint32 length );
+
+    /// Closes the cached descriptor for an object, if any.
+    /// \param handle [in] the object handle.
+    void invalidate( ObjHandle handle );
+
+    /// Closes every cached descriptor.
+    void clear();
+
+    /// Changes how many files may be kept open, closing the least recently
+    /// used ones if there are too many.
+    /// \param capacity [in] the new capacity; 0 disables the cache.
+    void setCapacity( int capacity );
+
+    /// \return the capacity.
+    int capacity() const;
+
+    /// \return the number of files currently open.
+    int count() const;
+
+private:
+    /// An open file and the way it has been read so far.
+    struct Entry
+    {
+        int fd;
+        quint64 size; ///< file size when opened.
+        quint64 lastOffset; ///< where the last read started.
+        quint64 nextOffset; ///< where the last read ended.
+        qint64 stride; ///< distance between the last two read offsets.
+        int sequentialReads; ///< reads in a row that continued the previous one.
+        quint32 window; ///< current read-ahead window.
+        quint64 aheadEnd; ///< end of the range already asked for.
+        quint64 droppedEnd; ///< pages before this have been dropped.
+    };
+
+    /// Closes least recently used descriptors until at most \a count remain.
+    void shrink( int count );
+
+    /// Applies the read-ahead policy for a read on a cached file.
+    static void advise( Entry &entry, quint64 offset, quint32 length );
+
+    int m_capacity;
+    QHash<ObjHandle, Entry> m_fds;
+    QList<ObjHandle> m_lru; ///< most recently used first; short enough to scan.
+    ObjHandle m_uncachedHandle; ///< owner of m_uncachedFd.
+    int m_uncachedFd; ///< descriptor handed out while caching is disabled.
+
+#ifdef UT_ON
+    friend class FSStoragePlugin_test;
+#endif
+};
+}
+
+#endif
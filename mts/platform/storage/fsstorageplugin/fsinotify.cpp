@@ -30,21 +30,65 @@
 */
 
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/fanotify.h>
+#include <sys/stat.h>
 #include "fsinotify.h"
-#include <QSocketNotifier>
+#include "trace.h"
+#include <QElapsedTimer>
+#include <QFile>
+#include <QThread>
+#include <QVector>
 
 using namespace meegomtp1dot0;
 
+// Bytes read from the inotify or fanotify descriptor at once.
+static const int READ_BUFFER_SIZE = 64 * 1024;
+// A batch this large is handed over without waiting for the debounce.
+static const int MAX_BATCH_SIZE = 256 * 1024;
+// A batch is handed over after this many debounce intervals even if events
+// keep coming.
+static const int MAX_LATENCY_FACTOR = 10;
+static const int DEFAULT_DEBOUNCE_INTERVAL = 50;
+static const uint32_t EVENT_TYPES = IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO;
+
+namespace meegomtp1dot0
+{
+class FSInotifyThread : public QThread
+{
+public:
+    explicit FSInotifyThread( FSInotify *inotify ) : m_inotify(inotify) {}
+
+protected:
+    void run() { m_inotify->watch(); }
+
+private:
+    FSInotify *m_inotify;
+};
+}
+
+/* Key of a directory in the fanotify watch maps: the file handle type and
+ * bytes, as returned by name_to_handle_at() and reported by fanotify. */
+static QByteArray handleKey( const struct file_handle *handle )
+{
+    QByteArray key( reinterpret_cast<const char*>(&handle->handle_type), sizeof(handle->handle_type) );
+    key.append( reinterpret_cast<const char*>(handle->f_handle), handle->handle_bytes );
+    return key;
+}
+
 /**************************************************
  * FSInotify::FSInotify
  *************************************************/
-FSInotify::FSInotify( uint32_t mask) : m_mask(mask)
+FSInotify::FSInotify( uint32_t mask) : m_mask(mask), m_fanotify(false), m_mountFd(-1),
+    m_debounceInterval(DEFAULT_DEBOUNCE_INTERVAL), m_lastCookie(0), m_lastWatch(0)
 {
-    m_readSocket = new QSocketNotifier( inotify_init(), QSocketNotifier::Read );
-    if( m_readSocket )
-    {
-        QObject::connect( m_readSocket, SIGNAL(activated(int)), this, SLOT(inotifyEventSlot(int)) );
-    }
+    m_fd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+    m_stopFd = eventfd( 0, EFD_CLOEXEC );
+    m_thread = new FSInotifyThread( this );
 }
 
 /**************************************************
@@ -52,58 +96,473 @@ FSInotify::FSInotify( uint32_t mask) : m_mask(mask)
  *************************************************/
 FSInotify::~FSInotify()
 {
-    if( m_readSocket )
+    if( m_thread->isRunning() )
+    {
+        uint64_t stop = 1;
+        if( (ssize_t)sizeof(stop) != write( m_stopFd, &stop, sizeof(stop) ) )
+        {
+            MTP_LOG_WARNING("Cannot stop the watcher thread" << strerror( errno ));
+        }
+        m_thread->wait();
+    }
+    delete m_thread;
+    if( -1 != m_stopFd )
+    {
+        close( m_stopFd );
+    }
+    if( -1 != m_fd )
+    {
+        close( m_fd );
+    }
+    if( -1 != m_mountFd )
+    {
+        close( m_mountFd );
+    }
+}
+
+/**************************************************
+ * bool FSInotify::useFanotify
+ *************************************************/
+bool FSInotify::useFanotify( const QString &path )
+{
+#ifdef FAN_RENAME
+    if( m_thread->isRunning() )
+    {
+        MTP_LOG_WARNING("Already watching, keeping inotify");
+        return false;
+    }
+
+    // Directory file handles and entry names, which is what inotify reports.
+    int fd = fanotify_init( FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK | FAN_REPORT_DFID_NAME, O_RDONLY );
+    if( -1 == fd )
     {
-        delete m_readSocket;
+        MTP_LOG_WARNING("fanotify unavailable:" << strerror( errno ) << ", using inotify");
+        return false;
     }
+
+    uint64_t mask = FAN_ONDIR;
+    if( m_mask & IN_CREATE )
+    {
+        mask |= FAN_CREATE;
+    }
+    if( m_mask & IN_DELETE )
+    {
+        mask |= FAN_DELETE;
+    }
+    if( m_mask & IN_MOVE )
+    {
+        // One event with both the old and the new name.
+        mask |= FAN_RENAME;
+    }
+    if( m_mask & IN_CLOSE_WRITE )
+    {
+        mask |= FAN_CLOSE_WRITE;
+    }
+    QByteArray ba = QFile::encodeName( path );
+    if( -1 == fanotify_mark( fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, mask, AT_FDCWD, ba.constData() ) )
+    {
+        MTP_LOG_WARNING("fanotify can't watch" << path << ':' << strerror( errno ) << ", using inotify");
+        close( fd );
+        return false;
+    }
+
+    if( -1 != m_fd )
+    {
+        close( m_fd );
+    }
+    m_fd = fd;
+    m_fanotify = true;
+    // Directory handles from events are opened relative to this.
+    m_mountFd = open( ba.constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+    return true;
+#else
+    Q_UNUSED( path );
+    MTP_LOG_WARNING("Built without fanotify support, using inotify");
+    return false;
+#endif
+}
+
+/**************************************************
+ * void FSInotify::setDebounceInterval
+ *************************************************/
+void FSInotify::setDebounceInterval( int msecs )
+{
+    QMutexLocker locker( &m_lock );
+    m_debounceInterval = msecs;
 }
 
 /**************************************************
  * int FSInotify::addWatch
  *************************************************/
-int FSInotify::addWatch( const QString& pathName ) const
+int FSInotify::addWatch( const QString& pathName )
 {
-    if( !m_readSocket )
+    if( -1 == m_fd )
     {
         return -1;
     }
+    if( !m_thread->isRunning() )
+    {
+        m_thread->start();
+    }
     QByteArray ba = pathName.toUtf8();
-    return inotify_add_watch( m_readSocket->socket(), ba.constData(), m_mask );
+    if( !m_fanotify )
+    {
+        return inotify_add_watch( m_fd, ba.constData(), m_mask );
+    }
+
+    // The filesystem is already watched, a watch only maps the directory's
+    // handle to a watch descriptor.
+    quint64 buffer[(sizeof(struct file_handle) + MAX_HANDLE_SZ) / sizeof(quint64) + 1];
+    struct file_handle *handle = reinterpret_cast<struct file_handle*>( buffer );
+    handle->handle_bytes = MAX_HANDLE_SZ;
+    int mountId;
+    if( -1 == name_to_handle_at( AT_FDCWD, ba.constData(), handle, &mountId, 0 ) )
+    {
+        return -1;
+    }
+    QByteArray key = handleKey( handle );
+    QMutexLocker locker( &m_lock );
+    // Like inotify, watching a directory twice gives the same descriptor.
+    QHash<QByteArray, int>::const_iterator i = m_handleWatches.constFind( key );
+    if( i != m_handleWatches.constEnd() )
+    {
+        return i.value();
+    }
+    int wd = ++m_lastWatch;
+    m_handleWatches.insert( key, wd );
+    m_watchHandles.insert( wd, key );
+    return wd;
 }
 
 /**************************************************
  * int FSInotify::removeWatch
  *************************************************/
-int FSInotify::removeWatch( const int& wd ) const
+int FSInotify::removeWatch( const int& wd )
 {
-    if( !m_readSocket )
+    if( -1 == m_fd )
     {
         return -1;
     }
-    return inotify_rm_watch( m_readSocket->socket(), wd );
+    if( !m_fanotify )
+    {
+        return inotify_rm_watch( m_fd, wd );
+    }
+    QMutexLocker locker( &m_lock );
+    QHash<int, QByteArray>::iterator i = m_watchHandles.find( wd );
+    if( i == m_watchHandles.end() )
+    {
+        return -1;
+    }
+    m_handleWatches.remove( i.value() );
+    m_watchHandles.erase( i );
+    return 0;
+}
+
+/**************************************************
+ * void FSInotify::takeEvents
+ *************************************************/
+void FSInotify::takeEvents( QByteArray &events )
+{
+    QMutexLocker locker( &m_lock );
+    events.swap( m_ready );
+    m_ready.clear();
 }
 
 /**************************************************
- * void FSInotify::inotifyEventSlot
+ * void FSInotify::watch
  *************************************************/
-void FSInotify::inotifyEventSlot(int)
+void FSInotify::watch()
 {
-    char tmp[512], *ptr;
-    int bytes_read = -1;
+    // Aligned for struct fanotify_event_metadata.
+    QVector<quint64> buffer( READ_BUFFER_SIZE / sizeof(quint64) );
+    char *data = reinterpret_cast<char*>( buffer.data() );
+    struct pollfd fds[2];
+    fds[0].fd = m_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = m_stopFd;
+    fds[1].events = POLLIN;
+    QElapsedTimer sinceFirst, sinceLast;
+
+    for( ;; )
+    {
+        m_lock.lock();
+        int debounce = m_debounceInterval;
+        m_lock.unlock();
+
+        int timeout = -1;
+        if( !m_batch.isEmpty() )
+        {
+            qint64 left = qMin( debounce - sinceLast.elapsed(),
+                                debounce * MAX_LATENCY_FACTOR - sinceFirst.elapsed() );
+            timeout = (int)qMax( Q_INT64_C(0), left );
+        }
+        fds[0].revents = 0;
+        fds[1].revents = 0;
+        if( -1 == poll( fds, 2, timeout ) )
+        {
+            if( EINTR == errno )
+            {
+                continue;
+            }
+            MTP_LOG_WARNING("Cannot wait for file system events" << strerror( errno ));
+            return;
+        }
+        if( fds[1].revents )
+        {
+            return;
+        }
+        if( fds[0].revents & POLLIN )
+        {
+            if( m_batch.isEmpty() )
+            {
+                sinceFirst.start();
+            }
+            sinceLast.start();
+            if( m_fanotify )
+            {
+                readFanotifyEvents( data, READ_BUFFER_SIZE );
+            }
+            else
+            {
+                readInotifyEvents( data, READ_BUFFER_SIZE );
+            }
+        }
+        if( !m_batch.isEmpty() && (sinceLast.elapsed() >= debounce ||
+            sinceFirst.elapsed() >= debounce * MAX_LATENCY_FACTOR || m_batch.size() >= MAX_BATCH_SIZE) )
+        {
+            publishBatch();
+        }
+    }
+}
 
-    bytes_read = read( m_readSocket->socket(), tmp, sizeof(tmp) );
+/**************************************************
+ * void FSInotify::readInotifyEvents
+ *************************************************/
+void FSInotify::readInotifyEvents( char *buffer, int size )
+{
+    ssize_t bytes_read;
+    while( (bytes_read = read( m_fd, buffer, size )) > 0 )
+    {
+        char *ptr = buffer;
+        while( ptr < buffer + bytes_read )
+        {
+            const struct inotify_event *event = reinterpret_cast<const struct inotify_event*>( ptr );
+            queueEvent( event );
+            ptr += sizeof *event + event->len;
+        }
+    }
+}
 
-    if(-1 == bytes_read)
+/**************************************************
+ * void FSInotify::queueEvent
+ *************************************************/
+void FSInotify::queueEvent( const struct inotify_event *event )
+{
+    uint32_t type = event->mask & EVENT_TYPES;
+    QPair<int, QByteArray> key;
+    if( event->len && type )
     {
-       return;
+        key = qMakePair( event->wd, QByteArray( event->name ) );
+        QHash<QPair<int, QByteArray>, int>::iterator last = m_lastEvents.find( key );
+        if( last != m_lastEvents.end() )
+        {
+            struct inotify_event *previous = reinterpret_cast<struct inotify_event*>( m_batch.data() + last.value() );
+            uint32_t previousType = previous->mask & EVENT_TYPES;
+            if( IN_CLOSE_WRITE == type && (previousType & (IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE)) )
+            {
+                // The entry is read after the previous event anyway.
+                return;
+            }
+            if( IN_DELETE == type && (previousType & (IN_CREATE | IN_CLOSE_WRITE)) )
+            {
+                // Gone before anyone looked at it.
+                previous->mask = 0;
+                if( previousType & IN_CREATE )
+                {
+                    m_lastEvents.erase( last );
+                    return;
+                }
+            }
+        }
     }
 
-    ptr = tmp;
-    while (ptr < tmp + bytes_read) {
-        struct inotify_event *event = (struct inotify_event *) ptr;
-        // FIXME: would it be better to pass all events or one at a time?
-        emit inotifyEventSignal( event );
-        ptr += sizeof *event + event->len;
+    int offset = m_batch.size();
+    m_batch.append( reinterpret_cast<const char*>( event ), sizeof *event + event->len );
+    if( !key.second.isEmpty() )
+    {
+        m_lastEvents.insert( key, offset );
     }
 }
 
+/**************************************************
+ * void FSInotify::publishBatch
+ *************************************************/
+void FSInotify::publishBatch()
+{
+    m_lock.lock();
+    bool notify = m_ready.isEmpty();
+    m_ready += m_batch;
+    m_lock.unlock();
+    m_batch.clear();
+    m_lastEvents.clear();
+    if( notify )
+    {
+        emit eventsAvailable();
+    }
+}
+
+/**************************************************
+ * bool FSInotify::entryExists
+ *************************************************/
+bool FSInotify::entryExists( const struct file_handle *handle, const char *name, bool &exists )
+{
+    // Needs CAP_DAC_READ_SEARCH on top of what fanotify needs.
+    int dirFd = open_by_handle_at( m_mountFd, const_cast<struct file_handle*>( handle ),
+                                   O_PATH | O_DIRECTORY | O_CLOEXEC );
+    if( -1 == dirFd )
+    {
+        return false;
+    }
+    struct stat st;
+    exists = 0 == fstatat( dirFd, name, &st, AT_SYMLINK_NOFOLLOW );
+    close( dirFd );
+    return true;
+}
+
+/**************************************************
+ * void FSInotify::readFanotifyEvents
+ *************************************************/
+void FSInotify::readFanotifyEvents( char *buffer, int size )
+{
+#ifdef FAN_RENAME
+    ssize_t bytes_read;
+
+    while( (bytes_read = read( m_fd, buffer, size )) > 0 )
+    {
+        const struct fanotify_event_metadata *metadata =
+            reinterpret_cast<const struct fanotify_event_metadata*>( buffer );
+        for( ; FAN_EVENT_OK( metadata, bytes_read ); metadata = FAN_EVENT_NEXT( metadata, bytes_read ) )
+        {
+            if( FANOTIFY_METADATA_VERSION != metadata->vers )
+            {
+                MTP_LOG_WARNING("Unexpected fanotify metadata version" << metadata->vers);
+                return;
+            }
+            if( metadata->mask & FAN_Q_OVERFLOW )
+            {
+                MTP_LOG_WARNING("fanotify queue overflow, events were lost");
+                continue;
+            }
+
+            // Collect the info records; a rename has an old and a new one.
+            const struct fanotify_event_info_fid *records[3] = { 0, 0, 0 };
+            const char *info = reinterpret_cast<const char*>( metadata ) + metadata->metadata_len;
+            const char *end = reinterpret_cast<const char*>( metadata ) + metadata->event_len;
+            while( info + sizeof(struct fanotify_event_info_header) <= end )
+            {
+                const struct fanotify_event_info_fid *fid =
+                    reinterpret_cast<const struct fanotify_event_info_fid*>( info );
+                if( !fid->hdr.len )
+                {
+                    break;
+                }
+                switch( fid->hdr.info_type )
+                {
+                case FAN_EVENT_INFO_TYPE_DFID_NAME:
+                    records[0] = fid;
+                    break;
+                case FAN_EVENT_INFO_TYPE_OLD_DFID_NAME:
+                    records[1] = fid;
+                    break;
+                case FAN_EVENT_INFO_TYPE_NEW_DFID_NAME:
+                    records[2] = fid;
+                    break;
+                }
+                info += fid->hdr.len;
+            }
+
+            uint32_t masks[3] = { 0, IN_MOVED_FROM, IN_MOVED_TO };
+            if( metadata->mask & FAN_CREATE )
+            {
+                masks[0] |= IN_CREATE;
+            }
+            if( metadata->mask & FAN_DELETE )
+            {
+                masks[0] |= IN_DELETE;
+            }
+            if( metadata->mask & FAN_CLOSE_WRITE )
+            {
+                masks[0] |= IN_CLOSE_WRITE;
+            }
+            uint32_t dirFlag = (metadata->mask & FAN_ONDIR) ? IN_ISDIR : 0;
+            uint32_t cookie = 0;
+            if( records[1] || records[2] )
+            {
+                // Pairs the halves of the rename, 0 means no pairing.
+                cookie = ++m_lastCookie ? m_lastCookie : ++m_lastCookie;
+            }
+
+            for( int r = 0; r < 3; ++r )
+            {
+                if( !records[r] || !masks[r] )
+                {
+                    continue;
+                }
+                const struct file_handle *handle =
+                    reinterpret_cast<const struct file_handle*>( records[r]->handle );
+                const char *name = reinterpret_cast<const char*>( handle->f_handle ) + handle->handle_bytes;
+                // Events about watched directories only, ignoring the rest
+                // of the filesystem.
+                m_lock.lock();
+                int wd = m_handleWatches.value( handleKey( handle ), -1 );
+                m_lock.unlock();
+                if( -1 == wd || !strcmp( name, "." ) )
+                {
+                    continue;
+                }
+                bool exists;
+                if( (masks[r] & (IN_CREATE | IN_DELETE)) == (IN_CREATE | IN_DELETE) )
+                {
+                    // Merged events don't tell the order; a file deleted and
+                    // created again must stay, one created and deleted must go.
+                    // One that stays is another file now, so its metadata is
+                    // read again as after a write.
+                    if( entryExists( handle, name, exists ) )
+                    {
+                        masks[r] = exists ? (masks[r] & ~IN_DELETE) | IN_CLOSE_WRITE
+                                          : masks[r] & ~(IN_CREATE | IN_CLOSE_WRITE);
+                    }
+                    else
+                    {
+                        // Can't tell, the entry is looked at again on creation.
+                        queueTranslatedEvent( wd, IN_DELETE | dirFlag, cookie, name );
+                        masks[r] &= ~IN_DELETE;
+                    }
+                }
+                queueTranslatedEvent( wd, masks[r] | dirFlag, cookie, name );
+            }
+        }
+    }
+#else
+    Q_UNUSED( buffer );
+    Q_UNUSED( size );
+#endif
+}
+
+/**************************************************
+ * void FSInotify::queueTranslatedEvent
+ *************************************************/
+void FSInotify::queueTranslatedEvent( int wd, uint32_t mask, uint32_t cookie, const char *name )
+{
+    // Laid out like inotify does, with the name null padded.
+    uint32_t nameLength = strlen( name ) + 1;
+    uint32_t len = (nameLength + sizeof(struct inotify_event) - 1) & ~(sizeof(struct inotify_event) - 1);
+    QByteArray buffer( sizeof(struct inotify_event) + len, '\0' );
+    struct inotify_event *event = reinterpret_cast<struct inotify_event*>( buffer.data() );
+    event->wd = wd;
+    event->mask = mask;
+    event->cookie = cookie;
+    event->len = len;
+    memcpy( event->name, name, nameLength );
+    queueEvent( event );
+}
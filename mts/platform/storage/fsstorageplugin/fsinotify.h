@@ -33,13 +33,30 @@
 #define FSINOTIFY_H
 
 #include <QObject>
+#include <QHash>
+#include <QByteArray>
+#include <QMutex>
+#include <QPair>
 #include "sys/inotify.h"
-class QSocketNotifier;
+class QThread;
 
 /// FSInotify is a wrapper class for the inotify library.
 
 /// FSInotify notifies the filesystem storage plug-in about changes in the file system
 /// so that the storage can take appropriate action.
+///
+/// The events are read on a watcher thread, in large batches. Events about
+/// the same directory entry within the debounce interval are coalesced: a
+/// IN_CLOSE_WRITE after IN_CREATE, IN_MOVED_TO or IN_CLOSE_WRITE adds
+/// nothing, and an entry created and deleted again is dropped altogether.
+/// Once no event arrived for the debounce interval, the batch is handed to
+/// the main thread with eventsAvailable(), in the order of the events.
+///
+/// By default every watched directory costs an inotify watch, bounded by
+/// max_user_watches. With useFanotify() a single fanotify mark covers the
+/// whole filesystem instead; a "watch" is then just the directory's file
+/// handle, and the fanotify events are translated to inotify ones, so that
+/// users see no difference besides watches that stay valid across renames.
 namespace meegomtp1dot0
 {
 class FSInotify : public QObject
@@ -51,31 +68,101 @@ public:
     /// \param mask [in] indicates what to watch for.
     FSInotify( uint32_t theMask = IN_MOVE | IN_CREATE | IN_DELETE | IN_CLOSE_WRITE );
 
-    /// Desctructor.
+    /// Desctructor, stops the watcher thread.
     ~FSInotify();
 
-    /// Adds a new watch to the file whose pathname is provided.
+    /// Adds a new watch to the file whose pathname is provided. The first
+    /// watch starts the watcher thread.
     /// \param pathName [in] the file's pathname.
     /// \return watch descriptor on success, -1 on failure.
-    int addWatch( const QString &pathName ) const;
+    int addWatch( const QString &pathName );
 
     /// Removes an added watch.
     /// \param wd [in] the watch to be removed.
     /// \return 0 on success -1 on failure.
-    int removeWatch( const int &wd ) const;
+    int removeWatch( const int &wd );
 
-public slots:
-    /// This slot is for reading the inotify event, when one is generated.
-    void inotifyEventSlot(int);
+    /// Switches to fanotify, watching the filesystem that contains path.
+    /// Must be called before any watch is added. Needs CAP_SYS_ADMIN and
+    /// Linux 5.17; inotify stays in use if that fails. Directories on other
+    /// filesystems mounted below path are not reported.
+    /// \param path [in] a path on the filesystem to watch.
+    /// \return true if fanotify is used.
+    bool useFanotify( const QString &path );
+
+    /// \return true if a watch follows its directory across renames and
+    /// moves, so that it doesn't need to be added again.
+    bool watchesFollowRenames() const { return m_fanotify; }
+
+    /// Sets how long the watcher waits for more events before handing over
+    /// a batch. A batch is handed over at the latest after ten times as long.
+    /// \param msecs [in] the debounce interval; 0 hands over every read.
+    void setDebounceInterval( int msecs );
+
+    /// Moves the batches of events handed over so far to the caller.
+    /// \param events [out] struct inotify_event records, laid out like
+    /// inotify does; records with a 0 mask were coalesced and are to be
+    /// skipped.
+    void takeEvents( QByteArray &events );
 
 signals:
-    /// This signal is emitted corresponding to an inotify event.
-    /// \param event [in] the structure holding inotify event details.
-    void inotifyEventSignal( struct inotify_event *event );
+    /// Emitted from the watcher thread when events can be taken with
+    /// takeEvents(); not again until they were taken.
+    void eventsAvailable();
 
 private:
+    friend class FSInotifyThread;
+
+    /// Watcher thread body: reads, coalesces and hands over events until
+    /// the FSInotify is destroyed.
+    void watch();
+
+    /// Reads the available inotify events into the current batch.
+    void readInotifyEvents( char *buffer, int size );
+
+    /// Reads the available fanotify events into the current batch.
+    void readFanotifyEvents( char *buffer, int size );
+
+    /// Adds an event to the current batch, coalescing it with the previous
+    /// event about the same entry.
+    /// \param event [in] the event.
+    void queueEvent( const struct inotify_event *event );
+
+    /// Adds a fanotify event, as an inotify one, to the current batch.
+    /// \param wd [in] the watch of the directory the event is about.
+    /// \param mask [in] the inotify event mask.
+    /// \param cookie [in] the cookie pairing IN_MOVED_FROM and IN_MOVED_TO.
+    /// \param name [in] the name of the entry in the directory.
+    void queueTranslatedEvent( int wd, uint32_t mask, uint32_t cookie, const char *name );
+
+    /// Checks whether a directory entry reported by fanotify still exists.
+    /// \param handle [in] the file handle of the directory.
+    /// \param name [in] the name of the entry in the directory.
+    /// \param exists [out] true if the entry is there.
+    /// \return false if the directory can't be opened from its handle.
+    bool entryExists( const struct file_handle *handle, const char *name, bool &exists );
+
+    /// Hands the current batch over to the main thread.
+    void publishBatch();
+
     uint32_t m_mask; ///< indicates what to watch for on a file.
-    QSocketNotifier *m_readSocket; ///< inotify events will be written to this socket.
+    int m_fd; ///< the inotify or fanotify descriptor.
+    int m_stopFd; ///< eventfd waking up the watcher thread to stop it.
+    bool m_fanotify; ///< true if m_fd is a fanotify descriptor.
+    int m_mountFd; ///< fanotify: a directory on the watched filesystem, for open_by_handle_at().
+    QThread *m_thread; ///< the watcher thread.
+    int m_debounceInterval; ///< msecs without events before a batch is handed over.
+
+    // Watcher thread only.
+    QByteArray m_batch; ///< events read, not handed over yet.
+    QHash<QPair<int, QByteArray>, int> m_lastEvents; ///< (wd, name) -> offset of the entry's last event in m_batch.
+    uint32_t m_lastCookie; ///< last cookie of a translated move.
+
+    QMutex m_lock; ///< protects everything below.
+    QByteArray m_ready; ///< events handed over, waiting for takeEvents().
+    int m_lastWatch; ///< last watch handed out for fanotify.
+    QHash<QByteArray, int> m_handleWatches; ///< fanotify: directory file handle -> watch.
+    QHash<int, QByteArray> m_watchHandles; ///< fanotify: watch -> directory file handle.
 };
 }
 
@@ -30,20 +30,35 @@
 */
 
 #include "fsstorageplugin.h"
+#include "fscopyengine.h"
+#include "fsdirwalker.h"
+#include "fsfdcache.h"
 #include "fsinotify.h"
+#include "fstreeremover.h"
+#include "fswritebehind.h"
+#include "logstore.h"
 #include "storagetracker.h"
 #include "storageitem.h"
 #include "thumbnailer.h"
 #include "trace.h"
 
 #include <sys/statvfs.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
 #include <QDebug>
 #include <QFile>
+#include <QSaveFile>
+#include <QDataStream>
 #include <QDir>
 #include <QVariant>
 #include <QFileInfo>
 #include <QDateTime>
+#include <QElapsedTimer>
 #include <QMetaObject>
+#include <QTimer>
 
 #ifndef UT_ON
 #include <blkid.h>
@@ -60,6 +75,233 @@ const quint32 THUMB_HEIGHT    =    100;
 static quint32 fourcc_wmv3 = 0x574D5633;
 static const QString FILENAMES_FILTER_REGEX("[<>:\\\"\\/\\\\\\|\\?\\*\\x0000-\\x001F]");
 
+// Object index snapshot, see storeSnapshot().
+static const quint32 SNAPSHOT_MAGIC = 0x4D545053; // "MTPS"
+static const quint32 SNAPSHOT_VERSION = 2;
+static const quint32 SNAPSHOT_NO_PARENT = 0xFFFFFFFF;
+static const quint32 SNAPSHOT_END = 0xFFFFFFFE;
+// Write the snapshot after the storage has been idle for this long (ms).
+static const int SNAPSHOT_IDLE_TIMEOUT = 30 * 1000;
+// Number of walker entries indexed per event loop iteration.
+static const int WALKER_BATCH_SIZE = 256;
+// Number of directories listed per event loop iteration when completing
+// a lazy enumeration in the background.
+static const int LAZY_COMPLETION_BATCH_SIZE = 16;
+// Files whose sniffed format is remembered across readMetadata() calls.
+static const int MAX_SNIFF_CACHE_SIZE = 4096;
+// Delay before written puoids and references are synced to disk.
+static const int LOG_SYNC_TIMEOUT = 1000;
+// A log is compacted once it has more than twice as many records as there
+// are live entries, plus this many.
+static const quint32 LOG_COMPACTION_SLACK = 1024;
+// How long a tree removal waits for progress before checking for a cancel, in ms.
+static const unsigned long REMOVE_PROGRESS_INTERVAL = 50;
+// Key of the largest puoid handed out in the puoids log; paths are never empty.
+static const QByteArray LARGEST_PUOID_KEY;
+// How long a file copy waits for progress before checking for a cancel, in ms.
+static const unsigned long COPY_PROGRESS_INTERVAL = 50;
+// SendObject data is written in chunks of this size.
+static const int WRITE_CHUNK_SIZE = 1024 * 1024;
+
+/* Maps the errno of a failed SendObject write to a response code. */
+static MTPResponseCode writeErrorResponse( int error )
+{
+    if( 0 == error )
+    {
+        return MTP_RESP_OK;
+    }
+    return ENOSPC == error ? MTP_RESP_StoreFull : MTP_RESP_GeneralError;
+}
+
+/* Reads the modification and change times of a directory, in nanoseconds.
+ * Returns false if path is not an existing directory. */
+static bool directoryStamps( const QString &path, qint64 &mtime, qint64 &ctime )
+{
+    FSDirEntry entry;
+    QByteArray ba = QFile::encodeName( path );
+    if( !FSDirWalker::statEntry( AT_FDCWD, ba.constData(), entry ) || !entry.isDir )
+    {
+        return false;
+    }
+    mtime = entry.mtime;
+    ctime = entry.ctime;
+    return true;
+}
+
+/* Encodes a puoid as stored in the logs. */
+static QByteArray puoidBytes( const MtpInt128 &puoid )
+{
+    return QByteArray( puoid.val, sizeof(puoid.val) );
+}
+
+/* Decodes a puoid stored in the logs; data must hold 16 bytes. */
+static MtpInt128 puoidFromBytes( const char *data )
+{
+    MtpInt128 puoid;
+    memcpy( puoid.val, data, sizeof(puoid.val) );
+    return puoid;
+}
+
+namespace
+{
+/* Replays the puoids log into the map of unclaimed puoids. */
+class PuoidsLogReader : public LogStoreVisitor
+{
+public:
+    PuoidsLogReader( QHash<QString,MtpInt128> &puoids, MtpInt128 &largest ) :
+        m_puoids(puoids), m_largest(largest) {}
+
+    void put( const QByteArray &key, const QByteArray &value )
+    {
+        if( (int)sizeof(MtpInt128) != value.size() )
+        {
+            return;
+        }
+        if( key.isEmpty() )
+        {
+            m_largest = puoidFromBytes( value.constData() );
+        }
+        else
+        {
+            m_puoids.insert( QString::fromUtf8( key ), puoidFromBytes( value.constData() ) );
+        }
+    }
+
+    void remove( const QByteArray &key )
+    {
+        m_puoids.remove( QString::fromUtf8( key ) );
+    }
+
+private:
+    QHash<QString,MtpInt128> &m_puoids;
+    MtpInt128 &m_largest;
+};
+
+/* Replays the references log: object puoid -> referenced puoids. */
+class ReferencesLogReader : public LogStoreVisitor
+{
+public:
+    void put( const QByteArray &key, const QByteArray &value )
+    {
+        // Deep copies, the log is unmapped after the replay.
+        m_references.insert( QByteArray( key.constData(), key.size() ),
+                             QByteArray( value.constData(), value.size() ) );
+    }
+
+    void remove( const QByteArray &key )
+    {
+        m_references.remove( key );
+    }
+
+    QHash<QByteArray, QByteArray> m_references;
+};
+}
+
+/* Formats a time in seconds since the epoch as an MTP date string. */
+static QString mtpDateString( qint64 secs )
+{
+    return QDateTime::fromMSecsSinceEpoch( secs * 1000, Qt::UTC ).toString("yyyyMMdd'T'hhmmss'Z'");
+}
+
+/* Extension -> format table, laid out as a perfect hash: each known
+ * extension sits in the slot given by extensionHash(), and no two share one,
+ * so a lookup is one hash and one string compare without any allocation.
+ * When adding an extension, pick a multiplier and size that keep the table
+ * collision free; the static_assert below checks the layout. */
+struct ExtensionFormat
+{
+    const char *ext;
+    MTPObjFormatCode format;
+};
+
+static constexpr quint32 EXT_HASH_MULTIPLIER = 38;
+static constexpr quint32 EXT_TABLE_SIZE = 61;
+static const int MAX_EXT_LENGTH = 4;
+
+static constexpr quint32 extensionHash( const char *ext, quint32 hash = 0 )
+{
+    return *ext ? extensionHash( ext + 1, hash * EXT_HASH_MULTIPLIER + static_cast<unsigned char>( *ext ) )
+                : hash % EXT_TABLE_SIZE;
+}
+
+#define EXT_NONE { 0, MTP_OBF_FORMAT_Undefined }
+static constexpr ExtensionFormat EXT_TABLE[EXT_TABLE_SIZE] = {
+    EXT_NONE, EXT_NONE, EXT_NONE,
+    { "tif", MTP_OBF_FORMAT_TIFF },
+    EXT_NONE,
+    { "alb", MTP_OBF_FORMAT_Abstract_Audio_Album },
+    EXT_NONE, EXT_NONE, EXT_NONE,
+    { "pla", MTP_OBF_FORMAT_Abstract_Audio_Video_Playlist },
+    EXT_NONE, EXT_NONE, EXT_NONE, EXT_NONE,
+    { "jpeg", MTP_OBF_FORMAT_EXIF_JPEG },
+    { "aac", MTP_OBF_FORMAT_AAC },
+    EXT_NONE,
+    { "3gp", MTP_OBF_FORMAT_3GP_Container },
+    EXT_NONE,
+    { "gif", MTP_OBF_FORMAT_GIF },
+    EXT_NONE,
+    { "wav", MTP_OBF_FORMAT_WAV },
+    EXT_NONE, EXT_NONE, EXT_NONE, EXT_NONE,
+    { "avi", MTP_OBF_FORMAT_AVI },
+    { "pls", MTP_OBF_FORMAT_PLS_Playlist },
+    { "ogg", MTP_OBF_FORMAT_OGG },
+    { "wma", MTP_OBF_FORMAT_WMA },
+    { "png", MTP_OBF_FORMAT_PNG },
+    EXT_NONE, EXT_NONE,
+    { "tiff", MTP_OBF_FORMAT_TIFF },
+    EXT_NONE, EXT_NONE, EXT_NONE,
+    { "bmp", MTP_OBF_FORMAT_BMP },
+    { "txt", MTP_OBF_FORMAT_Text },
+    EXT_NONE, EXT_NONE, EXT_NONE, EXT_NONE,
+    { "jpg", MTP_OBF_FORMAT_EXIF_JPEG },
+    { "mpg", MTP_OBF_FORMAT_MPEG },
+    EXT_NONE, EXT_NONE, EXT_NONE, EXT_NONE, EXT_NONE,
+    { "wmv", MTP_OBF_FORMAT_WMV },
+    EXT_NONE,
+    { "mpeg", MTP_OBF_FORMAT_MPEG },
+    { "mp3", MTP_OBF_FORMAT_MP3 },
+    { "mp4", MTP_OBF_FORMAT_MP4_Container },
+    { "html", MTP_OBF_FORMAT_HTML },
+    EXT_NONE, EXT_NONE,
+    { "htm", MTP_OBF_FORMAT_HTML },
+    EXT_NONE, EXT_NONE
+};
+#undef EXT_NONE
+
+static constexpr bool extensionTableIsPerfect( quint32 slot = 0 )
+{
+    return slot == EXT_TABLE_SIZE ||
+           ( ( !EXT_TABLE[slot].ext || extensionHash( EXT_TABLE[slot].ext ) == slot ) &&
+             extensionTableIsPerfect( slot + 1 ) );
+}
+static_assert( extensionTableIsPerfect(), "every extension must sit in its own hash slot" );
+
+/* Looks up the format of a file by its extension, which is matched case
+ * insensitively. Names without a known extension are Undefined. */
+static MTPObjFormatCode formatByExtension( const QString &name )
+{
+    int dot = name.lastIndexOf( '.' );
+    int length = name.size() - dot - 1;
+    if( dot < 0 || length < 1 || length > MAX_EXT_LENGTH )
+    {
+        return MTP_OBF_FORMAT_Undefined;
+    }
+    char ext[MAX_EXT_LENGTH + 1];
+    const QChar *c = name.constData() + dot + 1;
+    for( int i = 0; i < length; ++i )
+    {
+        ushort u = c[i].unicode();
+        if( u > 0x7f )
+        {
+            return MTP_OBF_FORMAT_Undefined;
+        }
+        ext[i] = static_cast<char>( u >= 'A' && u <= 'Z' ? u + ( 'a' - 'A' ) : u );
+    }
+    ext[length] = '\0';
+    const ExtensionFormat &entry = EXT_TABLE[extensionHash( ext )];
+    return entry.ext && !strcmp( entry.ext, ext ) ? entry.format : MTP_OBF_FORMAT_Undefined;
+}
+
 /************************************************************
  * FSStoragePlugin::FSStoragePlugin
  ***********************************************************/
@@ -68,9 +310,26 @@ FSStoragePlugin::FSStoragePlugin( quint32 storageId, MTPStorageType storageType,
   StoragePlugin(storageId),
   m_storagePath(QDir(storagePath).absolutePath()),
   m_root(0),
+  m_snapshotTimer(0),
+  m_snapshotDirty(false),
+  m_enumerated(false),
   m_writeObjectHandle(0),
+  m_puoidsLog(0),
+  m_referencesLog(0),
+  m_logSyncTimer(0),
   m_largestPuoid(0),
-  m_dataFile(0)
+  m_largestPuoidLogged(true),
+  m_storageInfoChanged(false),
+  m_freeSpaceMayHaveChanged(false),
+  m_dataFile(0),
+  m_dataWriter(0),
+  m_dataFilePreallocated(0),
+  m_walker(0),
+  m_lazyEnumeration(false),
+  m_lazyCompletionRunning(false),
+  m_lazyCompletionListed(0),
+  m_contentSniffing(false),
+  m_readFds(new FSFdCache)
 {
     m_storageInfo.storageType = storageType;
     m_storageInfo.accessCapability = MTP_STORAGE_ACCESS_ReadWrite;
@@ -102,12 +361,16 @@ FSStoragePlugin::FSStoragePlugin( quint32 storageId, MTPStorageType storageType,
         dir.mkpath( m_mtpPersistentDBPath );
     }
 
+    QString volumeId = volumeLabel + '-' + filesystemUuid();
     m_puoidsDbPath = m_mtpPersistentDBPath + "/mtppuoids";
     // Remove legacy PUOID database if it exists.
     QFile::remove(m_puoidsDbPath);
-    m_puoidsDbPath += '-' + volumeLabel + '-' + filesystemUuid();
+    m_puoidsDbPath += '-' + volumeId;
+    m_puoidsLog = new LogStore( m_puoidsDbPath + ".log" );
 
     m_objectReferencesDbPath = m_mtpPersistentDBPath + "/mtpreferences";
+    m_referencesLog = new LogStore( m_objectReferencesDbPath + '-' + volumeId + ".log" );
+    m_snapshotPath = m_mtpPersistentDBPath + "/mtpsnapshot-" + volumeId;
     m_internalPlaylistPath = m_mtpPersistentDBPath + "/Playlists";
     m_playlistPath = storagePath + "/Playlists";
 
@@ -121,7 +384,17 @@ FSStoragePlugin::FSStoragePlugin( quint32 storageId, MTPStorageType storageType,
     QObject::connect( m_thumbnailer, SIGNAL( thumbnailReady( const QString& ) ), this, SLOT( receiveThumbnail( const QString& ) ) );
     clearCachedInotifyEvent(); // initialize
     m_inotify = new FSInotify( IN_MOVE | IN_CREATE | IN_DELETE | IN_CLOSE_WRITE );
-    QObject::connect( m_inotify, SIGNAL(inotifyEventSignal( struct inotify_event* )), this, SLOT(inotifyEventSlot( struct inotify_event* )) );
+    QObject::connect( m_inotify, SIGNAL(eventsAvailable()), this, SLOT(inotifyEventsAvailable()) );
+
+    m_snapshotTimer = new QTimer( this );
+    m_snapshotTimer->setSingleShot( true );
+    m_snapshotTimer->setInterval( SNAPSHOT_IDLE_TIMEOUT );
+    QObject::connect( m_snapshotTimer, SIGNAL(timeout()), this, SLOT(storeSnapshot()) );
+
+    m_logSyncTimer = new QTimer( this );
+    m_logSyncTimer->setSingleShot( true );
+    m_logSyncTimer->setInterval( LOG_SYNC_TIMEOUT );
+    QObject::connect( m_logSyncTimer, SIGNAL(timeout()), this, SLOT(syncLogs()) );
 
     MTP_LOG_INFO(storagePath << "exported as FS storage" << volumeLabel << '('
             << storageDescription << ')');
@@ -155,9 +428,142 @@ void FSStoragePlugin::enumerateStorage_worker()
     m_tracker->getPlaylists(m_existingPlaylists.playlistPaths, m_existingPlaylists.playlistEntries, true);
     m_tracker->getPlaylists(m_newPlaylists.playlistNames, m_newPlaylists.playlistEntries, false);
 
-    // Add the root folder to storage
-    addToStorage(m_storagePath, &m_root);
+    // Add the root folder to storage, starting from the snapshot of the
+    // previous session if there is a usable one.
+    m_enumerationTimer.start();
+    if( restoreSnapshot() )
+    {
+        MTP_LOG_INFO("Storage" << m_storagePath << "restored from snapshot in"
+                << m_enumerationTimer.elapsed() << "ms");
+        // Subtrees that turned up while we were down are indexed like a
+        // full enumeration, without blocking the event loop.
+        if( !startWalker() )
+        {
+            finishEnumeration();
+        }
+        return;
+    }
+
+    // Otherwise walk the whole tree on worker threads, the entries are
+    // indexed in walkerEntriesAvailable().
+    addToStorage(m_storagePath, &m_root, 0, false, false, 0, false);
+    if( !m_root )
+    {
+        MTP_LOG_CRITICAL("Cannot add storage root" << m_storagePath);
+        finishEnumeration();
+        return;
+    }
+
+    if( m_lazyEnumeration )
+    {
+        // Only the top level for now, the rest is listed on demand.
+        m_root->m_listed = false;
+        m_unlistedDirs.insert( m_root->m_handle );
+        ensureListed( m_root );
+        MTP_LOG_INFO("Storage" << m_storagePath << "top level enumerated in"
+                << m_enumerationTimer.elapsed() << "ms");
+        finishEnumeration();
+        return;
+    }
+    directoryStamps( m_storagePath, m_root->m_dirMtime, m_root->m_dirCtime );
+    m_snapshotDirty = true;
+
+    m_pendingWalks.append( m_storagePath );
+    startWalker();
+}
+
+/************************************************************
+ * bool FSStoragePlugin::startWalker
+ ***********************************************************/
+bool FSStoragePlugin::startWalker()
+{
+    if( m_pendingWalks.isEmpty() )
+    {
+        return false;
+    }
+
+    m_walker = new FSDirWalker( m_pendingWalks.first(), m_excludePaths );
+    m_walkedDirs.clear();
+    foreach( const QString &path, m_pendingWalks )
+    {
+        if( path != m_pendingWalks.first() )
+        {
+            m_walker->addRoot( path );
+        }
+        StorageItem *item = lookupPath( path );
+        if( item )
+        {
+            m_walkedDirs.append( item->m_handle );
+        }
+    }
+    m_pendingWalks.clear();
+
+    // Keeps the file reads off the main thread during enumeration.
+    m_walker->setContentSniffing( m_contentSniffing );
+    QObject::connect( m_walker, SIGNAL(entriesAvailable()), this, SLOT(walkerEntriesAvailable()),
+            Qt::QueuedConnection );
+    m_walker->start();
+    return true;
+}
 
+/************************************************************
+ * void FSStoragePlugin::walkerEntriesAvailable
+ ***********************************************************/
+void FSStoragePlugin::walkerEntriesAvailable()
+{
+    if( !m_walker )
+    {
+        return;
+    }
+
+    // Index a bounded number of entries per call, so that the event loop
+    // keeps running without processEvents() re-entering us.
+    QVector<FSDirEntry> entries;
+    bool done = m_walker->takeEntries( entries, WALKER_BATCH_SIZE );
+    foreach( const FSDirEntry &entry, entries )
+    {
+        StorageItem *item = 0;
+        addToStorage( entry.path, &item, 0, false, false, 0, false, &entry );
+        if( item && entry.isDir )
+        {
+            item->m_dirMtime = entry.mtime;
+            item->m_dirCtime = entry.ctime;
+            m_walkedDirs.append( item->m_handle );
+        }
+    }
+
+    if( !done )
+    {
+        if( !entries.isEmpty() )
+        {
+            QMetaObject::invokeMethod( this, "walkerEntriesAvailable", Qt::QueuedConnection );
+        }
+        return;
+    }
+
+    m_walker->deleteLater();
+    m_walker = 0;
+
+    // A directory could have been listed before its inotify watch was
+    // added; rescan the ones that changed since they were listed. That
+    // may turn up new subtrees, which get a walk of their own.
+    QVector<ObjHandle> directories;
+    directories.swap( m_walkedDirs );
+    rescanChangedDirectories( directories );
+    if( startWalker() )
+    {
+        return;
+    }
+
+    MTP_LOG_INFO("Storage" << m_storagePath << "enumerated in" << m_enumerationTimer.elapsed() << "ms");
+    finishEnumeration();
+}
+
+/************************************************************
+ * void FSStoragePlugin::finishEnumeration
+ ***********************************************************/
+void FSStoragePlugin::finishEnumeration()
+{
     removeUnusedPuoids();
 
     // Populate object references stored persistently and add them to the storage.
@@ -169,6 +575,12 @@ void FSStoragePlugin::enumerateStorage_worker()
     // Create playlist folders and sync .pla files with real playlists.
     assignPlaylistReferences();
 
+    m_enumerated = true;
+    if( m_snapshotDirty )
+    {
+        m_snapshotTimer->start();
+    }
+
     emit storagePluginReady(m_storageId);
 }
 
@@ -177,8 +589,14 @@ void FSStoragePlugin::enumerateStorage_worker()
  ***********************************************************/
 FSStoragePlugin::~FSStoragePlugin()
 {
-    storePuoids();
-    storeObjectReferences();
+    delete m_walker;
+    m_walker = 0;
+    delete m_readFds;
+    m_readFds = 0;
+    closeDataFile();
+
+    syncLogs();
+    storeSnapshot();
 
     for( QHash<ObjHandle, StorageItem*>::iterator i = m_objectHandlesMap.begin() ; i != m_objectHandlesMap.end(); ++i )
     {
@@ -194,6 +612,10 @@ FSStoragePlugin::~FSStoragePlugin()
     m_thumbnailer = 0;
     delete m_inotify;
     m_inotify = 0;
+    delete m_puoidsLog;
+    m_puoidsLog = 0;
+    delete m_referencesLog;
+    m_referencesLog = 0;
 }
 
 #if 0
@@ -268,7 +690,7 @@ void FSStoragePlugin::syncPlaylists()
 void FSStoragePlugin::assignPlaylistReferences()
 {
     // Get the handle for the playlist path
-    ObjHandle playlistDirHandle = m_pathNamesMap[m_playlistPath];
+    ObjHandle playlistDirHandle = handleForPath(m_playlistPath);
     if(0 == playlistDirHandle)
     {
         MTP_LOG_CRITICAL("No handle found for playlists directory!, playlists will be unavailable!");
@@ -283,16 +705,16 @@ void FSStoragePlugin::assignPlaylistReferences()
         references.clear();
         QString playlistPath = m_existingPlaylists.playlistPaths[i];
         // Iterate over all entries, get their object handles, and assign references
-        if(m_pathNamesMap.contains(playlistPath))
+        if(lookupPath( playlistPath ))
         {
-            refHandle = m_pathNamesMap[playlistPath];
+            refHandle = handleForPath(playlistPath);
             // Iterate entries now
             QStringList entries = m_existingPlaylists.playlistEntries[i];
             foreach(QString entry, entries)
             {
-                if(m_pathNamesMap.contains(entry))
+                if(lookupPath( entry ))
                 {
-                    references.append(m_pathNamesMap[entry]);
+                    references.append(handleForPath(entry));
                 }
             }
             m_objectReferencesMap[refHandle] = references;
@@ -319,9 +741,9 @@ void FSStoragePlugin::assignPlaylistReferences()
             QStringList entries = m_newPlaylists.playlistEntries[i];
             foreach(QString entry, entries)
             {
-                if(m_pathNamesMap.contains(entry))
+                if(lookupPath( entry ))
                 {
-                    references.append(m_pathNamesMap[entry]);
+                    references.append(handleForPath(entry));
                 }
             }
             m_objectReferencesMap[newHandle] = references;
@@ -343,7 +765,7 @@ QVector<ObjHandle> FSStoragePlugin::readInternalAbstractPlaylist( StorageItem *i
         return playlistRefs;
     }
     char filePath[256]; // the max path length // FIXME
-    QFile file( item->m_path );
+    QFile file( item->path() );
     if( file.open( QIODevice::ReadOnly ) )
     {
         while( !file.atEnd() )
@@ -354,9 +776,9 @@ QVector<ObjHandle> FSStoragePlugin::readInternalAbstractPlaylist( StorageItem *i
                 continue;
             }
             filePath[bytesRead -1] = '\0';
-            if( m_pathNamesMap.contains( QString( filePath ) ) )
+            if( lookupPath( QString( filePath ) ) )
             {
-                playlistRefs.append( m_pathNamesMap.value( QString( filePath ) ) );
+                playlistRefs.append( handleForPath( QString( filePath ) ) );
             }
         }
     }
@@ -377,6 +799,23 @@ void FSStoragePlugin::removePlaylist(const QString &path)
  * void FSStoragePlugin::populatePuoids
  ***********************************************************/
 void FSStoragePlugin::populatePuoids()
+{
+    bool haveLog = QFile::exists( m_puoidsLog->path() );
+    PuoidsLogReader reader( m_puoidsMap, m_largestPuoid );
+    m_puoidsLog->open( &reader );
+    if( !haveLog )
+    {
+        // Convert the db of older versions.
+        readLegacyPuoids();
+        compactPuoids();
+        QFile::remove( m_puoidsDbPath );
+    }
+}
+
+/************************************************************
+ * void FSStoragePlugin::readLegacyPuoids
+ ***********************************************************/
+void FSStoragePlugin::readLegacyPuoids()
 {
     QFile file( m_puoidsDbPath );
     if( !file.open( QIODevice::ReadOnly ) || !file.size() )
@@ -442,95 +881,522 @@ void FSStoragePlugin::populatePuoids()
  ***********************************************************/
 void FSStoragePlugin::removeUnusedPuoids()
 {
-    QHash<QString, MtpInt128>::iterator i = m_puoidsMap.begin();
-    while( i != m_puoidsMap.end() )
+    // Items in the tree took their puoids out of the map when they were
+    // added, what is left belongs to objects that are gone. Directories that
+    // are yet to be listed still have to claim theirs.
+    if( !m_unlistedDirs.isEmpty() )
+    {
+        return;
+    }
+    for( QHash<QString,MtpInt128>::const_iterator i = m_puoidsMap.constBegin(); i != m_puoidsMap.constEnd(); ++i )
+    {
+        m_puoidsLog->remove( i.key().toUtf8() );
+    }
+    if( !m_puoidsMap.isEmpty() )
+    {
+        scheduleLogSync();
+    }
+    m_puoidsMap.clear();
+}
+
+/************************************************************
+ * void FSStoragePlugin::compactPuoids
+ ***********************************************************/
+void FSStoragePlugin::compactPuoids()
+{
+    if( !m_puoidsLog->beginRewrite() )
+    {
+        return;
+    }
+    m_puoidsLog->rewritePut( LARGEST_PUOID_KEY, puoidBytes( m_largestPuoid ) );
+    m_largestPuoidLogged = true;
+
+    // Unclaimed puoids first, so that the tree wins should a path be in both.
+    for( QHash<QString,MtpInt128>::const_iterator i = m_puoidsMap.constBegin(); i != m_puoidsMap.constEnd(); ++i )
+    {
+        m_puoidsLog->rewritePut( i.key().toUtf8(), puoidBytes( i.value() ) );
+    }
+
+    // The puoids of the objects in the tree, building the paths while
+    // walking down.
+    QVector<QPair<const StorageItem*, QString> > stack;
+    if( m_root )
     {
-        if( !m_pathNamesMap.contains( i.key() ) )
+        stack.append( qMakePair( static_cast<const StorageItem*>(m_root), m_root->m_name ) );
+    }
+    while( !stack.isEmpty() )
+    {
+        QPair<const StorageItem*, QString> top = stack.last();
+        stack.removeLast();
+        m_puoidsLog->rewritePut( top.second.toUtf8(), puoidBytes( top.first->m_puoid ) );
+        for( const StorageItem *child = top.first->m_firstChild; child; child = child->m_nextSibling )
         {
-            i = m_puoidsMap.erase(i);
+            stack.append( qMakePair( child, top.second + '/' + child->m_name ) );
         }
-        else
+    }
+
+    m_puoidsLog->commitRewrite();
+}
+
+/************************************************************
+ * void FSStoragePlugin::logMovedPuoids
+ ***********************************************************/
+void FSStoragePlugin::logMovedPuoids( StorageItem *item, const QString &oldPath )
+{
+    // Paths are the keys of the log, so every descendant is re-keyed.
+    QVector<QPair<const StorageItem*, QPair<QString, QString> > > stack;
+    stack.append( qMakePair( static_cast<const StorageItem*>(item), qMakePair( oldPath, item->path() ) ) );
+    while( !stack.isEmpty() )
+    {
+        const StorageItem *top = stack.last().first;
+        QPair<QString, QString> paths = stack.last().second;
+        stack.removeLast();
+        m_puoidsLog->remove( paths.first.toUtf8() );
+        m_puoidsLog->put( paths.second.toUtf8(), puoidBytes( top->m_puoid ) );
+        for( const StorageItem *child = top->m_firstChild; child; child = child->m_nextSibling )
         {
-            ++i;
+            stack.append( qMakePair( child, qMakePair( paths.first + '/' + child->m_name,
+                                                       paths.second + '/' + child->m_name ) ) );
         }
     }
+    scheduleLogSync();
 }
 
 /************************************************************
- * void FSStoragePlugin::storePuoids
+ * void FSStoragePlugin::scheduleLogSync
  ***********************************************************/
-void FSStoragePlugin::storePuoids()
+void FSStoragePlugin::scheduleLogSync()
 {
-    // Store in the following order
-    // Last used PUOID (128 bits)
-    // No. Of puoids ( 4 bytes )
-    // length of object's pathname : pathname : puoid ( for each puoid )
-    qint32 bytesWritten = -1;
-    QFile file( m_puoidsDbPath );
-    if( !file.open( QIODevice::WriteOnly | QIODevice::Truncate ) )
+    // Not restarted while active, so that a long burst of changes is
+    // still synced every LOG_SYNC_TIMEOUT.
+    if( m_logSyncTimer && !m_logSyncTimer->isActive() )
+    {
+        m_logSyncTimer->start();
+    }
+}
+
+/************************************************************
+ * void FSStoragePlugin::syncLogs
+ ***********************************************************/
+void FSStoragePlugin::syncLogs()
+{
+    if( m_logSyncTimer )
+    {
+        m_logSyncTimer->stop();
+    }
+
+    if( !m_largestPuoidLogged )
+    {
+        m_puoidsLog->put( LARGEST_PUOID_KEY, puoidBytes( m_largestPuoid ) );
+        m_largestPuoidLogged = true;
+    }
+
+    // Rewrite the logs once they are mostly history, which bounds their
+    // size and the time to replay them at startup.
+    quint32 livePuoids = m_objectHandlesMap.size() + m_puoidsMap.size() + 1;
+    if( m_puoidsLog->recordCount() > 2 * livePuoids + LOG_COMPACTION_SLACK )
+    {
+        compactPuoids();
+    }
+    else
+    {
+        m_puoidsLog->sync();
+    }
+
+    if( m_referencesLog->recordCount() > 2 * (quint32)m_objectReferencesMap.size() + LOG_COMPACTION_SLACK )
+    {
+        compactObjectReferences();
+    }
+    else
+    {
+        m_referencesLog->sync();
+    }
+}
+
+/************************************************************
+ * void FSStoragePlugin::storeSnapshot
+ ***********************************************************/
+void FSStoragePlugin::storeSnapshot()
+{
+    // Layout (QDataStream):
+    // magic : version : storage path
+    // one record per item, parents before their children:
+    //   parent record index : name : directory stamps : format : size :
+    //   created : modified : puoid
+    // end marker : number of records
+    m_snapshotTimer->stop();
+    // A lazily enumerated tree is not written until it is complete.
+    if( !m_enumerated || !m_root || !m_snapshotDirty || !m_unlistedDirs.isEmpty() )
     {
         return;
     }
 
-    // Write the last used puoid.
-    bytesWritten = file.write( reinterpret_cast<const char*>(&m_largestPuoid), sizeof(MtpInt128) );
-    if( -1 == bytesWritten )
+    QSaveFile file( m_snapshotPath );
+    if( !file.open( QIODevice::WriteOnly ) )
     {
-        MTP_LOG_WARNING("ERROR writing last used puoid to db!!");
-        file.resize(0);
-        file.close();
+        MTP_LOG_WARNING("Cannot write object index snapshot" << m_snapshotPath);
         return;
     }
 
-    // Write the no of puoids
-    quint32 noOfPuoids = m_puoidsMap.size();
-    bytesWritten = file.write( reinterpret_cast<const char*>(&noOfPuoids), sizeof(quint32) );
-    if( -1 == bytesWritten )
+    QDataStream out( &file );
+    out.setVersion( QDataStream::Qt_5_0 );
+    out << SNAPSHOT_MAGIC << SNAPSHOT_VERSION << m_storagePath;
+
+    QVector<QPair<StorageItem*, quint32> > stack;
+    stack.append( qMakePair( m_root, SNAPSHOT_NO_PARENT ) );
+    quint32 index = 0;
+    while( !stack.isEmpty() )
     {
-        MTP_LOG_WARNING("ERROR writing no of puoids to db!!");
-        file.resize(0);
-        file.close();
+        StorageItem *item = stack.last().first;
+        quint32 parentIndex = stack.last().second;
+        stack.removeLast();
+
+        out << parentIndex << item->name()
+            << item->m_dirMtime << item->m_dirCtime
+            << item->m_format << item->m_size
+            << item->m_created << item->m_modified;
+        out.writeRawData( item->m_puoid.val, sizeof(item->m_puoid.val) );
+
+        for( StorageItem *child = item->m_firstChild; child; child = child->m_nextSibling )
+        {
+            stack.append( qMakePair( child, index ) );
+        }
+        ++index;
+    }
+    out << SNAPSHOT_END << index;
+
+    if( out.status() != QDataStream::Ok || !file.commit() )
+    {
+        MTP_LOG_WARNING("ERROR writing object index snapshot" << m_snapshotPath);
         return;
     }
+    m_snapshotDirty = false;
+}
+
+/************************************************************
+ * bool FSStoragePlugin::restoreSnapshot
+ ***********************************************************/
+bool FSStoragePlugin::restoreSnapshot()
+{
+    QFile file( m_snapshotPath );
+    if( !file.open( QIODevice::ReadOnly ) || !file.size() )
+    {
+        return false;
+    }
+    uchar *mapped = file.map( 0, file.size() );
+    if( !mapped )
+    {
+        return false;
+    }
+    QByteArray data = QByteArray::fromRawData( reinterpret_cast<const char*>(mapped), file.size() );
+    QDataStream in( data );
+    in.setVersion( QDataStream::Qt_5_0 );
 
-    // Write info for each puoid
-    for( QHash<QString,MtpInt128>::const_iterator i = m_puoidsMap.constBegin() ; i != m_puoidsMap.constEnd(); ++i )
+    quint32 magic = 0, version = 0;
+    QString storagePath;
+    in >> magic >> version >> storagePath;
+    if( in.status() != QDataStream::Ok || SNAPSHOT_MAGIC != magic ||
+        SNAPSHOT_VERSION != version || storagePath != m_storagePath )
     {
-        quint32 pathnameLen = i.key().size();
-        QString pathname = i.key();
-        MtpInt128 puoid = i.value();
+        MTP_LOG_WARNING("Ignoring incompatible object index snapshot" << m_snapshotPath);
+        return false;
+    }
 
-        // Write length of path name
-        bytesWritten = file.write( reinterpret_cast<const char*>(&pathnameLen), sizeof(quint32) );
-        if( -1 == bytesWritten )
+    // Parse everything before touching the maps, so that a damaged snapshot
+    // leaves the storage empty for a full enumeration. Items below excluded
+    // paths are dropped and recorded as null.
+    QVector<StorageItem*> items;
+    bool valid = false;
+    while( in.status() == QDataStream::Ok )
+    {
+        quint32 parentIndex = SNAPSHOT_END;
+        in >> parentIndex;
+        if( SNAPSHOT_END == parentIndex )
         {
-            MTP_LOG_WARNING("ERROR writing pathname len to db!!");
-            file.resize(0);
-            file.close();
-            return;
+            quint32 count = 0;
+            in >> count;
+            valid = in.status() == QDataStream::Ok && !items.isEmpty() &&
+                    items.first() && count == (quint32)items.size();
+            break;
         }
 
-        // Write path name
-        QByteArray ba = pathname.toUtf8();
-        bytesWritten = file.write( reinterpret_cast<const char*>(ba.constData()), pathnameLen );
-        if( -1 == bytesWritten )
+        StorageItem *item = new StorageItem;
+        items.append( item );
+
+        QString name;
+        in >> name
+           >> item->m_dirMtime >> item->m_dirCtime
+           >> item->m_format >> item->m_size
+           >> item->m_created >> item->m_modified;
+        item->m_treeSize = item->m_size;
+        if( in.readRawData( item->m_puoid.val, sizeof(item->m_puoid.val) ) != sizeof(item->m_puoid.val) )
         {
-            MTP_LOG_WARNING("ERROR writing pathname to db!!");
-            file.resize(0);
-            file.close();
-            return;
+            break;
         }
 
-        // Write puoid
-        bytesWritten = file.write( reinterpret_cast<const char*>(&puoid), sizeof(MtpInt128) );
-        if( -1 == bytesWritten )
+        if( 1 == items.size() )
         {
-            MTP_LOG_WARNING("ERROR writing puoid to db!!");
-            file.resize(0);
-            file.close();
-            return;
+            if( SNAPSHOT_NO_PARENT != parentIndex ||
+                MTP_OBF_FORMAT_Association != item->m_format )
+            {
+                break;
+            }
+            item->m_name = m_storagePath;
+            continue;
+        }
+
+        if( parentIndex >= (quint32)items.size() - 1 )
+        {
+            break;
+        }
+        StorageItem *parent = items[parentIndex];
+        if( parent && MTP_OBF_FORMAT_Association != parent->m_format )
+        {
+            break;
+        }
+        item->m_name = name;
+        if( !parent || ( !m_excludePaths.isEmpty() && m_excludePaths.contains( parent->path() + '/' + name ) ) )
+        {
+            items.last() = 0;
+            delete item;
+            continue;
+        }
+        linkChildStorageItem( item, parent );
+    }
+
+    if( !valid )
+    {
+        MTP_LOG_WARNING("Ignoring damaged object index snapshot" << m_snapshotPath);
+        qDeleteAll( items );
+        m_childIndex.clear();
+        return false;
+    }
+
+    // Hand out this session's object handles and index the tree.
+    QVector<ObjHandle> directories;
+    foreach( StorageItem *item, items )
+    {
+        if( !item )
+        {
+            continue;
+        }
+        item->m_handle = item->m_parent ? requestNewObjectHandle() : 0;
+        addItemToMaps( item );
+        if( MTP_OBF_FORMAT_Association == item->m_format )
+        {
+            addWatchDescriptor( item );
+            directories.append( item->m_handle );
+        }
+        else
+        {
+            m_puoidToHandleMap[item->m_puoid] = item->m_handle;
         }
     }
+    m_root = items.first();
+
+    // Catch up with what happened while we were not watching. Parents are
+    // visited before their children, so a directory that went away is
+    // normally dropped together with its parent's rescan.
+    m_snapshotDirty = false;
+    int rescanned = rescanChangedDirectories( directories );
+    MTP_LOG_INFO("Snapshot" << m_snapshotPath << "restored" << items.size() << "items,"
+            << rescanned << "of" << directories.size() << "directories rescanned");
+
+    return true;
+}
+
+/************************************************************
+ * int FSStoragePlugin::rescanChangedDirectories
+ ***********************************************************/
+int FSStoragePlugin::rescanChangedDirectories( const QVector<ObjHandle> &directories )
+{
+    int rescanned = 0;
+    foreach( ObjHandle handle, directories )
+    {
+        StorageItem *item = m_objectHandlesMap.value( handle );
+        if( !item )
+        {
+            continue;
+        }
+        qint64 mtime, ctime;
+        if( !directoryStamps( item->path(), mtime, ctime ) )
+        {
+            deleteItemHelper( handle, false, false );
+            m_snapshotDirty = true;
+            continue;
+        }
+        if( mtime != item->m_dirMtime || ctime != item->m_dirCtime )
+        {
+            rescanDirectory( item );
+            m_snapshotDirty = true;
+            ++rescanned;
+        }
+    }
+    return rescanned;
+}
+
+/************************************************************
+ * void FSStoragePlugin::rescanDirectory
+ ***********************************************************/
+void FSStoragePlugin::rescanDirectory( StorageItem *dirItem )
+{
+    directoryStamps( dirItem->path(), dirItem->m_dirMtime, dirItem->m_dirCtime );
+
+    QVector<FSDirEntry> dirContents;
+    FSDirWalker::listDirectory( dirItem->path(), dirContents );
+    QHash<QString, int> present; // name -> index in dirContents
+    for( int i = 0; i < dirContents.size(); ++i )
+    {
+        const QString &path = dirContents[i].path;
+        present.insert( path.mid( path.lastIndexOf( '/' ) + 1 ), i );
+    }
+
+    // Drop children that are gone or changed type, refresh the others.
+    QVector<ObjHandle> stale;
+    for( StorageItem *child = dirItem->m_firstChild; child; child = child->m_nextSibling )
+    {
+        bool isDir = MTP_OBF_FORMAT_Association == child->m_format;
+        QHash<QString, int>::const_iterator i = present.constFind( child->m_name );
+        if( i == present.constEnd() || dirContents[i.value()].isDir != isDir )
+        {
+            stale.append( child->m_handle );
+        }
+        else if( !isDir )
+        {
+            delete child->m_objectInfo;
+            child->m_objectInfo = 0;
+            applyMetadata( child, dirContents[i.value()] );
+        }
+    }
+    foreach( ObjHandle handle, stale )
+    {
+        deleteItemHelper( handle, false, false );
+    }
+
+    // Pick up new entries. New subdirectories are only added here, their
+    // contents are left to a walk or to lazy listing.
+    foreach( const FSDirEntry &entry, dirContents )
+    {
+        if( childByName( dirItem, entry.path.mid( entry.path.lastIndexOf( '/' ) + 1 ) ) )
+        {
+            continue;
+        }
+        StorageItem *child = 0;
+        addToStorage( entry.path, &child, 0, false, false, 0, false, &entry );
+        if( !child || !entry.isDir )
+        {
+            continue;
+        }
+        if( m_lazyEnumeration )
+        {
+            child->m_listed = false;
+            m_unlistedDirs.insert( child->m_handle );
+        }
+        else
+        {
+            child->m_dirMtime = entry.mtime;
+            child->m_dirCtime = entry.ctime;
+            m_pendingWalks.append( entry.path );
+        }
+    }
+}
+
+/************************************************************
+ * void FSStoragePlugin::ensureListed
+ ***********************************************************/
+void FSStoragePlugin::ensureListed( StorageItem *item, bool sendEvent )
+{
+    if( !item || item->m_listed )
+    {
+        return;
+    }
+    item->m_listed = true;
+    m_unlistedDirs.remove( item->m_handle );
+    directoryStamps( item->path(), item->m_dirMtime, item->m_dirCtime );
+
+    QVector<FSDirEntry> dirContents;
+    FSDirWalker::listDirectory( item->path(), dirContents );
+    foreach( const FSDirEntry &entry, dirContents )
+    {
+        if( childByName( item, entry.path.mid( entry.path.lastIndexOf( '/' ) + 1 ) ) )
+        {
+            continue;
+        }
+        StorageItem *child = 0;
+        addToStorage( entry.path, &child, 0, sendEvent, false, 0, false, &entry );
+        if( child && MTP_OBF_FORMAT_Association == child->m_format )
+        {
+            child->m_listed = false;
+            m_unlistedDirs.insert( child->m_handle );
+        }
+    }
+}
+
+/************************************************************
+ * void FSStoragePlugin::startLazyCompletion
+ ***********************************************************/
+void FSStoragePlugin::startLazyCompletion()
+{
+    if( m_lazyCompletionRunning || m_unlistedDirs.isEmpty() )
+    {
+        return;
+    }
+    m_lazyCompletionRunning = true;
+    m_lazyCompletionListed = 0;
+    MTP_LOG_INFO("Completing enumeration of" << m_storagePath << "," << m_unlistedDirs.size()
+            << "directories not listed yet");
+    QMetaObject::invokeMethod( this, "lazyCompletionStep", Qt::QueuedConnection );
+}
+
+/************************************************************
+ * void FSStoragePlugin::lazyCompletionStep
+ ***********************************************************/
+void FSStoragePlugin::lazyCompletionStep()
+{
+    // The initiator already got a partial answer, so announce whatever
+    // turns up from now on.
+    for( int i = 0; i < LAZY_COMPLETION_BATCH_SIZE && !m_unlistedDirs.isEmpty(); ++i )
+    {
+        ObjHandle handle = *m_unlistedDirs.constBegin();
+        StorageItem *item = m_objectHandlesMap.value( handle );
+        if( !item )
+        {
+            m_unlistedDirs.remove( handle );
+            continue;
+        }
+        ensureListed( item, true );
+        ++m_lazyCompletionListed;
+        if( 0 == m_lazyCompletionListed % 256 )
+        {
+            MTP_LOG_INFO("Completing enumeration of" << m_storagePath << ":" << m_lazyCompletionListed
+                    << "directories listed," << m_unlistedDirs.size() << "to go");
+        }
+    }
+
+    if( !m_unlistedDirs.isEmpty() )
+    {
+        QMetaObject::invokeMethod( this, "lazyCompletionStep", Qt::QueuedConnection );
+        return;
+    }
+
+    m_lazyCompletionRunning = false;
+    MTP_LOG_INFO("Enumeration of" << m_storagePath << "completed," << m_lazyCompletionListed
+            << "directories listed in the background");
+    removeUnusedPuoids();
+    scheduleSnapshot();
+}
+
+/************************************************************
+ * void FSStoragePlugin::scheduleSnapshot
+ ***********************************************************/
+void FSStoragePlugin::scheduleSnapshot()
+{
+    m_snapshotDirty = true;
+    // Nothing to write until the initial enumeration is complete.
+    if( m_enumerated )
+    {
+        m_snapshotTimer->start();
+    }
 }
 
 /************************************************************
@@ -538,30 +1404,7 @@ void FSStoragePlugin::storePuoids()
  ***********************************************************/
 void FSStoragePlugin::buildSupportedFormatsList()
 {
-    m_formatByExtTable["pla"] = MTP_OBF_FORMAT_Abstract_Audio_Video_Playlist;
-    m_formatByExtTable["wav"] = MTP_OBF_FORMAT_WAV;
-    m_formatByExtTable["mp3"] = MTP_OBF_FORMAT_MP3;
-    m_formatByExtTable["ogg"] = MTP_OBF_FORMAT_OGG;
-    m_formatByExtTable["txt"] = MTP_OBF_FORMAT_Text;
-    m_formatByExtTable["htm"] = MTP_OBF_FORMAT_HTML;
-    m_formatByExtTable["html"] = MTP_OBF_FORMAT_HTML;
-    m_formatByExtTable["wmv"] = MTP_OBF_FORMAT_WMV;
-    m_formatByExtTable["avi"] = MTP_OBF_FORMAT_AVI;
-    m_formatByExtTable["mpg"] = MTP_OBF_FORMAT_MPEG;
-    m_formatByExtTable["mpeg"] = MTP_OBF_FORMAT_MPEG;
-    m_formatByExtTable["bmp"] = MTP_OBF_FORMAT_BMP;
-    m_formatByExtTable["gif"] = MTP_OBF_FORMAT_GIF;
-    m_formatByExtTable["jpg"] = MTP_OBF_FORMAT_EXIF_JPEG;
-    m_formatByExtTable["jpeg"] = MTP_OBF_FORMAT_EXIF_JPEG;
-    m_formatByExtTable["png"] = MTP_OBF_FORMAT_PNG;
-    m_formatByExtTable["tif"] = MTP_OBF_FORMAT_TIFF;
-    m_formatByExtTable["tiff"] = MTP_OBF_FORMAT_TIFF;
-    m_formatByExtTable["wma"] = MTP_OBF_FORMAT_WMA;
-    m_formatByExtTable["aac"] = MTP_OBF_FORMAT_AAC;
-    m_formatByExtTable["mp4"] = MTP_OBF_FORMAT_MP4_Container;
-    m_formatByExtTable["3gp"] = MTP_OBF_FORMAT_3GP_Container;
-    m_formatByExtTable["pls"] = MTP_OBF_FORMAT_PLS_Playlist;
-    m_formatByExtTable["alb"] = MTP_OBF_FORMAT_Abstract_Audio_Album;
+    // Extensions are looked up in EXT_TABLE, see formatByExtension().
 
     // Populate format code->MIME type map
     m_imageMimeTable[MTP_OBF_FORMAT_BMP] = "image/bmp";
@@ -592,6 +1435,8 @@ void FSStoragePlugin::requestNewPuoid( MtpInt128& newPuoid )
 {
     emit puoid( newPuoid );
     m_largestPuoid = newPuoid;
+    // Logged with the next sync, see syncLogs().
+    m_largestPuoidLogged = false;
 }
 
 
@@ -650,6 +1495,14 @@ void FSStoragePlugin::linkChildStorageItem( StorageItem *childStorageItem, Stora
         return;
     }
     childStorageItem->m_parent = parentStorageItem;
+    m_childIndex.insert( StorageItemKey( parentStorageItem, childStorageItem->m_name ), childStorageItem );
+
+    // Keep the aggregates of the new ancestors up to date.
+    parentStorageItem->m_childCount++;
+    for( StorageItem *ancestor = parentStorageItem; ancestor; ancestor = ancestor->m_parent )
+    {
+        ancestor->m_treeSize += childStorageItem->m_treeSize;
+    }
 
     // Parent has no children
     if( !parentStorageItem->m_firstChild )
@@ -676,6 +1529,19 @@ void FSStoragePlugin::unlinkChildStorageItem( StorageItem *childStorageItem )
         return;
     }
 
+    QHash<StorageItemKey, StorageItem*>::iterator i =
+            m_childIndex.find( StorageItemKey( childStorageItem->m_parent, childStorageItem->m_name ) );
+    if( i != m_childIndex.end() && i.value() == childStorageItem )
+    {
+        m_childIndex.erase( i );
+    }
+
+    childStorageItem->m_parent->m_childCount--;
+    for( StorageItem *ancestor = childStorageItem->m_parent; ancestor; ancestor = ancestor->m_parent )
+    {
+        ancestor->m_treeSize -= childStorageItem->m_treeSize;
+    }
+
     // If this is the first child.
     if( childStorageItem->m_parent->m_firstChild == childStorageItem)
     {
@@ -697,17 +1563,108 @@ void FSStoragePlugin::unlinkChildStorageItem( StorageItem *childStorageItem )
     childStorageItem->m_nextSibling = 0;
 }
 
+/************************************************************
+ * void FSStoragePlugin::setStorageItemSize
+ ***********************************************************/
+void FSStoragePlugin::setStorageItemSize( StorageItem *item, quint64 size )
+{
+    // Unsigned wrap-around makes this work for shrinking items too.
+    quint64 delta = size - item->m_size;
+    item->m_size = size;
+    for( StorageItem *ancestor = item; ancestor; ancestor = ancestor->m_parent )
+    {
+        ancestor->m_treeSize += delta;
+    }
+}
+
+/************************************************************
+ * void FSStoragePlugin::renameStorageItem
+ ***********************************************************/
+void FSStoragePlugin::renameStorageItem( StorageItem *item, const QString &name )
+{
+    QString oldPath = item->path();
+    StorageItem *parent = item->m_parent;
+    if( parent )
+    {
+        m_childIndex.remove( StorageItemKey( parent, item->m_name ) );
+    }
+    item->m_name = name;
+    if( parent )
+    {
+        m_childIndex.insert( StorageItemKey( parent, item->m_name ), item );
+    }
+    logMovedPuoids( item, oldPath );
+    scheduleSnapshot();
+}
+
+/************************************************************
+ * StorageItem* FSStoragePlugin::childByName
+ ***********************************************************/
+StorageItem* FSStoragePlugin::childByName( const StorageItem *parent, const QString &name ) const
+{
+    return m_childIndex.value( StorageItemKey( parent, name ) );
+}
+
+/************************************************************
+ * StorageItem* FSStoragePlugin::lookupPath
+ ***********************************************************/
+StorageItem* FSStoragePlugin::lookupPath( const QString &path ) const
+{
+    const int rootSize = m_storagePath.size();
+    if( !m_root || !path.startsWith( m_storagePath ) )
+    {
+        return 0;
+    }
+    if( path.size() == rootSize )
+    {
+        return m_root;
+    }
+    if( path.at( rootSize ) != QLatin1Char('/') )
+    {
+        return 0;
+    }
+
+    // Walk down one component at a time; the components are not copied.
+    StorageItem *item = m_root;
+    int start = rootSize + 1;
+    while( item && start <= path.size() )
+    {
+        int end = path.indexOf( QLatin1Char('/'), start );
+        if( end < 0 )
+        {
+            end = path.size();
+        }
+        item = childByName( item, QString::fromRawData( path.constData() + start, end - start ) );
+        start = end + 1;
+    }
+    return item;
+}
+
+/************************************************************
+ * ObjHandle FSStoragePlugin::handleForPath
+ ***********************************************************/
+ObjHandle FSStoragePlugin::handleForPath( const QString &path ) const
+{
+    StorageItem *item = lookupPath( path );
+    return item ? item->m_handle : 0;
+}
+
 /************************************************************
  * StorageItem* FSStoragePlugin::findStorageItemByPath
  ***********************************************************/
 StorageItem* FSStoragePlugin::findStorageItemByPath( const QString &path )
 {
-    StorageItem *storageItem = 0;
-    ObjHandle handle;
-    if( m_pathNamesMap.contains( path ) )
+    StorageItem *storageItem = lookupPath( path );
+    if( !storageItem && !m_unlistedDirs.isEmpty() && path.size() > m_storagePath.size() &&
+        path.startsWith( m_storagePath + '/' ) )
     {
-        handle = m_pathNamesMap.value( path );
-        storageItem = m_objectHandlesMap.value( handle );
+        // The item may be inside a directory that hasn't been listed yet.
+        StorageItem *parent = findStorageItemByPath( path.left( path.lastIndexOf( '/' ) ) );
+        if( parent && !parent->m_listed )
+        {
+            ensureListed( parent );
+            storageItem = lookupPath( path );
+        }
     }
     return storageItem;
 }
@@ -717,7 +1674,8 @@ StorageItem* FSStoragePlugin::findStorageItemByPath( const QString &path )
  ***********************************************************/
 MTPResponseCode FSStoragePlugin::addToStorage( const QString &path,
         StorageItem **storageItem, MTPObjectInfo *info, bool sendEvent,
-        bool createIfNotExist, ObjHandle handle )
+        bool createIfNotExist, ObjHandle handle, bool addChildren,
+        const FSDirEntry *entry )
 {
     if ( m_excludePaths.contains(path) )
     {
@@ -725,29 +1683,55 @@ MTPResponseCode FSStoragePlugin::addToStorage( const QString &path,
     }
 
     // If we already have StorageItem for given path...
-    if( m_pathNamesMap.contains( path ) )
+    StorageItem *existing = lookupPath( path );
+    if( existing )
     {
         if (storageItem) {
-            *storageItem = findStorageItemByPath(path);
+            *storageItem = existing;
         }
         return MTP_RESP_OK;
     }
 
     QScopedPointer<StorageItem> item(new StorageItem);
-    item->m_path = path;
+    int slash = path.lastIndexOf('/');
+    // The root is named by the storage path, everything else by its
+    // last path component.
+    item->m_name = path == m_storagePath ? path : path.mid( slash + 1 );
 
-    QString parentPath(item->m_path.left(item->m_path.lastIndexOf('/')));
+    QString parentPath(path.left(slash));
     StorageItem *parentItem = findStorageItemByPath(parentPath);
-    linkChildStorageItem( item.data(), parentItem ? parentItem : m_root );
+    if( !parentItem && path != m_storagePath )
+    {
+        MTP_LOG_WARNING("Parent of" << path << "is not in the storage");
+        return MTP_RESP_InvalidParentObject;
+    }
+    // Listing a lazily enumerated parent may have added the item already.
+    existing = parentItem ? childByName( parentItem, item->m_name ) : 0;
+    if( existing )
+    {
+        if (storageItem) {
+            *storageItem = existing;
+        }
+        return MTP_RESP_OK;
+    }
+    linkChildStorageItem( item.data(), parentItem );
 
     if ( info )
     {
+        // The object may not exist yet, so trust what the initiator sent.
         item->m_objectInfo = new MTPObjectInfo( *info );
         item->m_objectInfo->mtpStorageId = storageId();
+        item->m_format = info->mtpObjectFormat;
+        setStorageItemSize( item.data(), MTP_OBF_FORMAT_Association == info->mtpObjectFormat ? 0 : info->mtpObjectCompressedSize );
+    }
+    else if( entry )
+    {
+        applyMetadata( item.data(), *entry );
     }
     else
     {
-        populateObjectInfo( item.data() );
+        // The full object info is only built when someone asks for it.
+        readMetadata( item.data() );
     }
 
     // Root of the storage should have handle of 0.
@@ -763,14 +1747,14 @@ MTPResponseCode FSStoragePlugin::addToStorage( const QString &path,
 
     MTPResponseCode result;
     // Create file or directory
-    switch( item->m_objectInfo->mtpObjectFormat )
+    switch( item->m_format )
     {
         // Directory.
         case MTP_OBF_FORMAT_Association:
         {
             if (createIfNotExist)
             {
-                result = createDirectory( item->m_path );
+                result = createDirectory( path );
                 if ( result != MTP_RESP_OK )
                 {
                     unlinkChildStorageItem( item.data() );
@@ -782,16 +1766,29 @@ MTPResponseCode FSStoragePlugin::addToStorage( const QString &path,
 
             addItemToMaps( item.data() );
 
+            if( !addChildren )
+            {
+                break;
+            }
+
+            // Remember what the directory looked like when we listed it,
+            // see restoreSnapshot(). The caller's listing already has it.
+            if( entry )
+            {
+                item->m_dirMtime = entry->mtime;
+                item->m_dirCtime = entry->ctime;
+            }
+            else
+            {
+                directoryStamps( path, item->m_dirMtime, item->m_dirCtime );
+            }
+
             // Recursively add StorageItems for the contents of the directory.
-            QDir dir( item->m_path );
-            dir.setFilter( QDir::Files | QDir::Dirs | QDir::NoDotAndDotDot | QDir::Hidden );
-            QFileInfoList dirContents = dir.entryInfoList();
-            int work = 0;
-            foreach ( const QFileInfo &info, dirContents )
+            QVector<FSDirEntry> dirContents;
+            FSDirWalker::listDirectory( path, dirContents );
+            foreach ( const FSDirEntry &childEntry, dirContents )
             {
-                if (work++ % 16 == 0)
-                    QCoreApplication::processEvents();
-                addToStorage(info.absoluteFilePath(), 0, 0, createIfNotExist, sendEvent);
+                addToStorage(childEntry.path, 0, 0, createIfNotExist, sendEvent, 0, true, &childEntry);
             }
             break;
         }
@@ -799,7 +1796,7 @@ MTPResponseCode FSStoragePlugin::addToStorage( const QString &path,
         default:
             if (createIfNotExist)
             {
-                result = createFile( item->m_path );
+                result = createFile( path );
                 if ( result != MTP_RESP_OK )
                 {
                     unlinkChildStorageItem( item.data() );
@@ -821,8 +1818,12 @@ MTPResponseCode FSStoragePlugin::addToStorage( const QString &path,
     }
 
     // Dates from our device
-    item->m_objectInfo->mtpCaptureDate = getCreatedDate( item.data() );
-    item->m_objectInfo->mtpModificationDate = getModifiedDate( item.data() );
+    if( info )
+    {
+        readMetadata( item.data(), true );
+        item->m_objectInfo->mtpCaptureDate = getCreatedDate( item.data() );
+        item->m_objectInfo->mtpModificationDate = getModifiedDate( item.data() );
+    }
 
     if ( storageItem )
     {
@@ -836,25 +1837,75 @@ MTPResponseCode FSStoragePlugin::addToStorage( const QString &path,
     return MTP_RESP_OK;
 }
 
-void FSStoragePlugin::addItemToMaps( StorageItem *item )
+void FSStoragePlugin::addItemToMaps( StorageItem *item )
+{
+    // Object handles map.
+    m_objectHandlesMap[ item->m_handle ] = item;
+    addItemToFormatIndex( item );
+
+    // Claim the persistent puoid of this path, if there is one; the item
+    // keeps it from now on. Items restored from a snapshot already have one.
+    QHash<QString,MtpInt128>::iterator i = m_puoidsMap.isEmpty() ? m_puoidsMap.end() : m_puoidsMap.find( item->path() );
+    if( i != m_puoidsMap.end() )
+    {
+        if( item->m_puoid == MtpInt128(0) )
+        {
+            item->m_puoid = i.value();
+        }
+        m_puoidsMap.erase( i );
+    }
+    else if( item->m_puoid == MtpInt128(0) )
+    {
+        // Assign a new puoid
+        requestNewPuoid( item->m_puoid );
+        m_puoidsLog->put( item->path().toUtf8(), puoidBytes( item->m_puoid ) );
+        scheduleLogSync();
+    }
+
+    scheduleSnapshot();
+}
+
+/************************************************************
+ * void FSStoragePlugin::addItemToFormatIndex
+ ***********************************************************/
+void FSStoragePlugin::addItemToFormatIndex( StorageItem *item )
+{
+    // The root is never reported by getObjectHandles().
+    if( !item->m_parent )
+    {
+        return;
+    }
+    m_formatIndex[item->m_format].insert( item->m_handle );
+    m_parentFormatIndex[qMakePair( item->m_parent->m_handle, item->m_format )].insert( item->m_handle );
+}
+
+/************************************************************
+ * void FSStoragePlugin::removeItemFromFormatIndex
+ ***********************************************************/
+void FSStoragePlugin::removeItemFromFormatIndex( StorageItem *item )
 {
-    // Path names map.
-    m_pathNamesMap[ item->m_path ] = item->m_handle;
-
-    // Object handles map.
-    m_objectHandlesMap[ item->m_handle ] = item;
-
-    if( !m_puoidsMap.contains( item->m_path ) )
+    if( !item->m_parent )
     {
-        // Assign a new puoid
-        requestNewPuoid( item->m_puoid );
-        // Add the puoid to the map.
-        m_puoidsMap[item->m_path] = item->m_puoid;
+        return;
     }
-    else
+    QHash<MTPObjFormatCode, QSet<ObjHandle> >::iterator i = m_formatIndex.find( item->m_format );
+    if( i != m_formatIndex.end() )
+    {
+        i.value().remove( item->m_handle );
+        if( i.value().isEmpty() )
+        {
+            m_formatIndex.erase( i );
+        }
+    }
+    QHash<QPair<ObjHandle, MTPObjFormatCode>, QSet<ObjHandle> >::iterator j =
+            m_parentFormatIndex.find( qMakePair( item->m_parent->m_handle, item->m_format ) );
+    if( j != m_parentFormatIndex.end() )
     {
-        // Use the persistent puoid.
-        item->m_puoid = m_puoidsMap[item->m_path];
+        j.value().remove( item->m_handle );
+        if( j.value().isEmpty() )
+        {
+            m_parentFormatIndex.erase( j );
+        }
     }
 }
 
@@ -883,8 +1934,20 @@ MTPResponseCode FSStoragePlugin::addItem( ObjHandle &parentHandle, ObjHandle &ha
         return MTP_RESP_InvalidParentObject;
     }
 
-    QString path = m_objectHandlesMap[info->mtpParentObject]->m_path + "/"
-            + info->mtpFileName;
+    // Turn down objects that can't fit before the initiator starts sending.
+    if( MTP_OBF_FORMAT_Association != info->mtpObjectFormat && info->mtpObjectCompressedSize )
+    {
+        MTPStorageInfo spaceInfo;
+        if( MTP_RESP_OK == storageInfo( spaceInfo ) && spaceInfo.freeSpace < info->mtpObjectCompressedSize )
+        {
+            MTP_LOG_WARNING("No space for" << info->mtpFileName << info->mtpObjectCompressedSize);
+            return MTP_RESP_StoreFull;
+        }
+    }
+
+    StorageItem *parentItem = m_objectHandlesMap[info->mtpParentObject];
+    ensureListed( parentItem );
+    QString path = parentItem->path() + "/" + info->mtpFileName;
 
     // Add the object ( file/dir ) to the filesystem storage.
     response = addToStorage( path, &storageItem, info, false, true );
@@ -926,7 +1989,7 @@ MTPResponseCode FSStoragePlugin::copyHandle( StoragePlugin *sourceStorage,
     MTPObjectInfo newInfo( *info );
     newInfo.mtpParentObject = parent;
 
-    QString path = m_objectHandlesMap[newInfo.mtpParentObject]->m_path + "/"
+    QString path = m_objectHandlesMap[newInfo.mtpParentObject]->path() + "/"
             + newInfo.mtpFileName;
 
     result = addToStorage( path, 0, &newInfo, false, true, source );
@@ -955,7 +2018,7 @@ MTPResponseCode FSStoragePlugin::copyHandle( StoragePlugin *sourceStorage,
     {
         // Source and destination handles are the same, though each
         // in a different storage.
-        return copyData( sourceStorage, source, this, source );
+        return copyFileData( sourceStorage, source, source );
     }
 }
 
@@ -979,7 +2042,7 @@ MTPResponseCode FSStoragePlugin::deleteItem( const ObjHandle& handle, const MTPO
             if( formatCode && MTP_OBF_FORMAT_Undefined != formatCode )
             {
                 storageItem = i.value();
-                if( storageItem->m_objectInfo && storageItem->m_objectInfo->mtpObjectFormat == formatCode )
+                if( storageItem->m_format == formatCode )
                 {
                     response = deleteItemHelper( i.key() );
                 }
@@ -992,6 +2055,10 @@ MTPResponseCode FSStoragePlugin::deleteItem( const ObjHandle& handle, const MTPO
             {
                 deletedSome = true;
             }
+            else if( MTP_RESP_TransactionCancelled == response )
+            {
+                break;
+            }
             else if (MTP_RESP_InvalidObjectHandle != response)
             {
                 // "invalid object handle" is not a failure because it
@@ -1045,29 +2112,27 @@ MTPResponseCode FSStoragePlugin::deleteItemHelper( ObjHandle handle, bool remove
         return MTP_RESP_ObjectWriteProtected;
     }
 
+    // Directories are emptied on a worker thread.
+    if( removePhysically && MTP_OBF_FORMAT_Association == storageItem->m_format )
+    {
+        return removeTree( handle, sendEvent );
+    }
+
     // If this is a file or an empty dir, just delete this item.
     if( !storageItem->m_firstChild )
     {
-        if( removePhysically && MTP_OBF_FORMAT_Association == storageItem->m_objectInfo->mtpObjectFormat && 0 != storageItem->m_handle )
-        {
-            QDir dir(storageItem->m_parent->m_path);
-            if( !dir.rmdir(storageItem->m_path) )
-            {
-                return MTP_RESP_GeneralError;
-            }
-        }
-        else if( removePhysically )
+        if( removePhysically )
         {
-            QFile file( storageItem->m_path );
+            QFile file( storageItem->path() );
             if( !file.remove() )
             {
                 return MTP_RESP_GeneralError;
             }
         }
         // If this an abstract playlist, also remove the internal playlist.
-        if(MTP_OBF_FORMAT_Abstract_Audio_Video_Playlist == storageItem->m_objectInfo->mtpObjectFormat)
+        if(MTP_OBF_FORMAT_Abstract_Audio_Video_Playlist == storageItem->m_format)
         {
-            removePlaylist(storageItem->m_path);
+            removePlaylist(storageItem->path());
         }
 
         removeFromStorage( handle, sendEvent );
@@ -1090,7 +2155,7 @@ MTPResponseCode FSStoragePlugin::deleteItemHelper( ObjHandle handle, bool remove
         // Now delete the empty directory ( if empty! ).
         if( !itemNotDeleted )
         {
-            response = deleteItemHelper( handle );
+            response = deleteItemHelper( handle, removePhysically, sendEvent );
         }
         else
         {
@@ -1100,36 +2165,154 @@ MTPResponseCode FSStoragePlugin::deleteItemHelper( ObjHandle handle, bool remove
     return MTP_RESP_OK;
 }
 
+/************************************************************
+ * MTPResponseCode FSStoragePlugin::removeTree
+ ***********************************************************/
+MTPResponseCode FSStoragePlugin::removeTree( ObjHandle handle, bool sendEvent )
+{
+    StorageItem *root = m_objectHandlesMap.value( handle );
+    const QString path = root->path();
+
+    // Only what the host could see goes: list what is still unlisted, and
+    // let the remover skip whatever else is on the disk.
+    QSet<QString> indexedPaths;
+    QVector<StorageItem*> pending;
+    pending.append( root );
+    while( !pending.isEmpty() )
+    {
+        StorageItem *item = pending.takeLast();
+        ensureListed( item );
+        for( StorageItem *child = item->m_firstChild; child; child = child->m_nextSibling )
+        {
+            indexedPaths.insert( child->path() );
+            // The remover doesn't follow links to directories, nor do we.
+            if( MTP_OBF_FORMAT_Association == child->m_format && !QFileInfo( child->path() ).isSymLink() )
+            {
+                pending.append( child );
+            }
+        }
+    }
+
+    FSTreeRemover remover( path, indexedPaths, m_excludePaths );
+    remover.start();
+
+    bool done = false;
+    bool removedSome = false;
+    bool cancelled = false;
+    while( !done )
+    {
+        QStringList removed;
+        done = remover.takeRemoved( removed, REMOVE_PROGRESS_INTERVAL );
+
+        // Deepest paths come first, so each batch leaves a consistent tree.
+        foreach( const QString &removedPath, removed )
+        {
+            StorageItem *item = lookupPath( removedPath );
+            if( item )
+            {
+                // Drops whatever is still indexed below it, too.
+                deleteItemHelper( item->m_handle, false, sendEvent );
+            }
+        }
+        removedSome = removedSome || !removed.isEmpty();
+
+        if( !done && !cancelled )
+        {
+            // Gives the responder a chance to see a host cancel.
+            emit checkTransportEvents( cancelled );
+            if( cancelled )
+            {
+                MTP_LOG_WARNING("Delete cancelled, leaving the rest of" << path);
+                remover.cancel();
+            }
+        }
+    }
+
+    if( cancelled )
+    {
+        return MTP_RESP_TransactionCancelled;
+    }
+    if( remover.skipped() )
+    {
+        // The directory itself stays for what was left in it.
+        return MTP_RESP_PartialDeletion;
+    }
+    if( remover.failed() )
+    {
+        return removedSome ? MTP_RESP_PartialDeletion : MTP_RESP_GeneralError;
+    }
+    return MTP_RESP_OK;
+}
+
 /************************************************************
  * MTPResponseCode FSStoragePlugin::removeFromStorage
  ***********************************************************/
 MTPResponseCode FSStoragePlugin::removeFromStorage( ObjHandle handle, bool sendEvent )
 {
+    // Announce the removal while the item is still linked into the tree, so
+    // that the event scheduler can tell which subtree it belonged to.
+    if( sendEvent )
+    {
+        QVector<quint32> eventParams;
+        eventParams.append( handle );
+        emit eventGenerated(MTP_EV_ObjectRemoved, eventParams);
+    }
+
     StorageItem *storageItem = 0;
     // Remove the item from object handles map and delete the corresponding storage item.
     if( checkHandle( handle ) )
     {
         storageItem = m_objectHandlesMap.value( handle );
+        m_readFds->invalidate( handle );
+        if( handle == m_writeObjectHandle )
+        {
+            // A cancelled SendObject, nothing left to write.
+            closeDataFile();
+            m_writeObjectHandle = 0;
+        }
         // Remove the item from the watch descriptor map if present.
         if(-1 != storageItem->m_wd)
         {
             // Remove watch on the path and then remove the wd from the map
             removeWatchDescriptor( storageItem );
         }
+        removeItemFromFormatIndex( storageItem );
         m_objectHandlesMap.remove( handle );
-        m_pathNamesMap.remove( storageItem->m_path );
+        // Keep the puoid around in case the path reappears.
+        m_puoidsMap.insert( storageItem->path(), storageItem->m_puoid );
+        m_unlistedDirs.remove( handle );
         unlinkChildStorageItem( storageItem );
         delete storageItem;
+        scheduleSnapshot();
     }
 
-    if( sendEvent )
+    return MTP_RESP_OK;
+}
+
+/************************************************************
+ * void FSStoragePlugin::getChildHandlesByFormat
+ ***********************************************************/
+void FSStoragePlugin::getChildHandlesByFormat( const StorageItem *parentItem, MTPObjFormatCode formatCode,
+                                               QVector<ObjHandle> &objectHandles ) const
+{
+    // The index tells how many there are; the sibling list keeps them in
+    // the order the initiator sees without a filter.
+    QHash<QPair<ObjHandle, MTPObjFormatCode>, QSet<ObjHandle> >::const_iterator i =
+        m_parentFormatIndex.constFind( qMakePair( parentItem->m_handle, formatCode ) );
+    if( i == m_parentFormatIndex.constEnd() )
     {
-        QVector<quint32> eventParams;
-        eventParams.append( handle );
-        emit eventGenerated(MTP_EV_ObjectRemoved, eventParams);
+        return;
+    }
+    int remaining = i.value().size();
+    objectHandles.reserve( objectHandles.size() + remaining );
+    for( StorageItem *child = parentItem->m_firstChild; child && remaining; child = child->m_nextSibling )
+    {
+        if( child->m_format == formatCode )
+        {
+            objectHandles.append( child->m_handle );
+            --remaining;
+        }
     }
-
-    return MTP_RESP_OK;
 }
 
 /************************************************************
@@ -1139,10 +2322,17 @@ MTPResponseCode FSStoragePlugin::getObjectHandles( const MTPObjFormatCode& forma
                                                    QVector<ObjHandle> &objectHandles ) const
 {
 
+    // Lazy enumeration lists directories on demand, which is not a change
+    // of the storage as seen by the initiator.
+    FSStoragePlugin *self = const_cast<FSStoragePlugin*>( this );
+
     switch( associationHandle )
     {
         // Count of all objects in this storage.
         case 0x00000000:
+            // What has not been listed yet is announced with ObjectAdded
+            // events as it turns up.
+            self->startLazyCompletion();
             if( !formatCode )
             {
                 for( QHash<ObjHandle,StorageItem*>::const_iterator i = m_objectHandlesMap.constBegin() ; i != m_objectHandlesMap.constEnd(); ++i )
@@ -1157,39 +2347,36 @@ MTPResponseCode FSStoragePlugin::getObjectHandles( const MTPObjFormatCode& forma
             }
             else
             {
-                for( QHash<ObjHandle,StorageItem*>::const_iterator i = m_objectHandlesMap.constBegin() ; i != m_objectHandlesMap.constEnd(); ++i )
+                const QSet<ObjHandle> handles = m_formatIndex.value( formatCode );
+                objectHandles.reserve( objectHandles.size() + handles.size() );
+                foreach( ObjHandle handle, handles )
                 {
-                    // Don't enumerate the root.
-                    if( 0 == i.key() )
-                    {
-                        continue;
-                    }
-                    if( i.value()->m_objectInfo && formatCode == i.value()->m_objectInfo->mtpObjectFormat )
-                    {
-                        objectHandles.append( i.key() );
-                    }
+                    objectHandles.append( handle );
                 }
             }
             break;
 
         // Count of all objects present in the root storage.
         case 0xFFFFFFFF:
-            if( m_root )
+            if( !m_root )
             {
-                StorageItem *storageItem = m_root->m_firstChild;
-                while( storageItem )
+                return MTP_RESP_InvalidParentObject;
+            }
+            if( formatCode )
+            {
+                if( MTP_OBF_FORMAT_Undefined != formatCode )
                 {
-                    if( !formatCode ||
-                        ( MTP_OBF_FORMAT_Undefined != formatCode && storageItem->m_objectInfo && formatCode == storageItem->m_objectInfo->mtpObjectFormat ) )
-                    {
-                        objectHandles.append( storageItem->m_handle );
-                    }
-                    storageItem = storageItem->m_nextSibling;
+                    getChildHandlesByFormat( m_root, formatCode, objectHandles );
                 }
             }
             else
             {
-                return MTP_RESP_InvalidParentObject;
+                StorageItem *storageItem = m_root->m_firstChild;
+                while( storageItem )
+                {
+                    objectHandles.append( storageItem->m_handle );
+                    storageItem = storageItem->m_nextSibling;
+                }
             }
             break;
 
@@ -1204,20 +2391,26 @@ MTPResponseCode FSStoragePlugin::getObjectHandles( const MTPObjFormatCode& forma
            if( parentItem )
            {
                //Check if this is an association
-               if( !parentItem->m_objectInfo || MTP_OBF_FORMAT_Association != parentItem->m_objectInfo->mtpObjectFormat )
+               if( MTP_OBF_FORMAT_Association != parentItem->m_format )
                {
                    return MTP_RESP_InvalidParentObject;
                }
-               StorageItem *storageItem = parentItem->m_firstChild;
-               while( storageItem )
+               self->ensureListed( parentItem );
+               if( formatCode )
+               {
+                   if( MTP_OBF_FORMAT_Undefined != formatCode )
+                   {
+                       getChildHandlesByFormat( parentItem, formatCode, objectHandles );
+                   }
+               }
+               else
                {
-                   if( ( !formatCode ) ||
-                       ( MTP_OBF_FORMAT_Undefined != formatCode && storageItem->m_objectInfo &&
-                         formatCode == storageItem->m_objectInfo->mtpObjectFormat ) )
+                   StorageItem *storageItem = parentItem->m_firstChild;
+                   while( storageItem )
                    {
                        objectHandles.append( storageItem->m_handle );
+                       storageItem = storageItem->m_nextSibling;
                    }
-                   storageItem = storageItem->m_nextSibling;
                }
            }
            else
@@ -1229,6 +2422,65 @@ MTPResponseCode FSStoragePlugin::getObjectHandles( const MTPObjFormatCode& forma
     return MTP_RESP_OK;
 }
 
+/************************************************************
+ * MTPResponseCode FSStoragePlugin::getNumObjects
+ ***********************************************************/
+MTPResponseCode FSStoragePlugin::getNumObjects( const MTPObjFormatCode& formatCode, const quint32& associationHandle,
+                                                quint32 &noOfObjects ) const
+{
+    // Same selection as getObjectHandles(), answered from the counters kept
+    // in the tree and the format indexes instead of collecting the handles.
+    FSStoragePlugin *self = const_cast<FSStoragePlugin*>( this );
+    const StorageItem *parentItem = 0;
+    noOfObjects = 0;
+
+    switch( associationHandle )
+    {
+        case 0x00000000:
+            self->startLazyCompletion();
+            if( !formatCode )
+            {
+                // Don't count the root.
+                noOfObjects = m_objectHandlesMap.size() - ( m_objectHandlesMap.contains( 0 ) ? 1 : 0 );
+            }
+            else
+            {
+                QHash<MTPObjFormatCode, QSet<ObjHandle> >::const_iterator i = m_formatIndex.constFind( formatCode );
+                noOfObjects = i != m_formatIndex.constEnd() ? i.value().size() : 0;
+            }
+            return MTP_RESP_OK;
+
+        case 0xFFFFFFFF:
+            if( !m_root )
+            {
+                return MTP_RESP_InvalidParentObject;
+            }
+            parentItem = m_root;
+            break;
+
+        default:
+            parentItem = m_objectHandlesMap.value( associationHandle );
+            if( !parentItem || MTP_OBF_FORMAT_Association != parentItem->m_format )
+            {
+                return MTP_RESP_InvalidParentObject;
+            }
+            self->ensureListed( const_cast<StorageItem*>( parentItem ) );
+            break;
+    }
+
+    if( !formatCode )
+    {
+        noOfObjects = parentItem->m_childCount;
+    }
+    else if( MTP_OBF_FORMAT_Undefined != formatCode )
+    {
+        QHash<QPair<ObjHandle, MTPObjFormatCode>, QSet<ObjHandle> >::const_iterator i =
+                m_parentFormatIndex.constFind( qMakePair( parentItem->m_handle, formatCode ) );
+        noOfObjects = i != m_parentFormatIndex.constEnd() ? i.value().size() : 0;
+    }
+    return MTP_RESP_OK;
+}
+
 /************************************************************
  * bool FSStoragePlugin::checkHandle
  ***********************************************************/
@@ -1284,13 +2536,11 @@ MTPResponseCode FSStoragePlugin::copyObject( const ObjHandle &handle,
     {
         return MTP_RESP_GeneralError;
     }
-    if( !m_objectHandlesMap[handle]->m_objectInfo )
-    {
-        return MTP_RESP_InvalidObjectHandle;
-    }
+    ensureListed( storageItem );
 
     // Get the source object's objectinfo dataset.
-    MTPObjectInfo objectInfo  = *m_objectHandlesMap[handle]->m_objectInfo;
+    populateObjectInfo( storageItem );
+    MTPObjectInfo objectInfo  = *storageItem->m_objectInfo;
 
     MTPStorageInfo storageInfo;
     if( destinationStorage->storageInfo(storageInfo) != MTP_RESP_OK )
@@ -1350,7 +2600,7 @@ MTPResponseCode FSStoragePlugin::copyObject( const ObjHandle &handle,
     MTPResponseCode response = MTP_RESP_OK;
 
     // Apply metadata for the destination path
-    m_tracker->copy(storageItem->m_path, destinationPath);
+    m_tracker->copy(storageItem->path(), destinationPath);
 
     // Create the new item.
     ObjHandle ignoredHandle;
@@ -1360,6 +2610,16 @@ MTPResponseCode FSStoragePlugin::copyObject( const ObjHandle &handle,
     {
         // Error.
     }
+    // Whole directory trees between FS storages go through the copy engine.
+    else if( MTP_OBF_FORMAT_Association == objectInfo.mtpObjectFormat &&
+             destinationFsStorage && 0 == recursionCounter )
+    {
+        response = copyTree( storageItem, copiedObjectHandle, destinationFsStorage );
+        if( MTP_RESP_OK != response )
+        {
+            return response;
+        }
+    }
     // If this is a directory, copy recursively.
     else if( MTP_OBF_FORMAT_Association == objectInfo.mtpObjectFormat )
     {
@@ -1382,7 +2642,14 @@ MTPResponseCode FSStoragePlugin::copyObject( const ObjHandle &handle,
     // this is a file, copy the data
     else
     {
-        response = copyData( this, handle, destinationStorage, copiedObjectHandle );
+        if( destinationFsStorage )
+        {
+            response = destinationFsStorage->copyFileData( this, handle, copiedObjectHandle );
+        }
+        else
+        {
+            response = copyData( this, handle, destinationStorage, copiedObjectHandle );
+        }
         if ( response != MTP_RESP_OK )
         {
             return response;
@@ -1398,34 +2665,147 @@ MTPResponseCode FSStoragePlugin::copyObject( const ObjHandle &handle,
 }
 
 /************************************************************
- * void FSStoragePlugin::adjustMovedItemsPath
+ * MTPResponseCode FSStoragePlugin::copyFileData
  ***********************************************************/
-void FSStoragePlugin::adjustMovedItemsPath( QString newAncestorPath, StorageItem* movedItem, bool updateInTracker /*= false*/ )
+MTPResponseCode FSStoragePlugin::copyFileData( StoragePlugin *sourceStorage,
+        ObjHandle source, ObjHandle destination )
 {
-    if( !movedItem )
+    FSStoragePlugin *sourceFsStorage = dynamic_cast<FSStoragePlugin *>( sourceStorage );
+    StorageItem *sourceItem = sourceFsStorage ? sourceFsStorage->m_objectHandlesMap.value( source ) : 0;
+    StorageItem *destinationItem = m_objectHandlesMap.value( destination );
+    if( !sourceItem || !destinationItem )
     {
-        return;
+        return copyData( sourceStorage, source, this, destination );
+    }
+
+    FSCopyJob job = { sourceItem->path(), destinationItem->path(), destination };
+    FSCopyEngine engine( 1 );
+    engine.start();
+    engine.addJob( job );
+    engine.finishJobs();
+    return finishCopies( engine );
+}
+
+/************************************************************
+ * MTPResponseCode FSStoragePlugin::copyTree
+ ***********************************************************/
+MTPResponseCode FSStoragePlugin::copyTree( StorageItem *sourceDir, ObjHandle destinationDir,
+                                           FSStoragePlugin *destination )
+{
+    FSCopyEngine engine;
+    engine.start();
+    MTPResponseCode response = planCopy( sourceDir, destinationDir, destination, engine );
+    engine.finishJobs();
+    MTP_LOG_INFO("Copying" << engine.jobCount() << "files from" << sourceDir->path());
+
+    // Wait for the copies that have been started even if planning failed.
+    MTPResponseCode copyResponse = destination->finishCopies( engine );
+    return MTP_RESP_OK != response ? response : copyResponse;
+}
+
+/************************************************************
+ * MTPResponseCode FSStoragePlugin::planCopy
+ ***********************************************************/
+MTPResponseCode FSStoragePlugin::planCopy( StorageItem *sourceDir, ObjHandle destinationDir,
+                                           FSStoragePlugin *destination, FSCopyEngine &engine )
+{
+    ensureListed( sourceDir );
+    const QString destinationDirPath = destination->m_objectHandlesMap.value( destinationDir )->path();
+    for( StorageItem *child = sourceDir->m_firstChild; child; child = child->m_nextSibling )
+    {
+        populateObjectInfo( child );
+        MTPObjectInfo objectInfo = *child->m_objectInfo;
+        objectInfo.mtpParentObject = destinationDir;
+        objectInfo.mtpStorageId = destination->storageId();
+        const QString destinationPath = destinationDirPath + '/' + objectInfo.mtpFileName;
+
+        m_tracker->copy( child->path(), destinationPath );
+
+        ObjHandle ignoredHandle;
+        ObjHandle copiedHandle;
+        MTPResponseCode response = destination->addItem( ignoredHandle, copiedHandle, &objectInfo );
+        if( MTP_RESP_OK != response )
+        {
+            return response;
+        }
+
+        if( MTP_OBF_FORMAT_Association == objectInfo.mtpObjectFormat )
+        {
+            response = planCopy( child, copiedHandle, destination, engine );
+            if( MTP_RESP_OK != response )
+            {
+                return response;
+            }
+        }
+        else
+        {
+            FSCopyJob job = { child->path(), destinationPath, copiedHandle };
+            engine.addJob( job );
+        }
     }
+    return MTP_RESP_OK;
+}
 
-    m_pathNamesMap.remove( movedItem->m_path );
-    QString destinationPath = newAncestorPath + "/" + movedItem->m_objectInfo->mtpFileName;
-    if(true == updateInTracker)
+/************************************************************
+ * MTPResponseCode FSStoragePlugin::finishCopies
+ ***********************************************************/
+MTPResponseCode FSStoragePlugin::finishCopies( FSCopyEngine &engine )
+{
+    bool done = false;
+    bool failed = false;
+    bool cancelled = false;
+    while( !done )
     {
-        // Move the URI in tracker too
-        m_tracker->move(movedItem->m_path, destinationPath);
+        QList<FSCopyResult> results;
+        done = engine.takeFinished( results, COPY_PROGRESS_INTERVAL );
+
+        // Copies that didn't make it leave no partial files behind.
+        foreach( const FSCopyResult &result, results )
+        {
+            if( !result.copied )
+            {
+                failed = true;
+                deleteItemHelper( result.handle );
+            }
+        }
 
-        if( MTP_OBF_FORMAT_Abstract_Audio_Video_Playlist == movedItem->m_objectInfo->mtpObjectFormat )
+        if( !done && !cancelled )
         {
-            // If this is a playlist, also need to update the playlist URL
-            m_tracker->movePlaylist(movedItem->m_path, destinationPath);
+            emit checkTransportEvents( cancelled );
+            if( cancelled )
+            {
+                MTP_LOG_WARNING("CopyObject cancelled, aborting file copy...");
+                engine.cancel();
+            }
         }
     }
-    movedItem->m_path = destinationPath;
-    m_pathNamesMap[movedItem->m_path] = movedItem->m_handle;
+    return failed ? MTP_RESP_GeneralError : MTP_RESP_OK;
+}
+
+/************************************************************
+ * void FSStoragePlugin::adjustMovedItemsPath
+ ***********************************************************/
+void FSStoragePlugin::adjustMovedItemsPath( const QString &oldAncestorPath, const QString &newAncestorPath, StorageItem* movedItem )
+{
+    if( !movedItem )
+    {
+        return;
+    }
+
+    QString oldPath = oldAncestorPath + "/" + movedItem->m_name;
+    QString newPath = newAncestorPath + "/" + movedItem->m_name;
+    // Move the URI in tracker too
+    m_tracker->move(oldPath, newPath);
+
+    if( MTP_OBF_FORMAT_Abstract_Audio_Video_Playlist == movedItem->m_format )
+    {
+        // If this is a playlist, also need to update the playlist URL
+        m_tracker->movePlaylist(oldPath, newPath);
+    }
     StorageItem *itr = movedItem->m_firstChild;
     while( itr )
     {
-        adjustMovedItemsPath( movedItem->m_path, itr, updateInTracker );
+        adjustMovedItemsPath( oldPath, newPath, itr );
         itr = itr->m_nextSibling;
     }
 }
@@ -1465,68 +2845,85 @@ MTPResponseCode FSStoragePlugin::moveObject( const ObjHandle &handle,
         return MTP_RESP_GeneralError;
     }
 
-    if( storageItem->m_path == m_playlistPath )
+    if( storageItem->path() == m_playlistPath )
     {
         MTP_LOG_WARNING("Don't play around with the Playlists directory!");
         return MTP_RESP_AccessDenied;
     }
 
-    QString destinationPath = parentItem->m_path + "/" + storageItem->m_objectInfo->mtpFileName;
+    QString sourcePath = storageItem->path();
+    QString destinationPath = parentItem->path() + "/" + storageItem->m_name;
 
     // If this is a directory already exists, don't overwrite it.
-    if( MTP_OBF_FORMAT_Association == storageItem->m_objectInfo->mtpObjectFormat )
+    if( MTP_OBF_FORMAT_Association == storageItem->m_format )
     {
-        if( m_pathNamesMap.contains( destinationPath ) )
+        if( childByName( parentItem, storageItem->m_name ) )
         {
             return MTP_RESP_InvalidParentObject;
         }
     }
 
     // Invalidate the watch descriptor for this item and it's children, as their paths will change.
-    removeWatchDescriptorRecursively( storageItem );
+    bool rewatch = !m_inotify->watchesFollowRenames();
+    if( rewatch )
+    {
+        removeWatchDescriptorRecursively( storageItem );
+    }
 
     // Do the move.
     if( movePhysically )
     {
         QDir dir;
-        if ( !dir.rename( storageItem->m_path, destinationPath ) )
+        if ( !dir.rename( sourcePath, destinationPath ) )
         {
             // Move failed; restore original watch descriptors.
-            addWatchDescriptorRecursively( storageItem );
+            if( rewatch )
+            {
+                addWatchDescriptorRecursively( storageItem );
+            }
             return MTP_RESP_InvalidParentObject;
         }
     }
-    m_pathNamesMap.remove( storageItem->m_path );
-    m_pathNamesMap[destinationPath] = handle;
-
-    // Unlink this item from its current parent.
+    // An open file survives the rename, but drop it so that reads never
+    // outlive the path they were opened through.
+    m_readFds->invalidate( handle );
+    // Unlink this item from its current parent. The descendants stay
+    // linked to it, so their paths follow without touching the index.
+    removeItemFromFormatIndex( storageItem );
     unlinkChildStorageItem( storageItem );
 
     StorageItem *itr = storageItem->m_firstChild;
     while( itr )
     {
-        adjustMovedItemsPath( destinationPath, itr, true );
+        adjustMovedItemsPath( sourcePath, destinationPath, itr );
         itr = itr->m_nextSibling;
     }
 
     // link it to the new parent
     linkChildStorageItem( storageItem, parentItem );
+    addItemToFormatIndex( storageItem );
+    logMovedPuoids( storageItem, sourcePath );
+    scheduleSnapshot();
     //storageItem->m_nextSibling = 0;
     // Reset URI in tracker and ask it to ignore
-    m_tracker->move(storageItem->m_path, destinationPath);
+    m_tracker->move(sourcePath, destinationPath);
 
-    if(storageItem->m_objectInfo &&
-            MTP_OBF_FORMAT_Abstract_Audio_Video_Playlist == storageItem->m_objectInfo->mtpObjectFormat)
+    if(MTP_OBF_FORMAT_Abstract_Audio_Video_Playlist == storageItem->m_format)
     {
         // If this is a playlist, also need to update the playlist URL
-        m_tracker->movePlaylist(storageItem->m_path, destinationPath);
+        m_tracker->movePlaylist(sourcePath, destinationPath);
     }
 
-    // update it's path and parent object.
-    storageItem->m_path = destinationPath;
-    storageItem->m_objectInfo->mtpParentObject = parentHandle;
+    // update it's parent object.
+    if( storageItem->m_objectInfo )
+    {
+        storageItem->m_objectInfo->mtpParentObject = parentHandle;
+    }
     // create new watch descriptors for the moved item.
-    addWatchDescriptorRecursively( storageItem );
+    if( rewatch )
+    {
+        addWatchDescriptorRecursively( storageItem );
+    }
     return MTP_RESP_OK;
 }
 
@@ -1541,13 +2938,13 @@ void FSStoragePlugin::getFileListRecursively(const StorageItem *storageItem, con
         return;
     }
     // Add this iri to the list
-    fileList.append(m_tracker->generateIri(storageItem->m_path));
+    fileList.append(m_tracker->generateIri(storageItem->path()));
     // Add the destination iri to the list
     fileList.append(m_tracker->generateIri(destinationPath));
     StorageItem *itr = storageItem->m_firstChild;
     while( itr )
     {
-        getFileListRecursively( itr, destinationPath + "/" + itr->m_objectInfo->mtpFileName, fileList );
+        getFileListRecursively( itr, destinationPath + "/" + itr->name(), fileList );
         itr = itr->m_nextSibling;
     }
 }
@@ -1571,6 +2968,20 @@ MTPResponseCode FSStoragePlugin::getObjectInfo( const ObjHandle &handle, const M
     return MTP_RESP_OK;
 }
 
+/************************************************************
+ * MTPResponseCode FSStoragePlugin::getParentHandle
+ ***********************************************************/
+MTPResponseCode FSStoragePlugin::getParentHandle( const ObjHandle &handle, ObjHandle &parentHandle )
+{
+    StorageItem *storageItem = m_objectHandlesMap.value( handle );
+    if( !storageItem )
+    {
+        return MTP_RESP_InvalidObjectHandle;
+    }
+    parentHandle = storageItem->m_parent ? storageItem->m_parent->m_handle : 0x00000000;
+    return MTP_RESP_OK;
+}
+
 /************************************************************
  * MTPResponseCode FSStoragePlugin::populateObjectInfo
  ***********************************************************/
@@ -1592,11 +3003,9 @@ void FSStoragePlugin::populateObjectInfo( StorageItem *storageItem )
     // storage id.
     storageItem->m_objectInfo->mtpStorageId = m_storageId;
     // file name
-    QString name = storageItem->m_path;
-    name = name.remove(0,storageItem->m_path.lastIndexOf("/") + 1);
-    storageItem->m_objectInfo->mtpFileName = name;
+    storageItem->m_objectInfo->mtpFileName = storageItem->name();
     // object format.
-    storageItem->m_objectInfo->mtpObjectFormat = getObjectFormatByExtension( storageItem );
+    storageItem->m_objectInfo->mtpObjectFormat = storageItem->m_format;
     // protection status.
     storageItem->m_objectInfo->mtpProtectionStatus = getMTPProtectionStatus( storageItem );
     // object size.
@@ -1632,27 +3041,68 @@ void FSStoragePlugin::populateObjectInfo( StorageItem *storageItem )
 }
 
 /************************************************************
- * quint16 FSStoragePlugin::getObjectFormatByExtension
+ * void FSStoragePlugin::readMetadata
  ***********************************************************/
-quint16 FSStoragePlugin::getObjectFormatByExtension( StorageItem *storageItem )
+void FSStoragePlugin::readMetadata( StorageItem *storageItem, bool timesOnly )
 {
-    // TODO Fetch from tracker or determine from the file.
-    quint16 format = MTP_OBF_FORMAT_Undefined;
+    FSDirEntry entry;
+    QByteArray ba = QFile::encodeName( storageItem->path() );
+    if( FSDirWalker::statEntry( AT_FDCWD, ba.constData(), entry ) )
+    {
+        applyMetadata( storageItem, entry, timesOnly );
+    }
+}
 
-    QFileInfo item(storageItem->m_path);
-    if( item.isDir() )
+/************************************************************
+ * void FSStoragePlugin::applyMetadata
+ ***********************************************************/
+void FSStoragePlugin::applyMetadata( StorageItem *storageItem, const FSDirEntry &entry, bool timesOnly )
+{
+    storageItem->m_created = entry.ctime / 1000000000LL;
+    storageItem->m_modified = entry.mtime / 1000000000LL;
+    if( timesOnly )
+    {
+        return;
+    }
+    MTPObjFormatCode format;
+    if( entry.isDir )
     {
         format = MTP_OBF_FORMAT_Association;
+        setStorageItemSize( storageItem, 0 );
     }
-    else //file
+    else
     {
-        QString ext = storageItem->m_path.section('.',-1).toLower();
-        if( m_formatByExtTable.contains( ext ) )
+        format = getObjectFormatByExtension( storageItem );
+        if( m_contentSniffing && entry.size )
         {
-            format = m_formatByExtTable[ext];
+            format = sniffFormat( storageItem, entry, format );
+        }
+        setStorageItemSize( storageItem, entry.size );
+    }
+    if( format != storageItem->m_format )
+    {
+        // Re-index items that are already in the storage, e.g. after a rename.
+        bool indexed = m_objectHandlesMap.value( storageItem->m_handle ) == storageItem;
+        if( indexed )
+        {
+            removeItemFromFormatIndex( storageItem );
+        }
+        storageItem->m_format = format;
+        if( indexed )
+        {
+            addItemToFormatIndex( storageItem );
         }
     }
-    return format;
+}
+
+/************************************************************
+ * quint16 FSStoragePlugin::getObjectFormatByExtension
+ ***********************************************************/
+quint16 FSStoragePlugin::getObjectFormatByExtension( StorageItem *storageItem )
+{
+    // Directories are told apart by readMetadata(), this only looks at the
+    // name; see sniffFormat() for the content.
+    return formatByExtension( storageItem->m_name );
 }
 
 /************************************************************
@@ -1673,12 +3123,7 @@ quint64 FSStoragePlugin::getObjectSize( StorageItem *storageItem )
     {
         return 0;
     }
-    QFileInfo item( storageItem->m_path );
-    if( item.isFile() )
-    {
-        return item.size();
-    }
-    return 0;
+    return storageItem->m_size;
 }
 
 /************************************************************
@@ -1686,21 +3131,55 @@ quint64 FSStoragePlugin::getObjectSize( StorageItem *storageItem )
  ***********************************************************/
 bool FSStoragePlugin::isImage( StorageItem *storageItem )
 {
-    //UGLY
-    if( storageItem &&
-        ( storageItem->m_path.endsWith("gif")  ||
-          storageItem->m_path.endsWith("jpeg") ||
-          storageItem->m_path.endsWith("jpg")  ||
-          storageItem->m_path.endsWith("bmp")  ||
-          storageItem->m_path.endsWith("tif")  ||
-          storageItem->m_path.endsWith("tiff") ||
-          storageItem->m_path.endsWith("png")
-        )
-      )
+    return storageItem && m_imageMimeTable.contains( storageItem->m_format );
+}
+
+/************************************************************
+ * MTPObjFormatCode FSStoragePlugin::sniffFormat
+ ***********************************************************/
+MTPObjFormatCode FSStoragePlugin::sniffFormat( StorageItem *storageItem, const FSDirEntry &entry,
+                                               MTPObjFormatCode format )
+{
+    MTPObjFormatCode sniffed;
+    bool strong;
+    if( entry.sniffed )
+    {
+        // Read by the walker thread that listed the file.
+        sniffed = entry.contentFormat;
+        strong = entry.strongSignature;
+    }
+    else
+    {
+        // A file's content can only have changed if its mtime did.
+        QPair<quint64, qint64> key( entry.ino, entry.mtime );
+        QHash<QPair<quint64, qint64>, QPair<MTPObjFormatCode, bool> >::const_iterator i =
+            m_sniffCache.constFind( key );
+        if( i != m_sniffCache.constEnd() )
+        {
+            sniffed = i.value().first;
+            strong = i.value().second;
+        }
+        else
+        {
+            QByteArray ba = QFile::encodeName( storageItem->path() );
+            sniffed = FSDirWalker::formatByContent( AT_FDCWD, ba.constData(), strong );
+            if( m_sniffCache.size() >= MAX_SNIFF_CACHE_SIZE )
+            {
+                // Entries of deleted and rewritten files are never looked up
+                // again; starting over is cheaper than tracking them.
+                m_sniffCache.clear();
+            }
+            m_sniffCache.insert( key, qMakePair( sniffed, strong ) );
+        }
+    }
+
+    // A short signature only names files the extension says nothing about;
+    // "BM" at the start of a text file doesn't make it a bitmap.
+    if( MTP_OBF_FORMAT_Undefined == sniffed || ( !strong && MTP_OBF_FORMAT_Undefined != format ) )
     {
-        return true;
+        return format;
     }
-    return false;
+    return sniffed;
 }
 
 /************************************************************
@@ -1750,8 +3229,8 @@ quint32 FSStoragePlugin::getThumbCompressedSize( StorageItem *storageItem )
     quint32 size = 0;
     if ( isImage( storageItem ) )
     {
-        QString thumbPath = m_thumbnailer->requestThumbnail( storageItem->m_path,
-                m_imageMimeTable.value( storageItem->m_objectInfo->mtpObjectFormat ) );
+        QString thumbPath = m_thumbnailer->requestThumbnail( storageItem->path(),
+                m_imageMimeTable.value( storageItem->m_format ) );
         if( !thumbPath.isEmpty() )
         {
             size = QFileInfo( thumbPath ).size();
@@ -1783,8 +3262,7 @@ quint32 FSStoragePlugin::getImagePixelHeight( StorageItem * /*storageItem*/ )
  ***********************************************************/
 quint16 FSStoragePlugin::getAssociationType( StorageItem *storageItem )
 {
-    QFileInfo item(storageItem->m_path);
-    if( item.isDir() )
+    if( MTP_OBF_FORMAT_Association == storageItem->m_format )
     {
         // GenFolder is the only type used in MTP.
         // The others may be used for PTP compatibility but are not required.
@@ -1827,12 +3305,8 @@ quint32 FSStoragePlugin::getSequenceNumber( StorageItem * /*storageItem*/ )
  ***********************************************************/
 QString FSStoragePlugin::getCreatedDate( StorageItem *storageItem )
 {
-    // Get creation date from the file system
-    QFileInfo fileInfo(storageItem->m_path);
-    QDateTime dt = fileInfo.created();
-    dt = dt.toUTC();
-    QString dateCreated = dt.toString("yyyyMMdd'T'hhmmss'Z'");
-    return dateCreated;
+    // Creation date as read from the file system, see readMetadata().
+    return mtpDateString( storageItem->m_created );
 }
 
 /************************************************************
@@ -1840,12 +3314,8 @@ QString FSStoragePlugin::getCreatedDate( StorageItem *storageItem )
  ***********************************************************/
 QString FSStoragePlugin::getModifiedDate( StorageItem *storageItem )
 {
-    // Get modification date from the file system
-    QFileInfo fileInfo(storageItem->m_path);
-    QDateTime dt = fileInfo.lastModified();
-    dt = dt.toUTC();
-    QString dateModified = dt.toString("yyyyMMdd'T'hhmmss'Z'");
-    return dateModified;
+    // Modification date as read from the file system, see readMetadata().
+    return mtpDateString( storageItem->m_modified );
 }
 
 /************************************************************
@@ -1879,37 +3349,37 @@ MTPResponseCode FSStoragePlugin::readData( const ObjHandle &handle, char *readBu
         return MTP_RESP_GeneralError;
     }
 
-    // Open the file and read from it.
-    qint32 bytesToRead = readBufferLen;
-    QFile file( storageItem->m_path );
-    if( !file.open( QIODevice::ReadOnly ) )
-    {
-        return MTP_RESP_GeneralError;
-    }
-    qint64 fileSize = file.size();
-    if(fileSize < (readOffset + bytesToRead))
+    // Segmented reads come back for the same handle, keep the file open
+    // between them.
+    int fd = m_readFds->acquire( handle, storageItem->path() );
+    if( -1 == fd )
     {
         return MTP_RESP_GeneralError;
     }
-    if( !file.seek(readOffset) )
+    m_readFds->adviseRead( handle, readOffset, readBufferLen );
+
+    MTPResponseCode response = MTP_RESP_OK;
+    qint32 bytesRead = 0;
+    while( bytesRead < readBufferLen )
     {
-        MTP_LOG_WARNING("ERROR seeking file");
-        return MTP_RESP_GeneralError;
-    }
-    // TODO: Read this in a loop?
-    readBufferLen = 0;
-    do{
-        readBufferLen = file.read( readBuffer, bytesToRead );
-        if( -1 == readBufferLen )
+        ssize_t n = pread( fd, readBuffer + bytesRead, readBufferLen - bytesRead,
+                           static_cast<off_t>( readOffset ) + bytesRead );
+        if( -1 == n && EINTR == errno )
         {
-            return MTP_RESP_GeneralError;
+            continue;
         }
-        bytesToRead -= readBufferLen;
-    }while(bytesToRead);
-    // FIXME: Repeated opening and closing of the file will happen when we do segmented reads.
-    // This must be avoided
-    file.close();
-    return MTP_RESP_OK;
+        if( n <= 0 )
+        {
+            // Error, or the file is shorter than the caller expected.
+            MTP_LOG_WARNING("ERROR reading" << storageItem->path() << "at" << readOffset + bytesRead);
+            m_readFds->invalidate( handle );
+            response = MTP_RESP_GeneralError;
+            break;
+        }
+        bytesRead += n;
+    }
+    m_readFds->release( handle );
+    return response;
 }
 
 /************************************************************
@@ -1924,17 +3394,37 @@ MTPResponseCode FSStoragePlugin::truncateItem( const ObjHandle &handle, const qu
 
     // Get the corresponding storage item.
     StorageItem *storageItem = m_objectHandlesMap[handle];
-    if( !storageItem || !storageItem->m_objectInfo || MTP_OBF_FORMAT_Association == storageItem->m_objectInfo->mtpObjectFormat )
+    if( !storageItem || MTP_OBF_FORMAT_Association == storageItem->m_format )
     {
         return MTP_RESP_GeneralError;
     }
 
-    QFile file( storageItem->m_path );
-    if( !file.resize( size ) )
+    m_readFds->invalidate( handle );
+    if( handle == m_writeObjectHandle && m_dataFile )
     {
-        return MTP_RESP_GeneralError;
+        // Discarding a partial SendObject; the truncation releases the
+        // preallocated space too.
+        m_writeBuffer.clear();
+        m_dataFilePreallocated = 0;
+        m_dataWriter->discard( size );
+        if( !m_dataFile->resize( size ) )
+        {
+            return MTP_RESP_GeneralError;
+        }
+    }
+    else
+    {
+        QFile file( storageItem->path() );
+        if( !file.resize( size ) )
+        {
+            return MTP_RESP_GeneralError;
+        }
+    }
+    setStorageItemSize( storageItem, size );
+    if( storageItem->m_objectInfo )
+    {
+        storageItem->m_objectInfo->mtpObjectCompressedSize = static_cast<quint64>(size);
     }
-    storageItem->m_objectInfo->mtpObjectCompressedSize = static_cast<quint64>(size);
     return MTP_RESP_OK;
 }
 
@@ -1958,57 +3448,147 @@ MTPResponseCode FSStoragePlugin::writeData( const ObjHandle &handle, char *write
     if( ( true == isLastSegment ) && ( 0 == writeBuffer ) )
     {
         m_writeObjectHandle = 0;
+        MTPResponseCode response = MTP_RESP_OK;
         if( m_dataFile )
         {
-            m_dataFile->close();
-            delete m_dataFile;
-            m_dataFile = 0;
+            response = flushDataFile();
+            closeDataFile();
         }
+        return response;
     }
-    else
+
+    m_writeObjectHandle = handle;
+    if(isFirstSegment)
     {
-        m_writeObjectHandle = handle;
-        qint32 bytesRemaining = bufferLen;
-        // Resize file to zero, if first segment
-        if(isFirstSegment)
+        m_readFds->invalidate( handle );
+        MTPResponseCode response = openDataFile( storageItem );
+        if( MTP_RESP_OK != response )
         {
-            // Open the file and write to it.
-            m_dataFile = new QFile( storageItem->m_path );
-            if( !m_dataFile->open( QIODevice::Append ) )
-            {
-                delete m_dataFile;
-                m_dataFile = 0;
-                return MTP_RESP_GeneralError;
-            }
-            m_dataFile->resize(0);
+            return response;
         }
-        while( bytesRemaining && m_dataFile )
+    }
+    if( !m_dataFile )
+    {
+        return MTP_RESP_OK;
+    }
+
+    // The initiator sends small segments, collect them so that the file
+    // system sees large writes at chunk aligned offsets. Full chunks are
+    // written behind the transfer; the last segment waits for all of them,
+    // so that errors make it into the response.
+    while( bufferLen )
+    {
+        quint32 length = qMin( bufferLen, static_cast<quint32>( WRITE_CHUNK_SIZE - m_writeBuffer.size() ) );
+        m_writeBuffer.append( writeBuffer, length );
+        writeBuffer += length;
+        bufferLen -= length;
+        if( WRITE_CHUNK_SIZE == m_writeBuffer.size() )
         {
-            qint32 bytesWritten = m_dataFile->write( writeBuffer, bytesRemaining );
-            if( -1 == bytesWritten )
+            MTPResponseCode response = queueDataChunk();
+            if( MTP_RESP_OK != response )
             {
-                MTP_LOG_WARNING("ERROR writing data to" << storageItem->m_path);
-                //Send a store full event if there's no space.
-                /*MTPResponseCode resp;
-                MTPObjectInfo objectInfo;
-                resp = getObjectInfo( handle, &objectInfo );
-                quint64 freeSpaceRemaining = 0;
-                resp = freeSpace( freeSpaceRemaining );
-                if( freeSpaceRemaining < objectInfo.mtpObjectCompressedSize )
-                {
-                    QVector<quint32> params;
-                    params.append(m_storageId);
-                    emit eventGenerated(MTP_EV_StoreFull, params, QString());
-                }*///TODO Fixme eventGenerated not working.
-                return MTP_RESP_GeneralError;
+                return response;
             }
-            bytesRemaining -= bytesWritten;
-            writeBuffer += bytesWritten;
         }
     }
+    return isLastSegment ? flushDataFile() : MTP_RESP_OK;
+}
+
+/************************************************************
+ * MTPResponseCode FSStoragePlugin::openDataFile
+ ***********************************************************/
+MTPResponseCode FSStoragePlugin::openDataFile( StorageItem *storageItem )
+{
+    closeDataFile();
+
+    m_dataFile = new QFile( storageItem->path() );
+    if( !m_dataFile->open( QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Unbuffered ) )
+    {
+        delete m_dataFile;
+        m_dataFile = 0;
+        return MTP_RESP_GeneralError;
+    }
+
+    // Reserve the declared size in one go; this keeps the file in few
+    // extents and finds out about a full disk before any data is written.
+    // File systems that can't preallocate just get the writes.
+    if( storageItem->m_size )
+    {
+        if( 0 == fallocate( m_dataFile->handle(), FALLOC_FL_KEEP_SIZE, 0, storageItem->m_size ) )
+        {
+            m_dataFilePreallocated = storageItem->m_size;
+        }
+        else if( ENOSPC == errno )
+        {
+            MTP_LOG_WARNING("No space for" << storageItem->path() << storageItem->m_size);
+            closeDataFile();
+            return MTP_RESP_StoreFull;
+        }
+    }
+    m_writeBuffer.reserve( WRITE_CHUNK_SIZE );
+    m_dataWriter = new FSWriteBehind( m_dataFile->handle() );
+    m_dataWriter->start();
     return MTP_RESP_OK;
 }
 
+/************************************************************
+ * MTPResponseCode FSStoragePlugin::queueDataChunk
+ ***********************************************************/
+MTPResponseCode FSStoragePlugin::queueDataChunk()
+{
+    QByteArray chunk;
+    chunk.swap( m_writeBuffer );
+    m_writeBuffer.reserve( WRITE_CHUNK_SIZE );
+    return writeErrorResponse( m_dataWriter->enqueue( chunk ) );
+}
+
+/************************************************************
+ * MTPResponseCode FSStoragePlugin::flushDataFile
+ ***********************************************************/
+MTPResponseCode FSStoragePlugin::flushDataFile()
+{
+    if( !m_writeBuffer.isEmpty() )
+    {
+        MTPResponseCode response = queueDataChunk();
+        if( MTP_RESP_OK != response )
+        {
+            return response;
+        }
+    }
+    return writeErrorResponse( m_dataWriter->drain() );
+}
+
+/************************************************************
+ * void FSStoragePlugin::closeDataFile
+ ***********************************************************/
+void FSStoragePlugin::closeDataFile()
+{
+    if( !m_dataFile )
+    {
+        return;
+    }
+
+    // Whatever is still queued is dropped with the writer.
+    quint64 written = m_dataWriter ? m_dataWriter->offset() : 0;
+    delete m_dataWriter;
+    m_dataWriter = 0;
+
+    // Give back what the declared size reserved beyond the actual data,
+    // e.g. when the transfer was cut short.
+    if( m_dataFilePreallocated > written )
+    {
+        if( -1 == ftruncate( m_dataFile->handle(), written ) )
+        {
+            MTP_LOG_WARNING("Couldn't trim" << m_dataFile->fileName() << strerror(errno));
+        }
+    }
+    m_dataFile->close();
+    delete m_dataFile;
+    m_dataFile = 0;
+    m_dataFilePreallocated = 0;
+    m_writeBuffer.clear();
+}
+
 /************************************************************
  * MTPResponseCode FSStoragePlugin::getPath
  ***********************************************************/
@@ -2025,7 +3605,7 @@ MTPResponseCode FSStoragePlugin::getPath( const quint32 &handle, QString &path )
         return MTP_RESP_GeneralError;
     }
 
-    path = storageItem->m_path;
+    path = storageItem->path();
     return MTP_RESP_OK;
 }
 
@@ -2040,8 +3620,8 @@ void FSStoragePlugin::dumpStorageItem( StorageItem *storageItem, bool recurse )
     }
 
     ObjHandle parentHandle = storageItem->m_parent ? storageItem->m_parent->m_handle : 0;
-    QString parentPath = storageItem->m_parent ? storageItem->m_parent->m_path : "";
-    MTP_LOG_INFO("\n<" << storageItem->m_handle << "," << storageItem->m_path
+    QString parentPath = storageItem->m_parent ? storageItem->m_parent->path() : "";
+    MTP_LOG_INFO("\n<" << storageItem->m_handle << "," << storageItem->path()
                       << "," << parentHandle << "," << parentPath << ">");
 
     if( recurse )
@@ -2055,6 +3635,41 @@ void FSStoragePlugin::dumpStorageItem( StorageItem *storageItem, bool recurse )
     }
 }
 
+/************************************************************
+ * void FSStoragePlugin::inotifyEventsAvailable
+ ***********************************************************/
+void FSStoragePlugin::inotifyEventsAvailable()
+{
+    QByteArray events;
+    m_inotify->takeEvents( events );
+
+    char *ptr = events.data();
+    char *end = ptr + events.size();
+    while( ptr < end )
+    {
+        struct inotify_event *event = reinterpret_cast<struct inotify_event*>( ptr );
+        // A 0 mask was coalesced into another event.
+        if( event->mask )
+        {
+            inotifyEventSlot( event );
+        }
+        ptr += sizeof *event + event->len;
+    }
+
+    if( m_freeSpaceMayHaveChanged )
+    {
+        m_freeSpaceMayHaveChanged = false;
+        checkFreeSpaceChanged();
+    }
+    if( m_storageInfoChanged )
+    {
+        m_storageInfoChanged = false;
+        QVector<quint32> params;
+        params.append(m_storageId);
+        emit eventGenerated(MTP_EV_StorageInfoChanged, params);
+    }
+}
+
 /************************************************************
  * void FSStoragePlugin::inotifyEventSlot
  ***********************************************************/
@@ -2177,30 +3792,41 @@ MTPResponseCode FSStoragePlugin::setReferences( const ObjHandle &handle , const
 {
     StorageItem *playlist = m_objectHandlesMap.value(handle);
     StorageItem *reference = 0;
-    if( 0 == playlist || 0 == playlist->m_objectInfo )
+    if( 0 == playlist )
     {
         return MTP_RESP_InvalidObjectHandle;
     }
-    bool savePlaylist = (MTP_OBF_FORMAT_Abstract_Audio_Video_Playlist == playlist->m_objectInfo->mtpObjectFormat);
+    bool savePlaylist = (MTP_OBF_FORMAT_Abstract_Audio_Video_Playlist == playlist->m_format);
     QStringList entries;
     for( int i = 0; i < references.size(); ++i )
     {
         reference = m_objectHandlesMap.value(references[i]);
-        if( 0 == reference || 0 == reference->m_objectInfo )
+        if( 0 == reference )
         {
             return MTP_RESP_Invalid_ObjectReference;
         }
         if(true == savePlaylist)
         {
             // Append the path to the entries list
-            entries.append(reference->m_path);
+            entries.append(reference->path());
         }
     }
     m_objectReferencesMap[handle] = references;
     // Trigger a save of playlists into tracker
     if(true == savePlaylist)
     {
-        QString playlistId = m_tracker->savePlaylist(playlist->m_path, entries);
+        QString playlistId = m_tracker->savePlaylist(playlist->path(), entries);
+    }
+    else
+    {
+        QByteArray value;
+        value.reserve( references.size() * sizeof(MtpInt128) );
+        for( int i = 0; i < references.size(); ++i )
+        {
+            value += puoidBytes( m_objectHandlesMap.value(references[i])->m_puoid );
+        }
+        m_referencesLog->put( puoidBytes( playlist->m_puoid ), value );
+        scheduleLogSync();
     }
     return MTP_RESP_OK;
 }
@@ -2247,11 +3873,11 @@ void FSStoragePlugin::setPlaylistReferences( const ObjHandle &handle , const QVe
         return;
     }
     StorageItem *storageItem = m_objectHandlesMap.value( handle );
-    if( !storageItem || "" == storageItem->m_path || !storageItem->m_objectInfo || !storageItem->m_path.endsWith( ".pla" ) )
+    if( !storageItem || !storageItem->m_name.endsWith( ".pla" ) )
     {
         return;
     }
-    QString name = storageItem->m_objectInfo->mtpFileName;
+    QString name = storageItem->name();
     name.replace( ".pla", ".m3u" );
     QString path = m_internalPlaylistPath + "/" + name;
     if( !path.endsWith( ".m3u" ) )
@@ -2273,7 +3899,7 @@ void FSStoragePlugin::setPlaylistReferences( const ObjHandle &handle , const QVe
             {
                 continue;
             }
-            QString refItemName = storageItem->m_path;
+            QString refItemName = storageItem->path();
             if( refItemName[refItemName.size() -1] == '\0' )
             {
                 refItemName[refItemName.size() -1] = '\n';
@@ -2291,133 +3917,92 @@ void FSStoragePlugin::setPlaylistReferences( const ObjHandle &handle , const QVe
 #endif
 
 /************************************************************
- * void FSStoragePlugin::storeObjectReferences
+ * void FSStoragePlugin::compactObjectReferences
  ***********************************************************/
-void FSStoragePlugin::storeObjectReferences()
+void FSStoragePlugin::compactObjectReferences()
 {
-    // Write as follows
-    // 1. No. of objects that have references.
-    // 2a. Object PUOID
-    // 2b. No. of references for this object.
-    // 2c. PUOIDs of the referred objects.
-
-    qint32 bytesWritten = -1;
-    QFile file( m_objectReferencesDbPath );
-    StorageItem *item = 0;
-
-    if( !file.open( QIODevice::WriteOnly | QIODevice::Truncate ) )
+    // Per object with references: object puoid -> puoids of the references.
+    if( !m_referencesLog->beginRewrite() )
     {
         return;
     }
-    quint32 noOfHandles = m_objectReferencesMap.count();
-    // Recored the position to store the number of object handles at...
-    qint64 posNoOfHandles = file.pos();
-    bytesWritten = file.write( reinterpret_cast<const char*>(&noOfHandles), sizeof(quint32) );
-    if( -1 == bytesWritten )
+    for( QHash<ObjHandle , QVector<ObjHandle> >::const_iterator i = m_objectReferencesMap.constBegin(); i != m_objectReferencesMap.constEnd(); ++i )
     {
-        MTP_LOG_WARNING("ERROR writing count to persistent objrefs db!!");
-        file.resize(0);
-        return;
-    }
-    for( QHash<ObjHandle , QVector<ObjHandle> >::iterator i = m_objectReferencesMap.begin(); i != m_objectReferencesMap.end(); ++i )
-    {
-        ObjHandle handle = i.key();
         // Get the object PUOID from the object handle (we need to store PUOIDs
         // in the ref DB as it is persistent, not object handles)
-        item = m_objectHandlesMap.value(handle);
-        if(0 == item || (MTP_OBF_FORMAT_Abstract_Audio_Video_Playlist == item->m_objectInfo->mtpObjectFormat))
+        const StorageItem *item = m_objectHandlesMap.value( i.key() );
+        if(0 == item || (MTP_OBF_FORMAT_Abstract_Audio_Video_Playlist == item->m_format))
         {
             // 1) Possibly, the handle was removed from the objectHandles map, but
             // still lingers in the object references map (It is cleared lazily
             // in getObjectReferences). Ignore this handle.
             // 2) This object is an abstract playlist, which is stored only in tracker.
             // Ignore this too.
-            noOfHandles--;
             continue;
         }
-        // No NULL check for the item here, as it can safely be assumed that it
-        // will exist in the object handles map.
-        bytesWritten = file.write( reinterpret_cast<const char*>(&item->m_puoid), sizeof(MtpInt128) );
-        if( -1 == bytesWritten )
-        {
-            MTP_LOG_WARNING("ERROR writing a handle to persistent objrefs db!!");
-            file.resize(0);
-            return;
-        }
-        quint32 noOfRefs = i.value().size();
-        // Record the position to write the number of object references into...
-        qint64 posNoOfReferences = file.pos();
-        bytesWritten = file.write( reinterpret_cast<const char*>(&noOfRefs), sizeof(quint32) );
-        if( -1 == bytesWritten )
-        {
-            MTP_LOG_WARNING("ERROR writing a handle's ref count to persistent objrefs db!!");
-            file.resize(0);
-            return;
-        }
+        QByteArray value;
+        value.reserve( i.value().size() * sizeof(MtpInt128) );
         for( int j = 0; j < i.value().size(); ++j )
         {
-            ObjHandle reference = (i.value())[j];
-            // Get PUOID from the reference
-            item = m_objectHandlesMap.value(reference);
-            if(0 == item)
-            {
-                // Ignore this handle...
-                noOfRefs--;
-                continue;
-            }
-            bytesWritten = file.write( reinterpret_cast<const char*>(&item->m_puoid), sizeof(MtpInt128) );
-            if( -1 == bytesWritten )
+            const StorageItem *reference = m_objectHandlesMap.value( i.value()[j] );
+            if( reference )
             {
-                MTP_LOG_WARNING("ERROR writing a handle's reference to persistent objrefs db!!");
-                file.resize(0);
-                return;
+                value += puoidBytes( reference->m_puoid );
             }
         }
-        // Backup current position
-        qint64 curPos = file.pos();
-        // Seek back to write the number of references
-        if(false == file.seek(posNoOfReferences))
+        m_referencesLog->rewritePut( puoidBytes( item->m_puoid ), value );
+    }
+    m_referencesLog->commitRewrite();
+}
+
+/************************************************************
+ * void FSStoragePlugin::populateObjectReferences
+ ***********************************************************/
+void FSStoragePlugin::populateObjectReferences()
+{
+    bool haveLog = QFile::exists( m_referencesLog->path() );
+    ReferencesLogReader reader;
+    m_referencesLog->open( &reader );
+    if( !haveLog )
+    {
+        // Convert the db of older versions. It is shared by all storages,
+        // so it is left for the others to convert too.
+        readLegacyObjectReferences();
+        compactObjectReferences();
+        return;
+    }
+
+    QVector<ObjHandle> references;
+    for( QHash<QByteArray, QByteArray>::const_iterator i = reader.m_references.constBegin(); i != reader.m_references.constEnd(); ++i )
+    {
+        if( (int)sizeof(MtpInt128) != i.key().size() )
         {
-            MTP_LOG_WARNING("File seek failed!!");
-            file.resize(0);
-            return;
+            continue;
         }
-        bytesWritten = file.write( reinterpret_cast<const char*>(&noOfRefs), sizeof(quint32) );
-        if( -1 == bytesWritten )
+        QHash<MtpInt128, ObjHandle>::const_iterator object = m_puoidToHandleMap.constFind( puoidFromBytes( i.key().constData() ) );
+        if( object == m_puoidToHandleMap.constEnd() )
         {
-            MTP_LOG_WARNING("ERROR writing a handle's ref count to persistent objrefs db!!");
-            file.resize(0);
-            return;
+            continue;
         }
-        // Seek forward again
-        if(false == file.seek(curPos))
+        references.clear();
+        const char *data = i.value().constData();
+        for( int j = 0; j + (int)sizeof(MtpInt128) <= i.value().size(); j += sizeof(MtpInt128) )
         {
-            MTP_LOG_WARNING("File seek failed!!");
-            file.resize(0);
-            return;
+            // Get object handle from the PUOID
+            QHash<MtpInt128, ObjHandle>::const_iterator reference = m_puoidToHandleMap.constFind( puoidFromBytes( data + j ) );
+            if( reference != m_puoidToHandleMap.constEnd() )
+            {
+                references.append( reference.value() );
+            }
         }
-
-    }
-    // Seek backwards to write the number of object handles
-    if(false == file.seek(posNoOfHandles))
-    {
-        MTP_LOG_WARNING("File seek failed!!");
-        file.resize(0);
-        return;
-    }
-    bytesWritten = file.write( reinterpret_cast<const char*>(&noOfHandles), sizeof(quint32) );
-    if( -1 == bytesWritten )
-    {
-        MTP_LOG_WARNING("ERROR writing count to persistent objrefs db!!");
-        file.resize(0);
+        m_objectReferencesMap[object.value()] = references;
     }
-    // No file.close() needed, handled in QFile's d'tor
 }
 
 /************************************************************
- * void FSStoragePlugin::populateObjectReferences
+ * void FSStoragePlugin::readLegacyObjectReferences
  ***********************************************************/
-void FSStoragePlugin::populateObjectReferences()
+void FSStoragePlugin::readLegacyObjectReferences()
 {
     QFile file( m_objectReferencesDbPath );
     if( !file.open( QIODevice::ReadOnly ) )
@@ -2473,11 +4058,16 @@ MTPResponseCode FSStoragePlugin:: getObjectPropertyValueFromStorage( const ObjHa
                                                    QVariant &value, MTPDataType /*type*/ )
 {
     MTPResponseCode code = MTP_RESP_OK;
-    const MTPObjectInfo *objectInfo;
-    code = getObjectInfo( handle, objectInfo );
-    if( MTP_RESP_OK != code )
+    if( !checkHandle( handle ) )
+    {
+        return MTP_RESP_InvalidObjectHandle;
+    }
+    // Answer from the compact item fields, so that property queries over
+    // many objects don't build an object info dataset for each of them.
+    StorageItem *storageItem = m_objectHandlesMap.value( handle );
+    if( !storageItem )
     {
-        return code;
+        return MTP_RESP_GeneralError;
     }
     switch(propCode)
     {
@@ -2488,37 +4078,38 @@ MTPResponseCode FSStoragePlugin:: getObjectPropertyValueFromStorage( const ObjHa
         break;
         case MTP_OBJ_PROP_Association_Type:
         {
-            quint16 v = objectInfo->mtpAssociationType;
+            quint16 v = getAssociationType( storageItem );
             value = QVariant::fromValue(v);
         }
         break;
         case MTP_OBJ_PROP_Parent_Obj:
         {
-            quint32 v = objectInfo->mtpParentObject;
+            quint32 v = storageItem->m_parent ? storageItem->m_parent->m_handle : 0x00000000;
             value = QVariant::fromValue(v);
         }
         break;
         case MTP_OBJ_PROP_Obj_Size:
         {
-            quint64 v = objectInfo->mtpObjectCompressedSize;
+            quint64 v = storageItem->m_size;
             value = QVariant::fromValue(v);
         }
         break;
         case MTP_OBJ_PROP_StorageID:
         {
-            quint32 v = objectInfo->mtpStorageId;
+            quint32 v = m_storageId;
             value = QVariant::fromValue(v);
         }
         break;
         case MTP_OBJ_PROP_Obj_Format:
         {
-            quint16 v = objectInfo->mtpObjectFormat;
+            quint16 v = storageItem->m_format;
             value = QVariant::fromValue(v);
         }
         break;
         case MTP_OBJ_PROP_Protection_Status:
         {
-            quint16 v = objectInfo->mtpProtectionStatus;
+            quint16 v = storageItem->m_objectInfo ?
+                    storageItem->m_objectInfo->mtpProtectionStatus : getMTPProtectionStatus( storageItem );
             value = QVariant::fromValue(v);
         }
         break;
@@ -2531,25 +4122,25 @@ MTPResponseCode FSStoragePlugin:: getObjectPropertyValueFromStorage( const ObjHa
         break;
         case MTP_OBJ_PROP_Date_Modified:
         {
-            QString v = objectInfo->mtpModificationDate;
+            QString v = getModifiedDate( storageItem );
             value = QVariant::fromValue(v);
         }
         break;
         case MTP_OBJ_PROP_Date_Created:
         {
-            QString v = objectInfo->mtpCaptureDate;
+            QString v = getCreatedDate( storageItem );
             value = QVariant::fromValue(v);
         }
         break;
         case MTP_OBJ_PROP_Date_Added:
         {
-            QString v = objectInfo->mtpCaptureDate;
+            QString v = getCreatedDate( storageItem );
             value = QVariant::fromValue(v);
         }
         break;
         case MTP_OBJ_PROP_Obj_File_Name:
         {
-            QString v = objectInfo->mtpFileName;
+            QString v = storageItem->name();
             value = QVariant::fromValue(v);
         }
         break;
@@ -2590,7 +4181,6 @@ MTPResponseCode FSStoragePlugin:: getObjectPropertyValueFromStorage( const ObjHa
         break;
         case MTP_OBJ_PROP_Persistent_Unique_ObjId:
         {
-            StorageItem *storageItem = m_objectHandlesMap.value( handle );
             value = QVariant::fromValue(storageItem->m_puoid);
         }
         break;
@@ -2602,8 +4192,7 @@ MTPResponseCode FSStoragePlugin:: getObjectPropertyValueFromStorage( const ObjHa
         break;
         case MTP_OBJ_PROP_Rep_Sample_Data:
         {
-            StorageItem *storageItem = m_objectHandlesMap.value( handle );
-            QString thumbPath = m_thumbnailer->requestThumbnail(storageItem->m_path, m_imageMimeTable.value(objectInfo->mtpObjectFormat));
+            QString thumbPath = m_thumbnailer->requestThumbnail(storageItem->path(), m_imageMimeTable.value(storageItem->m_format));
             value = QVariant::fromValue(QVector<quint8>());
             if(false == thumbPath.isEmpty())
             {
@@ -2632,13 +4221,13 @@ MTPResponseCode FSStoragePlugin::getObjectPropertyValueFromTracker( const ObjHan
 {
     MTPResponseCode code = MTP_RESP_ObjectProp_Not_Supported;
     StorageItem *storageItem = m_objectHandlesMap.value( handle );
-    if( !storageItem || storageItem->m_path.isEmpty() )
+    if( !storageItem || storageItem->path().isEmpty() )
     {
         code = MTP_RESP_GeneralError;
     }
     else
     {
-        code = m_tracker->getObjectProperty( storageItem->m_path, propCode, type, value ) ?
+        code = m_tracker->getObjectProperty( storageItem->path(), propCode, type, value ) ?
                MTP_RESP_OK : code;
     }
     return code;
@@ -2648,7 +4237,7 @@ MTPResponseCode FSStoragePlugin::getObjectPropertyValue(const ObjHandle &handle,
         QList<MTPObjPropDescVal> &propValList)
 {
     StorageItem *storageItem = m_objectHandlesMap.value( handle );
-    if( !storageItem || storageItem->m_path.isEmpty() )
+    if( !storageItem || storageItem->path().isEmpty() )
     {
         return MTP_RESP_GeneralError;
     }
@@ -2669,7 +4258,7 @@ MTPResponseCode FSStoragePlugin::getObjectPropertyValue(const ObjHandle &handle,
         }
 
         // Fetch whatever else remains from Tracker.
-        m_tracker->getPropVals(storageItem->m_path, propValList);
+        m_tracker->getPropVals(storageItem->path(), propValList);
     }
     return MTP_RESP_OK;
 }
@@ -2684,10 +4273,11 @@ MTPResponseCode FSStoragePlugin::getChildPropertyValues(ObjHandle handle,
     }
 
     StorageItem *item = m_objectHandlesMap[handle];
-    if (item->m_objectInfo->mtpObjectFormat != MTP_OBF_FORMAT_Association) {
+    if (item->m_format != MTP_OBF_FORMAT_Association) {
         // Not an association.
         return MTP_RESP_InvalidObjectHandle;
     }
+    ensureListed(item);
 
     StorageItem *child = item->m_firstChild;
     for (; child; child = child->m_nextSibling) {
@@ -2708,7 +4298,7 @@ MTPResponseCode FSStoragePlugin::getChildPropertyValues(ObjHandle handle,
     }
 
     QMap<QString, QList<QVariant> > trackerValues;
-    m_tracker->getChildPropVals(item->m_path, trackerSupportedProperties,
+    m_tracker->getChildPropVals(item->path(), trackerSupportedProperties,
             trackerValues);
     if (trackerValues.isEmpty()) {
         // Nothing more in Tracker, return immediately.
@@ -2720,14 +4310,15 @@ MTPResponseCode FSStoragePlugin::getChildPropertyValues(ObjHandle handle,
     for (it = values.begin(); it != values.end(); ++it) {
         StorageItem *child = m_objectHandlesMap[it.key()];
         QList<QVariant> &childValues = it.value();
-        if (!trackerValues.contains(child->m_path)) {
-            MTP_LOG_INFO("Object" << child->m_path << "not found in tracker "
+        QString childPath = child->path();
+        if (!trackerValues.contains(childPath)) {
+            MTP_LOG_INFO("Object" << childPath << "not found in tracker "
                     "result set.");
             continue;
         }
 
         QList<QVariant>::iterator trackerValuesIt =
-                trackerValues[child->m_path].begin();
+                trackerValues[childPath].begin();
         for (int i = 0; i != properties.size(); ++i) {
             if (!m_tracker->supportsProperty(properties[i]->uPropCode)) {
                 // Not in Tracker result set.
@@ -2763,7 +4354,8 @@ MTPResponseCode FSStoragePlugin::setObjectPropertyValue( const ObjHandle &handle
         if( MTP_OBJ_PROP_Obj_File_Name == propDesc->uPropCode )
         {
             QDir dir;
-            QString path = storageItem->m_path;
+            QString oldPath = storageItem->path();
+            QString path = oldPath;
             path.truncate( path.lastIndexOf("/") + 1 );
             QString newName = QString( value.value<QString>() );
             // Check if the file name is valid
@@ -2774,51 +4366,49 @@ MTPResponseCode FSStoragePlugin::setObjectPropertyValue( const ObjHandle &handle
                 return MTP_RESP_Invalid_ObjectProp_Value;
             }
             path += newName;
-            if( dir.rename( storageItem->m_path, path ) )
+            if( dir.rename( oldPath, path ) )
             {
-                m_pathNamesMap.remove(storageItem->m_path);
-                m_puoidsMap.remove(storageItem->m_path);
                 // Adjust path in tracker
-                m_tracker->move(storageItem->m_path, path);
+                m_tracker->move(oldPath, path);
 
-                if( MTP_OBF_FORMAT_Abstract_Audio_Video_Playlist == storageItem->m_objectInfo->mtpObjectFormat )
+                if( MTP_OBF_FORMAT_Abstract_Audio_Video_Playlist == storageItem->m_format )
                 {
                     // If this is a playlist, also need to update the playlist URL
-                    m_tracker->movePlaylist(storageItem->m_path, path);
+                    m_tracker->movePlaylist(oldPath, path);
                 }
 
-                storageItem->m_path = path;
-                storageItem->m_objectInfo->mtpFileName = newName;
-                m_pathNamesMap[storageItem->m_path] = handle;
-                m_puoidsMap[storageItem->m_path] = storageItem->m_puoid;
-                removeWatchDescriptorRecursively( storageItem );
-                addWatchDescriptorRecursively( storageItem );
+                renameStorageItem( storageItem, newName );
+                if( storageItem->m_objectInfo )
+                {
+                    storageItem->m_objectInfo->mtpFileName = newName;
+                }
+                rewatchMovedItem( storageItem );
                 StorageItem *itr = storageItem->m_firstChild;
                 while( itr )
                 {
-                    adjustMovedItemsPath( path, itr, true );
+                    adjustMovedItemsPath( oldPath, path, itr );
                     itr = itr->m_nextSibling;
                 }
                 code = MTP_RESP_OK;
             }
         }
-        else if((false == sendObjectPropList) && (false == storageItem->m_path.isEmpty()))
+        else if((false == sendObjectPropList) && (false == storageItem->path().isEmpty()))
         {
             // go to tracker
-            if( !storageItem->m_path.isEmpty() )
+            if( !storageItem->path().isEmpty() )
             {
-                code = m_tracker->setObjectProperty( storageItem->m_path, propDesc->uPropCode, propDesc->uDataType, value ) ?
+                code = m_tracker->setObjectProperty( storageItem->path(), propDesc->uPropCode, propDesc->uDataType, value ) ?
                     MTP_RESP_OK : code;
             }
         }
     }
     if(true == sendObjectPropList)
     {
-        m_tracker->setPropVals(storageItem->m_path, propValList);
+        m_tracker->setPropVals(storageItem->path(), propValList);
 #if 0
         // Ask tracker to ignore the current file, this is because we already have
         // all required metadata from the initiator.
-        m_tracker->ignoreNextUpdate(QStringList(m_tracker->generateIri(storageItem->m_path)));
+        m_tracker->ignoreNextUpdate(QStringList(m_tracker->generateIri(storageItem->path())));
 #endif
     }
     return code;
@@ -2827,12 +4417,15 @@ MTPResponseCode FSStoragePlugin::setObjectPropertyValue( const ObjHandle &handle
 void FSStoragePlugin::receiveThumbnail(const QString &path)
 {
     // Thumbnail for the file "path" is ready
-    ObjHandle handle = m_pathNamesMap.value(path);
+    ObjHandle handle = handleForPath(path);
     if(0 != handle)
     {
         StorageItem *storageItem = m_objectHandlesMap[handle];
-        storageItem->m_objectInfo->mtpThumbCompressedSize =
-                getThumbCompressedSize( storageItem );
+        if( storageItem->m_objectInfo )
+        {
+            storageItem->m_objectInfo->mtpThumbCompressedSize =
+                    getThumbCompressedSize( storageItem );
+        }
 
         QVector<quint32> params;
         params.append(handle);
@@ -2856,12 +4449,11 @@ void FSStoragePlugin::handleFSDelete(const struct inotify_event *event, const ch
 
             if(0 != parentNode)
             {
-                QString fullPath = parentNode->m_path + QString("/") + QString(name);
-                if(m_pathNamesMap.contains(fullPath))
+                StorageItem *deletedNode = childByName(parentNode, QString(name));
+                if(deletedNode)
                 {
                     MTP_LOG_INFO("Handle FS Delete, deleting file::" << name);
-                    ObjHandle toBeDeleted = m_pathNamesMap[fullPath];
-                    deleteItemHelper( toBeDeleted, false, true );
+                    deleteItemHelper( deletedNode->m_handle, false, true );
                 }
                 // Emit storageinfo changed events, free space may be different from before now
                 QVector<quint32> params;
@@ -2883,16 +4475,21 @@ void FSStoragePlugin::handleFSCreate(const struct inotify_event *event, const ch
         // The above QHash::value() may return a default constructed value of 0... so we double check the wd's here
         if(parentNode && (parentNode->m_wd == event->wd))
         {
-            QString addedPath = parentNode->m_path + QString("/") + QString(name);
-            if( !m_pathNamesMap.contains(addedPath) )
+            StorageItem *existing = childByName(parentNode, QString(name));
+            if( existing )
+            {
+                // Another file took over the path.
+                m_readFds->invalidate( existing->m_handle );
+            }
+            else
             {
                 MTP_LOG_INFO("Handle FS create, adding file::" << name);
+                QString addedPath = parentNode->path() + QString("/") + QString(name);
                 addToStorage(addedPath, 0, 0, true);
 
-                // Emit storageinfo changed events, free space may be different from before now
-                QVector<quint32> params;
-                params.append(m_storageId);
-                emit eventGenerated(MTP_EV_StorageInfoChanged, params);
+                // Free space may be different from before now, announced
+                // once the batch is handled.
+                m_storageInfoChanged = true;
             }
         }
     }
@@ -2917,59 +4514,44 @@ void FSStoragePlugin::handleFSMove(const struct inotify_event *fromEvent, const
         if((0 != fromNode) && (0 != toNode) && (fromNode->m_wd == fromEvent->wd) && (toNode->m_wd == toEvent->wd))
         {
             MTP_LOG_INFO("Handle FS Move, moving file::" << fromName << toName);
-            QString oldPath = fromNode->m_path + QString("/") + QString(fromName);
-            ObjHandle movedHandle = m_pathNamesMap.value(oldPath);
-
-            if(0 == movedHandle)
+            StorageItem *movedNode = childByName(fromNode, QString(fromName));
+            if(0 == movedNode)
             {
                 // Already handled
                 return;
             }
-            StorageItem *movedNode = m_objectHandlesMap.value(movedHandle);
-            if(movedNode)
+            ObjHandle movedHandle = movedNode->m_handle;
+            if( StorageItem *replaced = childByName( toNode, QString(toName) ) ) // Already Handled
             {
-                QString newPath = toNode->m_path + QString("/") + toName;
-                if( m_pathNamesMap.contains( newPath ) ) // Already Handled
-                {
-                    // As the destination path is already present in our tree,
-                    // we only need to delete the fromNode
-                    MTP_LOG_INFO("The path to rename to is already present in our tree, hence, delete the moved node from our tree");
-                    deleteItemHelper( m_pathNamesMap[oldPath], false, true );
-                    return;
-                }
-                MTP_LOG_INFO("Handle FS Move, moving file, found!");
-                if( fromHandle == toHandle ) // Rename
-                {
-                    MTP_LOG_INFO("Handle FS Move, renaming file::" << fromName << toName);
-                    // Remove the old path from the path names map
-                    m_pathNamesMap.remove(oldPath);
-                    movedNode->m_path = newPath;
-                    movedNode->m_objectInfo->mtpFileName = QString(toName);
-                    m_pathNamesMap[movedNode->m_path] = movedHandle;
-                    StorageItem *itr = movedNode->m_firstChild;
-                    while( itr )
-                    {
-                        adjustMovedItemsPath( movedNode->m_path, itr );
-                        itr = itr->m_nextSibling;
-                    }
-                    removeWatchDescriptorRecursively( movedNode );
-                    addWatchDescriptorRecursively( movedNode );
-                }
-                else
-                {
-                    moveObject( movedHandle, toHandle, this, false );
-                }
+                m_readFds->invalidate( replaced->m_handle );
+                // As the destination path is already present in our tree,
+                // we only need to delete the fromNode
+                MTP_LOG_INFO("The path to rename to is already present in our tree, hence, delete the moved node from our tree");
+                deleteItemHelper( movedHandle, false, true );
+                return;
+            }
+            MTP_LOG_INFO("Handle FS Move, moving file, found!");
+            if( fromHandle == toHandle ) // Rename
+            {
+                MTP_LOG_INFO("Handle FS Move, renaming file::" << fromName << toName);
+                // The descendants' paths follow the new name.
+                renameStorageItem( movedNode, QString(toName) );
+                rewatchMovedItem( movedNode );
+            }
+            else
+            {
+                moveObject( movedHandle, toHandle, this, false );
+            }
 
-                // object info would need to be computed again
-                delete movedNode->m_objectInfo;
-                movedNode->m_objectInfo = 0;
-                populateObjectInfo( movedNode );
+            // object info would need to be computed again
+            delete movedNode->m_objectInfo;
+            movedNode->m_objectInfo = 0;
+            readMetadata( movedNode );
 
-                // Emit an object info changed signal
-                QVector<quint32> evtParams;
-                evtParams.append(movedHandle);
-                emit eventGenerated(MTP_EV_ObjectInfoChanged, evtParams);
-            }
+            // Emit an object info changed signal
+            QVector<quint32> evtParams;
+            evtParams.append(movedHandle);
+            emit eventGenerated(MTP_EV_ObjectInfoChanged, evtParams);
         }
     }
 }
@@ -2983,41 +4565,47 @@ void FSStoragePlugin::handleFSModify(const struct inotify_event *event, const ch
         //MTP_LOG_INFO("Handle FS Modify::" << name);
         if(parentNode && (parentNode->m_wd == event->wd))
         {
-            QString changedPath = parentNode->m_path + QString("/") + QString(name);
-            ObjHandle changedHandle = m_pathNamesMap.value(changedPath);
+            StorageItem *changedNode = childByName(parentNode, QString(name));
+            ObjHandle changedHandle = changedNode ? changedNode->m_handle : 0;
             // Don't fire the change signal in the case when there is a transfer to the device ongoing
             if ((0 != changedHandle) && (changedHandle != m_writeObjectHandle))
             {
                 MTP_LOG_INFO("Handle FS Modify, file::" << name);
+                m_readFds->invalidate( changedHandle );
                 StorageItem *item = m_objectHandlesMap.value(changedHandle);
                 // object info would need to be computed again
                 delete item->m_objectInfo;
                 item->m_objectInfo = 0;
-                populateObjectInfo( item );
+                readMetadata( item );
+                scheduleSnapshot();
 
                 // Emit an object info changed event
                 QVector<quint32> eventParams;
                 eventParams.append(changedHandle);
                 emit eventGenerated(MTP_EV_ObjectInfoChanged, eventParams);
 
-                static quint64 freeSpace = m_storageInfo.freeSpace;
-                MTPStorageInfo info;
-                storageInfo( info );
-                qint64 diff = freeSpace - info.freeSpace;
-                if( diff < 0 ) diff *= -1;
-                // Emit storageinfo changed event, if free space changes by 1% or more
-                if( freeSpace && (((quint64)diff*100)/freeSpace) >= 1 )
-                {
-                    freeSpace = m_storageInfo.freeSpace;
-                    eventParams.clear();
-                    eventParams.append(m_storageId);
-                    emit eventGenerated(MTP_EV_StorageInfoChanged, eventParams);
-                }
+                // Checked once the batch is handled.
+                m_freeSpaceMayHaveChanged = true;
             }
         }
     }
 }
 
+void FSStoragePlugin::checkFreeSpaceChanged()
+{
+    static quint64 freeSpace = m_storageInfo.freeSpace;
+    MTPStorageInfo info;
+    storageInfo( info );
+    qint64 diff = freeSpace - info.freeSpace;
+    if( diff < 0 ) diff *= -1;
+    // Emit storageinfo changed event, if free space changes by 1% or more
+    if( freeSpace && (((quint64)diff*100)/freeSpace) >= 1 )
+    {
+        freeSpace = m_storageInfo.freeSpace;
+        m_storageInfoChanged = true;
+    }
+}
+
 void FSStoragePlugin::cacheInotifyEvent(const struct inotify_event *event, const char* name)
 {
     m_iNotifyCache.fromEvent = *event;
@@ -3047,7 +4635,7 @@ void FSStoragePlugin::clearCachedInotifyEvent()
 void FSStoragePlugin::removeWatchDescriptorRecursively( StorageItem* item )
 {
     StorageItem *itr;
-    if( item && item->m_objectInfo && MTP_OBF_FORMAT_Association == item->m_objectInfo->mtpObjectFormat )
+    if( item && MTP_OBF_FORMAT_Association == item->m_format )
     {
         removeWatchDescriptor( item );
         for( itr = item->m_firstChild; itr; itr = itr->m_nextSibling )
@@ -3059,7 +4647,7 @@ void FSStoragePlugin::removeWatchDescriptorRecursively( StorageItem* item )
 
 void FSStoragePlugin::removeWatchDescriptor( StorageItem* item )
 {
-    if( item && item->m_objectInfo && MTP_OBF_FORMAT_Association == item->m_objectInfo->mtpObjectFormat )
+    if( item && MTP_OBF_FORMAT_Association == item->m_format )
     {
         m_inotify->removeWatch( item->m_wd );
         m_watchDescriptorMap.remove( item->m_wd );
@@ -3069,7 +4657,7 @@ void FSStoragePlugin::removeWatchDescriptor( StorageItem* item )
 void FSStoragePlugin::addWatchDescriptorRecursively( StorageItem* item )
 {
     StorageItem *itr;
-    if( item && item->m_objectInfo && MTP_OBF_FORMAT_Association == item->m_objectInfo->mtpObjectFormat )
+    if( item && MTP_OBF_FORMAT_Association == item->m_format )
     {
         addWatchDescriptor( item );
         for( itr = item->m_firstChild; itr; itr = itr->m_nextSibling )
@@ -3079,11 +4667,21 @@ void FSStoragePlugin::addWatchDescriptorRecursively( StorageItem* item )
     }
 }
 
+void FSStoragePlugin::rewatchMovedItem( StorageItem* item )
+{
+    // fanotify watches directories by file handle, which survives renames.
+    if( !m_inotify->watchesFollowRenames() )
+    {
+        removeWatchDescriptorRecursively( item );
+        addWatchDescriptorRecursively( item );
+    }
+}
+
 void FSStoragePlugin::addWatchDescriptor( StorageItem* item )
 {
-    if( item && item->m_objectInfo && MTP_OBF_FORMAT_Association == item->m_objectInfo->mtpObjectFormat )
+    if( item && MTP_OBF_FORMAT_Association == item->m_format )
     {
-        item->m_wd = m_inotify->addWatch( item->m_path );
+        item->m_wd = m_inotify->addWatch( item->path() );
         if( -1 != item->m_wd )
         {
             m_watchDescriptorMap[ item->m_wd ] = item->m_handle;
@@ -3101,7 +4699,7 @@ bool FSStoragePlugin::isFileNameValid(const QString &fileName, const StorageItem
         // Illegal characters, or all .'s
         return false;
     }
-    if(m_pathNamesMap.contains(parent->m_path + "/" + fileName))
+    if(childByName(parent, fileName))
     {
         // Already present
         return false;
@@ -3116,6 +4714,32 @@ void FSStoragePlugin::excludePath(const QString &path)
             << path << "from being exported via MTP.");
 }
 
+void FSStoragePlugin::setContentSniffing(bool sniff)
+{
+    m_contentSniffing = sniff;
+    if (sniff) {
+        MTP_LOG_INFO("Storage" << m_storageInfo.volumeLabel
+                << "detects object formats by content.");
+    }
+}
+
+void FSStoragePlugin::setFanotify(bool fanotify)
+{
+    if (fanotify && m_inotify->useFanotify(m_storagePath)) {
+        MTP_LOG_INFO("Storage" << m_storageInfo.volumeLabel
+                << "watches its filesystem with fanotify.");
+    }
+}
+
+void FSStoragePlugin::setLazyEnumeration(bool lazy)
+{
+    m_lazyEnumeration = lazy;
+    if (lazy) {
+        MTP_LOG_INFO("Storage" << m_storageInfo.volumeLabel
+                << "lists directories on demand.");
+    }
+}
+
 QString FSStoragePlugin::filesystemUuid() const
 {
 #ifndef UT_ON
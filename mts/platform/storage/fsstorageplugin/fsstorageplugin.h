@@ -34,19 +34,29 @@
 
 #include <sys/inotify.h>
 #include "storageplugin.h"
+#include "storageitem.h"
 #include <QVector>
 #include <QList>
 #include <QStringList>
+#include <QElapsedTimer>
+#include <QSet>
+#include <QPair>
 
 class QFile;
 class QDir;
+class QTimer;
 
 namespace meegomtp1dot0
 {
+class FSCopyEngine;
+class FSDirWalker;
+struct FSDirEntry;
+class FSFdCache;
+class FSWriteBehind;
+class LogStore;
 class FSInotify;
 class StorageTracker;
 class Thumbnailer;
-class StorageItem;
 }
 
 /// FSStoragePlugin implements StoragePlugin for the case of a filesystem storage.
@@ -75,6 +85,8 @@ public:
 
     MTPResponseCode getObjectHandles( const MTPObjFormatCode& formatCode, const quint32& associationHandle, QVector<ObjHandle> &objectHandles ) const;
 
+    MTPResponseCode getNumObjects( const MTPObjFormatCode& formatCode, const quint32& associationHandle, quint32 &noOfObjects ) const;
+
     bool checkHandle( const ObjHandle &handle ) const;
 
     MTPResponseCode storageInfo( MTPStorageInfo &info );
@@ -91,6 +103,8 @@ public:
 
     MTPResponseCode getObjectInfo( const ObjHandle &handle, const MTPObjectInfo *&objectInfo );
 
+    MTPResponseCode getParentHandle( const ObjHandle &handle, ObjHandle &parentHandle );
+
     MTPResponseCode writeData( const ObjHandle &handle, char *writeBuffer, quint32 bufferLen, bool isFirstSegment, bool isLastSegment );
 
     MTPResponseCode readData( const ObjHandle &handle, char *readBuffer, qint32 &readBufferLen, quint32 readOffset );
@@ -110,6 +124,24 @@ public:
 
     void excludePath( const QString & path );
 
+    /// Enables lazy enumeration: a directory is listed only when the
+    /// initiator first asks for its contents. Must be called before
+    /// enumerateStorage().
+    /// \param lazy [in] true to enable lazy enumeration.
+    void setLazyEnumeration( bool lazy );
+
+    /// Enables detecting the format of files from their first bytes, for
+    /// files without a known extension or with a misleading one.
+    /// \param sniff [in] true to enable content sniffing.
+    void setContentSniffing( bool sniff );
+
+    /// Watches the filesystem of the storage with a single fanotify mark
+    /// instead of an inotify watch per directory. Falls back to inotify
+    /// when fanotify is not available. Must be called before
+    /// enumerateStorage().
+    /// \param fanotify [in] true to use fanotify.
+    void setFanotify( bool fanotify );
+
 public slots:
     /// This slot gets notified when an inotify event is received, and takes appropriate action.
     void inotifyEventSlot( struct inotify_event* );
@@ -131,15 +163,68 @@ private:
 
     void setPlaylistReferences( const ObjHandle &handle , const QVector<ObjHandle> &references );
 
-    /// Reads puoids from the puoids db, so that are preserved across MTP sessions.
+    /// Reads puoids from the puoids log, so that are preserved across MTP
+    /// sessions. A puoids db of an older version is converted to a log.
     void populatePuoids();
 
-    /// Writes puoids to a db, so that are preserved across MTP sessions.
-    void storePuoids();
+    /// Reads the puoids db of older versions into the puoids map.
+    void readLegacyPuoids();
+
+    /// Rewrites the puoids log from the puoids of the tree and the unclaimed
+    /// ones, see LogStore.
+    void compactPuoids();
+
+    /// Logs the new paths of a renamed or moved item and its descendants.
+    /// \param item [in] the item, already at its new place in the tree.
+    /// \param oldPath [in] the item's path before the change.
+    void logMovedPuoids( StorageItem *item, const QString &oldPath );
 
     /// After reading puoids the db, this gets rid of any puoids that are no longer valid ( the corresponding object doesn't exist ).
     void removeUnusedPuoids();
 
+    /// Rebuilds the storage item tree from the snapshot written by a
+    /// previous session, then rescans only the directories whose mtime or
+    /// ctime differ from the ones recorded in the snapshot.
+    ///
+    /// Files modified in place without touching their directory keep the
+    /// cached object info until inotify reports a change for them.
+    /// \return true if the tree was restored, false if a full enumeration is needed.
+    bool restoreSnapshot();
+
+    /// Rescans the directories whose mtime or ctime differ from the ones
+    /// recorded when they were listed, and drops the ones that went away.
+    /// \param directories [in] handles of the directories to check.
+    /// \return number of directories rescanned.
+    int rescanChangedDirectories( const QVector<ObjHandle> &directories );
+
+    /// Lists the contents of a directory not listed yet in lazy enumeration
+    /// mode; its subdirectories are added unlisted.
+    /// \param item [in] the directory; other items are ignored.
+    /// \param sendEvent [in] if true, ObjectAdded events are sent for the new items.
+    void ensureListed( StorageItem *item, bool sendEvent = false );
+
+    /// Starts listing all remaining directories in the background after
+    /// a whole-storage query in lazy enumeration mode.
+    void startLazyCompletion();
+
+    /// Synchronizes the children of a directory item with the file system.
+    /// New subdirectories are left unlisted in lazy enumeration mode and
+    /// queued for the next walk otherwise.
+    /// \param dirItem [in] the directory to rescan.
+    void rescanDirectory( StorageItem *dirItem );
+
+    /// Starts a directory walker over the directories queued in
+    /// m_pendingWalks; they must be in the storage already.
+    /// \return false if nothing was queued.
+    bool startWalker();
+
+    /// Marks the snapshot as outdated and (re)starts the idle timer that writes it.
+    void scheduleSnapshot();
+
+    /// Starts the timer that syncs the puoids and references logs, unless
+    /// it is already running.
+    void scheduleLogSync();
+
     /// Creates a directory in the file system.
     ///
     /// \param path [in] filesystem path of the directory to create.
@@ -177,7 +262,37 @@ private:
     /// \param childStorageItem [in] pointer to the child storage item.
     void unlinkChildStorageItem( StorageItem *childStorageItem );
 
+    /// Renames a storage item within its parent; the paths of its
+    /// descendants follow without being touched.
+    /// \param item [in] the storage item.
+    /// \param name [in] the new name.
+    void renameStorageItem( StorageItem *item, const QString &name );
+
+    /// Sets the size of a storage item and updates the byte totals of its
+    /// ancestors.
+    /// \param item [in] the storage item.
+    /// \param size [in] the new size in bytes.
+    void setStorageItemSize( StorageItem *item, quint64 size );
+
+    /// Looks up a child by name.
+    /// \param parent [in] the parent directory item.
+    /// \param name [in] the name of the child.
+    /// \return the child storage item, or 0 if there's none.
+    StorageItem* childByName( const StorageItem *parent, const QString &name ) const;
+
+    /// Resolves a path one component at a time through the child index.
+    /// Unlike findStorageItemByPath() this never lists directories.
+    /// \param path [in] the pathname of the item.
+    /// \return the storage item, or 0 if the path is not in the storage.
+    StorageItem* lookupPath( const QString &path ) const;
+
+    /// Resolves a path to an object handle.
+    /// \param path [in] the pathname of the item.
+    /// \return the object handle, or 0 if the path is not in the storage.
+    ObjHandle handleForPath( const QString &path ) const;
+
     /// Given a pathname, gives the corresponding storage item if the item exists in the filesystem.
+    /// In lazy enumeration mode, unlisted ancestors of the item are listed.
     /// \param path [in] the pathname of the item.
     /// \return the storage item.
     StorageItem* findStorageItemByPath( const QString &path );
@@ -197,6 +312,10 @@ private:
     ///                         created if it doesn't exist yet.
     /// \param handle [in] when nonzero, assigns the specific object handle to
     ///               the newly created StorageItem.
+    /// \param addChildren [in] if false, the contents of a directory are not
+    ///                    added; FSDirWalker delivers them during enumeration.
+    /// \param entry [in] the item's metadata if the caller already read it
+    ///              while listing the parent, saves a stat of path.
     /// \return MTP response code.
     ///
     /// This method will call processEvents() regularly when adding
@@ -204,34 +323,139 @@ private:
     MTPResponseCode addToStorage( const QString &path,
             StorageItem **storageItem = 0, MTPObjectInfo *info = 0,
             bool sendEvent = false, bool createIfNotExist = false,
-            ObjHandle handle = 0 );
+            ObjHandle handle = 0, bool addChildren = true,
+            const FSDirEntry *entry = 0 );
 
     /// Inserts a storage item into internal data structures for faster search.
     ///
     /// \param item [in] a storage item.
     void addItemToMaps( StorageItem *item );
 
+    /// Adds a storage item to the per-format indexes used by getObjectHandles().
+    /// \param item [in] a storage item with its handle, parent and format set.
+    void addItemToFormatIndex( StorageItem *item );
+
+    /// Appends the handles of the children of an object that are in a given
+    /// format, in the same order as an unfiltered query returns them.
+    /// \param parentItem [in] the parent object.
+    /// \param formatCode [in] the object format.
+    /// \param objectHandles [out] the handles are appended here.
+    void getChildHandlesByFormat( const StorageItem *parentItem, MTPObjFormatCode formatCode,
+                                  QVector<ObjHandle> &objectHandles ) const;
+
+    /// Removes a storage item from the per-format indexes.
+    /// \param item [in] a storage item, with the parent and format it was indexed under.
+    void removeItemFromFormatIndex( StorageItem *item );
+
     /// Removes a storage item.
     /// \param handle [in] the handle of the object that needs to be removed.
     /// \sendEvent [in] indicates whether to send an ObjectRemoved event to the inititiator.
     MTPResponseCode removeFromStorage( ObjHandle handle, bool sendEvent = false );
 
+    /// Removes a directory and everything below it from the disk on a
+    /// worker thread, dropping the removed items from the storage in
+    /// batches as it goes. A host cancel stops it between two entries.
+    /// \param handle [in] the handle of the directory.
+    /// \param sendEvent [in] indicates whether to send ObjectRemoved events to the initiator.
+    /// \return MTP_RESP_PartialDeletion if some entries could not be removed,
+    /// MTP_RESP_TransactionCancelled if the initiator cancelled.
+    MTPResponseCode removeTree( ObjHandle handle, bool sendEvent );
+
+    /// Copies a file's contents into an existing object of this storage.
+    /// Between FS storages this goes through an FSCopyEngine, so the data
+    /// doesn't pass through user space; other sources go through
+    /// StoragePlugin::copyData().
+    /// \param sourceStorage [in] the storage holding the source object.
+    /// \param source [in] the handle of the source object.
+    /// \param destination [in] the handle of the destination object in this storage.
+    /// \return MTP response.
+    MTPResponseCode copyFileData( StoragePlugin *sourceStorage, ObjHandle source, ObjHandle destination );
+
+    /// Copies the contents of a directory to an FS storage. The destination
+    /// directories and objects are created up front while an FSCopyEngine
+    /// copies the file data on worker threads.
+    /// \param sourceDir [in] the directory whose contents to copy.
+    /// \param destinationDir [in] the handle of the directory to copy into.
+    /// \param destination [in] the storage holding destinationDir.
+    /// \return MTP response.
+    MTPResponseCode copyTree( StorageItem *sourceDir, ObjHandle destinationDir, FSStoragePlugin *destination );
+
+    /// Creates the objects for a copy of a directory's contents, and queues
+    /// their file data on the copy engine.
+    /// \param sourceDir [in] the directory whose contents to copy.
+    /// \param destinationDir [in] the handle of the directory to copy into.
+    /// \param destination [in] the storage holding destinationDir.
+    /// \param engine [in] the engine doing the copies.
+    /// \return MTP response.
+    MTPResponseCode planCopy( StorageItem *sourceDir, ObjHandle destinationDir,
+                              FSStoragePlugin *destination, FSCopyEngine &engine );
+
+    /// Waits for the copies of an engine into this storage, removing the
+    /// objects of copies that failed. A host cancel stops the remaining
+    /// copies and fails them.
+    /// \param engine [in] the engine doing the copies.
+    /// \return MTP_RESP_GeneralError if some copy failed or was cancelled.
+    MTPResponseCode finishCopies( FSCopyEngine &engine );
+
+    /// Opens the file of an object for SendObject and preallocates the
+    /// size the initiator declared for it.
+    /// \param storageItem [in] the object being written.
+    /// \return MTP_RESP_StoreFull if the declared size doesn't fit.
+    MTPResponseCode openDataFile( StorageItem *storageItem );
+
+    /// Hands the buffered SendObject data to the write-behind thread.
+    /// \return MTP response; reports an earlier failed write too.
+    MTPResponseCode queueDataChunk();
+
+    /// Hands the rest of the SendObject data to the write-behind thread
+    /// and waits until all of it is on the file.
+    /// \return MTP response.
+    MTPResponseCode flushDataFile();
+
+    /// Closes the SendObject file, dropping unwritten data and releasing
+    /// preallocated space beyond what was written.
+    void closeDataFile();
+
     /// Populates the object info for a storage item if that's not done by the initiator.
     /// \param storageItem [in] the item's whose object info needs to be populated.
     void populateObjectInfo( StorageItem *storageItem );
 
-    /// This method helps recursively modify the "path" field of a StorageItem ther has been moved.
-    /// \param newAncestorPath [in] the new ancestor for the moved item and it's children.
-    /// \movedItem [in] the moved item.
-    /// \updateInTracker [in] If true, the function also updates the URIs in
-    /// tracker
-    void adjustMovedItemsPath( QString newAncestorPath, StorageItem* movedItem, bool updateInTracker = false );
+    /// Fills the compact format, size and time fields of a storage item from
+    /// the file system. The full object info dataset is left alone.
+    /// \param storageItem [in] the storage item.
+    /// \param timesOnly [in] if true, only the times are refreshed.
+    void readMetadata( StorageItem *storageItem, bool timesOnly = false );
+
+    /// Fills the compact format, size and time fields of a storage item from
+    /// metadata that has already been read, see FSDirWalker::statEntry().
+    /// \param storageItem [in] the storage item.
+    /// \param entry [in] the item's metadata.
+    /// \param timesOnly [in] if true, only the times are refreshed.
+    void applyMetadata( StorageItem *storageItem, const FSDirEntry &entry, bool timesOnly = false );
+
+    /// Moves the tracker URIs of a moved item's descendants. Paths are
+    /// derived from the tree, so the items themselves need no update.
+    /// \param oldAncestorPath [in] the path of the moved item before the move.
+    /// \param newAncestorPath [in] the path of the moved item after the move.
+    /// \param movedItem [in] the moved item.
+    void adjustMovedItemsPath( const QString &oldAncestorPath, const QString &newAncestorPath, StorageItem* movedItem );
 
     /// Gets the object format of a storage item.
     /// \param storageItem [in] the storage item.
     /// \return object format code.
     quint16 getObjectFormatByExtension( StorageItem *storageItem );
 
+    /// Detects the format of a file from its content. Uses what the walker
+    /// read if entry has it; other results are cached by inode and
+    /// modification time. Short signatures only apply to files without a
+    /// known extension.
+    /// \param storageItem [in] the storage item.
+    /// \param entry [in] the item's metadata.
+    /// \param format [in] the format derived from the extension.
+    /// \return the detected format, or format if the content is not recognized.
+    MTPObjFormatCode sniffFormat( StorageItem *storageItem, const FSDirEntry &entry,
+                                  MTPObjFormatCode format );
+
     /// Gets the protection status of a storage item.
     /// \param storageItem [in] the storage item.
     /// \return the protection status code.
@@ -313,11 +537,14 @@ private:
     /// \param recurse indiicates whether to dump info recursively or not.
     void dumpStorageItem( StorageItem *storageItem, bool recurse = false );
 
-    /// Reads object references from the references db and populates them to the references map.
+    /// Reads object references from the references log and populates them to the references map.
     void populateObjectReferences();
 
-    /// Writes object references from the references map onto ther persistent references db.
-    void storeObjectReferences();
+    /// Rewrites the references log from the references map.
+    void compactObjectReferences();
+
+    /// Reads the references db of older versions into the references map.
+    void readLegacyObjectReferences();
 
     /// This method removes invalid object handles and invalid references from the references map.
     void removeInvalidObjectReferences( const ObjHandle &handle );
@@ -334,6 +561,10 @@ private:
 
     /// This handles IN_MODIFY iNotify events
     void handleFSModify(const struct inotify_event *event, const char* name);
+
+    /// Emits StorageInfoChanged if the free space changed by 1% or more since
+    /// it was last announced.
+    void checkFreeSpaceChanged();
     
     /// Caches IN_MOVED_FROM events for future pairing
     void cacheInotifyEvent(const struct inotify_event *event, const char* name);
@@ -358,6 +589,10 @@ private:
     /// Adds inotify watch on a directory and sub dirs if any.
     void addWatchDescriptorRecursively( StorageItem *item );
 
+    /// Updates the watches of a renamed or moved directory and its sub dirs,
+    /// if the change monitor needs it.
+    void rewatchMovedItem( StorageItem *item );
+
     /// Returns recursively the list of files (and directories) under a given item,
     /// and the new paths for all those file, if they were moved under a new
     /// root
@@ -372,35 +607,65 @@ private:
 
 private slots:
     void enumerateStorage_worker();
+
+    /// Indexes the entries found by the directory walker.
+    void walkerEntriesAvailable();
+
+    /// Lists a few of the remaining directories, see startLazyCompletion().
+    void lazyCompletionStep();
+
+    /// Writes the storage item tree, puoids and object info to the snapshot file.
+    void storeSnapshot();
+
+    /// Flushes the puoids and references logs to disk, and compacts the ones
+    /// that have grown well beyond their live data.
+    void syncLogs();
+
+    /// Handles a batch of file system events from the watcher thread, in
+    /// order, announcing storage info changes once per batch.
+    void inotifyEventsAvailable();
     
 private:
+    /// Completes the enumeration once the tree is indexed, and announces
+    /// that the storage is ready.
+    void finishEnumeration();
+
     MTPResponseCode deleteItemHelper( ObjHandle handle, bool removePhysically = true, bool sendEvent = false );
     bool isFileNameValid(const QString &fileName, const StorageItem *parent);
     QString filesystemUuid() const;
 
     QString m_storagePath;
     QHash<int,ObjHandle> m_watchDescriptorMap; ///< map from an inotify watch on an object to it's object handle.
-    QHash<QString,ObjHandle> m_pathNamesMap;
-    QHash<QString,MtpInt128> m_puoidsMap;
+    QHash<StorageItemKey,StorageItem*> m_childIndex; ///< (parent, name) -> child, see lookupPath().
+    QHash<QString,MtpInt128> m_puoidsMap; ///< persistent puoids of paths that are not in the tree.
     QHash<MtpInt128, ObjHandle> m_puoidToHandleMap; ///< Maps the PUOID to the corresponding object handle
     StorageItem *m_root; ///< the root folder
     QString m_puoidsDbPath; ///< path where puoids will be stored persistently.
-    QString m_objectReferencesDbPath; ///< path where references will be stored persistently.
+    QString m_objectReferencesDbPath; ///< path of the references db of older versions, shared by all storages.
+    LogStore *m_puoidsLog; ///< persistent path -> puoid log of this storage.
+    LogStore *m_referencesLog; ///< persistent object references log of this storage.
+    QTimer *m_logSyncTimer; ///< syncs the logs shortly after they were written.
+    QString m_snapshotPath; ///< path of the object index snapshot of this storage.
+    QTimer *m_snapshotTimer; ///< writes the snapshot once the storage has been idle for a while.
+    bool m_snapshotDirty; ///< true if the tree changed since the snapshot was last written.
+    bool m_enumerated; ///< true once the initial enumeration is complete.
     QString m_playlistPath; ///< the path where playlists are stored.
     QString m_internalPlaylistPath; ///< the path where internal abstract playlists are stored.
     ObjHandle m_writeObjectHandle; ///< The obj handle for which a write operation is currently is progress. 0 means invalid handle, NOT root node!!
     StorageTracker* m_tracker; ///< pointer to the tracker object
     Thumbnailer* m_thumbnailer; ///< pointer to the thumbnailer object
     FSInotify* m_inotify; ///< pointer to the inotify wrapper
-    QHash<QString,quint16> m_formatByExtTable;
     QHash<MTPObjFormatCode, QString> m_imageMimeTable; ///< Maps the MTP object format code (for image types only) to MIME type string
     QString m_mtpPersistentDBPath;
     MtpInt128 m_largestPuoid;
+    bool m_largestPuoidLogged; ///< whether m_largestPuoid is in the puoids log.
     struct INotifyCache
     {
         struct inotify_event    fromEvent;
         QString                 fromName;
     }m_iNotifyCache; ///< A cache for iNotify events
+    bool m_storageInfoChanged; ///< a handled file system event changed the storage info.
+    bool m_freeSpaceMayHaveChanged; ///< a handled file system event modified a file.
 
     struct ExistingPlaylists
     {
@@ -415,9 +680,26 @@ private:
     }m_newPlaylists;
 
     QHash<ObjHandle, StorageItem*> m_objectHandlesMap; ///< each storage has a map of all it's object's handles to corresponding storage item.
+    QHash<MTPObjFormatCode, QSet<ObjHandle> > m_formatIndex; ///< format -> handles of the objects in that format.
+    QHash<QPair<ObjHandle, MTPObjFormatCode>, QSet<ObjHandle> > m_parentFormatIndex; ///< (parent, format) -> handles of the children in that format.
     QFile *m_dataFile;
+    FSWriteBehind *m_dataWriter; ///< writes m_dataFile behind the transfer.
+    QByteArray m_writeBuffer; ///< SendObject data not yet queued to m_dataWriter.
+    quint64 m_dataFilePreallocated; ///< bytes preallocated for m_dataFile.
 
     QStringList m_excludePaths; ///< Paths that should not be indexed
+    FSDirWalker *m_walker; ///< walks the tree during the initial enumeration.
+    QStringList m_pendingWalks; ///< directories whose contents the next walk indexes.
+    QVector<ObjHandle> m_walkedDirs; ///< directories indexed by the current walk, rescanned once it is done.
+    bool m_lazyEnumeration; ///< true if directories are listed on demand.
+    bool m_lazyCompletionRunning; ///< true while the remaining directories are listed in the background.
+    int m_lazyCompletionListed; ///< directories listed so far by the background completion.
+    QSet<ObjHandle> m_unlistedDirs; ///< directories whose contents haven't been listed yet.
+    QElapsedTimer m_enumerationTimer; ///< measures the time to storagePluginReady.
+    bool m_contentSniffing; ///< true if formats are detected from file contents.
+    /// (inode, mtime) -> format found by sniffFormat() and whether its signature is strong.
+    QHash<QPair<quint64, qint64>, QPair<MTPObjFormatCode, bool> > m_sniffCache;
+    FSFdCache *m_readFds; ///< files kept open across the segments of a read.
 
 #ifdef UT_ON
     ObjHandle m_testHandleProvider;
@@ -5,7 +5,7 @@
 TEMPLATE = lib
 TARGET = fsstorage
 
-CONFIG += plugin link_pkgconfig debug qtsparql
+CONFIG += plugin link_pkgconfig debug qtsparql c++11
 
 QT += dbus xml
 QT -= gui
@@ -33,6 +33,12 @@ HEADERS += fsstorageplugin.h \
            thumbnailerproxy.h \
            thumbnailer.h \
            fsinotify.h \
+           fscopyengine.h \
+           fsfdcache.h \
+           fsdirwalker.h \
+           fstreeremover.h \
+           fswritebehind.h \
+           logstore.h \
            storageitem.h
 
 SOURCES += fsstorageplugin.cpp \
@@ -41,6 +47,12 @@ SOURCES += fsstorageplugin.cpp \
            thumbnailerproxy.cpp \
            thumbnailer.cpp \
            fsinotify.cpp \
+           fscopyengine.cpp \
+           fsfdcache.cpp \
+           fsdirwalker.cpp \
+           fstreeremover.cpp \
+           fswritebehind.cpp \
+           logstore.cpp \
            storageitem.cpp
 
 LIBPATH += ../../..
@@ -94,6 +94,21 @@ QList<StoragePlugin *>FSStoragePluginFactory::create(quint32 storageId)
         bool removable =
             !storage.attribute("removable").compare("true", Qt::CaseInsensitive);
 
+        // enumeration="lazy" lists directories only when the initiator
+        // asks for them; the default is to index the whole tree up front.
+        bool lazy =
+            !storage.attribute("enumeration").compare("lazy", Qt::CaseInsensitive);
+
+        // formatdetection="content" also looks at the first bytes of files
+        // whose extension is unknown or doesn't match their content.
+        bool sniff =
+            !storage.attribute("formatdetection").compare("content", Qt::CaseInsensitive);
+
+        // changemonitor="fanotify" watches the whole filesystem with one
+        // fanotify mark instead of an inotify watch per directory.
+        bool fanotify =
+            !storage.attribute("changemonitor").compare("fanotify", Qt::CaseInsensitive);
+
         QStringList blacklistPaths;
         const QDomNodeList &blacklist = storage.elementsByTagName("blacklist");
         for (int i = 0; i != blacklist.size(); ++i) {
@@ -164,6 +179,10 @@ QList<StoragePlugin *>FSStoragePluginFactory::create(quint32 storageId)
                 plugin->excludePath(line);
             }
 
+            plugin->setLazyEnumeration(lazy);
+            plugin->setContentSniffing(sniff);
+            plugin->setFanotify(fanotify);
+
             result.append(plugin);
             storageId++;
         }
@@ -0,0 +1,315 @@
+/*
+* This file is part of libmeegomtp package
+*
+* Copyright (C) 2010 Nokia Corporation. All rights reserved.
+*
+* Contact: Deepak Kodihalli <deepak.kodihalli@nokia.com>
+*
+* Redistribution and use in source and binary forms, with or without modification,
+* are permitted provided that the following conditions are met:
+*
+* Redistributions of source code must retain the above copyright notice, this list
+* of conditions and the following disclaimer. Redistributions in binary form must
+* reproduce the above copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of Nokia Corporation nor the names of its contributors may be
+* used to endorse or promote products derived from this software without specific
+* prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+* INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+* BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+* LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+* OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+* OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#include "fstreeremover.h"
+#include "trace.h"
+
+#include <QFile>
+#include <QThread>
+#include <QVector>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace meegomtp1dot0;
+
+/// Removed paths collected before the caller gets to see them.
+static const int REMOVED_BATCH_SIZE = 256;
+
+namespace meegomtp1dot0
+{
+class FSTreeRemoverThread : public QThread
+{
+public:
+    explicit FSTreeRemoverThread( FSTreeRemover *remover ) : m_remover(remover) {}
+
+protected:
+    void run() { m_remover->work(); }
+
+private:
+    FSTreeRemover *m_remover;
+};
+}
+
+namespace
+{
+/// A directory being emptied.
+struct OpenDir
+{
+    DIR *dir;
+    QString path;
+};
+
+bool isDirectory( int dirFd, const struct dirent *entry )
+{
+    if( DT_UNKNOWN != entry->d_type )
+    {
+        return DT_DIR == entry->d_type;
+    }
+    struct stat st;
+    return 0 == fstatat( dirFd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW ) && S_ISDIR( st.st_mode );
+}
+}
+
+/**************************************************
+ * FSTreeRemover::FSTreeRemover
+ *************************************************/
+FSTreeRemover::FSTreeRemover( const QString &rootPath, const QSet<QString> &indexedPaths,
+                              const QStringList &excludePaths ) :
+    m_rootPath(rootPath), m_indexedPaths(indexedPaths), m_excludePaths(excludePaths),
+    m_thread(new FSTreeRemoverThread( this )),
+    m_done(false), m_cancelled(false), m_failed(false), m_skipped(false)
+{
+}
+
+/**************************************************
+ * FSTreeRemover::~FSTreeRemover
+ *************************************************/
+FSTreeRemover::~FSTreeRemover()
+{
+    cancel();
+    m_thread->wait();
+    delete m_thread;
+}
+
+/**************************************************
+ * void FSTreeRemover::start
+ *************************************************/
+void FSTreeRemover::start()
+{
+    m_thread->start();
+}
+
+/**************************************************
+ * void FSTreeRemover::cancel
+ *************************************************/
+void FSTreeRemover::cancel()
+{
+    QMutexLocker locker( &m_lock );
+    m_cancelled = true;
+}
+
+/**************************************************
+ * bool FSTreeRemover::isCancelled
+ *************************************************/
+bool FSTreeRemover::isCancelled()
+{
+    QMutexLocker locker( &m_lock );
+    return m_cancelled;
+}
+
+/**************************************************
+ * bool FSTreeRemover::failed
+ *************************************************/
+bool FSTreeRemover::failed() const
+{
+    QMutexLocker locker( &m_lock );
+    return m_failed;
+}
+
+/**************************************************
+ * bool FSTreeRemover::skipped
+ *************************************************/
+bool FSTreeRemover::skipped() const
+{
+    QMutexLocker locker( &m_lock );
+    return m_skipped;
+}
+
+/**************************************************
+ * bool FSTreeRemover::takeRemoved
+ *************************************************/
+bool FSTreeRemover::takeRemoved( QStringList &paths, unsigned long timeout )
+{
+    QMutexLocker locker( &m_lock );
+    if( m_removed.isEmpty() && !m_done )
+    {
+        m_progress.wait( &m_lock, timeout );
+    }
+    paths += m_removed;
+    m_removed.clear();
+    return m_done;
+}
+
+/**************************************************
+ * void FSTreeRemover::publish
+ *************************************************/
+void FSTreeRemover::publish( QStringList &batch )
+{
+    QMutexLocker locker( &m_lock );
+    m_removed += batch;
+    batch.clear();
+    m_progress.wakeAll();
+}
+
+/**************************************************
+ * void FSTreeRemover::work
+ *************************************************/
+void FSTreeRemover::work()
+{
+    QStringList batch;
+    bool failed = false;
+    bool skipped = false;
+
+    QVector<OpenDir> stack;
+    QByteArray rootPath = QFile::encodeName( m_rootPath );
+    int rootFd = open( rootPath.constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+    if( -1 == rootFd )
+    {
+        MTP_LOG_WARNING("Can't open" << m_rootPath << "for removal:" << errno);
+        failed = true;
+    }
+    else
+    {
+        OpenDir root = { fdopendir( rootFd ), m_rootPath };
+        if( root.dir )
+        {
+            stack.append( root );
+        }
+        else
+        {
+            close( rootFd );
+            failed = true;
+        }
+    }
+
+    while( !stack.isEmpty() )
+    {
+        if( isCancelled() )
+        {
+            break;
+        }
+
+        OpenDir &top = stack.last();
+        int dirFd = dirfd( top.dir );
+        errno = 0;
+        struct dirent *entry = readdir( top.dir );
+        if( !entry )
+        {
+            // The directory is empty now, remove it from its parent.
+            OpenDir done = stack.takeLast();
+            closedir( done.dir );
+            int result;
+            if( stack.isEmpty() )
+            {
+                result = rmdir( rootPath.constData() );
+                if( -1 == result && ENOTDIR == errno )
+                {
+                    // The root was a link to a directory.
+                    result = unlink( rootPath.constData() );
+                }
+            }
+            else
+            {
+                QByteArray name = QFile::encodeName( done.path.mid( done.path.lastIndexOf( '/' ) + 1 ) );
+                result = unlinkat( dirfd( stack.last().dir ), name.constData(), AT_REMOVEDIR );
+            }
+            if( 0 == result )
+            {
+                batch.append( done.path );
+            }
+            else
+            {
+                // ENOTEMPTY means a child was left behind, which has been logged.
+                if( ENOTEMPTY != errno )
+                {
+                    MTP_LOG_WARNING("Can't remove" << done.path << ":" << errno);
+                }
+                failed = true;
+            }
+        }
+        else if( !strcmp( entry->d_name, "." ) || !strcmp( entry->d_name, ".." ) )
+        {
+            continue;
+        }
+        else
+        {
+            QString path = top.path + '/' + QFile::decodeName( entry->d_name );
+            if( !m_indexedPaths.contains( path ) || m_excludePaths.contains( path ) )
+            {
+                // Not ours to remove. Its directory will then fail to go
+                // with ENOTEMPTY, which keeps the way to it, too.
+                skipped = true;
+                continue;
+            }
+            if( isDirectory( dirFd, entry ) )
+            {
+                int fd = openat( dirFd, entry->d_name,
+                                 O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC );
+                DIR *dir = -1 != fd ? fdopendir( fd ) : 0;
+                if( dir )
+                {
+                    OpenDir child = { dir, path };
+                    stack.append( child );
+                }
+                else
+                {
+                    if( -1 != fd )
+                    {
+                        close( fd );
+                    }
+                    MTP_LOG_WARNING("Can't open" << path << "for removal:" << errno);
+                    failed = true;
+                }
+            }
+            else if( 0 == unlinkat( dirFd, entry->d_name, 0 ) )
+            {
+                batch.append( path );
+            }
+            else
+            {
+                MTP_LOG_WARNING("Can't remove" << path << ":" << errno);
+                failed = true;
+            }
+        }
+
+        if( batch.size() >= REMOVED_BATCH_SIZE )
+        {
+            publish( batch );
+        }
+    }
+
+    // Left over after a cancel.
+    foreach( const OpenDir &openDir, stack )
+    {
+        closedir( openDir.dir );
+    }
+
+    QMutexLocker locker( &m_lock );
+    m_removed += batch;
+    m_failed = failed;
+    m_skipped = skipped;
+    m_done = true;
+    m_progress.wakeAll();
+}
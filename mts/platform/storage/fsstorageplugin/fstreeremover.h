@@ -0,0 +1,113 @@
+/*
+* This file is part of libmeegomtp package
+*
+* Copyright (C) 2010 Nokia Corporation. All rights reserved.
+*
+* Contact: Deepak Kodihalli <deepak.kodihalli@nokia.com>
+*
+* Redistribution and use in source and binary forms, with or without modification,
+* are permitted provided that the following conditions are met:
+*
+* Redistributions of source code must retain the above copyright notice, this list
+* of conditions and the following disclaimer. Redistributions in binary form must
+* reproduce the above copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of Nokia Corporation nor the names of its contributors may be
+* used to endorse or promote products derived from this software without specific
+* prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+* INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+* BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+* LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+* OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+* OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#ifndef FSTREEREMOVER_H
+#define FSTREEREMOVER_H
+
+#include <QMutex>
+#include <QSet>
+#include <QStringList>
+#include <QWaitCondition>
+
+class QThread;
+
+namespace meegomtp1dot0
+{
+/// FSTreeRemover deletes a directory tree on a worker thread.
+
+/// Each directory is opened relative to its parent's fd and emptied with
+/// unlinkat(), depth first, so a directory is reported only after all of its
+/// contents. Symbolic links inside the tree are removed, not followed.
+/// Removed paths are handed over in batches, which lets the caller keep its
+/// own index in step with the disk while the removal runs, and the removal
+/// can be cancelled between any two entries. Only what the caller has
+/// indexed is removed: excluded paths and entries the index never held are
+/// left alone, and so are the directories containing them.
+class FSTreeRemover
+{
+public:
+    /// Constructor.
+    /// \param rootPath [in] the directory to remove, including itself.
+    /// \param indexedPaths [in] the paths below rootPath that may be removed.
+    /// \param excludePaths [in] paths that must never be removed.
+    FSTreeRemover( const QString &rootPath, const QSet<QString> &indexedPaths,
+                   const QStringList &excludePaths );
+
+    /// Destructor, cancels the removal and waits for the worker.
+    ~FSTreeRemover();
+
+    /// Starts the worker thread.
+    void start();
+
+    /// Asks the worker to stop after the entry it's working on.
+    void cancel();
+
+    /// Moves the paths removed so far to the caller, waiting for some if
+    /// there are none yet.
+    /// \param paths [out] the removed paths are appended here, deepest first.
+    /// \param timeout [in] how long to wait in ms.
+    /// \return true when the removal is over and every path has been taken.
+    bool takeRemoved( QStringList &paths, unsigned long timeout );
+
+    /// \return true if some entry could not be removed; valid once
+    /// takeRemoved() has returned true.
+    bool failed() const;
+
+    /// \return true if some entry was left alone because it was excluded
+    /// or not indexed; valid once takeRemoved() has returned true.
+    bool skipped() const;
+
+private:
+    friend class FSTreeRemoverThread;
+
+    /// Worker thread body.
+    void work();
+
+    /// Hands a batch of removed paths over to takeRemoved().
+    void publish( QStringList &batch );
+
+    bool isCancelled();
+
+    QString m_rootPath;
+    QSet<QString> m_indexedPaths;
+    QStringList m_excludePaths;
+    QThread *m_thread;
+    mutable QMutex m_lock; ///< protects everything below.
+    QWaitCondition m_progress;
+    QStringList m_removed; ///< removed paths waiting for takeRemoved().
+    bool m_done;
+    bool m_cancelled;
+    bool m_failed;
+    bool m_skipped;
+};
+}
+
+#endif
@@ -0,0 +1,198 @@
+/*
+* This file is part of libmeegomtp package
+*
+* Copyright (C) 2010 Nokia Corporation. All rights reserved.
+*
+* Contact: Deepak Kodihalli <deepak.kodihalli@nokia.com>
+*
+* Redistribution and use in source and binary forms, with or without modification,
+* are permitted provided that the following conditions are met:
+*
+* Redistributions of source code must retain the above copyright notice, this list
+* of conditions and the following disclaimer. Redistributions in binary form must
+* reproduce the above copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of Nokia Corporation nor the names of its contributors may be
+* used to endorse or promote products derived from this software without specific
+* prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+* INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+* BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+* LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+* OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+* OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#include "fswritebehind.h"
+#include "trace.h"
+
+#include <QThread>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+using namespace meegomtp1dot0;
+
+namespace meegomtp1dot0
+{
+class FSWriteBehindThread : public QThread
+{
+public:
+    explicit FSWriteBehindThread( FSWriteBehind *writer ) : m_writer(writer) {}
+
+protected:
+    void run() { m_writer->work(); }
+
+private:
+    FSWriteBehind *m_writer;
+};
+}
+
+/**************************************************
+ * FSWriteBehind::FSWriteBehind
+ *************************************************/
+FSWriteBehind::FSWriteBehind( int fd, int queueLength ) :
+    m_fd(fd), m_queueLength(qMax( queueLength, 1 )), m_thread(new FSWriteBehindThread( this )),
+    m_writing(false), m_stop(false), m_error(0), m_offset(0)
+{
+}
+
+/**************************************************
+ * FSWriteBehind::~FSWriteBehind
+ *************************************************/
+FSWriteBehind::~FSWriteBehind()
+{
+    {
+        QMutexLocker locker( &m_lock );
+        m_queue.clear();
+        m_stop = true;
+        m_changed.wakeAll();
+    }
+    m_thread->wait();
+    delete m_thread;
+}
+
+/**************************************************
+ * void FSWriteBehind::start
+ *************************************************/
+void FSWriteBehind::start()
+{
+    m_thread->start();
+}
+
+/**************************************************
+ * int FSWriteBehind::enqueue
+ *************************************************/
+int FSWriteBehind::enqueue( const QByteArray &chunk )
+{
+    QMutexLocker locker( &m_lock );
+    while( !m_error && m_queue.size() >= m_queueLength )
+    {
+        m_changed.wait( &m_lock );
+    }
+    if( !m_error )
+    {
+        m_queue.enqueue( chunk );
+        m_changed.wakeAll();
+    }
+    return m_error;
+}
+
+/**************************************************
+ * int FSWriteBehind::drain
+ *************************************************/
+int FSWriteBehind::drain()
+{
+    QMutexLocker locker( &m_lock );
+    while( !m_error && ( !m_queue.isEmpty() || m_writing ) )
+    {
+        m_changed.wait( &m_lock );
+    }
+    return m_error;
+}
+
+/**************************************************
+ * void FSWriteBehind::discard
+ *************************************************/
+void FSWriteBehind::discard( quint64 offset )
+{
+    QMutexLocker locker( &m_lock );
+    m_queue.clear();
+    while( m_writing )
+    {
+        m_changed.wait( &m_lock );
+    }
+    m_offset = offset;
+    m_error = 0;
+}
+
+/**************************************************
+ * quint64 FSWriteBehind::offset
+ *************************************************/
+quint64 FSWriteBehind::offset() const
+{
+    QMutexLocker locker( &m_lock );
+    return m_offset;
+}
+
+/**************************************************
+ * void FSWriteBehind::work
+ *************************************************/
+void FSWriteBehind::work()
+{
+    QMutexLocker locker( &m_lock );
+    forever
+    {
+        while( !m_stop && ( m_error || m_queue.isEmpty() ) )
+        {
+            m_changed.wait( &m_lock );
+        }
+        if( m_stop )
+        {
+            break;
+        }
+
+        QByteArray chunk = m_queue.dequeue();
+        quint64 offset = m_offset;
+        m_writing = true;
+        locker.unlock();
+
+        int error = 0;
+        const char *data = chunk.constData();
+        qint64 remaining = chunk.size();
+        while( remaining > 0 )
+        {
+            ssize_t written = pwrite( m_fd, data, remaining, offset );
+            if( -1 == written )
+            {
+                if( EINTR == errno )
+                {
+                    continue;
+                }
+                error = errno;
+                MTP_LOG_WARNING("Write behind failed at" << offset << strerror(error));
+                break;
+            }
+            data += written;
+            offset += written;
+            remaining -= written;
+        }
+
+        locker.relock();
+        m_writing = false;
+        m_offset = offset;
+        if( error && !m_error )
+        {
+            m_error = error;
+            // Nothing queued behind a failed write can be written either.
+            m_queue.clear();
+        }
+        m_changed.wakeAll();
+    }
+}
@@ -0,0 +1,109 @@
+/*
+* This file is part of libmeegomtp package
+*
+* Copyright (C) 2010 Nokia Corporation. All rights reserved.
+*
+* Contact: Deepak Kodihalli <deepak.kodihalli@nokia.com>
+*
+* Redistribution and use in source and binary forms, with or without modification,
+* are permitted provided that the following conditions are met:
+*
+* Redistributions of source code must retain the above copyright notice, this list
+* of conditions and the following disclaimer. Redistributions in binary form must
+* reproduce the above copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of Nokia Corporation nor the names of its contributors may be
+* used to endorse or promote products derived from this software without specific
+* prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+* INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+* BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+* LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+* OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+* OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#ifndef FSWRITEBEHIND_H
+#define FSWRITEBEHIND_H
+
+#include <QByteArray>
+#include <QMutex>
+#include <QQueue>
+#include <QWaitCondition>
+
+class QThread;
+
+namespace meegomtp1dot0
+{
+/// FSWriteBehind writes the data of a SendObject on a worker thread.
+
+/// The responder can't hand the USB receive buffer back before writeData()
+/// returns, so a slow card used to stall reception for as long as every
+/// write took. Chunks queued here are written in order with pwrite() while
+/// the main thread goes back to receiving. The queue is bounded: once it's
+/// full, queueing blocks, which stops the main thread from releasing
+/// receive buffers and in turn makes the bulk reader wait for space. The
+/// first failed write is remembered and reported by every later call.
+class FSWriteBehind
+{
+public:
+    /// Default number of chunks waiting to be written.
+    static const int DEFAULT_QUEUE_LENGTH = 4;
+
+    /// Constructor.
+    /// \param fd [in] the file to write to; stays owned by the caller and
+    /// must stay open until the writer is destroyed.
+    /// \param queueLength [in] how many chunks may wait to be written.
+    explicit FSWriteBehind( int fd, int queueLength = DEFAULT_QUEUE_LENGTH );
+
+    /// Destructor, drops whatever hasn't been written and waits for the
+    /// worker.
+    ~FSWriteBehind();
+
+    /// Starts the worker thread.
+    void start();
+
+    /// Queues a chunk to be written after the previous ones, waiting for
+    /// room in the queue if it's full. The data is shared, not copied.
+    /// \param chunk [in] the data.
+    /// \return 0, or the errno of the first write that failed.
+    int enqueue( const QByteArray &chunk );
+
+    /// Waits until every queued chunk has been written.
+    /// \return 0, or the errno of the first write that failed.
+    int drain();
+
+    /// Drops the queued chunks and waits for the write in progress, if any.
+    /// Writing continues at \a offset, and earlier errors are forgotten.
+    /// \param offset [in] the file offset the next chunk goes to.
+    void discard( quint64 offset );
+
+    /// \return the file offset the next chunk will be written at.
+    quint64 offset() const;
+
+private:
+    friend class FSWriteBehindThread;
+
+    /// Worker thread body.
+    void work();
+
+    int m_fd;
+    int m_queueLength;
+    QThread *m_thread;
+    mutable QMutex m_lock; ///< protects everything below.
+    QWaitCondition m_changed; ///< signalled when a chunk is queued or written.
+    QQueue<QByteArray> m_queue;
+    bool m_writing; ///< true while the worker writes a chunk taken from m_queue.
+    bool m_stop;
+    int m_error; ///< errno of the first failed write.
+    quint64 m_offset; ///< where the next chunk goes.
+};
+}
+
+#endif
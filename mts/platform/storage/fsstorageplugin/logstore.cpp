@@ -0,0 +1,339 @@
+/*
+* This file is part of libmeegomtp package
+*
+* Copyright (C) 2010 Nokia Corporation. All rights reserved.
+*
+* Contact: Deepak Kodihalli <deepak.kodihalli@nokia.com>
+*
+* Redistribution and use in source and binary forms, with or without modification,
+* are permitted provided that the following conditions are met:
+*
+* Redistributions of source code must retain the above copyright notice, this list
+* of conditions and the following disclaimer. Redistributions in binary form must
+* reproduce the above copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of Nokia Corporation nor the names of its contributors may be
+* used to endorse or promote products derived from this software without specific
+* prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+* INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+* BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+* LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+* OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+* OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#include "logstore.h"
+#include "trace.h"
+
+#include <QFile>
+#include <QSaveFile>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+using namespace meegomtp1dot0;
+
+// Layout: magic, then records of
+//   payload length (4) : checksum of payload (2) : payload
+// with the payload being
+//   op (1) : key length (4) : key : value
+// Integers are in host byte order; the log never leaves the device.
+static const char LOG_MAGIC[8] = { 'M', 'T', 'P', 'L', 'O', 'G', '0', '1' };
+static const int RECORD_HEADER_SIZE = sizeof(quint32) + sizeof(quint16);
+static const quint8 OP_PUT = 1;
+static const quint8 OP_REMOVE = 2;
+// Buffered records are written once they reach this size.
+static const int LOG_BUFFER_SIZE = 64 * 1024;
+
+/**************************************************
+ * LogStore::LogStore
+ *************************************************/
+LogStore::LogStore( const QString &path ) :
+    m_path(path), m_fd(-1), m_records(0), m_rewrite(0), m_rewriteRecords(0)
+{
+}
+
+/**************************************************
+ * LogStore::~LogStore
+ *************************************************/
+LogStore::~LogStore()
+{
+    flush();
+    delete m_rewrite;
+    if( -1 != m_fd )
+    {
+        close( m_fd );
+    }
+}
+
+/**************************************************
+ * bool LogStore::open
+ *************************************************/
+bool LogStore::open( LogStoreVisitor *visitor )
+{
+    m_records = 0;
+    QFile file( m_path );
+    if( !file.open( QIODevice::ReadWrite ) )
+    {
+        MTP_LOG_WARNING("Cannot open" << m_path);
+        return false;
+    }
+
+    qint64 size = file.size();
+    qint64 end = 0;
+    const uchar *data = size >= (qint64)sizeof(LOG_MAGIC) ? file.map( 0, size ) : 0;
+    if( data && !memcmp( data, LOG_MAGIC, sizeof(LOG_MAGIC) ) )
+    {
+        qint64 pos = sizeof(LOG_MAGIC);
+        end = pos;
+        while( size - pos >= RECORD_HEADER_SIZE )
+        {
+            quint32 length;
+            quint16 checksum;
+            memcpy( &length, data + pos, sizeof(length) );
+            memcpy( &checksum, data + pos + sizeof(length), sizeof(checksum) );
+            const char *payload = reinterpret_cast<const char*>( data + pos + RECORD_HEADER_SIZE );
+            if( length < 1 + sizeof(quint32) || length > size - pos - RECORD_HEADER_SIZE ||
+                qChecksum( payload, length ) != checksum )
+            {
+                break;
+            }
+            quint8 op = payload[0];
+            quint32 keyLength;
+            memcpy( &keyLength, payload + 1, sizeof(keyLength) );
+            if( keyLength > length - 1 - sizeof(quint32) )
+            {
+                break;
+            }
+            const char *key = payload + 1 + sizeof(quint32);
+            if( visitor )
+            {
+                QByteArray k = QByteArray::fromRawData( key, keyLength );
+                if( OP_PUT == op )
+                {
+                    visitor->put( k, QByteArray::fromRawData( key + keyLength, length - 1 - sizeof(quint32) - keyLength ) );
+                }
+                else if( OP_REMOVE == op )
+                {
+                    visitor->remove( k );
+                }
+            }
+            ++m_records;
+            pos += RECORD_HEADER_SIZE + length;
+            end = pos;
+        }
+    }
+    if( data )
+    {
+        file.unmap( const_cast<uchar*>( data ) );
+    }
+
+    if( !end )
+    {
+        // New, or not a log at all: start over.
+        if( size )
+        {
+            MTP_LOG_WARNING("Discarding unreadable log" << m_path);
+        }
+        if( !file.resize( 0 ) || file.write( LOG_MAGIC, sizeof(LOG_MAGIC) ) != sizeof(LOG_MAGIC) )
+        {
+            return false;
+        }
+    }
+    else if( end < size )
+    {
+        // Cut off what a crash left half written.
+        MTP_LOG_WARNING("Truncating log" << m_path << "from" << size << "to" << end << "bytes");
+        if( !file.resize( end ) )
+        {
+            return false;
+        }
+    }
+    file.close();
+
+    return openForAppend();
+}
+
+/**************************************************
+ * bool LogStore::openForAppend
+ *************************************************/
+bool LogStore::openForAppend()
+{
+    if( -1 != m_fd )
+    {
+        close( m_fd );
+    }
+    QByteArray ba = QFile::encodeName( m_path );
+    m_fd = ::open( ba.constData(), O_WRONLY | O_APPEND | O_CLOEXEC );
+    if( -1 == m_fd )
+    {
+        MTP_LOG_WARNING("Cannot open" << m_path << "for appending");
+        return false;
+    }
+    return true;
+}
+
+/**************************************************
+ * QByteArray LogStore::record
+ *************************************************/
+QByteArray LogStore::record( quint8 op, const QByteArray &key, const QByteArray &value )
+{
+    quint32 keyLength = key.size();
+    quint32 length = 1 + sizeof(keyLength) + keyLength + value.size();
+    QByteArray rec( RECORD_HEADER_SIZE + length, Qt::Uninitialized );
+    char *p = rec.data();
+    char *payload = p + RECORD_HEADER_SIZE;
+    payload[0] = op;
+    memcpy( payload + 1, &keyLength, sizeof(keyLength) );
+    memcpy( payload + 1 + sizeof(keyLength), key.constData(), keyLength );
+    memcpy( payload + 1 + sizeof(keyLength) + keyLength, value.constData(), value.size() );
+    quint16 checksum = qChecksum( payload, length );
+    memcpy( p, &length, sizeof(length) );
+    memcpy( p + sizeof(length), &checksum, sizeof(checksum) );
+    return rec;
+}
+
+/**************************************************
+ * bool LogStore::append
+ *************************************************/
+bool LogStore::append( const QByteArray &rec )
+{
+    if( -1 == m_fd )
+    {
+        return false;
+    }
+    m_pending += rec;
+    ++m_records;
+    return m_pending.size() < LOG_BUFFER_SIZE || flush();
+}
+
+/**************************************************
+ * bool LogStore::flush
+ *************************************************/
+bool LogStore::flush()
+{
+    if( -1 == m_fd )
+    {
+        return false;
+    }
+    if( m_pending.isEmpty() )
+    {
+        return true;
+    }
+    // A record cut short by a crash is dropped by the next open().
+    off_t start = lseek( m_fd, 0, SEEK_END );
+    const char *p = m_pending.constData();
+    qint64 left = m_pending.size();
+    while( left > 0 )
+    {
+        ssize_t written = write( m_fd, p, left );
+        if( -1 == written )
+        {
+            if( EINTR == errno )
+            {
+                continue;
+            }
+            MTP_LOG_WARNING("ERROR appending to" << m_path << strerror( errno ));
+            // Records appended after a torn one would never be replayed.
+            // Cut it off and keep the whole batch for the next flush.
+            if( -1 == start || ftruncate( m_fd, start ) )
+            {
+                MTP_LOG_WARNING("Cannot truncate" << m_path << ", closing it");
+                close( m_fd );
+                m_fd = -1;
+            }
+            return false;
+        }
+        p += written;
+        left -= written;
+    }
+    m_pending.clear();
+    return true;
+}
+
+/**************************************************
+ * bool LogStore::put
+ *************************************************/
+bool LogStore::put( const QByteArray &key, const QByteArray &value )
+{
+    return append( record( OP_PUT, key, value ) );
+}
+
+/**************************************************
+ * bool LogStore::remove
+ *************************************************/
+bool LogStore::remove( const QByteArray &key )
+{
+    return append( record( OP_REMOVE, key, QByteArray() ) );
+}
+
+/**************************************************
+ * bool LogStore::sync
+ *************************************************/
+bool LogStore::sync()
+{
+    return flush() && !fdatasync( m_fd );
+}
+
+/**************************************************
+ * bool LogStore::beginRewrite
+ *************************************************/
+bool LogStore::beginRewrite()
+{
+    delete m_rewrite;
+    m_rewrite = new QSaveFile( m_path );
+    m_rewriteRecords = 0;
+    if( !m_rewrite->open( QIODevice::WriteOnly ) ||
+        m_rewrite->write( LOG_MAGIC, sizeof(LOG_MAGIC) ) != sizeof(LOG_MAGIC) )
+    {
+        MTP_LOG_WARNING("Cannot rewrite" << m_path);
+        delete m_rewrite;
+        m_rewrite = 0;
+        return false;
+    }
+    return true;
+}
+
+/**************************************************
+ * void LogStore::rewritePut
+ *************************************************/
+void LogStore::rewritePut( const QByteArray &key, const QByteArray &value )
+{
+    if( m_rewrite )
+    {
+        // QSaveFile remembers a failed write and refuses to commit.
+        m_rewrite->write( record( OP_PUT, key, value ) );
+        ++m_rewriteRecords;
+    }
+}
+
+/**************************************************
+ * bool LogStore::commitRewrite
+ *************************************************/
+bool LogStore::commitRewrite()
+{
+    if( !m_rewrite )
+    {
+        return false;
+    }
+    bool committed = m_rewrite->commit();
+    delete m_rewrite;
+    m_rewrite = 0;
+    if( !committed )
+    {
+        MTP_LOG_WARNING("ERROR rewriting" << m_path);
+        return false;
+    }
+    m_records = m_rewriteRecords;
+    m_pending.clear();
+    // The old log has been replaced, append to the new one.
+    return openForAppend();
+}
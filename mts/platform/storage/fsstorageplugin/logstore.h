@@ -0,0 +1,146 @@
+/*
+* This file is part of libmeegomtp package
+*
+* Copyright (C) 2010 Nokia Corporation. All rights reserved.
+*
+* Contact: Deepak Kodihalli <deepak.kodihalli@nokia.com>
+*
+* Redistribution and use in source and binary forms, with or without modification,
+* are permitted provided that the following conditions are met:
+*
+* Redistributions of source code must retain the above copyright notice, this list
+* of conditions and the following disclaimer. Redistributions in binary form must
+* reproduce the above copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of Nokia Corporation nor the names of its contributors may be
+* used to endorse or promote products derived from this software without specific
+* prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+* INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+* BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+* LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+* OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+* OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#ifndef LOGSTORE_H
+#define LOGSTORE_H
+
+#include <QByteArray>
+#include <QString>
+
+class QSaveFile;
+
+namespace meegomtp1dot0
+{
+/// Receives the records of a LogStore while it is replayed.
+class LogStoreVisitor
+{
+public:
+    virtual ~LogStoreVisitor() {}
+
+    /// A key was set.
+    /// \param key [in] the key; it points into the mapped log, copy it to keep it.
+    /// \param value [in] the value; it points into the mapped log, copy it to keep it.
+    virtual void put( const QByteArray &key, const QByteArray &value ) = 0;
+
+    /// A key was removed.
+    /// \param key [in] the key; it points into the mapped log, copy it to keep it.
+    virtual void remove( const QByteArray &key ) = 0;
+};
+
+/// LogStore is a crash safe, append-only key/value log.
+
+/// Every change is encoded as one checksummed record and buffered; flush()
+/// hands the buffered records to the kernel with a single write(), after
+/// which killing the process loses nothing, and sync() also makes them
+/// durable against power loss. At startup the log is mapped and replayed in
+/// order; a torn record at the end, from a crash in the middle of a write,
+/// is cut off. The owner keeps the live data and
+/// periodically rewrites the log from it (beginRewrite(), rewritePut(),
+/// commitRewrite()), which bounds both the file size and the replay time.
+class LogStore
+{
+public:
+    /// Constructor.
+    /// \param path [in] the log file.
+    explicit LogStore( const QString &path );
+
+    /// Destructor, flushes and closes the log without syncing it.
+    ~LogStore();
+
+    /// Replays the log and opens it for appending; a missing or unreadable
+    /// log is started afresh.
+    /// \param visitor [in] receives the records, oldest first. May be 0.
+    /// \return false if the log can't be written.
+    bool open( LogStoreVisitor *visitor );
+
+    /// Appends a record setting a key.
+    /// \param key [in] the key.
+    /// \param value [in] the value.
+    /// \return false if the record could not be written.
+    bool put( const QByteArray &key, const QByteArray &value );
+
+    /// Appends a record removing a key.
+    /// \param key [in] the key.
+    /// \return false if the record could not be written.
+    bool remove( const QByteArray &key );
+
+    /// Writes the buffered records to the log file. On error the log is cut
+    /// back to where it was and the records stay buffered.
+    /// \return false on error.
+    bool flush();
+
+    /// Writes the buffered records and flushes the log to the storage device.
+    /// \return false on error.
+    bool sync();
+
+    /// Starts rewriting the log from the live data. The current log stays in
+    /// place until commitRewrite() succeeds.
+    /// \return false if the new log can't be created.
+    bool beginRewrite();
+
+    /// Adds a live key to the log being rewritten.
+    /// \param key [in] the key.
+    /// \param value [in] the value.
+    void rewritePut( const QByteArray &key, const QByteArray &value );
+
+    /// Atomically replaces the log with the rewritten one. Records still
+    /// buffered are dropped, the live data passed to rewritePut() is assumed
+    /// to include them.
+    /// \return false if that failed; the old log is kept then.
+    bool commitRewrite();
+
+    /// \return the number of records in the log; compare to the amount of
+    /// live data to decide when to rewrite it.
+    quint32 recordCount() const { return m_records; }
+
+    /// \return the path of the log file.
+    QString path() const { return m_path; }
+
+private:
+    /// Encodes a record.
+    static QByteArray record( quint8 op, const QByteArray &key, const QByteArray &value );
+
+    /// Buffers a record for the log.
+    bool append( const QByteArray &record );
+
+    /// Opens m_path for appending.
+    bool openForAppend();
+
+    QString m_path;
+    int m_fd; ///< append only descriptor of the log, -1 if not open.
+    QByteArray m_pending; ///< records not written to m_fd yet.
+    quint32 m_records; ///< records in the log.
+    QSaveFile *m_rewrite; ///< the log being rewritten, 0 if none.
+    quint32 m_rewriteRecords; ///< records in m_rewrite.
+};
+}
+
+#endif
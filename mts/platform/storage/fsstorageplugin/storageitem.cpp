@@ -31,11 +31,54 @@
 
 #include "storageitem.h"
 
+#include <QVector>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
 using namespace meegomtp1dot0;
 
+namespace
+{
+// Number of storage items carved out of one slab.
+const int SLAB_ITEMS = 1024;
+
+// Free list node overlaid on an unused storage item slot.
+struct FreeSlot
+{
+    FreeSlot *next;
+};
+
+// Storage items are created and destroyed from the main thread only, so the
+// pool doesn't need any locking. Slabs are never returned to the system:
+// freed slots are recycled for the next items instead, which keeps the tree
+// nodes densely packed across rescans.
+FreeSlot *s_freeList = 0;
+QVector<void*> s_slabs;
+
+void addSlab()
+{
+    char *slab = static_cast<char*>( ::malloc( SLAB_ITEMS * sizeof(StorageItem) ) );
+    if( !slab )
+    {
+        throw std::bad_alloc();
+    }
+    s_slabs.append( slab );
+    for( int i = SLAB_ITEMS - 1; i >= 0; --i )
+    {
+        FreeSlot *slot = reinterpret_cast<FreeSlot*>( slab + i * sizeof(StorageItem) );
+        slot->next = s_freeList;
+        s_freeList = slot;
+    }
+}
+}
+
 // Constructor.
-StorageItem::StorageItem() : m_handle(0), m_path(""), m_wd(-1), m_objectInfo(0),
-                             m_parent(0), m_firstChild(0), m_nextSibling(0), m_puoid(MtpInt128(0))
+StorageItem::StorageItem() : m_parent(0), m_firstChild(0), m_nextSibling(0), m_objectInfo(0),
+                             m_size(0), m_treeSize(0), m_created(0), m_modified(0),
+                             m_dirMtime(0), m_dirCtime(0), m_puoid(MtpInt128(0)),
+                             m_handle(0), m_childCount(0), m_wd(-1), m_format(MTP_OBF_FORMAT_Undefined),
+                             m_listed(true)
 {
 }
 
@@ -48,3 +91,67 @@ StorageItem::~StorageItem()
         m_objectInfo = 0;
     }
 }
+
+void *StorageItem::operator new( size_t size )
+{
+    if( size != sizeof(StorageItem) )
+    {
+        return ::operator new( size );
+    }
+    if( !s_freeList )
+    {
+        addSlab();
+    }
+    FreeSlot *slot = s_freeList;
+    s_freeList = slot->next;
+    return slot;
+}
+
+void StorageItem::operator delete( void *p, size_t size )
+{
+    if( !p )
+    {
+        return;
+    }
+    if( size != sizeof(StorageItem) )
+    {
+        ::operator delete( p );
+        return;
+    }
+    FreeSlot *slot = static_cast<FreeSlot*>( p );
+    slot->next = s_freeList;
+    s_freeList = slot;
+}
+
+quint64 StorageItem::poolBytes()
+{
+    return static_cast<quint64>( s_slabs.size() ) * SLAB_ITEMS * sizeof(StorageItem);
+}
+
+QString StorageItem::path() const
+{
+    // Size the result first so that it is allocated only once.
+    int size = m_name.size();
+    for( const StorageItem *item = m_parent; item; item = item->m_parent )
+    {
+        size += item->m_name.size() + 1;
+    }
+    QString path( size, Qt::Uninitialized );
+    QChar *out = path.data() + size;
+    for( const StorageItem *item = this; item; item = item->m_parent )
+    {
+        out -= item->m_name.size();
+        memcpy( out, item->m_name.constData(), item->m_name.size() * sizeof(QChar) );
+        if( item->m_parent )
+        {
+            *--out = QLatin1Char('/');
+        }
+    }
+    return path;
+}
+
+QString StorageItem::name() const
+{
+    // The root is named by the whole storage path.
+    return m_parent ? m_name : m_name.mid( m_name.lastIndexOf( '/' ) + 1 );
+}
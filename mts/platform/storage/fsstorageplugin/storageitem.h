@@ -34,6 +34,7 @@
 
 #include "mtptypes.h"
 #include <QString>
+#include <QHash>
 
 namespace meegomtp1dot0
 {
@@ -51,16 +52,65 @@ public:
     /// Constructor
     ~StorageItem();
 
+    /// Storage items are allocated from a pool of fixed size slabs instead of
+    /// the general purpose heap; storages with 100k+ objects would otherwise
+    /// pay the malloc header and fragmentation cost on every node.
+    static void *operator new( size_t size );
+
+    /// Returns a storage item to the slab pool.
+    static void operator delete( void *p, size_t size );
+
+    /// Returns the number of bytes currently reserved by the slab pool.
+    static quint64 poolBytes();
+
+    /// Builds the absolute path of this item from its name and the names of
+    /// its ancestors.
+    /// \return the path by which this item is identified in the storage.
+    QString path() const;
+
+    /// \return the file name of this item, the last component of path().
+    QString name() const;
+
 private:
-    ObjHandle m_handle; ///< the item's handle
-    QString m_path; ///< the pathname by which this item is identified in the storage.
-    int m_wd; ///< The item's iNotify watch descriptor. This will be -1 for non-directories
-    MTPObjectInfo *m_objectInfo; ///< the objectinfo dataset for this item.
+    // Keep the fields touched while walking the tree next to each other; the
+    // full MTPObjectInfo dataset is only built on demand, see m_objectInfo.
     StorageItem *m_parent; ///< this item's parent.
     StorageItem *m_firstChild; ///< this item's first child.
     StorageItem *m_nextSibling; ///< this item's first sibling.
+    MTPObjectInfo *m_objectInfo; ///< the objectinfo dataset for this item, 0 until requested.
+    QString m_name; ///< the item's name in its parent directory; the storage path for the root.
+    quint64 m_size; ///< the size of the item in bytes, 0 for directories.
+    quint64 m_treeSize; ///< m_size plus the sizes of all linked descendants.
+    qint64 m_created; ///< creation (status change) time, seconds since the epoch.
+    qint64 m_modified; ///< modification time, seconds since the epoch.
+    qint64 m_dirMtime; ///< mtime (ns) of a directory when its contents were last listed.
+    qint64 m_dirCtime; ///< ctime (ns) of a directory when its contents were last listed.
     MtpInt128 m_puoid;
+    ObjHandle m_handle; ///< the item's handle
+    quint32 m_childCount; ///< the number of direct children linked to this item.
+    int m_wd; ///< The item's iNotify watch descriptor. This will be -1 for non-directories
+    MTPObjFormatCode m_format; ///< the item's MTP object format.
+    bool m_listed; ///< false while the contents of a directory haven't been listed (lazy enumeration).
 };
+
+/// Key of the storage's child index: an item's name within its parent.
+struct StorageItemKey
+{
+    StorageItemKey( const StorageItem *parent, const QString &name ) : parent(parent), name(name) {}
+
+    const StorageItem *parent;
+    QString name;
+};
+
+inline bool operator==( const StorageItemKey &a, const StorageItemKey &b )
+{
+    return a.parent == b.parent && a.name == b.name;
+}
+
+inline uint qHash( const StorageItemKey &key, uint seed = 0 )
+{
+    return qHash( key.name, seed ) ^ qHash( key.parent, seed );
+}
 }
 
 #endif
@@ -30,8 +30,17 @@
 */
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include "fsstorageplugin_test.h"
 #include "fsstorageplugin.h"
+#include "fsdirwalker.h"
+#include "fsfdcache.h"
+#include "fsinotify.h"
+#include "fswritebehind.h"
+#include "logstore.h"
 #include "storageitem.h"
 #include "storagetracker.h"
 #include <QSparqlConnection>
@@ -41,6 +50,9 @@
 #include <QPainter>
 #include <QRadialGradient>
 #include <QSignalSpy>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QThread>
 
 
 using namespace meegomtp1dot0;
@@ -65,12 +77,12 @@ void FSStoragePlugin_test::initTestCase()
         setupPlugin(m_storage);
         QVERIFY( m_storage->m_root != 0 );
         QCOMPARE( m_storage->m_root->m_handle, static_cast<unsigned int>(0) );
-        QCOMPARE( m_storage->m_objectHandlesMap.size(), m_storage->m_pathNamesMap.size() );
+        QCOMPARE( m_storage->m_objectHandlesMap.size(), m_storage->m_childIndex.size() + 1 );
         QCOMPARE( m_storage->m_objectHandlesMap.size(), 12 );
 
         QVector<ObjHandle> references;
         MTPResponseCode response;
-        quint32 handle = m_storage->m_pathNamesMap["/tmp/mtptests/subdir2/fileA"];
+        quint32 handle = m_storage->handleForPath("/tmp/mtptests/subdir2/fileA");
         response = m_storage->getReferences( handle, references );
         QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
         QCOMPARE( references.size(), 2 );
@@ -249,7 +261,7 @@ void FSStoragePlugin_test::testStorageCreation()
     QVERIFY( m_storage->m_root->m_parent == 0 );
     QVERIFY( m_storage->m_root->m_firstChild != 0 );
     QVERIFY( m_storage->m_root->m_nextSibling == 0 );
-    QCOMPARE( m_storage->m_root->m_path, QString("/tmp/mtptests") );
+    QCOMPARE( m_storage->m_root->path(), QString("/tmp/mtptests") );
 
     // Check whether child items are correctly linked to their parents.
     StorageItem *parentItem =
@@ -257,6 +269,8 @@ void FSStoragePlugin_test::testStorageCreation()
     StorageItem *childItem =
             m_storage->findStorageItemByPath("/tmp/mtptests/subdir1/file1");
     QVERIFY( parentItem && childItem );
+    QCOMPARE( childItem->m_parent, parentItem );
+    m_storage->populateObjectInfo( childItem );
     QCOMPARE( childItem->m_objectInfo->mtpParentObject, parentItem->m_handle );
 }
 
@@ -270,7 +284,7 @@ void FSStoragePlugin_test::testDeleteAll()
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_PartialDeletion );
 
     QCOMPARE( m_storage->m_objectHandlesMap.size(), 1 );
-    QCOMPARE( m_storage->m_objectHandlesMap.size(), m_storage->m_pathNamesMap.size() );
+    QCOMPARE( m_storage->m_objectHandlesMap.size(), m_storage->m_childIndex.size() + 1 );
 
     delete m_storage;
     system("rm -rf ~/.local/mtp");
@@ -284,7 +298,7 @@ void FSStoragePlugin_test::testDeleteAll()
 }
 void FSStoragePlugin_test::testObjectHandlesCountAfterCreation()
 {
-    QCOMPARE( m_storage->m_objectHandlesMap.size(), m_storage->m_pathNamesMap.size() );
+    QCOMPARE( m_storage->m_objectHandlesMap.size(), m_storage->m_childIndex.size() + 1 );
     //QCOMPARE( m_storage->m_objectHandlesMap.size(), totalCount );
     totalCount = m_storage->m_objectHandlesMap.size();
     quint32 noOfObjects;
@@ -300,17 +314,17 @@ void FSStoragePlugin_test::testObjectHandlesCountAfterCreation()
     QCOMPARE( objectHandles.size(), static_cast<qint32>(7) );
 
     objectHandles.clear();
-    response = m_storage->getObjectHandles( 0x0000, m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir1")], objectHandles );
+    response = m_storage->getObjectHandles( 0x0000, m_storage->handleForPath(QString("/tmp/mtptests/subdir1")), objectHandles );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectHandles.size(), static_cast<qint32>(4) );
 
     objectHandles.clear();
-    response = m_storage->getObjectHandles( 0x0000, m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir2")], objectHandles );
+    response = m_storage->getObjectHandles( 0x0000, m_storage->handleForPath(QString("/tmp/mtptests/subdir2")), objectHandles );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectHandles.size(), static_cast<qint32>(3) );
 
     objectHandles.clear();
-    response = m_storage->getObjectHandles( 0x0000, m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir1/subdir3")], objectHandles );
+    response = m_storage->getObjectHandles( 0x0000, m_storage->handleForPath(QString("/tmp/mtptests/subdir1/subdir3")), objectHandles );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectHandles.size(), static_cast<qint32>(3) );
 }
@@ -328,12 +342,12 @@ void FSStoragePlugin_test::testObjectHandlesAfterCreation()
     QCOMPARE( objectHandles.contains(totalCount - 1), static_cast<bool>(true) );
 
     objectHandles.clear();
-    response = m_storage->getObjectHandles( 0x0000, m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir1/subdir3")], objectHandles );
+    response = m_storage->getObjectHandles( 0x0000, m_storage->handleForPath(QString("/tmp/mtptests/subdir1/subdir3")), objectHandles );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectHandles.size(), 3 );
 
     objectHandles.clear();
-    response = m_storage->getObjectHandles( 0x0000, m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir1")], objectHandles );
+    response = m_storage->getObjectHandles( 0x0000, m_storage->handleForPath(QString("/tmp/mtptests/subdir1")), objectHandles );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectHandles.size(), 4 );
 
@@ -353,7 +367,7 @@ void FSStoragePlugin_test::testInvalidGetObjectHandle()
 
     //test getObjectHandles with association param that's a valid handle but not an association.
     objectHandles.clear();
-    response = m_storage->getObjectHandles( 0x0000, m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir1/file1")],
+    response = m_storage->getObjectHandles( 0x0000, m_storage->handleForPath(QString("/tmp/mtptests/subdir1/file1")),
                                           objectHandles );
     QCOMPARE( response,(MTPResponseCode) MTP_RESP_InvalidParentObject);
     QCOMPARE( objectHandles.size(), static_cast<qint32>(0) );
@@ -371,34 +385,34 @@ void FSStoragePlugin_test::testObjectInfoAfterCreation()
 {
     const MTPObjectInfo *objectInfo = 0;
 
-    MTPResponseCode response = m_storage->getObjectInfo( m_storage->m_pathNamesMap[QString("/tmp/mtptests")], objectInfo );
+    MTPResponseCode response = m_storage->getObjectInfo( m_storage->handleForPath(QString("/tmp/mtptests")), objectInfo );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectInfo->mtpFileName, QString("mtptests") );
 
-    response = m_storage->getObjectInfo( m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir1")], objectInfo );
+    response = m_storage->getObjectInfo( m_storage->handleForPath(QString("/tmp/mtptests/subdir1")), objectInfo );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectInfo->mtpFileName, QString("subdir1") );
 
-    response = m_storage->getObjectInfo( m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir2")], objectInfo );
+    response = m_storage->getObjectInfo( m_storage->handleForPath(QString("/tmp/mtptests/subdir2")), objectInfo );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectInfo->mtpFileName, QString("subdir2") );
 
-    response = m_storage->getObjectInfo( m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir1/file1")], objectInfo );
+    response = m_storage->getObjectInfo( m_storage->handleForPath(QString("/tmp/mtptests/subdir1/file1")), objectInfo );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectInfo->mtpFileName, QString("file1") );
     QCOMPARE( objectInfo->mtpObjectCompressedSize, static_cast<quint64>(1));
 
-    response = m_storage->getObjectInfo( m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir2/fileB")], objectInfo );
+    response = m_storage->getObjectInfo( m_storage->handleForPath(QString("/tmp/mtptests/subdir2/fileB")), objectInfo );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectInfo->mtpFileName, QString("fileB") );
     QCOMPARE( objectInfo->mtpObjectCompressedSize,static_cast<quint64>(6));
 
-    response = m_storage->getObjectInfo( m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir1/subdir3")], objectInfo );
+    response = m_storage->getObjectInfo( m_storage->handleForPath(QString("/tmp/mtptests/subdir1/subdir3")), objectInfo );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectInfo->mtpFileName, QString("subdir3") );
     QCOMPARE( objectInfo->mtpObjectCompressedSize,static_cast<quint64>(0));
 
-    response = m_storage->getObjectInfo( m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir1/subdir3/file3")], objectInfo );
+    response = m_storage->getObjectInfo( m_storage->handleForPath(QString("/tmp/mtptests/subdir1/subdir3/file3")), objectInfo );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectInfo->mtpFileName, QString("file3") );
     QCOMPARE( objectInfo->mtpObjectCompressedSize,static_cast<quint64>(100));
@@ -413,16 +427,16 @@ void FSStoragePlugin_test::testFindByPath()
 
     storageItem = static_cast<StorageItem*>( m_storage->findStorageItemByPath( "/tmp/mtptests" ) );
     QCOMPARE( storageItem != 0, true );
-    QCOMPARE( storageItem->m_path, QString("/tmp/mtptests") );
+    QCOMPARE( storageItem->path(), QString("/tmp/mtptests") );
     QCOMPARE( storageItem->m_handle, static_cast<quint32>(0) );
 
     storageItem = static_cast<StorageItem*>( m_storage->findStorageItemByPath( "/tmp/mtptests/subdir1/subdir3" ) );
     QCOMPARE( storageItem != 0, true );
-    QCOMPARE( storageItem->m_path, QString("/tmp/mtptests/subdir1/subdir3") );
+    QCOMPARE( storageItem->path(), QString("/tmp/mtptests/subdir1/subdir3") );
 
     storageItem = static_cast<StorageItem*>( m_storage->findStorageItemByPath( "/tmp/mtptests/subdir2/fileC" ) );
     QCOMPARE( storageItem != 0, true );
-    QCOMPARE( storageItem->m_path, QString("/tmp/mtptests/subdir2/fileC") );
+    QCOMPARE( storageItem->path(), QString("/tmp/mtptests/subdir2/fileC") );
 
     storageItem = static_cast<StorageItem*>( m_storage->findStorageItemByPath( "/tmp/NOmtptests/subdir2/fileC" ) );
     QCOMPARE( storageItem == 0, true );
@@ -456,11 +470,11 @@ void FSStoragePlugin_test::testWriteData()
 {
     MTPResponseCode response;
 
-    response = m_storage->writeData( m_storage->m_pathNamesMap["/tmp/mtptests/file2"], "bbb", 3, true, false );
+    response = m_storage->writeData( m_storage->handleForPath("/tmp/mtptests/file2"), "bbb", 3, true, false );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
 
-    response = m_storage->writeData( m_storage->m_pathNamesMap["/tmp/mtptests/file2"], "bbb", 3, false, true );
-    m_storage->writeData(m_storage->m_pathNamesMap["/tmp/mtptests/file2"], 0, 0, false, true);
+    response = m_storage->writeData( m_storage->handleForPath("/tmp/mtptests/file2"), "bbb", 3, false, true );
+    m_storage->writeData(m_storage->handleForPath("/tmp/mtptests/file2"), 0, 0, false, true);
     QFile file("/tmp/mtptests/file2");
     file.open( QIODevice::ReadOnly);
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
@@ -485,7 +499,7 @@ void FSStoragePlugin_test::testReadData()
     MTPResponseCode response;
 
     readBuf = (char*)malloc(readBufLen);
-    response = m_storage->readData( m_storage->m_pathNamesMap["/tmp/mtptests/subdir1/subdir3/file1"], readBuf, readBufLen, 0 );
+    response = m_storage->readData( m_storage->handleForPath("/tmp/mtptests/subdir1/subdir3/file1"), readBuf, readBufLen, 0 );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( readBuf != 0, static_cast<bool>(true) );
     QCOMPARE( readBufLen, 1 );
@@ -495,7 +509,7 @@ void FSStoragePlugin_test::testReadData()
 
     readBufLen = 100;
     readBuf = (char*)malloc(readBufLen);
-    response = m_storage->readData( m_storage->m_pathNamesMap["/tmp/mtptests/subdir1/subdir3/file3"], readBuf, readBufLen, 0 );
+    response = m_storage->readData( m_storage->handleForPath("/tmp/mtptests/subdir1/subdir3/file3"), readBuf, readBufLen, 0 );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( readBuf != 0, static_cast<bool>(true) );
     QCOMPARE( readBufLen, 100 );
@@ -534,7 +548,7 @@ void FSStoragePlugin_test::testAddFile()
     QCOMPARE( parentHandle, static_cast<quint32>(0) );
     QCOMPARE( objectInfo.mtpParentObject, static_cast<quint32>(0) );
     QCOMPARE( objectInfo.mtpFileName, QString("addfile" ) );
-    QCOMPARE( m_storage->m_pathNamesMap["/tmp/mtptests/addfile"], static_cast<quint32>(handle) );
+    QCOMPARE( m_storage->handleForPath("/tmp/mtptests/addfile"), static_cast<quint32>(handle) );
     QCOMPARE( m_storage->m_objectHandlesMap[handle] != 0, true );
     QCOMPARE( m_storage->m_objectHandlesMap[handle]->m_parent->m_handle, static_cast<quint32>(0) );
     response = m_storage->writeData( handle, "xxx", 3, true, true );
@@ -561,7 +575,7 @@ void FSStoragePlugin_test::testAddFile()
     QCOMPARE( parentHandle, static_cast<quint32>(0) );
     QCOMPARE( objectInfo.mtpParentObject, static_cast<quint32>(0) );
     QCOMPARE( objectInfo.mtpFileName, QString("addfile2" ) );
-    QCOMPARE( m_storage->m_pathNamesMap["/tmp/mtptests/addfile2"], static_cast<quint32>(handle) );
+    QCOMPARE( m_storage->handleForPath("/tmp/mtptests/addfile2"), static_cast<quint32>(handle) );
     QCOMPARE( m_storage->m_objectHandlesMap[handle] != 0, true );
     QCOMPARE( m_storage->m_objectHandlesMap[handle]->m_parent->m_handle, static_cast<quint32>(0) );
     response = m_storage->writeData( handle, "xxx", 3, true, true );
@@ -580,17 +594,17 @@ void FSStoragePlugin_test::testAddFile()
 
     {
     // Add a file to subdir1
-    objectInfo.mtpParentObject = m_storage->m_pathNamesMap["/tmp/mtptests/subdir1"];
+    objectInfo.mtpParentObject = m_storage->handleForPath("/tmp/mtptests/subdir1");
     objectInfo.mtpFileName = "addfile";
     objectInfo.mtpObjectCompressedSize = 3;
     response = m_storage->addItem( parentHandle, handle, &objectInfo );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( handle, static_cast<quint32>(++totalCount) );
-    QCOMPARE( parentHandle, static_cast<quint32>(m_storage->m_pathNamesMap["/tmp/mtptests/subdir1"]) );
+    QCOMPARE( parentHandle, static_cast<quint32>(m_storage->handleForPath("/tmp/mtptests/subdir1")) );
     QCOMPARE( objectInfo.mtpFileName, QString("addfile" ) );
-    QCOMPARE( m_storage->m_pathNamesMap["/tmp/mtptests/subdir1/addfile"], static_cast<quint32>(handle) );
+    QCOMPARE( m_storage->handleForPath("/tmp/mtptests/subdir1/addfile"), static_cast<quint32>(handle) );
     QCOMPARE( m_storage->m_objectHandlesMap[handle] != 0, true );
-    QCOMPARE( m_storage->m_objectHandlesMap[handle]->m_parent->m_handle,  m_storage->m_pathNamesMap["/tmp/mtptests/subdir1"]);
+    QCOMPARE( m_storage->m_objectHandlesMap[handle]->m_parent->m_handle,  m_storage->handleForPath("/tmp/mtptests/subdir1"));
     response = m_storage->writeData( handle, "xxx", 3, true, true );
     m_storage->writeData(handle, 0, 0, false, true);
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
@@ -607,15 +621,15 @@ void FSStoragePlugin_test::testAddFile()
 
     {
     // Add a file to subdir3
-    objectInfo.mtpParentObject = m_storage->m_pathNamesMap["/tmp/mtptests/subdir1/subdir3"];
+    objectInfo.mtpParentObject = m_storage->handleForPath("/tmp/mtptests/subdir1/subdir3");
     response = m_storage->addItem( parentHandle, handle, &objectInfo );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( handle, static_cast<quint32>(++totalCount) );
-    QCOMPARE( parentHandle, static_cast<quint32>(m_storage->m_pathNamesMap["/tmp/mtptests/subdir1/subdir3"]) );
+    QCOMPARE( parentHandle, static_cast<quint32>(m_storage->handleForPath("/tmp/mtptests/subdir1/subdir3")) );
     QCOMPARE( objectInfo.mtpFileName, QString("addfile" ) );
-    QCOMPARE( m_storage->m_pathNamesMap["/tmp/mtptests/subdir1/subdir3/addfile"], static_cast<quint32>(handle) );
+    QCOMPARE( m_storage->handleForPath("/tmp/mtptests/subdir1/subdir3/addfile"), static_cast<quint32>(handle) );
     QCOMPARE( m_storage->m_objectHandlesMap[handle] != 0, true );
-    QCOMPARE( m_storage->m_objectHandlesMap[handle]->m_parent->m_handle, m_storage->m_pathNamesMap["/tmp/mtptests/subdir1/subdir3"] );
+    QCOMPARE( m_storage->m_objectHandlesMap[handle]->m_parent->m_handle, m_storage->handleForPath("/tmp/mtptests/subdir1/subdir3") );
     response = m_storage->writeData( handle, "xxx", 3, true, true );
     m_storage->writeData(handle, 0, 0, false, true);
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
@@ -642,18 +656,18 @@ void FSStoragePlugin_test::testAddDir()
     //memset(&objectInfo, 0 , sizeof(MTPObjectInfo));
 
     //add a nested dir to subdir2 : D1, D1->D2, D1->D2->f
-    objectInfo.mtpParentObject = m_storage->m_pathNamesMap["/tmp/mtptests/subdir2"];
+    objectInfo.mtpParentObject = m_storage->handleForPath("/tmp/mtptests/subdir2");
     objectInfo.mtpFileName = "D1";
     objectInfo.mtpObjectCompressedSize = 0;
     objectInfo.mtpObjectFormat = MTP_OBF_FORMAT_Association;
     response = m_storage->addItem( parentHandle, handle, &objectInfo );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( handle, static_cast<quint32>(++totalCount) );
-    QCOMPARE( parentHandle, static_cast<quint32>(m_storage->m_pathNamesMap["/tmp/mtptests/subdir2"]) );
+    QCOMPARE( parentHandle, static_cast<quint32>(m_storage->handleForPath("/tmp/mtptests/subdir2")) );
     QCOMPARE( objectInfo.mtpFileName, QString("D1" ) );
-    QCOMPARE( m_storage->m_pathNamesMap["/tmp/mtptests/subdir2/D1"], static_cast<quint32>(handle) );
+    QCOMPARE( m_storage->handleForPath("/tmp/mtptests/subdir2/D1"), static_cast<quint32>(handle) );
     QCOMPARE( m_storage->m_objectHandlesMap[handle] != 0, true );
-    QCOMPARE( m_storage->m_objectHandlesMap[handle]->m_parent->m_handle, static_cast<quint32>(m_storage->m_pathNamesMap["/tmp/mtptests/subdir2"]) );
+    QCOMPARE( m_storage->m_objectHandlesMap[handle]->m_parent->m_handle, static_cast<quint32>(m_storage->handleForPath("/tmp/mtptests/subdir2")) );
 
     objectInfo.mtpParentObject = handle;
     objectInfo.mtpFileName = "D2";
@@ -662,7 +676,7 @@ void FSStoragePlugin_test::testAddDir()
     QCOMPARE( handle, static_cast<quint32>(++totalCount) );
     QCOMPARE( objectInfo.mtpParentObject, static_cast<quint32>(parentHandle) );
     QCOMPARE( objectInfo.mtpFileName, QString("D2" ) );
-    QCOMPARE( m_storage->m_pathNamesMap["/tmp/mtptests/subdir2/D1/D2"], static_cast<quint32>(handle) );
+    QCOMPARE( m_storage->handleForPath("/tmp/mtptests/subdir2/D1/D2"), static_cast<quint32>(handle) );
     QCOMPARE( m_storage->m_objectHandlesMap[handle] != 0, true );
     QCOMPARE( m_storage->m_objectHandlesMap[handle]->m_parent->m_handle, static_cast<quint32>(parentHandle) );
     QCOMPARE( m_storage->m_objectHandlesMap[parentHandle]->m_firstChild->m_handle, static_cast<quint32>(handle) );
@@ -675,7 +689,7 @@ void FSStoragePlugin_test::testAddDir()
     QCOMPARE( handle, static_cast<quint32>(++totalCount) );
     QCOMPARE( objectInfo.mtpParentObject, static_cast<quint32>(parentHandle) );
     QCOMPARE( objectInfo.mtpFileName, QString("f1" ) );
-    QCOMPARE( m_storage->m_pathNamesMap["/tmp/mtptests/subdir2/D1/D2/f1"], static_cast<quint32>(handle) );
+    QCOMPARE( m_storage->handleForPath("/tmp/mtptests/subdir2/D1/D2/f1"), static_cast<quint32>(handle) );
     QCOMPARE( m_storage->m_objectHandlesMap[handle] != 0, true );
     QCOMPARE( m_storage->m_objectHandlesMap[handle]->m_parent->m_handle, static_cast<quint32>(parentHandle) );
     QCOMPARE( m_storage->m_objectHandlesMap[parentHandle]->m_firstChild->m_handle, static_cast<quint32>(handle) );
@@ -695,7 +709,7 @@ void FSStoragePlugin_test::testAddDir()
 
 void FSStoragePlugin_test::testObjectHandlesCountAfterAddition()
 {
-    QCOMPARE( m_storage->m_objectHandlesMap.size(), m_storage->m_pathNamesMap.size() );
+    QCOMPARE( m_storage->m_objectHandlesMap.size(), m_storage->m_childIndex.size() + 1 );
     QCOMPARE( m_storage->m_objectHandlesMap.size(), totalCount + 1 );
     quint32 noOfObjects;
     QVector<ObjHandle> objectHandles;
@@ -710,17 +724,17 @@ void FSStoragePlugin_test::testObjectHandlesCountAfterAddition()
     QCOMPARE( objectHandles.size(), static_cast<qint32>(9) );
 
     objectHandles.clear();
-    response = m_storage->getObjectHandles( 0x0000, m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir1")], objectHandles );
+    response = m_storage->getObjectHandles( 0x0000, m_storage->handleForPath(QString("/tmp/mtptests/subdir1")), objectHandles );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectHandles.size(), static_cast<qint32>(5) );
 
     objectHandles.clear();
-    response = m_storage->getObjectHandles( 0x0000, m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir2")], objectHandles );
+    response = m_storage->getObjectHandles( 0x0000, m_storage->handleForPath(QString("/tmp/mtptests/subdir2")), objectHandles );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectHandles.size(), static_cast<qint32>(4) );
 
     objectHandles.clear();
-    response = m_storage->getObjectHandles( 0x0000, m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir1/subdir3")], objectHandles );
+    response = m_storage->getObjectHandles( 0x0000, m_storage->handleForPath(QString("/tmp/mtptests/subdir1/subdir3")), objectHandles );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectHandles.size(), static_cast<qint32>(4) );
 
@@ -743,12 +757,12 @@ void FSStoragePlugin_test::testObjectHandlesAfterAddition()
     QCOMPARE( objectHandles.contains(totalCount), static_cast<bool>(true) );
 
     objectHandles.clear();
-    response = m_storage->getObjectHandles( 0x0000, m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir1/subdir3")], objectHandles );
+    response = m_storage->getObjectHandles( 0x0000, m_storage->handleForPath(QString("/tmp/mtptests/subdir1/subdir3")), objectHandles );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectHandles.size(), 4 );
 
     objectHandles.clear();
-    response = m_storage->getObjectHandles( 0x0000, m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir1")], objectHandles );
+    response = m_storage->getObjectHandles( 0x0000, m_storage->handleForPath(QString("/tmp/mtptests/subdir1")), objectHandles );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectHandles.size(), 5 );
 
@@ -762,19 +776,19 @@ void FSStoragePlugin_test::testObjectInfoAfterAddition()
 {
     const MTPObjectInfo *objectInfo;
 
-    MTPResponseCode response = m_storage->getObjectInfo( m_storage->m_pathNamesMap[QString("/tmp/mtptests")], objectInfo );
+    MTPResponseCode response = m_storage->getObjectInfo( m_storage->handleForPath(QString("/tmp/mtptests")), objectInfo );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectInfo->mtpFileName, QString("mtptests") );
 
-    response = m_storage->getObjectInfo( m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir1")], objectInfo );
+    response = m_storage->getObjectInfo( m_storage->handleForPath(QString("/tmp/mtptests/subdir1")), objectInfo );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectInfo->mtpFileName, QString("subdir1") );
 
-    response = m_storage->getObjectInfo( m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir1/addfile")], objectInfo );
+    response = m_storage->getObjectInfo( m_storage->handleForPath(QString("/tmp/mtptests/subdir1/addfile")), objectInfo );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectInfo->mtpFileName, QString("addfile") );
 
-    response = m_storage->getObjectInfo( m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir2/D1/D2/f1")], objectInfo );
+    response = m_storage->getObjectInfo( m_storage->handleForPath(QString("/tmp/mtptests/subdir2/D1/D2/f1")), objectInfo );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectInfo->mtpFileName, QString("f1") );
 
@@ -782,7 +796,7 @@ void FSStoragePlugin_test::testObjectInfoAfterAddition()
 
     storageItem = static_cast<StorageItem*>( m_storage->findStorageItemByPath( "/tmp/mtptests/subdir2/D1/D2/f1" ) );
     QCOMPARE( storageItem != 0, true );
-    QCOMPARE( storageItem->m_path, QString("/tmp/mtptests/subdir2/D1/D2/f1") );
+    QCOMPARE( storageItem->path(), QString("/tmp/mtptests/subdir2/D1/D2/f1") );
 
     response = m_storage->getObjectInfo( 100, objectInfo );
     QCOMPARE( response,(MTPResponseCode) MTP_RESP_InvalidObjectHandle);
@@ -908,7 +922,7 @@ void FSStoragePlugin_test::testSetReferences()
     response = m_storage->setReferences( 100, references );
     QCOMPARE( response,(MTPResponseCode) MTP_RESP_InvalidObjectHandle);
 
-    response = m_storage->setReferences( m_storage->m_pathNamesMap["/tmp/mtptests/subdir2/fileA"], references );
+    response = m_storage->setReferences( m_storage->handleForPath("/tmp/mtptests/subdir2/fileA"), references );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
 }
 
@@ -920,7 +934,7 @@ void FSStoragePlugin_test::testGetReferences()
     response = m_storage->getReferences( 100, references );
     QCOMPARE( response,(MTPResponseCode) MTP_RESP_InvalidObjectHandle);
 
-    response = m_storage->getReferences( m_storage->m_pathNamesMap["/tmp/mtptests/subdir2/fileA"], references );
+    response = m_storage->getReferences( m_storage->handleForPath("/tmp/mtptests/subdir2/fileA"), references );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( references.size(), 3 );
     QCOMPARE( references[0], static_cast<unsigned int>(1) );
@@ -932,13 +946,13 @@ void FSStoragePlugin_test::testDeleteFile()
 {
     MTPResponseCode response;
 
-    response = m_storage->deleteItem( m_storage->m_pathNamesMap["/tmp/mtptests/subdir1/file1"],  MTP_OBF_FORMAT_Undefined );
+    response = m_storage->deleteItem( m_storage->handleForPath("/tmp/mtptests/subdir1/file1"),  MTP_OBF_FORMAT_Undefined );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
 
-    response = m_storage->deleteItem( m_storage->m_pathNamesMap["/tmp/mtptests/subdir1/file2"],  MTP_OBF_FORMAT_Undefined );
+    response = m_storage->deleteItem( m_storage->handleForPath("/tmp/mtptests/subdir1/file2"),  MTP_OBF_FORMAT_Undefined );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
 
-    response = m_storage->deleteItem( m_storage->m_pathNamesMap["/tmp/mtptests/subdir1/file3"],  MTP_OBF_FORMAT_Undefined );
+    response = m_storage->deleteItem( m_storage->handleForPath("/tmp/mtptests/subdir1/file3"),  MTP_OBF_FORMAT_Undefined );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
 
 }
@@ -947,10 +961,10 @@ void FSStoragePlugin_test::testDeleteDir()
 {
     MTPResponseCode response;
 
-    response = m_storage->deleteItem( m_storage->m_pathNamesMap["/tmp/mtptests/subdir1/subdir3"],  MTP_OBF_FORMAT_Undefined );
+    response = m_storage->deleteItem( m_storage->handleForPath("/tmp/mtptests/subdir1/subdir3"),  MTP_OBF_FORMAT_Undefined );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
 
-    response = m_storage->deleteItem( m_storage->m_pathNamesMap["/tmp/mtptests/subdir1"],  MTP_OBF_FORMAT_Undefined );
+    response = m_storage->deleteItem( m_storage->handleForPath("/tmp/mtptests/subdir1"),  MTP_OBF_FORMAT_Undefined );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
 
     totalCount -= 9;
@@ -958,7 +972,7 @@ void FSStoragePlugin_test::testDeleteDir()
 
 void FSStoragePlugin_test::testObjectHandlesCountAfterDeletion()
 {
-    QCOMPARE( m_storage->m_objectHandlesMap.size(), m_storage->m_pathNamesMap.size() );
+    QCOMPARE( m_storage->m_objectHandlesMap.size(), m_storage->m_childIndex.size() + 1 );
     QCOMPARE( m_storage->m_objectHandlesMap.size(), totalCount );
     quint32 noOfObjects;
     QVector<ObjHandle> objectHandles;
@@ -973,7 +987,7 @@ void FSStoragePlugin_test::testObjectHandlesCountAfterDeletion()
     QCOMPARE( objectHandles.size(), static_cast<qint32>(8) );
 
     objectHandles.clear();
-    response = m_storage->getObjectHandles( 0x0000, m_storage->m_pathNamesMap[QString("/tmp/mtptests/subdir2")], objectHandles );
+    response = m_storage->getObjectHandles( 0x0000, m_storage->handleForPath(QString("/tmp/mtptests/subdir2")), objectHandles );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( objectHandles.size(), static_cast<qint32>(4) );
 
@@ -1001,10 +1015,10 @@ void FSStoragePlugin_test::testFileCopy()
     ObjHandle newHandle;
     QVector<ObjHandle> objectHandles;
 
-    response = m_storage->copyObject( 1, m_storage->m_pathNamesMap["/tmp/mtptests/subdir2"], 0, newHandle );
+    response = m_storage->copyObject( 1, m_storage->handleForPath("/tmp/mtptests/subdir2"), 0, newHandle );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
 
-    response = m_storage->copyObject( 3, m_storage->m_pathNamesMap["/tmp/mtptests/subdir2"], 0, newHandle );
+    response = m_storage->copyObject( 3, m_storage->handleForPath("/tmp/mtptests/subdir2"), 0, newHandle );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
 }
 
@@ -1019,7 +1033,7 @@ void FSStoragePlugin_test::testDirCopy()
     //memset(&objectInfo, 0 , sizeof(MTPObjectInfo));
 
     //add a nested dir to subdir2 : D1, D1->D2, D1->D2->f
-    objectInfo.mtpParentObject = m_storage->m_pathNamesMap["/tmp/mtptests/subdir2"];
+    objectInfo.mtpParentObject = m_storage->handleForPath("/tmp/mtptests/subdir2");
     objectInfo.mtpFileName = "D1";
     objectInfo.mtpObjectCompressedSize = 0;
     objectInfo.mtpObjectFormat = MTP_OBF_FORMAT_Association;
@@ -1040,7 +1054,7 @@ void FSStoragePlugin_test::testDirCopy()
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
 
     // Copy dir D1 from subdir2 to mtptests
-    response = m_storage->copyObject( m_storage->m_pathNamesMap["/tmp/mtptests/subdir2/D1"], m_storage->m_pathNamesMap["/tmp/mtptests"], 0, newHandle );
+    response = m_storage->copyObject( m_storage->handleForPath("/tmp/mtptests/subdir2/D1"), m_storage->handleForPath("/tmp/mtptests"), 0, newHandle );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
 }
 
@@ -1048,8 +1062,8 @@ void FSStoragePlugin_test::testFileMove()
 {
     MTPResponseCode response;
 
-    response = m_storage->moveObject( m_storage->m_pathNamesMap["/tmp/mtptests/subdir2/fileA"],
-            m_storage->m_pathNamesMap["/tmp/mtptests"], m_storage );
+    response = m_storage->moveObject( m_storage->handleForPath("/tmp/mtptests/subdir2/fileA"),
+            m_storage->handleForPath("/tmp/mtptests"), m_storage );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
 }
 
@@ -1082,10 +1096,11 @@ void FSStoragePlugin_test::testFileMoveAcrossStorage()
     StorageItem *item = m_storage->findStorageItemByPath( "/tmp/mtptests/fileToMove" );
 
     ObjHandle originalHandle = item->m_handle;
+    m_storage->populateObjectInfo( item );
     MTPObjectInfo originalInfo = *item->m_objectInfo;
 
     QCOMPARE( m_storage->moveObject( originalHandle,
-            secondStorage.m_pathNamesMap["/tmp/mtptests-second/dir1"], &secondStorage ),
+            secondStorage.handleForPath("/tmp/mtptests-second/dir1"), &secondStorage ),
             (MTPResponseCode)MTP_RESP_OK);
 
     QVERIFY( !m_storage->checkHandle( originalHandle ) );
@@ -1114,8 +1129,8 @@ void FSStoragePlugin_test::testDirMove()
 {
     MTPResponseCode response;
 
-    response = m_storage->moveObject( m_storage->m_pathNamesMap["/tmp/mtptests/subdir2/D1"],
-            m_storage->m_pathNamesMap["/tmp/mtptests/D1"], m_storage );
+    response = m_storage->moveObject( m_storage->handleForPath("/tmp/mtptests/subdir2/D1"),
+            m_storage->handleForPath("/tmp/mtptests/D1"), m_storage );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
 }
 
@@ -1145,18 +1160,21 @@ void FSStoragePlugin_test::testDirMoveAcrossStorage()
 
     item = m_storage->findStorageItemByPath( "/tmp/mtptests/d1" );
     ObjHandle hOrigD1 = item->m_handle;
+    m_storage->populateObjectInfo( item );
     MTPObjectInfo iOrigD1 = *item->m_objectInfo;
 
     item = m_storage->findStorageItemByPath( "/tmp/mtptests/d1/d2" );
     ObjHandle hOrigD2 = item->m_handle;
+    m_storage->populateObjectInfo( item );
     MTPObjectInfo iOrigD2 = *item->m_objectInfo;
 
     item = m_storage->findStorageItemByPath( "/tmp/mtptests/d1/d2/f1" );
     ObjHandle hOrigF1 = item->m_handle;
+    m_storage->populateObjectInfo( item );
     MTPObjectInfo iOrigF1 = *item->m_objectInfo;
 
     QCOMPARE( m_storage->moveObject( hOrigD1,
-            secondStorage.m_pathNamesMap["/tmp/mtptests-second/dir"], &secondStorage ),
+            secondStorage.handleForPath("/tmp/mtptests-second/dir"), &secondStorage ),
             (MTPResponseCode)MTP_RESP_OK);
 
     QVERIFY( !m_storage->checkHandle( hOrigD1 ) &&
@@ -1190,7 +1208,7 @@ void FSStoragePlugin_test::testGetLargestPuoid()
 void FSStoragePlugin_test::testTruncateItem()
 {
     MTPResponseCode response;
-    response = m_storage->truncateItem( m_storage->m_pathNamesMap["/tmp/mtptests/file3"], 0 );
+    response = m_storage->truncateItem( m_storage->handleForPath("/tmp/mtptests/file3"), 0 );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QFile file("/tmp/mtptests/file3");
     QCOMPARE( file.size(), static_cast<qint64>(0));
@@ -1200,7 +1218,7 @@ void FSStoragePlugin_test::testGetPath()
 {
     MTPResponseCode response;
     QString path;
-    response = m_storage->getPath( m_storage->m_pathNamesMap["/tmp/mtptests/file3"], path );
+    response = m_storage->getPath( m_storage->handleForPath("/tmp/mtptests/file3"), path );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
     QCOMPARE( path, QString("/tmp/mtptests/file3") );
 }
@@ -1209,7 +1227,7 @@ void FSStoragePlugin_test::testGetObjectPropertyValueFromStorage()
 {
     MTPResponseCode response;
     QVariant v;
-    ObjHandle handle = m_storage->m_pathNamesMap["/tmp/mtptests/file3"];
+    ObjHandle handle = m_storage->handleForPath("/tmp/mtptests/file3");
     response = m_storage->getObjectPropertyValueFromStorage( handle,
                                                              MTP_OBJ_PROP_Association_Desc, v, MTP_DATA_TYPE_UNDEF );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
@@ -1223,7 +1241,7 @@ void FSStoragePlugin_test::testGetObjectPropertyValueFromStorage()
     response = m_storage->getObjectPropertyValueFromStorage( handle,
                                                              MTP_OBJ_PROP_Parent_Obj, v, MTP_DATA_TYPE_UNDEF );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_OK );
-    QCOMPARE( v.toUInt(), m_storage->m_pathNamesMap["/tmp/mtptests"] );
+    QCOMPARE( v.toUInt(), m_storage->handleForPath("/tmp/mtptests") );
 
     response = m_storage->getObjectPropertyValueFromStorage( handle,
                                                              MTP_OBJ_PROP_Obj_Size, v, MTP_DATA_TYPE_UNDEF );
@@ -1317,7 +1335,7 @@ void FSStoragePlugin_test::testGetObjectPropertyValueFromTracker()
 {
     MTPResponseCode response;
     QVariant v;
-    ObjHandle handle = m_storage->m_pathNamesMap["/tmp/mtptests/file3"];
+    ObjHandle handle = m_storage->handleForPath("/tmp/mtptests/file3");
 
     response = m_storage->getObjectPropertyValueFromTracker( handle,
                                                              MTP_OBJ_PROP_Date_Created, v, MTP_DATA_TYPE_STR );
@@ -1435,7 +1453,7 @@ void FSStoragePlugin_test::testSetObjectPropertyValueInTracker()
     quint16 uInt16 = 0;
     QString none = "none";
     QString empty = "";
-    ObjHandle handle = m_storage->m_pathNamesMap["/tmp/mtptests/file3"];
+    ObjHandle handle = m_storage->handleForPath("/tmp/mtptests/file3");
     QList<MTPObjPropDescVal> propValList;
     MTPObjPropDescVal val;
     MtpObjPropDesc desc;
@@ -1597,7 +1615,7 @@ void FSStoragePlugin_test::testGetInvalidObjectPropertyValueFromStorage()
 {
     MTPResponseCode response;
     QVariant v;
-    ObjHandle handle = m_storage->m_pathNamesMap["/tmp/mtptests/file3"];
+    ObjHandle handle = m_storage->handleForPath("/tmp/mtptests/file3");
     response = m_storage->getObjectPropertyValueFromStorage( handle,
                                                              0x0000, v, MTP_DATA_TYPE_UNDEF );
     QCOMPARE( response, (MTPResponseCode)MTP_RESP_ObjectProp_Not_Supported );
@@ -1605,91 +1623,60 @@ void FSStoragePlugin_test::testGetInvalidObjectPropertyValueFromStorage()
 
 void FSStoragePlugin_test::testInotifyCreate()
 {
-    QEventLoop loop;
-
+    // Events are delivered in batches from the watcher thread.
     QDir dir;
     dir.mkpath( "/tmp/mtptests/inotifydir" );
 
-    while( loop.processEvents() );
+    QTRY_VERIFY( m_storage->lookupPath("/tmp/mtptests/inotifydir") );
 
     QFile file( "/tmp/mtptests/inotifydir/tmpfile" );
     file.open( QFile::ReadWrite );
     file.close();
 
-    while( loop.processEvents() );
-
-    QVERIFY( m_storage->m_pathNamesMap.contains("/tmp/mtptests/inotifydir/tmpfile") );
+    QTRY_VERIFY( m_storage->lookupPath("/tmp/mtptests/inotifydir/tmpfile") );
 }
 
 void FSStoragePlugin_test::testInotifyModify()
 {
-    QEventLoop loop;
-    loop.processEvents();
-
     QFile file( "/tmp/mtptests/tmpfile" );
     file.open( QFile::ReadWrite );
     file.close();
 
-    loop.processEvents();
-
-    StorageItem *item =
-            m_storage->findStorageItemByPath("/tmp/mtptests/tmpfile");
-    QVERIFY( item );
-    QCOMPARE( item->m_objectInfo->mtpObjectCompressedSize,
-              static_cast<quint64>(0) );
+    StorageItem *item = 0;
+    QTRY_VERIFY( (item = m_storage->findStorageItemByPath("/tmp/mtptests/tmpfile")) );
+    QCOMPARE( item->m_size, static_cast<quint64>(0) );
 
     const QString TEXT( "some text to be written into the file" );
     file.open( QFile::ReadWrite );
     file.write( TEXT.toUtf8() );
     file.close();
 
-    loop.processEvents();
-
-    QCOMPARE( item->m_objectInfo->mtpObjectCompressedSize,
-              static_cast<quint64>(TEXT.size()) );
+    QTRY_COMPARE( item->m_size, static_cast<quint64>(TEXT.size()) );
 }
 
 void FSStoragePlugin_test::testInotifyMove()
 {
-    QEventLoop loop;
-    quint32 getOutOfHere = 0;
-    loop.processEvents();
     //system("mkdir /tmp/mtptests/tmpdir");
     //system("mv /tmp/mtptests/tmpfile /tmp/mtptests/tmpdir");
     system("mv /tmp/mtptests/tmpfile /tmp/mtptests/subdir2");
     StorageItem *storageItem = 0;
-    while( !storageItem && getOutOfHere < 20 )
-    {
-        //storageItem = static_cast<StorageItem*>( m_storage->findStorageItemByPath( "/tmp/mtptests/tmpdir/tmpfile" ) );
-        storageItem = static_cast<StorageItem*>( m_storage->findStorageItemByPath( "/tmp/mtptests/subdir2/tmpfile" ) );
-        loop.processEvents();
-        ++getOutOfHere;
-    }
-    QCOMPARE( storageItem != 0, true );
-    //QCOMPARE( storageItem->m_parent->m_handle, m_storage->m_pathNamesMap["/tmp/mtptests/tmpdir"] );
-    QCOMPARE( storageItem->m_parent->m_handle, m_storage->m_pathNamesMap["/tmp/mtptests/subdir2"] );
+    //QTRY_VERIFY( (storageItem = m_storage->findStorageItemByPath( "/tmp/mtptests/tmpdir/tmpfile" )) );
+    QTRY_VERIFY( (storageItem = m_storage->findStorageItemByPath( "/tmp/mtptests/subdir2/tmpfile" )) );
+    //QCOMPARE( storageItem->m_parent->m_handle, m_storage->handleForPath("/tmp/mtptests/tmpdir") );
+    QCOMPARE( storageItem->m_parent->m_handle, m_storage->handleForPath("/tmp/mtptests/subdir2") );
     // Fetch the object info once
     const MTPObjectInfo *objInfo;
-    m_storage->getObjectInfo(m_storage->m_pathNamesMap["/tmp/mtptests/subdir2/tmpfile"], objInfo);
+    m_storage->getObjectInfo(m_storage->handleForPath("/tmp/mtptests/subdir2/tmpfile"), objInfo);
 }
 
 void FSStoragePlugin_test::testInotifyDelete()
 {
-    QEventLoop loop;
-    quint32 getOutOfHere = 0;
-    loop.processEvents();
-    //StorageItem *storageItem = static_cast<StorageItem*>( m_storage->findStorageItemByPath( "/tmp/mtptests/tmpdir/tmpfile" ) );
-    StorageItem *storageItem = static_cast<StorageItem*>( m_storage->findStorageItemByPath( "/tmp/mtptests/subdir2/tmpfile" ) );
+    //QVERIFY( m_storage->findStorageItemByPath( "/tmp/mtptests/tmpdir/tmpfile" ) );
+    QVERIFY( m_storage->findStorageItemByPath( "/tmp/mtptests/subdir2/tmpfile" ) );
     //system("rm /tmp/mtptests/tmpdir/tmpfile");
     system("rm /tmp/mtptests/subdir2/tmpfile");
-    while( storageItem && getOutOfHere < 20 )
-    {
-        //storageItem = static_cast<StorageItem*>( m_storage->findStorageItemByPath( "/tmp/mtptests/tmpdir/tmpfile" ) );
-        storageItem = static_cast<StorageItem*>( m_storage->findStorageItemByPath( "/tmp/mtptests/subdir2/tmpfile" ) );
-        loop.processEvents();
-        ++getOutOfHere;
-    }
-    QCOMPARE( storageItem == 0, true );
+    //QTRY_VERIFY( !m_storage->findStorageItemByPath( "/tmp/mtptests/tmpdir/tmpfile" ) );
+    QTRY_VERIFY( !m_storage->findStorageItemByPath( "/tmp/mtptests/subdir2/tmpfile" ) );
 }
 
 void FSStoragePlugin_test::testReadPlaylists()
@@ -1698,7 +1685,7 @@ void FSStoragePlugin_test::testReadPlaylists()
     // as .pla files
     // Get handle to the playlists directory
     ObjHandle playlistsDirHandle = 0;
-    playlistsDirHandle = m_storage->m_pathNamesMap["/tmp/mtptests/Playlists"];
+    playlistsDirHandle = m_storage->handleForPath("/tmp/mtptests/Playlists");
     QCOMPARE(playlistsDirHandle != 0, true);
     // Get children of the playlists directory
     QVector<ObjHandle> playlists;
@@ -1760,7 +1747,7 @@ void FSStoragePlugin_test::testDeletePlaylists()
 {
     // Delete one of the existing playlists
     ObjHandle handle = 0;
-    handle = m_storage->m_pathNamesMap["/tmp/mtptests/Playlists/play1.pla"];
+    handle = m_storage->handleForPath("/tmp/mtptests/Playlists/play1.pla");
     QCOMPARE(handle != 0, true);
 
     MTPResponseCode response = m_storage->deleteItem(handle, MTP_OBF_FORMAT_Undefined);
@@ -1777,7 +1764,7 @@ void FSStoragePlugin_test::testDeletePlaylists()
     delete result;
 
     // Delete the other one too
-    handle = m_storage->m_pathNamesMap["/tmp/mtptests/Playlists/play2.pla"];
+    handle = m_storage->handleForPath("/tmp/mtptests/Playlists/play2.pla");
     QCOMPARE(handle != 0, true);
 
     response = m_storage->deleteItem(handle, MTP_OBF_FORMAT_Undefined);
@@ -1793,7 +1780,7 @@ void FSStoragePlugin_test::testCreatePlaylists()
     // Create a new abstract audio video playlist and assign references to it
     ObjHandle parentHandle = 0;
     ObjHandle newPlaylistHandle = 0;
-    parentHandle = m_storage->m_pathNamesMap["/tmp/mtptests/Playlists"];
+    parentHandle = m_storage->handleForPath("/tmp/mtptests/Playlists");
     QCOMPARE(parentHandle == 0, false);
 
     MTPObjectInfo objInfo;
@@ -1807,10 +1794,10 @@ void FSStoragePlugin_test::testCreatePlaylists()
 
     // Set references to all songs under Music into this playlist
     QVector<ObjHandle> allSongs;
-    allSongs.append(m_storage->m_pathNamesMap["/tmp/mtptests/Music/song1.mp3"]);
-    allSongs.append(m_storage->m_pathNamesMap["/tmp/mtptests/Music/song2.mp3"]);
-    allSongs.append(m_storage->m_pathNamesMap["/tmp/mtptests/Music/song3.mp3"]);
-    allSongs.append(m_storage->m_pathNamesMap["/tmp/mtptests/Music/song4.mp3"]);
+    allSongs.append(m_storage->handleForPath("/tmp/mtptests/Music/song1.mp3"));
+    allSongs.append(m_storage->handleForPath("/tmp/mtptests/Music/song2.mp3"));
+    allSongs.append(m_storage->handleForPath("/tmp/mtptests/Music/song3.mp3"));
+    allSongs.append(m_storage->handleForPath("/tmp/mtptests/Music/song4.mp3"));
     response = m_storage->setReferences(newPlaylistHandle, allSongs);
     QCOMPARE(response, (MTPResponseCode)MTP_RESP_OK);
 }
@@ -1909,7 +1896,7 @@ void FSStoragePlugin_test::testThumbnailer()
     while (!handle && maxtries > 0)
     {
         loop.processEvents();
-        handle = m_storage->m_pathNamesMap["/tmp/mtptests/testpic.png"];
+        handle = m_storage->handleForPath("/tmp/mtptests/testpic.png");
         --maxtries;
     }
     QVERIFY2(handle != 0, "testpic not registered in storage");
@@ -1969,6 +1956,332 @@ void FSStoragePlugin_test::testThumbnailer()
     QVERIFY(thumbnail.height() <= THUMBNAIL_HEIGHT);
 }
 
+void FSStoragePlugin_test::testSnapshotStartup()
+{
+    const QString root("/tmp/mtptests-snapshot");
+    const int dirs = 20;
+    const int filesPerDir = 50;
+    for( int i = 0; i < dirs; ++i )
+    {
+        QString dirPath = root + QString("/dir%1").arg(i);
+        QDir().mkpath( dirPath );
+        for( int j = 0; j < filesPerDir; ++j )
+        {
+            QFile file( dirPath + QString("/file%1.jpg").arg(j) );
+            file.open( QIODevice::WriteOnly );
+            file.write( "a", 1 );
+            file.close();
+        }
+    }
+
+    // Cold start: full enumeration, the snapshot is written on destruction.
+    FSStoragePlugin *storage = createStorage( root, 3 );
+    QString snapshotPath = storage->m_snapshotPath;
+    int coldCount = storage->m_objectHandlesMap.size();
+    QVERIFY( coldCount >= 1 + 1 + dirs * (1 + filesPerDir) ); // root, Playlists, dirs, files
+    MtpInt128 puoid = storage->lookupPath( root + "/dir0/file0.jpg" )->m_puoid;
+    delete storage;
+    QVERIFY( QFile::exists( snapshotPath ) );
+
+    // Change one directory while the storage is down.
+    sleep(1);
+    QFile::remove( root + "/dir1/file0.jpg" );
+    QFile added( root + "/dir2/added.jpg" );
+    added.open( QIODevice::WriteOnly );
+    added.close();
+    // A whole new subtree is walked, not listed recursively in place.
+    QDir().mkpath( root + "/dir3/new/deep" );
+    QFile deep( root + "/dir3/new/deep/deep.jpg" );
+    deep.open( QIODevice::WriteOnly );
+    deep.close();
+
+    // Warm start: restore from the snapshot, rescan the changed directories.
+    storage = createStorage( root, 3, true, true );
+
+    QCOMPARE( storage->m_objectHandlesMap.size(), coldCount + 3 );
+    QCOMPARE( storage->m_objectHandlesMap.size(), storage->m_childIndex.size() + 1 );
+    QVERIFY( !storage->lookupPath( root + "/dir1/file0.jpg" ) );
+    QVERIFY( storage->lookupPath( root + "/dir2/added.jpg" ) );
+    QVERIFY( storage->lookupPath( root + "/dir3/new/deep/deep.jpg" ) );
+    QVERIFY( !storage->m_walker );
+    QVERIFY( storage->lookupPath( root + "/dir0/file0.jpg" )->m_puoid == puoid );
+
+    ObjHandle handle = storage->handleForPath( root + "/dir0/file0.jpg" );
+    const MTPObjectInfo *info = 0;
+    QCOMPARE( storage->getObjectInfo( handle, info ), (MTPResponseCode)MTP_RESP_OK );
+    QCOMPARE( info->mtpFileName, QString("file0.jpg") );
+    QCOMPARE( info->mtpObjectCompressedSize, (quint64)1 );
+    QCOMPARE( info->mtpParentObject, storage->handleForPath( root + "/dir0" ) );
+
+    destroyStorage( storage, root );
+}
+
+void FSStoragePlugin_test::benchmarkStartup_data()
+{
+    QTest::addColumn<bool>("warm");
+
+    QTest::newRow("cold") << false;
+    QTest::newRow("warm") << true;
+}
+
+void FSStoragePlugin_test::benchmarkStartup()
+{
+    QFETCH(bool, warm);
+    const QString root("/tmp/mtptests-startbench");
+    const int dirs = 50;
+    const int filesPerDir = 100;
+    for( int i = 0; i < dirs; ++i )
+    {
+        QString dirPath = root + QString("/dir%1").arg(i);
+        QDir().mkpath( dirPath );
+        for( int j = 0; j < filesPerDir; ++j )
+        {
+            QFile file( dirPath + QString("/file%1.jpg").arg(j) );
+            file.open( QIODevice::WriteOnly );
+            file.close();
+        }
+    }
+
+    // The first storage walks the tree and leaves a snapshot behind.
+    FSStoragePlugin *storage = createStorage( root, 19 );
+    const int expected = storage->m_objectHandlesMap.size();
+    QString snapshotPath = storage->m_snapshotPath;
+    delete storage;
+
+    // Each round also writes the snapshot on deletion, in both rows.
+    int count = 0;
+    QBENCHMARK
+    {
+        storage = createStorage( root, 19, true, warm );
+        count = storage->m_objectHandlesMap.size();
+        delete storage;
+    }
+    QCOMPARE( count, expected );
+
+    QFile::remove( snapshotPath );
+    QDir( root ).removeRecursively();
+}
+
+void FSStoragePlugin_test::testLazyEnumeration()
+{
+    const QString root("/tmp/mtptests-lazy");
+    QDir().mkpath( root + "/DCIM/Camera" );
+    QDir().mkpath( root + "/Music/Album" );
+    QStringList files;
+    files << "/DCIM/Camera/img1.jpg" << "/DCIM/Camera/img2.jpg"
+          << "/Music/Album/song1.mp3" << "/Music/Album/song2.mp3";
+    foreach( const QString &name, files )
+    {
+        QFile file( root + name );
+        file.open( QIODevice::WriteOnly );
+        file.close();
+    }
+
+    FSStoragePlugin *storage = createStorage( root, 4, false );
+    storage->setLazyEnumeration( true );
+    setupPlugin( storage );
+
+    // Only the top level is known after startup.
+    QVERIFY( storage->lookupPath( root + "/DCIM" ) );
+    QVERIFY( storage->lookupPath( root + "/Music" ) );
+    QVERIFY( !storage->lookupPath( root + "/DCIM/Camera" ) );
+
+    // Browsing lists one level.
+    QVector<ObjHandle> handles;
+    ObjHandle dcim = storage->handleForPath( root + "/DCIM" );
+    QCOMPARE( storage->getObjectHandles( 0, dcim, handles ), (MTPResponseCode)MTP_RESP_OK );
+    QCOMPARE( handles.size(), 1 );
+    QVERIFY( storage->lookupPath( root + "/DCIM/Camera" ) );
+    QVERIFY( !storage->lookupPath( root + "/DCIM/Camera/img1.jpg" ) );
+
+    // Looking up a path lists its ancestors.
+    QVERIFY( storage->findStorageItemByPath( root + "/Music/Album/song1.mp3" ) != 0 );
+    QVERIFY( storage->lookupPath( root + "/Music/Album/song2.mp3" ) );
+
+    // A whole-storage query completes the enumeration in the background
+    // and announces what was missing from its answer.
+    QSignalSpy spy( storage, SIGNAL(eventGenerated(MTPEventCode, const QVector<quint32>&)) );
+    handles.clear();
+    QCOMPARE( storage->getObjectHandles( 0, 0, handles ), (MTPResponseCode)MTP_RESP_OK );
+    int maxtries = 100;
+    while( !storage->m_unlistedDirs.isEmpty() && maxtries-- > 0 )
+    {
+        QCoreApplication::processEvents();
+    }
+    QVERIFY( storage->m_unlistedDirs.isEmpty() );
+    QVERIFY( storage->lookupPath( root + "/DCIM/Camera/img2.jpg" ) );
+    QVERIFY( spy.count() >= 2 );
+
+    destroyStorage( storage, root );
+}
+
+/* Heap bytes owned by a string that doesn't share its data. */
+static quint64 stringBytes( const QString &string )
+{
+    return string.isDetached() ? sizeof(QString::Data) + ( string.capacity() + 1 ) * sizeof(QChar) : 0;
+}
+
+void FSStoragePlugin_test::testCompactNodeMemory()
+{
+    const QString root("/tmp/mtptests-memory");
+    const int dirs = 100;
+    const int filesPerDir = 200;
+    for( int i = 0; i < dirs; ++i )
+    {
+        QString dirPath = root + QString("/directory%1").arg(i);
+        QDir().mkpath( dirPath );
+        for( int j = 0; j < filesPerDir; ++j )
+        {
+            QFile file( dirPath + QString("/document%1.txt").arg(j) );
+            file.open( QIODevice::WriteOnly );
+            file.close();
+        }
+    }
+
+    FSStoragePlugin *storage = createStorage( root, 5 );
+    int count = storage->m_objectHandlesMap.size();
+    QVERIFY( count >= dirs * (1 + filesPerDir) );
+
+    // Enumeration only fills the compact item fields.
+    foreach( StorageItem *item, storage->m_objectHandlesMap )
+    {
+        QVERIFY( !item->m_objectInfo );
+    }
+    StorageItem *item = storage->findStorageItemByPath( root + "/directory0/document0.txt" );
+    QVERIFY( item );
+    QCOMPARE( item->m_format, (MTPObjFormatCode)MTP_OBF_FORMAT_Text );
+    QCOMPARE( item->m_size, (quint64)0 );
+    QVERIFY( item->m_modified > 0 );
+
+    // An item's share of the pool, free slots included, against the dataset
+    // the old node layout kept next to every item.
+    quint64 compactBytes = StorageItem::poolBytes() / count;
+    storage->populateObjectInfo( item );
+    const MTPObjectInfo *info = item->m_objectInfo;
+    QVERIFY( info );
+    quint64 infoBytes = sizeof(MTPObjectInfo) + stringBytes( info->mtpFileName ) +
+                        stringBytes( info->mtpCaptureDate ) + stringBytes( info->mtpModificationDate ) +
+                        stringBytes( info->mtpKeywords );
+    // The compact item is less than half the size of an item carrying it.
+    QVERIFY2( 2 * compactBytes < compactBytes + infoBytes,
+              qPrintable( QString("%1 bytes per item, %2 per dataset").arg( compactBytes ).arg( infoBytes ) ) );
+
+    destroyStorage( storage, root );
+}
+
+void FSStoragePlugin_test::testPathIndexRename()
+{
+    const QString root("/tmp/mtptests-index");
+    QDir().mkpath( root + "/top/middle/bottom" );
+    for( int i = 0; i < 100; ++i )
+    {
+        QFile file( root + QString("/top/middle/bottom/file%1").arg(i) );
+        file.open( QIODevice::WriteOnly );
+        file.close();
+    }
+
+    FSStoragePlugin *storage = createStorage( root, 6 );
+
+    StorageItem *top = storage->lookupPath( root + "/top" );
+    StorageItem *file = storage->lookupPath( root + "/top/middle/bottom/file42" );
+    QVERIFY( top && file );
+    QCOMPARE( file->path(), root + "/top/middle/bottom/file42" );
+    QCOMPARE( file->name(), QString("file42") );
+    QCOMPARE( storage->m_root->name(), QString("mtptests-index") );
+    QVERIFY( !storage->lookupPath( root + "/top/middle/bottom/file42/x" ) );
+    QVERIFY( !storage->lookupPath( root + "/top/" ) );
+    QVERIFY( !storage->lookupPath( root + "-other/top" ) );
+    QVERIFY( storage->lookupPath( root ) == storage->m_root );
+
+    // Renaming a directory only touches its own index entry.
+    int indexSize = storage->m_childIndex.size();
+    QVERIFY( QDir().rename( root + "/top", root + "/renamed" ) );
+    storage->renameStorageItem( top, "renamed" );
+    QCOMPARE( storage->m_childIndex.size(), indexSize );
+    QVERIFY( !storage->lookupPath( root + "/top/middle/bottom/file42" ) );
+    QVERIFY( storage->lookupPath( root + "/renamed/middle/bottom/file42" ) == file );
+    QCOMPARE( file->path(), root + "/renamed/middle/bottom/file42" );
+
+    destroyStorage( storage, root );
+}
+
+/* Number of objects in a format, by scanning the whole storage. */
+static int countByScan( const QHash<ObjHandle, StorageItem*> &items, MTPObjFormatCode format, const StorageItem *parent )
+{
+    int count = 0;
+    foreach( const StorageItem *item, items )
+    {
+        if( item->m_parent && item->m_format == format && ( !parent || item->m_parent == parent ) )
+        {
+            ++count;
+        }
+    }
+    return count;
+}
+
+void FSStoragePlugin_test::testFormatIndex()
+{
+    const QString root("/tmp/mtptests-format");
+    QDir().mkpath( root + "/Music" );
+    QDir().mkpath( root + "/Other" );
+    QStringList files;
+    files << "/Music/a.mp3" << "/Music/b.mp3" << "/Music/c.jpg" << "/d.mp3";
+    foreach( const QString &name, files )
+    {
+        QFile file( root + name );
+        file.open( QIODevice::WriteOnly );
+        file.close();
+    }
+
+    FSStoragePlugin *storage = createStorage( root, 7 );
+
+    ObjHandle music = storage->handleForPath( root + "/Music" );
+    ObjHandle other = storage->handleForPath( root + "/Other" );
+    StorageItem *musicItem = storage->lookupPath( root + "/Music" );
+    QVector<ObjHandle> handles;
+    QCOMPARE( storage->getObjectHandles( MTP_OBF_FORMAT_MP3, 0, handles ), (MTPResponseCode)MTP_RESP_OK );
+    QCOMPARE( handles.size(), 3 );
+    handles.clear();
+    QCOMPARE( storage->getObjectHandles( MTP_OBF_FORMAT_MP3, music, handles ), (MTPResponseCode)MTP_RESP_OK );
+    QCOMPARE( handles.size(), 2 );
+    // Filtered children come in the same order as unfiltered ones.
+    QVector<ObjHandle> siblings;
+    QCOMPARE( storage->getObjectHandles( 0, music, siblings ), (MTPResponseCode)MTP_RESP_OK );
+    siblings.remove( siblings.indexOf( storage->handleForPath( root + "/Music/c.jpg" ) ) );
+    QCOMPARE( handles, siblings );
+    handles.clear();
+    QCOMPARE( storage->getObjectHandles( MTP_OBF_FORMAT_MP3, 0xFFFFFFFF, handles ), (MTPResponseCode)MTP_RESP_OK );
+    QCOMPARE( handles.size(), 1 );
+    QCOMPARE( handles[0], storage->handleForPath( root + "/d.mp3" ) );
+
+    // Moves, deletes and renames seen through inotify keep the index current.
+    QCOMPARE( storage->moveObject( storage->handleForPath( root + "/Music/a.mp3" ), other, storage ),
+              (MTPResponseCode)MTP_RESP_OK );
+    QCOMPARE( storage->deleteItem( storage->handleForPath( root + "/d.mp3" ), MTP_OBF_FORMAT_Undefined ),
+              (MTPResponseCode)MTP_RESP_OK );
+    QVERIFY( QFile::rename( root + "/Music/b.mp3", root + "/Music/b.jpg" ) );
+    QEventLoop loop;
+    for( int tries = 0; tries < 100 && !storage->lookupPath( root + "/Music/b.jpg" ); ++tries )
+    {
+        loop.processEvents( QEventLoop::AllEvents, 10 );
+    }
+    QVERIFY( storage->lookupPath( root + "/Music/b.jpg" ) );
+
+    handles.clear();
+    storage->getObjectHandles( MTP_OBF_FORMAT_MP3, 0, handles );
+    QCOMPARE( handles.size(), 1 );
+    QCOMPARE( handles.size(), countByScan( storage->m_objectHandlesMap, MTP_OBF_FORMAT_MP3, 0 ) );
+    handles.clear();
+    storage->getObjectHandles( MTP_OBF_FORMAT_EXIF_JPEG, music, handles );
+    QCOMPARE( handles.size(), countByScan( storage->m_objectHandlesMap, MTP_OBF_FORMAT_EXIF_JPEG, musicItem ) );
+    QCOMPARE( handles.size(), 2 );
+    handles.clear();
+    storage->getObjectHandles( MTP_OBF_FORMAT_MP3, music, handles );
+    QVERIFY( handles.isEmpty() );
+
+    destroyStorage( storage, root );
+}
+
 void FSStoragePlugin_test::setupPlugin(StoragePlugin *plugin)
 {
     QSignalSpy readySpy(plugin, SIGNAL(storagePluginReady(quint32)));
@@ -1976,6 +2289,965 @@ void FSStoragePlugin_test::setupPlugin(StoragePlugin *plugin)
     QVERIFY(readySpy.wait());
 }
 
+FSStoragePlugin *FSStoragePlugin_test::createStorage( const QString &root, quint32 storageId,
+                                                      bool enumerate, bool keepSnapshot )
+{
+    FSStoragePlugin *storage = new FSStoragePlugin( storageId, MTP_STORAGE_TYPE_FixedRAM, root,
+                                                    QFileInfo( root ).fileName(), "Test storage" );
+    if( !keepSnapshot )
+    {
+        QFile::remove( storage->m_snapshotPath );
+    }
+    if( enumerate )
+    {
+        setupPlugin( storage );
+    }
+    return storage;
+}
+
+void FSStoragePlugin_test::destroyStorage( FSStoragePlugin *storage, const QString &root )
+{
+    QString snapshotPath = storage->m_snapshotPath;
+    delete storage;
+    QFile::remove( snapshotPath );
+    QDir( root ).removeRecursively();
+}
+
+void FSStoragePlugin_test::testObjectCounters()
+{
+    const QString root("/tmp/mtptests-counters");
+    QDir().mkpath( root + "/Music/Albums" );
+    QDir().mkpath( root + "/Other" );
+    QStringList files;
+    files << "/Music/a.mp3" << "/Music/Albums/b.mp3" << "/Other/c.jpg";
+    foreach( const QString &name, files )
+    {
+        QFile file( root + name );
+        file.open( QIODevice::WriteOnly );
+        file.write( QByteArray( 100, 'x' ) );
+        file.close();
+    }
+
+    FSStoragePlugin *storage = createStorage( root, 8 );
+
+    // The counts must agree with the handle lists for every kind of query.
+    QList<quint32> parents;
+    parents << 0 << 0xFFFFFFFF << storage->handleForPath( root + "/Music" )
+            << storage->handleForPath( root + "/Music/Albums" ) << storage->handleForPath( root + "/Other" );
+    QList<MTPObjFormatCode> formats;
+    formats << 0 << MTP_OBF_FORMAT_MP3 << MTP_OBF_FORMAT_EXIF_JPEG << MTP_OBF_FORMAT_Association;
+    foreach( quint32 parent, parents )
+    {
+        foreach( MTPObjFormatCode format, formats )
+        {
+            QVector<ObjHandle> handles;
+            quint32 count = 0xdead;
+            QCOMPARE( storage->getObjectHandles( format, parent, handles ), (MTPResponseCode)MTP_RESP_OK );
+            QCOMPARE( storage->getNumObjects( format, parent, count ), (MTPResponseCode)MTP_RESP_OK );
+            QCOMPARE( count, (quint32)handles.size() );
+        }
+    }
+    quint32 count = 0;
+    QCOMPARE( storage->getNumObjects( 0, storage->handleForPath( root + "/Music/a.mp3" ), count ),
+              (MTPResponseCode)MTP_RESP_InvalidParentObject );
+
+    // Byte totals follow moves, deletes and size changes.
+    StorageItem *music = storage->lookupPath( root + "/Music" );
+    StorageItem *other = storage->lookupPath( root + "/Other" );
+    QCOMPARE( storage->m_root->m_treeSize, (quint64)300 );
+    QCOMPARE( music->m_treeSize, (quint64)200 );
+    QCOMPARE( music->m_childCount, (quint32)2 );
+
+    QCOMPARE( storage->moveObject( storage->handleForPath( root + "/Music/Albums" ), other->m_handle, storage ),
+              (MTPResponseCode)MTP_RESP_OK );
+    QCOMPARE( music->m_treeSize, (quint64)100 );
+    QCOMPARE( other->m_treeSize, (quint64)200 );
+    QCOMPARE( music->m_childCount, (quint32)1 );
+    QCOMPARE( other->m_childCount, (quint32)2 );
+
+    QCOMPARE( storage->truncateItem( storage->handleForPath( root + "/Other/c.jpg" ), 40 ),
+              (MTPResponseCode)MTP_RESP_OK );
+    QCOMPARE( other->m_treeSize, (quint64)140 );
+
+    QCOMPARE( storage->deleteItem( storage->handleForPath( root + "/Other/Albums" ), MTP_OBF_FORMAT_Undefined ),
+              (MTPResponseCode)MTP_RESP_OK );
+    QCOMPARE( other->m_treeSize, (quint64)40 );
+    QCOMPARE( other->m_childCount, (quint32)1 );
+    QCOMPARE( storage->m_root->m_treeSize, (quint64)140 );
+    QCOMPARE( storage->getNumObjects( 0, 0, count ), (MTPResponseCode)MTP_RESP_OK );
+    QCOMPARE( count, (quint32)4 );
+
+    destroyStorage( storage, root );
+}
+
+void FSStoragePlugin_test::testStatEntry()
+{
+    const QString root("/tmp/mtptests-stat");
+    QDir().mkpath( root + "/dir" );
+    QFile file( root + "/file.mp3" );
+    file.open( QIODevice::WriteOnly );
+    file.write( QByteArray( 123, 'x' ) );
+    file.close();
+    QByteArray fifo = QFile::encodeName( root + "/fifo" );
+    mkfifo( fifo.constData(), 0600 );
+
+    // One call yields everything the storage keeps about an entry.
+    FSDirEntry entry;
+    QByteArray ba = QFile::encodeName( root + "/file.mp3" );
+    QVERIFY( FSDirWalker::statEntry( AT_FDCWD, ba.constData(), entry ) );
+    QVERIFY( !entry.isDir );
+    QCOMPARE( entry.size, (quint64)123 );
+    QCOMPARE( entry.mtime / 1000000000LL, (qint64)QFileInfo( file ).lastModified().toTime_t() );
+    ba = QFile::encodeName( root + "/dir" );
+    QVERIFY( FSDirWalker::statEntry( AT_FDCWD, ba.constData(), entry ) );
+    QVERIFY( entry.isDir );
+    QCOMPARE( entry.size, (quint64)0 );
+    QVERIFY( !FSDirWalker::statEntry( AT_FDCWD, fifo.constData(), entry ) );
+    ba = QFile::encodeName( root + "/missing" );
+    QVERIFY( !FSDirWalker::statEntry( AT_FDCWD, ba.constData(), entry ) );
+
+    // Listings only report regular files and directories.
+    QVector<FSDirEntry> entries;
+    FSDirWalker::listDirectory( root, entries );
+    QCOMPARE( entries.size(), 2 );
+    foreach( const FSDirEntry &listed, entries )
+    {
+        QVERIFY( listed.path == root + "/dir" || listed.path == root + "/file.mp3" );
+        QCOMPARE( listed.isDir, listed.path == root + "/dir" );
+    }
+
+    QDir( root ).removeRecursively();
+}
+
+void FSStoragePlugin_test::benchmarkDirWalker_data()
+{
+    QTest::addColumn<int>("threadCount");
+
+    QTest::newRow("1 thread") << 1;
+    QTest::newRow("per core") << 0;
+}
+
+void FSStoragePlugin_test::benchmarkDirWalker()
+{
+    QFETCH(int, threadCount);
+    const QString root("/tmp/mtptests-walkbench");
+    const int dirs = 50;
+    const int subdirs = 4;
+    const int filesPerDir = 100;
+    for( int i = 0; i < dirs; ++i )
+    {
+        for( int k = 0; k <= subdirs; ++k )
+        {
+            QString dirPath = root + QString("/dir%1").arg(i);
+            if( k )
+            {
+                dirPath += QString("/sub%1").arg(k);
+            }
+            QDir().mkpath( dirPath );
+            for( int j = 0; j < filesPerDir; ++j )
+            {
+                QFile file( dirPath + QString("/file%1.jpg").arg(j) );
+                file.open( QIODevice::WriteOnly );
+                file.close();
+            }
+        }
+    }
+    const int expected = dirs * (1 + subdirs) * (1 + filesPerDir);
+
+    QVector<FSDirEntry> entries;
+    QBENCHMARK
+    {
+        entries.clear();
+        FSDirWalker walker( root, QStringList(), threadCount );
+        walker.start();
+        while( !walker.takeEntries( entries, expected ) )
+        {
+            QThread::yieldCurrentThread();
+        }
+    }
+
+    // Every entry is reported once, and after the directory holding it.
+    QCOMPARE( entries.size(), expected );
+    QSet<QString> seen;
+    foreach( const FSDirEntry &entry, entries )
+    {
+        QString parent = QFileInfo( entry.path ).path();
+        QVERIFY( parent == root || seen.contains( parent ) );
+        QVERIFY( !seen.contains( entry.path ) );
+        seen.insert( entry.path );
+    }
+
+    QDir( root ).removeRecursively();
+}
+
+void FSStoragePlugin_test::testFormatDetection()
+{
+    const QString root("/tmp/mtptests-sniff");
+    QDir().mkpath( root );
+    QList<QPair<QString, QByteArray> > files;
+    files << qMakePair( QString("/PHOTO.JPG"), QByteArray("\xff\xd8\xff\xe0", 4) )
+          << qMakePair( QString("/noext"), QByteArray("\x89PNG\r\n\x1a\n", 8) )
+          << qMakePair( QString("/fake.mp3"), QByteArray("GIF89a") )
+          << qMakePair( QString("/notes.txt"), QByteArray("hello") )
+          << qMakePair( QString("/archive.tar.gz"), QByteArray("\x1f\x8b", 2) )
+          << qMakePair( QString("/bitmap.txt"), QByteArray("BMW 320i\n") )
+          << qMakePair( QString("/noise.wma"), QByteArray("\xff\xfb\x90\x64\0\0", 6) )
+          << qMakePair( QString("/tune"), QByteArray("\xff\xfb\x90\x64\0\0", 6) );
+    for( int i = 0; i < files.size(); ++i )
+    {
+        QFile file( root + files[i].first );
+        file.open( QIODevice::WriteOnly );
+        file.write( files[i].second );
+        file.close();
+    }
+
+    FSStoragePlugin *storage = createStorage( root, 9 );
+
+    // Without sniffing only the extension counts, case insensitively.
+    StorageItem *photo = storage->lookupPath( root + "/PHOTO.JPG" );
+    QCOMPARE( photo->m_format, (MTPObjFormatCode)MTP_OBF_FORMAT_EXIF_JPEG );
+    QVERIFY( storage->isImage( photo ) );
+    QCOMPARE( storage->lookupPath( root + "/noext" )->m_format, (MTPObjFormatCode)MTP_OBF_FORMAT_Undefined );
+    QCOMPARE( storage->lookupPath( root + "/fake.mp3" )->m_format, (MTPObjFormatCode)MTP_OBF_FORMAT_MP3 );
+    QCOMPARE( storage->lookupPath( root + "/archive.tar.gz" )->m_format, (MTPObjFormatCode)MTP_OBF_FORMAT_Undefined );
+
+    // With sniffing the content wins when it is recognized.
+    storage->setContentSniffing( true );
+    foreach( StorageItem *item, storage->m_objectHandlesMap )
+    {
+        storage->readMetadata( item );
+    }
+    QCOMPARE( storage->lookupPath( root + "/noext" )->m_format, (MTPObjFormatCode)MTP_OBF_FORMAT_PNG );
+    QCOMPARE( storage->lookupPath( root + "/fake.mp3" )->m_format, (MTPObjFormatCode)MTP_OBF_FORMAT_GIF );
+    QVERIFY( storage->isImage( storage->lookupPath( root + "/fake.mp3" ) ) );
+    QCOMPARE( storage->lookupPath( root + "/notes.txt" )->m_format, (MTPObjFormatCode)MTP_OBF_FORMAT_Text );
+    QCOMPARE( storage->lookupPath( root + "/archive.tar.gz" )->m_format, (MTPObjFormatCode)MTP_OBF_FORMAT_Undefined );
+    // Short signatures don't override a known extension.
+    QCOMPARE( storage->lookupPath( root + "/bitmap.txt" )->m_format, (MTPObjFormatCode)MTP_OBF_FORMAT_Text );
+    QCOMPARE( storage->lookupPath( root + "/noise.wma" )->m_format, (MTPObjFormatCode)MTP_OBF_FORMAT_WMA );
+    QCOMPARE( storage->lookupPath( root + "/tune" )->m_format, (MTPObjFormatCode)MTP_OBF_FORMAT_MP3 );
+    QVector<ObjHandle> handles;
+    storage->getObjectHandles( MTP_OBF_FORMAT_GIF, 0, handles );
+    QCOMPARE( handles.size(), 1 );
+
+    // Unchanged files are answered from the cache.
+    int cached = storage->m_sniffCache.size();
+    storage->readMetadata( storage->lookupPath( root + "/noext" ) );
+    QCOMPARE( storage->m_sniffCache.size(), cached );
+
+    delete storage;
+
+    // During enumeration the walker threads read the files.
+    storage = createStorage( root, 9, false );
+    storage->setContentSniffing( true );
+    setupPlugin( storage );
+    QCOMPARE( storage->lookupPath( root + "/noext" )->m_format, (MTPObjFormatCode)MTP_OBF_FORMAT_PNG );
+    QCOMPARE( storage->lookupPath( root + "/fake.mp3" )->m_format, (MTPObjFormatCode)MTP_OBF_FORMAT_GIF );
+    QCOMPARE( storage->lookupPath( root + "/bitmap.txt" )->m_format, (MTPObjFormatCode)MTP_OBF_FORMAT_Text );
+    QCOMPARE( storage->lookupPath( root + "/tune" )->m_format, (MTPObjFormatCode)MTP_OBF_FORMAT_MP3 );
+    QVERIFY( storage->m_sniffCache.isEmpty() );
+
+    destroyStorage( storage, root );
+}
+
+class LogCollector : public LogStoreVisitor
+{
+public:
+    void put( const QByteArray &key, const QByteArray &value )
+    {
+        m_data.insert( QByteArray( key.constData(), key.size() ), QByteArray( value.constData(), value.size() ) );
+    }
+    void remove( const QByteArray &key )
+    {
+        m_data.remove( key );
+    }
+    QHash<QByteArray, QByteArray> m_data;
+};
+
+void FSStoragePlugin_test::testLogStore()
+{
+    const QString path("/tmp/mtptests-logstore");
+    QFile::remove( path );
+    {
+        LogStore log( path );
+        QVERIFY( log.open( 0 ) );
+        QVERIFY( log.put( "a", "1" ) );
+        QVERIFY( log.put( "b", "2" ) );
+        QVERIFY( log.put( "a", "3" ) );
+        QVERIFY( log.remove( "b" ) );
+        QVERIFY( log.sync() );
+        QCOMPARE( log.recordCount(), (quint32)4 );
+    }
+
+    // Replayed in order.
+    {
+        LogCollector collector;
+        LogStore log( path );
+        QVERIFY( log.open( &collector ) );
+        QCOMPARE( log.recordCount(), (quint32)4 );
+        QCOMPARE( collector.m_data.size(), 1 );
+        QCOMPARE( collector.m_data.value( "a" ), QByteArray( "3" ) );
+        QVERIFY( log.put( "c", QByteArray( 16, 'x' ) ) );
+    }
+
+    // A record torn by a crash is cut off, the ones before it survive.
+    qint64 size = QFileInfo( path ).size();
+    QVERIFY( QFile::resize( path, size - 5 ) );
+    {
+        LogCollector collector;
+        LogStore log( path );
+        QVERIFY( log.open( &collector ) );
+        QCOMPARE( log.recordCount(), (quint32)4 );
+        QVERIFY( !collector.m_data.contains( "c" ) );
+        QVERIFY( log.put( "d", "4" ) );
+    }
+    {
+        LogCollector collector;
+        LogStore log( path );
+        QVERIFY( log.open( &collector ) );
+        QCOMPARE( collector.m_data.value( "d" ), QByteArray( "4" ) );
+
+        // A rewrite keeps only the live data.
+        QVERIFY( log.beginRewrite() );
+        log.rewritePut( "a", "3" );
+        log.rewritePut( "d", "4" );
+        QVERIFY( log.commitRewrite() );
+        QCOMPARE( log.recordCount(), (quint32)2 );
+        QVERIFY( log.put( "e", "5" ) );
+    }
+    {
+        LogCollector collector;
+        LogStore log( path );
+        QVERIFY( log.open( &collector ) );
+        QCOMPARE( log.recordCount(), (quint32)3 );
+        QCOMPARE( collector.m_data.size(), 3 );
+        QCOMPARE( collector.m_data.value( "e" ), QByteArray( "5" ) );
+    }
+
+    // A short write is cut off again, later appends stay replayable.
+    {
+        LogStore log( path );
+        QVERIFY( log.open( 0 ) );
+        qint64 before = QFileInfo( path ).size();
+        struct rlimit saved;
+        QCOMPARE( getrlimit( RLIMIT_FSIZE, &saved ), 0 );
+        struct rlimit limit = saved;
+        limit.rlim_cur = before + 100;
+        void (*oldHandler)(int) = signal( SIGXFSZ, SIG_IGN );
+        QCOMPARE( setrlimit( RLIMIT_FSIZE, &limit ), 0 );
+        QVERIFY( log.put( "f", QByteArray( 1000, 'y' ) ) );
+        bool flushed = log.flush();
+        QCOMPARE( setrlimit( RLIMIT_FSIZE, &saved ), 0 );
+        signal( SIGXFSZ, oldHandler );
+        QVERIFY( !flushed );
+        QCOMPARE( QFileInfo( path ).size(), before );
+        QVERIFY( log.put( "g", "7" ) );
+        QVERIFY( log.sync() );
+    }
+    {
+        LogCollector collector;
+        LogStore log( path );
+        QVERIFY( log.open( &collector ) );
+        QCOMPARE( log.recordCount(), (quint32)5 );
+        QCOMPARE( collector.m_data.value( "f" ), QByteArray( 1000, 'y' ) );
+        QCOMPARE( collector.m_data.value( "g" ), QByteArray( "7" ) );
+    }
+    QFile::remove( path );
+}
+
+void FSStoragePlugin_test::testPuoidsLog()
+{
+    const QString root("/tmp/mtptests-puoids");
+    QDir().mkpath( root + "/dir" );
+    QFile file( root + "/dir/file.txt" );
+    file.open( QIODevice::WriteOnly );
+    file.close();
+
+    FSStoragePlugin *storage = createStorage( root, 10 );
+    MtpInt128 filePuoid = storage->lookupPath( root + "/dir/file.txt" )->m_puoid;
+    StorageItem *dir = storage->lookupPath( root + "/dir" );
+    MtpInt128 dirPuoid = dir->m_puoid;
+
+    // Renames are logged as they happen.
+    QVERIFY( QDir().rename( root + "/dir", root + "/renamed" ) );
+    storage->renameStorageItem( dir, "renamed" );
+    QString logPath = storage->m_puoidsLog->path();
+    storage->m_puoidsLog->flush();
+    quint32 records = storage->m_puoidsLog->recordCount();
+    QVERIFY( records > 0 );
+
+    // Without the snapshot the puoids can only come from the log.
+    delete storage;
+    QVERIFY( QFile::exists( logPath ) );
+    storage = createStorage( root, 10 );
+    QVERIFY( storage->lookupPath( root + "/renamed/file.txt" )->m_puoid == filePuoid );
+    QVERIFY( storage->lookupPath( root + "/renamed" )->m_puoid == dirPuoid );
+
+    destroyStorage( storage, root );
+    QFile::remove( logPath );
+}
+
+void FSStoragePlugin_test::testFanotifyMonitor()
+{
+    const QString root("/tmp/mtptests-fanotify");
+    QDir().mkpath( root + "/dir" );
+    FSInotify monitor( IN_MOVE | IN_CREATE | IN_DELETE | IN_CLOSE_WRITE );
+    if( !monitor.useFanotify( root ) )
+    {
+        QDir( root ).removeRecursively();
+        QSKIP("fanotify is not available");
+    }
+    QVERIFY( monitor.watchesFollowRenames() );
+
+    int wd = monitor.addWatch( root + "/dir" );
+    QVERIFY( -1 != wd );
+    QCOMPARE( monitor.addWatch( root + "/dir" ), wd );
+
+    // fanotify may merge events about the same entry, and the watcher
+    // coalesces them, so collect the masks per name.
+    QHash<QString, quint32> masks;
+    QHash<QString, quint32> cookies;
+    monitor.setDebounceInterval( 0 );
+    QObject::connect( &monitor, &FSInotify::eventsAvailable, [&]() {
+        QByteArray events;
+        monitor.takeEvents( events );
+        for( int i = 0; i < events.size(); )
+        {
+            const struct inotify_event *event = reinterpret_cast<const struct inotify_event*>( events.constData() + i );
+            QCOMPARE( event->wd, wd );
+            masks[QString::fromUtf8( event->name )] |= event->mask;
+            if( event->cookie )
+            {
+                cookies[QString::fromUtf8( event->name )] = event->cookie;
+            }
+            i += sizeof *event + event->len;
+        }
+    } );
+
+    QFile file( root + "/dir/a.txt" );
+    file.open( QIODevice::WriteOnly );
+    file.write( "a" );
+    file.close();
+    QVERIFY( QFile::rename( root + "/dir/a.txt", root + "/dir/b.txt" ) );
+    // Not watched, not reported.
+    QDir().mkdir( root + "/other" );
+    QTRY_COMPARE( masks.value( "b.txt" ), (quint32)IN_MOVED_TO );
+    QCOMPARE( masks.value( "a.txt" ), (quint32)(IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_FROM) );
+    QVERIFY( cookies.value( "a.txt" ) && cookies.value( "a.txt" ) == cookies.value( "b.txt" ) );
+
+    // The watch follows the directory.
+    QVERIFY( QDir().rename( root + "/dir", root + "/renamed" ) );
+    QDir().mkdir( root + "/renamed/sub" );
+    QTRY_COMPARE( masks.value( "sub" ), (quint32)(IN_CREATE | IN_ISDIR) );
+    QVERIFY( !masks.contains( "other" ) );
+
+    QCOMPARE( monitor.removeWatch( wd ), 0 );
+    QDir( root ).removeRecursively();
+}
+
+void FSStoragePlugin_test::testEventCoalescing()
+{
+    const QString root("/tmp/mtptests-coalesce");
+    QDir().mkpath( root );
+    FSInotify monitor( IN_MOVE | IN_CREATE | IN_DELETE | IN_CLOSE_WRITE );
+    monitor.setDebounceInterval( 500 );
+    int wd = monitor.addWatch( root );
+    QVERIFY( -1 != wd );
+    QSignalSpy spy( &monitor, SIGNAL(eventsAvailable()) );
+
+    // Written twice, then a temporary file created and removed.
+    for( int i = 0; i < 2; ++i )
+    {
+        QFile file( root + "/photo.jpg" );
+        file.open( QIODevice::WriteOnly );
+        file.write( "data" );
+        file.close();
+    }
+    QFile tmp( root + "/photo.tmp" );
+    tmp.open( QIODevice::WriteOnly );
+    tmp.close();
+    QFile::remove( root + "/photo.tmp" );
+
+    QTRY_COMPARE( spy.count(), 1 );
+    QByteArray events;
+    monitor.takeEvents( events );
+    QList<QPair<quint32, QString> > handled;
+    for( int i = 0; i < events.size(); )
+    {
+        const struct inotify_event *event = reinterpret_cast<const struct inotify_event*>( events.constData() + i );
+        if( event->mask )
+        {
+            handled.append( qMakePair( (quint32)event->mask, QString::fromUtf8( event->name ) ) );
+        }
+        i += sizeof *event + event->len;
+    }
+    QCOMPARE( handled.size(), 1 );
+    QCOMPARE( handled[0], qMakePair( (quint32)IN_CREATE, QString("photo.jpg") ) );
+
+    QDir( root ).removeRecursively();
+}
+
+void FSStoragePlugin_test::testRemoveTree()
+{
+    const QString root("/tmp/mtptests-remove");
+    const QString outside("/tmp/mtptests-remove-outside");
+    QDir().mkpath( outside );
+    QFile( outside + "/keep.jpg" ).open( QIODevice::WriteOnly );
+    for( int dir = 0; dir < 4; ++dir )
+    {
+        QString dirPath = QString( "%1/DCIM/%2/sub" ).arg( root ).arg( 100 + dir );
+        QDir().mkpath( dirPath );
+        for( int i = 0; i < 300; ++i )
+        {
+            QFile( QString( "%1/../IMG_%2.jpg" ).arg( dirPath ).arg( i ) ).open( QIODevice::WriteOnly );
+        }
+    }
+    QFile::link( outside, root + "/DCIM/100/outside" );
+    QDir().mkpath( root + "/DCIM/102/private" );
+    QFile( root + "/DCIM/102/private/secret.jpg" ).open( QIODevice::WriteOnly );
+
+    FSStoragePlugin *storage = createStorage( root, 11, false );
+    storage->excludePath( "DCIM/102/private" );
+    setupPlugin( storage );
+    // Not indexed yet, as no events are processed before the removal.
+    QFile( root + "/DCIM/103/stray.jpg" ).open( QIODevice::WriteOnly );
+
+    // A cancel stops the removal with the index still matching the disk.
+    bool cancel = true;
+    QObject::connect( storage, &StoragePlugin::checkTransportEvents,
+                      [&cancel]( bool &txCancelled ) { txCancelled = cancel; } );
+    QCOMPARE( storage->deleteItem( storage->handleForPath( root + "/DCIM/101" ), MTP_OBF_FORMAT_Undefined ),
+              (MTPResponseCode)MTP_RESP_TransactionCancelled );
+    foreach( StorageItem *item, storage->m_objectHandlesMap )
+    {
+        QVERIFY2( QFileInfo( item->path() ).exists() || QFileInfo( item->path() ).isSymLink(),
+                  qPrintable( item->path() ) );
+    }
+
+    // Without one the whole tree goes, links are removed but not followed.
+    cancel = false;
+    ObjHandle dir100 = storage->handleForPath( root + "/DCIM/100" );
+    QVERIFY( dir100 );
+    QCOMPARE( storage->deleteItem( dir100, MTP_OBF_FORMAT_Undefined ), (MTPResponseCode)MTP_RESP_OK );
+    QVERIFY( !QFileInfo( root + "/DCIM/100" ).exists() );
+    QVERIFY( QFile::exists( outside + "/keep.jpg" ) );
+    QVERIFY( !storage->checkHandle( dir100 ) );
+
+    // Excluded and unindexed entries stay, and so do the directories
+    // leading to them.
+    ObjHandle dcim = storage->handleForPath( root + "/DCIM" );
+    QVERIFY( dcim );
+    QCOMPARE( storage->deleteItem( dcim, MTP_OBF_FORMAT_Undefined ), (MTPResponseCode)MTP_RESP_PartialDeletion );
+    QVERIFY( QFile::exists( root + "/DCIM/102/private/secret.jpg" ) );
+    QVERIFY( QFile::exists( root + "/DCIM/103/stray.jpg" ) );
+    QVERIFY( !QFileInfo( root + "/DCIM/101" ).exists() );
+    QVERIFY( !QFile::exists( root + "/DCIM/103/IMG_0.jpg" ) );
+    QVERIFY( storage->checkHandle( dcim ) );
+    foreach( StorageItem *item, storage->m_objectHandlesMap )
+    {
+        QVERIFY2( QFileInfo( item->path() ).exists(), qPrintable( item->path() ) );
+    }
+
+    destroyStorage( storage, root );
+    QDir( outside ).removeRecursively();
+}
+
+void FSStoragePlugin_test::testKernelCopy()
+{
+    const QString root("/tmp/mtptests-copy");
+    QDir().mkpath( root + "/src" );
+    QDir().mkpath( root + "/dst" );
+    QDir().mkpath( root + "/cancelled" );
+    QByteArray content;
+    for( int i = 0; i < 5 * 1024 * 1024 / 4; ++i )
+    {
+        content.append( reinterpret_cast<const char *>( &i ), 4 );
+    }
+    QFile source( root + "/src/video.mp4" );
+    QVERIFY( source.open( QIODevice::WriteOnly ) );
+    source.write( content );
+    source.close();
+
+    FSStoragePlugin *storage = createStorage( root, 12 );
+
+    ObjHandle copied = 0;
+    QCOMPARE( storage->copyObject( storage->handleForPath( root + "/src/video.mp4" ),
+                                   storage->handleForPath( root + "/dst" ), 0, copied ),
+              (MTPResponseCode)MTP_RESP_OK );
+    QCOMPARE( copied, storage->handleForPath( root + "/dst/video.mp4" ) );
+    QFile copy( root + "/dst/video.mp4" );
+    QVERIFY( copy.open( QIODevice::ReadOnly ) );
+    QVERIFY( copy.readAll() == content );
+    copy.close();
+
+    // A cancel between two chunks drops the partial copy. Reflinks finish
+    // before there's anything to cancel.
+    QObject::connect( storage, &StoragePlugin::checkTransportEvents,
+                      []( bool &txCancelled ) { txCancelled = true; } );
+    MTPResponseCode response = storage->copyObject( storage->handleForPath( root + "/src/video.mp4" ),
+                                                    storage->handleForPath( root + "/cancelled" ), 0, copied );
+    if( MTP_RESP_OK == response )
+    {
+        QCOMPARE( QFileInfo( root + "/cancelled/video.mp4" ).size(), (qint64)content.size() );
+    }
+    else
+    {
+        QCOMPARE( response, (MTPResponseCode)MTP_RESP_GeneralError );
+        QVERIFY( !storage->checkHandle( copied ) );
+    }
+
+    destroyStorage( storage, root );
+}
+
+void FSStoragePlugin_test::testCopyTree()
+{
+    const QString root("/tmp/mtptests-copytree");
+    QStringList files;
+    for( int i = 0; i < 64; ++i )
+    {
+        QString name = QString( "/Album/CD%1/track%2.mp3" ).arg( i % 3 ).arg( i );
+        QDir().mkpath( QFileInfo( root + name ).path() );
+        QFile file( root + name );
+        QVERIFY( file.open( QIODevice::WriteOnly ) );
+        file.write( QByteArray( 1000 + i * 997, 'a' + i % 26 ) );
+        file.close();
+        files << name;
+    }
+    QDir().mkpath( root + "/Album/empty" );
+    QDir().mkpath( root + "/Backup" );
+
+    FSStoragePlugin *storage = createStorage( root, 13 );
+
+    ObjHandle copied = 0;
+    QCOMPARE( storage->copyObject( storage->handleForPath( root + "/Album" ),
+                                   storage->handleForPath( root + "/Backup" ), 0, copied ),
+              (MTPResponseCode)MTP_RESP_OK );
+    QCOMPARE( copied, storage->handleForPath( root + "/Backup/Album" ) );
+    QVERIFY( storage->handleForPath( root + "/Backup/Album/empty" ) );
+    foreach( const QString &name, files )
+    {
+        QFile original( root + name );
+        QFile copy( root + "/Backup" + name );
+        QVERIFY( original.open( QIODevice::ReadOnly ) );
+        QVERIFY( copy.open( QIODevice::ReadOnly ) );
+        QVERIFY( original.readAll() == copy.readAll() );
+        QVERIFY( storage->handleForPath( root + "/Backup" + name ) );
+    }
+
+    destroyStorage( storage, root );
+}
+
+void FSStoragePlugin_test::testReadFdCache()
+{
+    const QString root("/tmp/mtptests-readfds");
+    QDir().mkpath( root );
+    QByteArray content;
+    for( int i = 0; i < 64 * 1024 / 4; ++i )
+    {
+        content.append( reinterpret_cast<const char *>( &i ), 4 );
+    }
+    for( int i = 0; i < 3; ++i )
+    {
+        QFile file( root + QString( "/file%1.bin" ).arg( i ) );
+        QVERIFY( file.open( QIODevice::WriteOnly ) );
+        file.write( content );
+        file.close();
+    }
+
+    FSStoragePlugin *storage = createStorage( root, 14 );
+    storage->m_readFds->setCapacity( 2 );
+
+    // Segments of one object share a descriptor.
+    ObjHandle first = storage->handleForPath( root + "/file0.bin" );
+    QByteArray data( content.size(), 0 );
+    for( int offset = 0; offset < content.size(); offset += 5000 )
+    {
+        qint32 len = qMin( 5000, content.size() - offset );
+        QCOMPARE( storage->readData( first, data.data() + offset, len, offset ), (MTPResponseCode)MTP_RESP_OK );
+        QCOMPARE( len, qMin( 5000, content.size() - offset ) );
+    }
+    QVERIFY( data == content );
+    QCOMPARE( storage->m_readFds->count(), 1 );
+
+    // Reading past the end fails.
+    qint32 len = 100;
+    QCOMPARE( storage->readData( first, data.data(), len, content.size() - 50 ), (MTPResponseCode)MTP_RESP_GeneralError );
+
+    // The least recently used file is closed when the cache is full.
+    ObjHandle second = storage->handleForPath( root + "/file1.bin" );
+    ObjHandle third = storage->handleForPath( root + "/file2.bin" );
+    len = 100;
+    QCOMPARE( storage->readData( first, data.data(), len, 0 ), (MTPResponseCode)MTP_RESP_OK );
+    QCOMPARE( storage->readData( second, data.data(), len, 0 ), (MTPResponseCode)MTP_RESP_OK );
+    QCOMPARE( storage->readData( third, data.data(), len, 0 ), (MTPResponseCode)MTP_RESP_OK );
+    QCOMPARE( storage->m_readFds->count(), 2 );
+
+    // Truncating and deleting drop the cached descriptor.
+    QCOMPARE( storage->truncateItem( third, 10 ), (MTPResponseCode)MTP_RESP_OK );
+    QCOMPARE( storage->m_readFds->count(), 1 );
+    QCOMPARE( storage->readData( third, data.data(), len, 0 ), (MTPResponseCode)MTP_RESP_GeneralError );
+    QCOMPARE( storage->deleteItem( second, MTP_OBF_FORMAT_Undefined ), (MTPResponseCode)MTP_RESP_OK );
+    QCOMPARE( storage->m_readFds->count(), 0 );
+
+    // Without caching, every read opens and closes the file.
+    storage->m_readFds->setCapacity( 0 );
+    len = 100;
+    QCOMPARE( storage->readData( first, data.data(), len, 200 ), (MTPResponseCode)MTP_RESP_OK );
+    QVERIFY( data.left( 100 ) == content.mid( 200, 100 ) );
+    QCOMPARE( storage->m_readFds->count(), 0 );
+
+    destroyStorage( storage, root );
+}
+
+void FSStoragePlugin_test::testReadAhead()
+{
+    const QString root("/tmp/mtptests-readahead");
+    QDir().mkpath( root );
+    QFile file( root + "/movie.mp4" );
+    QVERIFY( file.open( QIODevice::WriteOnly ) );
+    QVERIFY( file.resize( 4 * 1024 * 1024 ) );
+    file.close();
+
+    FSStoragePlugin *storage = createStorage( root, 16 );
+
+    ObjHandle handle = storage->handleForPath( root + "/movie.mp4" );
+    QByteArray buffer( 16 * 1024, 0 );
+    qint32 len = buffer.size();
+
+    // A sequential stream gets a growing window ahead of it.
+    quint32 window = 0;
+    for( int i = 0; i < 64; ++i )
+    {
+        len = buffer.size();
+        QCOMPARE( storage->readData( handle, buffer.data(), len, i * buffer.size() ), (MTPResponseCode)MTP_RESP_OK );
+        const FSFdCache::Entry &entry = storage->m_readFds->m_fds[handle];
+        QVERIFY( entry.window >= window );
+        window = entry.window;
+        if( i > 0 )
+        {
+            QVERIFY( entry.aheadEnd > entry.nextOffset );
+        }
+    }
+    QVERIFY( window > 128 * 1024 );
+
+    // Jumping elsewhere starts over.
+    len = buffer.size();
+    QCOMPARE( storage->readData( handle, buffer.data(), len, 100 ), (MTPResponseCode)MTP_RESP_OK );
+    QCOMPARE( storage->m_readFds->m_fds[handle].sequentialReads, 0 );
+    QCOMPARE( storage->m_readFds->m_fds[handle].window, (quint32)128 * 1024 );
+
+    // Strided reads are recognized as such.
+    for( int i = 1; i < 4; ++i )
+    {
+        len = buffer.size();
+        QCOMPARE( storage->readData( handle, buffer.data(), len, 100 + i * 1000000 ), (MTPResponseCode)MTP_RESP_OK );
+    }
+    QCOMPARE( storage->m_readFds->m_fds[handle].stride, (qint64)1000000 );
+    QCOMPARE( storage->m_readFds->m_fds[handle].sequentialReads, 0 );
+
+    destroyStorage( storage, root );
+}
+
+void FSStoragePlugin_test::benchmarkSegmentedRead_data()
+{
+    QTest::addColumn<int>("capacity");
+    QTest::newRow("uncached") << 0;
+    QTest::newRow("cached") << (int)FSFdCache::DEFAULT_CAPACITY;
+}
+
+void FSStoragePlugin_test::benchmarkSegmentedRead()
+{
+    QFETCH(int, capacity);
+    const QString root("/tmp/mtptests-readbench");
+    QDir().mkpath( root );
+    QFile file( root + "/movie.mp4" );
+    QVERIFY( file.open( QIODevice::WriteOnly ) );
+    QVERIFY( file.resize( 16 * 1024 * 1024 ) );
+    file.close();
+
+    FSStoragePlugin *storage = createStorage( root, 15 );
+    storage->m_readFds->setCapacity( capacity );
+
+    // Same segment size as the responder uses for GetObject.
+    const qint32 segmentSize = 4 * 4096 - 12;
+    const qint32 fileSize = 16 * 1024 * 1024;
+    ObjHandle handle = storage->handleForPath( root + "/movie.mp4" );
+    QByteArray buffer( segmentSize, 0 );
+    QBENCHMARK
+    {
+        for( qint32 offset = 0; offset < fileSize; offset += segmentSize )
+        {
+            qint32 len = qMin( segmentSize, fileSize - offset );
+            QCOMPARE( storage->readData( handle, buffer.data(), len, offset ), (MTPResponseCode)MTP_RESP_OK );
+        }
+    }
+
+    destroyStorage( storage, root );
+}
+
+void FSStoragePlugin_test::testSendObjectPreallocation()
+{
+    const QString root("/tmp/mtptests-prealloc");
+    QDir().mkpath( root );
+
+    FSStoragePlugin *storage = createStorage( root, 17 );
+
+    MTPStorageInfo storageInfo;
+    QCOMPARE( storage->storageInfo( storageInfo ), (MTPResponseCode)MTP_RESP_OK );
+
+    // An object that can't fit is refused up front.
+    ObjHandle parentHandle = 0, handle = 0;
+    MTPObjectInfo objectInfo;
+    objectInfo.mtpParentObject = 0;
+    objectInfo.mtpFileName = "huge.mkv";
+    objectInfo.mtpObjectFormat = MTP_OBF_FORMAT_Undefined;
+    objectInfo.mtpObjectCompressedSize = storageInfo.freeSpace + 1024 * 1024 * 1024;
+    QCOMPARE( storage->addItem( parentHandle, handle, &objectInfo ), (MTPResponseCode)MTP_RESP_StoreFull );
+    QVERIFY( !QFile::exists( root + "/huge.mkv" ) );
+
+    // Segments end up in the file in order.
+    QByteArray content;
+    for( int i = 0; i < 3 * 1024 * 1024 / 4; ++i )
+    {
+        content.append( reinterpret_cast<const char *>( &i ), 4 );
+    }
+    objectInfo.mtpFileName = "complete.bin";
+    objectInfo.mtpObjectCompressedSize = content.size();
+    QCOMPARE( storage->addItem( parentHandle, handle, &objectInfo ), (MTPResponseCode)MTP_RESP_OK );
+    const int segmentSize = 16 * 1024 - 12;
+    for( int offset = 0; offset < content.size(); offset += segmentSize )
+    {
+        int len = qMin( segmentSize, content.size() - offset );
+        QCOMPARE( storage->writeData( handle, content.data() + offset, len, 0 == offset,
+                                      offset + len == content.size() ),
+                  (MTPResponseCode)MTP_RESP_OK );
+    }
+    QCOMPARE( storage->writeData( handle, 0, 0, false, true ), (MTPResponseCode)MTP_RESP_OK );
+    QFile complete( root + "/complete.bin" );
+    QVERIFY( complete.open( QIODevice::ReadOnly ) );
+    QVERIFY( complete.readAll() == content );
+    complete.close();
+
+    // A transfer cut short gives back the space reserved for the rest.
+    objectInfo.mtpFileName = "partial.bin";
+    objectInfo.mtpObjectCompressedSize = 64 * 1024 * 1024;
+    QCOMPARE( storage->addItem( parentHandle, handle, &objectInfo ), (MTPResponseCode)MTP_RESP_OK );
+    QCOMPARE( storage->writeData( handle, content.data(), content.size(), true, false ), (MTPResponseCode)MTP_RESP_OK );
+    QCOMPARE( storage->writeData( handle, 0, 0, false, true ), (MTPResponseCode)MTP_RESP_OK );
+    struct stat st;
+    QCOMPARE( stat( QFile::encodeName( root + "/partial.bin" ).constData(), &st ), 0 );
+    QCOMPARE( (qint64)st.st_size, (qint64)content.size() );
+    QVERIFY( (qint64)st.st_blocks * 512 < 2 * content.size() );
+
+    // Discarding a partial transfer leaves an empty file.
+    objectInfo.mtpFileName = "discarded.bin";
+    QCOMPARE( storage->addItem( parentHandle, handle, &objectInfo ), (MTPResponseCode)MTP_RESP_OK );
+    QCOMPARE( storage->writeData( handle, content.data(), content.size(), true, false ), (MTPResponseCode)MTP_RESP_OK );
+    QCOMPARE( storage->truncateItem( handle, 0 ), (MTPResponseCode)MTP_RESP_OK );
+    QCOMPARE( storage->writeData( handle, 0, 0, false, true ), (MTPResponseCode)MTP_RESP_OK );
+    QCOMPARE( QFileInfo( root + "/discarded.bin" ).size(), (qint64)0 );
+
+    // So does a cancel, which deletes the object mid-transfer.
+    objectInfo.mtpFileName = "cancelled.bin";
+    QCOMPARE( storage->addItem( parentHandle, handle, &objectInfo ), (MTPResponseCode)MTP_RESP_OK );
+    QCOMPARE( storage->writeData( handle, content.data(), content.size(), true, false ), (MTPResponseCode)MTP_RESP_OK );
+    QCOMPARE( storage->deleteItem( handle, MTP_OBF_FORMAT_Undefined ), (MTPResponseCode)MTP_RESP_OK );
+    QVERIFY( !storage->m_dataFile );
+    QVERIFY( !QFile::exists( root + "/cancelled.bin" ) );
+
+    destroyStorage( storage, root );
+}
+
+void FSStoragePlugin_test::benchmarkSendObject_data()
+{
+    QTest::addColumn<int>("fileCount");
+    QTest::addColumn<int>("fileSize");
+    QTest::newRow("small files") << 256 << 64 * 1024;
+    QTest::newRow("huge file") << 1 << 64 * 1024 * 1024;
+}
+
+void FSStoragePlugin_test::benchmarkSendObject()
+{
+    QFETCH(int, fileCount);
+    QFETCH(int, fileSize);
+    const QString root("/tmp/mtptests-writebench");
+    QDir().mkpath( root );
+
+    FSStoragePlugin *storage = createStorage( root, 18 );
+
+    // Same segment size as the responder hands over during SendObject.
+    const int segmentSize = 16 * 1024 - 12;
+    QByteArray segment( segmentSize, 'x' );
+    MTPObjectInfo objectInfo;
+    objectInfo.mtpParentObject = 0;
+    objectInfo.mtpObjectFormat = MTP_OBF_FORMAT_Undefined;
+    objectInfo.mtpObjectCompressedSize = fileSize;
+    int round = 0;
+    QBENCHMARK
+    {
+        for( int i = 0; i < fileCount; ++i )
+        {
+            ObjHandle parentHandle = 0, handle = 0;
+            objectInfo.mtpFileName = QString( "file%1-%2" ).arg( round ).arg( i );
+            QCOMPARE( storage->addItem( parentHandle, handle, &objectInfo ), (MTPResponseCode)MTP_RESP_OK );
+            for( int offset = 0; offset < fileSize; offset += segmentSize )
+            {
+                int len = qMin( segmentSize, fileSize - offset );
+                QCOMPARE( storage->writeData( handle, segment.data(), len, 0 == offset, offset + len == fileSize ),
+                          (MTPResponseCode)MTP_RESP_OK );
+            }
+            QCOMPARE( storage->writeData( handle, 0, 0, false, true ), (MTPResponseCode)MTP_RESP_OK );
+        }
+        ++round;
+    }
+
+    destroyStorage( storage, root );
+}
+
+void FSStoragePlugin_test::testWriteBehind()
+{
+    const QString path("/tmp/mtptests-writebehind.bin");
+    QFile file( path );
+    QVERIFY( file.open( QIODevice::WriteOnly | QIODevice::Truncate ) );
+
+    // Chunks land in order, and more of them than the queue holds.
+    QByteArray content;
+    {
+        FSWriteBehind writer( file.handle(), 2 );
+        writer.start();
+        for( int i = 0; i < 16; ++i )
+        {
+            QByteArray chunk( 64 * 1024 + i, 'a' + i );
+            content += chunk;
+            QCOMPARE( writer.enqueue( chunk ), 0 );
+        }
+        QCOMPARE( writer.drain(), 0 );
+        QCOMPARE( writer.offset(), (quint64)content.size() );
+
+        // Discarding starts over at the given offset.
+        writer.discard( 10 );
+        QCOMPARE( writer.enqueue( QByteArray( "xyz" ) ), 0 );
+        QCOMPARE( writer.drain(), 0 );
+        content.replace( 10, 3, "xyz" );
+    }
+    file.close();
+    QVERIFY( file.open( QIODevice::ReadOnly ) );
+    QVERIFY( file.readAll() == content );
+
+    // A failed write is reported from then on.
+    {
+        FSWriteBehind writer( file.handle() );
+        writer.start();
+        writer.enqueue( QByteArray( 100, 'x' ) );
+        QCOMPARE( writer.drain(), EBADF );
+        QCOMPARE( writer.enqueue( QByteArray( 100, 'x' ) ), EBADF );
+        writer.discard( 0 );
+        QCOMPARE( writer.drain(), 0 );
+    }
+    file.close();
+    QFile::remove( path );
+}
+
 void FSStoragePlugin_test::cleanupTestCase()
 {
     delete m_storage;
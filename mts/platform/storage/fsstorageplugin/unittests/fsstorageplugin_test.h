@@ -97,12 +97,45 @@ private slots:
     void testCreatePlaylists();
     void testPlaylistsPersistence();
     void testThumbnailer();
+    void testSnapshotStartup();
+    void benchmarkStartup_data();
+    void benchmarkStartup();
+    void testLazyEnumeration();
+    void testCompactNodeMemory();
+    void testPathIndexRename();
+    void testFormatIndex();
+    void testObjectCounters();
+    void testStatEntry();
+    void benchmarkDirWalker_data();
+    void benchmarkDirWalker();
+    void testFormatDetection();
+    void testLogStore();
+    void testPuoidsLog();
+    void testFanotifyMonitor();
+    void testEventCoalescing();
+    void testRemoveTree();
+    void testKernelCopy();
+    void testCopyTree();
+    void testReadFdCache();
+    void testReadAhead();
+    void benchmarkSegmentedRead_data();
+    void benchmarkSegmentedRead();
+    void testSendObjectPreallocation();
+    void benchmarkSendObject_data();
+    void benchmarkSendObject();
+    void testWriteBehind();
     void cleanupTestCase();
 
 private:
     FSStoragePlugin *m_storage;
 
     void setupPlugin(StoragePlugin *plugin);
+    /// Creates a storage over root, without a snapshot unless keepSnapshot
+    /// is set, and waits for its enumeration unless enumerate is false.
+    FSStoragePlugin *createStorage( const QString &root, quint32 storageId,
+                                    bool enumerate = true, bool keepSnapshot = false );
+    /// Deletes storage, its snapshot and root.
+    void destroyStorage( FSStoragePlugin *storage, const QString &root );
 };
 }
 #endif
@@ -3,7 +3,7 @@
 ######################################################################
 
 CONFIG += warn_off debug_and_release link_pkgconfig
-CONFIG += qtsparql
+CONFIG += qtsparql c++11
 
 PKGCONFIG += buteosyncfw5 Qt5SystemInfo
 
@@ -42,9 +42,16 @@ HEADERS += fsstorageplugin_test.h \
            ../../storageplugin.h \
            ../fsstorageplugin.h \
            ../fsinotify.h \
+           ../fscopyengine.h \
+           ../fsfdcache.h \
+           ../fsdirwalker.h \
+           ../fstreeremover.h \
+           ../fswritebehind.h \
+           ../logstore.h \
            ../thumbnailer.h \
            ../thumbnailerproxy.h \
            ../storagetracker.h \
+           ../../eventscheduler.h \
            ../../storagefactory.h \
            ../../../../device_interface.h \
            ../storageitem.h \
@@ -56,6 +63,8 @@ HEADERS += fsstorageplugin_test.h \
            protocol/mtptxcontainer.h \
            protocol/propertypod.h \
            protocol/objectpropertycache.h \
+           protocol/segmentring.h \
+           common/bufferpool.h \
            protocol/mtpextensionmanager.h \
            protocol/extensions/mtpextension.h \
            transport/mtptransporter.h \
@@ -69,10 +78,17 @@ HEADERS += fsstorageplugin_test.h \
 SOURCES += fsstorageplugin_test.cpp \
            ../fsstorageplugin.cpp \
            ../fsinotify.cpp \
+           ../fscopyengine.cpp \
+           ../fsfdcache.cpp \
+           ../fsdirwalker.cpp \
+           ../fstreeremover.cpp \
+           ../fswritebehind.cpp \
+           ../logstore.cpp \
            ../storageitem.cpp \
            ../thumbnailer.cpp \
            ../thumbnailerproxy.cpp \
            ../storagetracker.cpp \
+           ../../eventscheduler.cpp \
            ../../storagefactory.cpp \
            ../../storageplugin.cpp \
            ../../../../device_interface.cpp \
@@ -84,6 +100,8 @@ SOURCES += fsstorageplugin_test.cpp \
            protocol/mtptxcontainer.cpp \
            protocol/propertypod.cpp \
            protocol/objectpropertycache.cpp \
+           protocol/segmentring.cpp \
+           common/bufferpool.cpp \
            protocol/mtpextensionmanager.cpp \
            transport/usb/mtptransporterusb.cpp \
            transport/usb/threadio.cpp \
@@ -33,6 +33,7 @@
 
 #include <QDir>
 
+#include "eventscheduler.h"
 #include "objectpropertycache.h"
 #include "storagefactory.h"
 #include "storageplugin.h"
@@ -46,7 +47,8 @@ using namespace meegomtp1dot0;
  ******************************************************/
 StorageFactory::StorageFactory(): m_storageId(0),
         m_storagePluginsPath(pluginLocation), m_newObjectHandle(0),
-        m_newPuoid(0), m_objectPropertyCache(new ObjectPropertyCache)
+        m_newPuoid(0), m_objectPropertyCache(new ObjectPropertyCache),
+        m_eventScheduler(new EventScheduler)
 {
     //TODO For now handle only the file system storage plug-in. As we have more storages
     // make this generic.
@@ -170,14 +172,20 @@ bool StorageFactory::enumerateStorages(QVector<quint32>& failedStorageIds)
 {
     bool result = true;
 
+    // Events reach the initiator through the scheduler, which coalesces
+    // and paces them.
+    connect(m_eventScheduler.data(), &EventScheduler::eventReady,
+        MTPResponder::instance(), &MTPResponder::dispatchEvent);
+
     QHash<quint32,StoragePlugin*>::const_iterator itr;
     for (itr = m_allStorages.constBegin(); itr != m_allStorages.constEnd(); ++itr) {
         // Connect the storage plugin's eventGenerated signal
         connect(itr.value(), &StoragePlugin::eventGenerated,
             this, &StorageFactory::onStorageEvent, Qt::QueuedConnection);
+        // Direct, so that the parent of a removed object can still be
+        // looked up.
         connect(itr.value(), &StoragePlugin::eventGenerated,
-            MTPResponder::instance(), &MTPResponder::dispatchEvent,
-            Qt::QueuedConnection);
+            this, &StorageFactory::scheduleStorageEvent, Qt::DirectConnection);
 
         // Connects for assigning object handles
         connect(itr.value(), &StoragePlugin::objectHandle,
@@ -329,6 +337,42 @@ MTPResponseCode StorageFactory::getObjectHandles( const quint32& storageId, cons
     return response;
 }
 
+/*******************************************************
+ * MTPResponseCode StorageFactory::getNumObjects
+ ******************************************************/
+MTPResponseCode StorageFactory::getNumObjects( const quint32& storageId, const MTPObjFormatCode& formatCode, const quint32& associationHandle,
+                                               quint32 &noOfObjects ) const
+{
+    MTPResponseCode response = MTP_RESP_InvalidStorageID;
+    noOfObjects = 0;
+    // Get the total count across all storages.
+    if( 0xFFFFFFFF == storageId )
+    {
+        QHash<quint32,StoragePlugin*>::const_iterator itr = m_allStorages.constBegin();
+        for( ; itr != m_allStorages.constEnd(); ++itr )
+        {
+            quint32 count = 0;
+            response = itr.value()->getNumObjects( formatCode, associationHandle, count );
+            if( MTP_RESP_OK != response )
+            {
+                break;
+            }
+            noOfObjects += count;
+        }
+    }
+    else
+    {
+        //Get the no. of objects from the requested storage.
+        StoragePlugin *storagePlugin =  m_allStorages.value(storageId);
+        if( storagePlugin )
+        {
+            response = storagePlugin->getNumObjects( formatCode, associationHandle, noOfObjects );
+        }
+    }
+
+    return response;
+}
+
 /*******************************************************
  * static MTPResponseCode StorageFactory::storageIds
  ******************************************************/
@@ -501,6 +545,23 @@ MTPResponseCode StorageFactory::truncateItem( const ObjHandle &handle, const qui
     return MTP_RESP_InvalidObjectHandle;
 }
 
+/*******************************************************
+ * void StorageFactory::scheduleStorageEvent
+ ******************************************************/
+void StorageFactory::scheduleStorageEvent(MTPEventCode event, const QVector<quint32> &params)
+{
+    ObjHandle parentHandle = 0;
+    quint32 storageId = 0;
+    StoragePlugin *storage = qobject_cast<StoragePlugin *>(sender());
+    if (storage) {
+        storageId = storage->storageId();
+        if (event == MTP_EV_ObjectRemoved && !params.isEmpty()) {
+            storage->getParentHandle(params[0], parentHandle);
+        }
+    }
+    m_eventScheduler->postEvent(event, params, parentHandle, storageId);
+}
+
 /*******************************************************
  * MTPResponseCode StorageFactory::readData
  ******************************************************/
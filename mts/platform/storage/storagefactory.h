@@ -44,6 +44,7 @@ class QDir;
 
 namespace meegomtp1dot0
 {
+class EventScheduler;
 class StoragePlugin;
 class ObjectPropertyCache;
 
@@ -108,6 +109,16 @@ public:
     MTPResponseCode getObjectHandles( const quint32& storageId, const MTPObjFormatCode& formatCode,
                                        const quint32& associationHandle, QVector<ObjHandle> &objectHandles ) const;
 
+    /// Returns the no. of items belonging to a certain format and/or contained in a certain folder,
+    /// without collecting their handles.
+    /// \param storageId [in] which storage to look for.
+    /// \param formatCode [in] this optional arg can be used to count only objects of a certain format.
+    /// \param associationHandle [in] this optional argument can specify the containing folder.
+    /// \param noOfObjects [out] no. of objects found.
+    /// \return MTP response.
+    MTPResponseCode getNumObjects( const quint32& storageId, const MTPObjFormatCode& formatCode,
+                                   const quint32& associationHandle, quint32 &noOfObjects ) const;
+
     /// Gets the id's of all the created storages.
     /// \param storageIds [out] A vector containing the storage id's.
     /// \return MTP response.
@@ -256,6 +267,9 @@ private:
     /// cache with StoragePlugin::getChildPropertyValues().
     QSet<ObjHandle> m_massQueriedAssociations;
 
+    /// Coalesces and paces the events sent to the initiator.
+    QScopedPointer<EventScheduler> m_eventScheduler;
+
 private slots:
     /// This slot is called when some of the underlying storage plugins
     /// generates an MTP event.
@@ -264,6 +278,14 @@ private slots:
     /// \param params [in] a collection of event parameters.
     void onStorageEvent(MTPEventCode event, const QVector<quint32> &params);
 
+    /// Hands an event generated by a storage plugin over to the event
+    /// scheduler. Called directly from the emitting plugin, so the parent of
+    /// a removed object is looked up before the object is gone.
+    ///
+    /// \param event [in] an MTP event code.
+    /// \param params [in] a collection of event parameters.
+    void scheduleStorageEvent(MTPEventCode event, const QVector<quint32> &params);
+
 #ifdef UT_ON
     friend class StorageFactory_test;
 #endif
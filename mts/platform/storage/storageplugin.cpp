@@ -40,6 +40,24 @@ using namespace meegomtp1dot0;
 
 const quint32 MAX_READ_LEN = 64 * 1024;
 
+MTPResponseCode StoragePlugin::getNumObjects( const MTPObjFormatCode& formatCode,
+        const quint32& associationHandle, quint32 &noOfObjects ) const
+{
+    // Storages that keep no counters of their own just count the handles.
+    QVector<ObjHandle> handles;
+    MTPResponseCode result = getObjectHandles( formatCode, associationHandle, handles );
+    noOfObjects = handles.size();
+    return result;
+}
+
+MTPResponseCode StoragePlugin::getParentHandle( const ObjHandle &handle, ObjHandle &parentHandle )
+{
+    const MTPObjectInfo *objectInfo = 0;
+    MTPResponseCode result = getObjectInfo( handle, objectInfo );
+    parentHandle = ( MTP_RESP_OK == result && objectInfo ) ? objectInfo->mtpParentObject : 0;
+    return result;
+}
+
 MTPResponseCode StoragePlugin::copyData(StoragePlugin *sourceStorage,
         ObjHandle source, StoragePlugin *destinationStorage,
         ObjHandle destination)
@@ -111,6 +111,18 @@ public:
     virtual MTPResponseCode getObjectHandles( const MTPObjFormatCode& formatCode, const quint32& associationHandle,
                                               QVector<ObjHandle> &objectHandles ) const = 0;
 
+    /// Counts the child objects of a given association (folder), without
+    /// collecting their handles.
+    ///
+    /// \param formatCode [in] if not zero, counts only objects of particular
+    ///                   type.
+    /// \param associationHandle [in] the association whose children to count.
+    /// \param noOfObjects [out] the number of matching objects.
+    ///
+    /// \return MTP response.
+    virtual MTPResponseCode getNumObjects( const MTPObjFormatCode& formatCode, const quint32& associationHandle,
+                                           quint32 &noOfObjects ) const;
+
     /// Searches for the given object handle in this storage.
     ///
     /// \param handle [in] the object handle.
@@ -163,6 +175,14 @@ public:
     /// \return MTP response.
     virtual MTPResponseCode getObjectInfo( const ObjHandle &handle, const MTPObjectInfo *&objectInfo ) = 0;
 
+    /// Given an object handle, provides the handle of its parent association.
+    /// The default implementation goes through the objectinfo dataset;
+    /// storages that keep the object tree in memory can answer cheaper.
+    /// \param handle [in] the object handle.
+    /// \param parentHandle [out] the parent handle, 0 for objects in the storage root.
+    /// \return MTP response.
+    virtual MTPResponseCode getParentHandle( const ObjHandle &handle, ObjHandle &parentHandle );
+
     /// Writes data onto a storage item.
     /// \param handle [in] the object handle.
     /// \param writeBuffer [in] the data to be written.
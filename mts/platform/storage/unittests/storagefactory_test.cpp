@@ -22,6 +22,7 @@
  */
 
 #include "storagefactory_test.h"
+#include "eventscheduler.h"
 #include "storagefactory.h"
 #include "mtpresponder.h"
 
@@ -183,6 +184,108 @@ void StorageFactory_test::testMassObjectPropertyQueryThrottle()
     QVERIFY(!m_storageFactory->m_massQueriedAssociations.contains(massDirHandle));
 }
 
+void StorageFactory_test::testEventCoalescing()
+{
+    EventScheduler scheduler;
+    QSignalSpy spy(&scheduler,
+            SIGNAL(eventReady(MTPEventCode, const QVector<quint32>&)));
+
+    // Changes to an object that's about to be announced are redundant.
+    scheduler.postEvent(MTP_EV_ObjectAdded, QVector<quint32>() << 100);
+    scheduler.postEvent(MTP_EV_ObjectInfoChanged, QVector<quint32>() << 100);
+    scheduler.postEvent(MTP_EV_ObjectPropChanged,
+            QVector<quint32>() << 100 << MTP_OBJ_PROP_Obj_Size);
+
+    // One ObjectInfoChanged per object.
+    scheduler.postEvent(MTP_EV_ObjectInfoChanged, QVector<quint32>() << 5);
+    scheduler.postEvent(MTP_EV_ObjectInfoChanged, QVector<quint32>() << 5);
+    scheduler.postEvent(MTP_EV_ObjectPropChanged,
+            QVector<quint32>() << 5 << MTP_OBJ_PROP_Obj_Size);
+
+    // A removed subtree collapses into its root.
+    scheduler.postEvent(MTP_EV_ObjectInfoChanged, QVector<quint32>() << 201);
+    scheduler.postEvent(MTP_EV_ObjectRemoved, QVector<quint32>() << 201, 200);
+    scheduler.postEvent(MTP_EV_ObjectRemoved, QVector<quint32>() << 202, 200);
+    scheduler.postEvent(MTP_EV_ObjectRemoved, QVector<quint32>() << 200, 0);
+
+    // Objects that come and go never reach the initiator.
+    scheduler.postEvent(MTP_EV_ObjectAdded, QVector<quint32>() << 300);
+    scheduler.postEvent(MTP_EV_ObjectRemoved, QVector<quint32>() << 300, 0);
+
+    // Storage events are deduplicated and follow the object events.
+    scheduler.postEvent(MTP_EV_StorageInfoChanged, QVector<quint32>() << STORAGE_ID);
+    scheduler.postEvent(MTP_EV_StorageInfoChanged, QVector<quint32>() << STORAGE_ID);
+
+    QTRY_COMPARE(scheduler.pendingEvents(), 0);
+    QCOMPARE(spy.count(), 4);
+
+    QCOMPARE(spy.at(0).at(0).value<MTPEventCode>(),
+            static_cast<MTPEventCode>(MTP_EV_ObjectAdded));
+    QCOMPARE(spy.at(0).at(1).value<QVector<quint32> >(), QVector<quint32>() << 100);
+    QCOMPARE(spy.at(1).at(0).value<MTPEventCode>(),
+            static_cast<MTPEventCode>(MTP_EV_ObjectInfoChanged));
+    QCOMPARE(spy.at(1).at(1).value<QVector<quint32> >(), QVector<quint32>() << 5);
+    QCOMPARE(spy.at(2).at(0).value<MTPEventCode>(),
+            static_cast<MTPEventCode>(MTP_EV_ObjectRemoved));
+    QCOMPARE(spy.at(2).at(1).value<QVector<quint32> >(), QVector<quint32>() << 200);
+    QCOMPARE(spy.at(3).at(0).value<MTPEventCode>(),
+            static_cast<MTPEventCode>(MTP_EV_StorageInfoChanged));
+}
+
+void StorageFactory_test::testEventBacklogOverflow()
+{
+    EventScheduler scheduler;
+    scheduler.setBacklogLimit(4);
+    QSignalSpy spy(&scheduler,
+            SIGNAL(eventReady(MTPEventCode, const QVector<quint32>&)));
+
+    for (ObjHandle handle = 1; handle <= 10; ++handle) {
+        scheduler.postEvent(MTP_EV_ObjectAdded, QVector<quint32>() << handle);
+    }
+    QVERIFY(scheduler.pendingEvents() <= scheduler.backlogLimit());
+
+    QTRY_COMPARE(scheduler.pendingEvents(), 0);
+    QCOMPARE(spy.count(), 1);
+    QCOMPARE(spy.at(0).at(0).value<MTPEventCode>(),
+            static_cast<MTPEventCode>(MTP_EV_DeviceInfoChanged));
+
+    // Once the rescan hint is out, events flow again.
+    scheduler.postEvent(MTP_EV_ObjectAdded, QVector<quint32>() << 11);
+    QTRY_COMPARE(spy.count(), 2);
+    QCOMPARE(spy.at(1).at(0).value<MTPEventCode>(),
+            static_cast<MTPEventCode>(MTP_EV_ObjectAdded));
+}
+
+void StorageFactory_test::testStoreRemovedEvents()
+{
+    const quint32 otherStorageId = STORAGE_ID + 1;
+    EventScheduler scheduler;
+    QSignalSpy spy(&scheduler,
+            SIGNAL(eventReady(MTPEventCode, const QVector<quint32>&)));
+
+    // A storage event doesn't overtake the object events before it.
+    scheduler.postEvent(MTP_EV_ObjectAdded, QVector<quint32>() << 1, 0, otherStorageId);
+    scheduler.postEvent(MTP_EV_StorageInfoChanged, QVector<quint32>() << otherStorageId);
+
+    // Nothing waiting about a removed store is sent.
+    scheduler.postEvent(MTP_EV_ObjectAdded, QVector<quint32>() << 2, 0, STORAGE_ID);
+    scheduler.postEvent(MTP_EV_ObjectInfoChanged, QVector<quint32>() << 3, 0, STORAGE_ID);
+    scheduler.postEvent(MTP_EV_StorageInfoChanged, QVector<quint32>() << STORAGE_ID);
+    scheduler.postEvent(MTP_EV_StoreRemoved, QVector<quint32>() << STORAGE_ID);
+
+    QTRY_COMPARE(scheduler.pendingEvents(), 0);
+    QCOMPARE(spy.count(), 3);
+    QCOMPARE(spy.at(0).at(0).value<MTPEventCode>(),
+            static_cast<MTPEventCode>(MTP_EV_ObjectAdded));
+    QCOMPARE(spy.at(0).at(1).value<QVector<quint32> >(), QVector<quint32>() << 1);
+    QCOMPARE(spy.at(1).at(0).value<MTPEventCode>(),
+            static_cast<MTPEventCode>(MTP_EV_StorageInfoChanged));
+    QCOMPARE(spy.at(1).at(1).value<QVector<quint32> >(), QVector<quint32>() << otherStorageId);
+    QCOMPARE(spy.at(2).at(0).value<MTPEventCode>(),
+            static_cast<MTPEventCode>(MTP_EV_StoreRemoved));
+    QCOMPARE(spy.at(2).at(1).value<QVector<quint32> >(), QVector<quint32>() << STORAGE_ID);
+}
+
 void StorageFactory_test::cleanupTestCase()
 {
     delete m_storageFactory;
@@ -40,6 +40,9 @@ private slots:
     void testGetObjectHandles();
     void testGetDevicePropValueAfterObjectInfoChanged();
     void testMassObjectPropertyQueryThrottle();
+    void testEventCoalescing();
+    void testEventBacklogOverflow();
+    void testStoreRemovedEvents();
     void cleanupTestCase();
 
 private:
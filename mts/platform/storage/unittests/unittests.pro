@@ -23,6 +23,7 @@ LIBS += -ldl
 
 HEADERS += \
 	storagefactory_test.h \
+	../eventscheduler.h \
 	../storagefactory.h \
 	../storageplugin.h \
 	../../deviceinfo/deviceinfo.h \
@@ -32,6 +33,8 @@ HEADERS += \
 	../../../protocol/mtpresponder.h \
 	../../../protocol/objectpropertycache.h \
 	../../../protocol/propertypod.h \
+	../../../protocol/segmentring.h \
+	../../../common/bufferpool.h \
 	../../../transport/mtptransporter.h \
 	../../../transport/dummy/mtptransporterdummy.h \
 	../../../transport/usb/mtptransporterusb.h \
@@ -39,6 +42,7 @@ HEADERS += \
 
 SOURCES += \
 	storagefactory_test.cpp \
+	../eventscheduler.cpp \
 	../storagefactory.cpp \
 	../../deviceinfo/deviceinfo.cpp \
 	../../deviceinfo/deviceinfoprovider.cpp \
@@ -52,6 +56,8 @@ SOURCES += \
 	../../../protocol/mtptxcontainer.cpp \
 	../../../protocol/objectpropertycache.cpp \
 	../../../protocol/propertypod.cpp \
+	../../../protocol/segmentring.cpp \
+	../../../common/bufferpool.cpp \
 	../../../transport/dummy/mtptransporterdummy.cpp \
 	../../../transport/usb/descriptor.c \
 	../../../transport/usb/mtptransporterusb.cpp \
@@ -47,12 +47,14 @@
 #include "propertypod.h"
 #include "objectpropertycache.h"
 #include "mtpextensionmanager.h"
+#include "segmentring.h"
+#include "bufferpool.h"
 
 using namespace meegomtp1dot0;
 
-// BUFFER_MAX_LEN is based on the max request size in ci13xxx_udc.c,
-// which is four pages of 4k each
-static const quint32 BUFFER_MAX_LEN = 4 * 4096;
+// Data segments are whole high-speed packets, so that only the last one
+// of a transfer can be short
+static const quint32 MIN_SEGMENT_SIZE = PTP_HS_DATA_PKT_SIZE;
 MTPResponder* MTPResponder::m_instance = 0;
 
 MTPResponder* MTPResponder::instance()
@@ -94,6 +96,8 @@ MTPResponder::MTPResponder(): m_storageServer(0),
     m_containerToBeResent(false),
     m_isLastPacket(false),
     m_storageWaitDataComplete(false),
+    m_segmentSize(qgetenv("MTP_SEGMENT_SIZE").toUInt()),
+    m_segmentRing(new SegmentRing),
     m_state(RESPONDER_IDLE),
     m_prevState(RESPONDER_IDLE),
     m_objPropListInfo(0),
@@ -178,6 +182,10 @@ MTPResponder::~MTPResponder()
         m_transporter = 0;
     }
 
+    // Only after the transporter: its writer gives the segments back on exit
+    delete m_segmentRing;
+    m_segmentRing = 0;
+
     if(m_propertyPod)
     {
         PropertyPod::releaseInstance();
@@ -880,6 +888,12 @@ void MTPResponder::closeSessionReq()
 
         freeObjproplistInfo();
 
+        BufferPool::Stats poolStats = BufferPool::instance()->stats();
+        MTP_LOG_INFO("Buffer pool:" << poolStats.hits << "of" << poolStats.allocations << "allocations reused,"
+                     << poolStats.oversized << "oversized, peak" << poolStats.peakBytesInUse << "bytes in use,"
+                     << poolStats.bytesCached << "bytes cached");
+        BufferPool::instance()->resetStats();
+
          // FIXME: Trigger the discarding of a file, which has been possibly created in StorageServer
     }
     sendResponse(code);
@@ -982,8 +996,7 @@ void MTPResponder::getStorageInfoReq()
 void MTPResponder::getNumObjectsReq()
 {
     MTP_FUNC_TRACE();
-    quint32 noOfObjects;
-    QVector<ObjHandle> handles;
+    quint32 noOfObjects = 0;
     MTPResponseCode code = MTP_RESP_OK;
     MTPRxContainer *reqContainer = m_transactionSequence->reqContainer;
     QVector<quint32> params;
@@ -1019,9 +1032,8 @@ void MTPResponder::getNumObjectsReq()
     if( MTP_RESP_OK == code )
     {
         // retrieve the number of objects from storage server
-        code = m_storageServer->getObjectHandles(params[0], static_cast<MTPObjFormatCode>(params[1]), params[2], handles);
+        code = m_storageServer->getNumObjects(params[0], static_cast<MTPObjFormatCode>(params[1]), params[2], noOfObjects);
     }
-    noOfObjects = handles.size() >= 0 ? handles.size() : 0;
 
     sendResponse(code, noOfObjects);
 }
@@ -1141,7 +1153,7 @@ void MTPResponder::getObjectReq()
 
     quint64 payloadLength = 0;
     quint32 startingOffset = 0;
-    quint64 maxBufferSize = BUFFER_MAX_LEN;
+    quint64 maxBufferSize = segmentSize();
     qint32 readLength = 0;
     MTPResponseCode code = MTP_RESP_OK;
     MTPRxContainer *reqContainer = m_transactionSequence->reqContainer;
@@ -1179,7 +1191,7 @@ void MTPResponder::getObjectReq()
             // segmentation needed
             // set the segmentation info
             m_segmentedSender.totalDataLen = startingOffset + payloadLength;
-            m_segmentedSender.payloadLen = BUFFER_MAX_LEN - MTP_HEADER_SIZE;
+            m_segmentedSender.payloadLen = maxBufferSize - MTP_HEADER_SIZE;
             m_segmentedSender.objHandle = params[0];
             m_segmentedSender.offset = startingOffset;
             m_segmentedSender.segmentationStarted = true;
@@ -1807,7 +1819,7 @@ void MTPResponder::getObjectPropListReq()
             if(MTP_RESP_OK == resp)
             {
                 // TODO: The buffer max len needs to be decided
-                quint32 maxPayloadLen = BUFFER_MAX_LEN - MTP_HEADER_SIZE;
+                quint32 maxPayloadLen = segmentSize() - MTP_HEADER_SIZE;
                 MTPTxContainer dataContainer(MTP_CONTAINER_TYPE_DATA, reqContainer->code(), reqContainer->transactionId(), maxPayloadLen);
 
                 // if there are no handles found an empty dataset will be sent
@@ -2701,6 +2713,9 @@ void MTPResponder::handleCancelTransaction()
     MTP_LOG_CRITICAL("Received Cancel Transaction for operation " << QString("0x%1").arg( m_transactionSequence->reqContainer->code(), 0 , 16 ));
 
     m_state = RESPONDER_TX_CANCEL;
+    // Segments of a GetObject may still be queued for the initiator,
+    // they must not go out ahead of the next response.
+    m_transporter->flushData();
     switch( m_transactionSequence->reqContainer->code() )
     {
         // Host initiated cancel for host to device data transfer
@@ -2814,6 +2829,13 @@ quint32 MTPResponder::serializePropList(ObjHandle currentObj,
     return serializedCount;
 }
 
+quint32 MTPResponder::segmentSize() const
+{
+    quint32 size = m_segmentSize ? m_segmentSize : m_transporter->transferSize();
+    size -= size % MIN_SEGMENT_SIZE;
+    return qMax(size, MIN_SEGMENT_SIZE);
+}
+
 void MTPResponder::sendObjectSegmented()
 {
     MTP_FUNC_TRACE();
@@ -2825,6 +2847,7 @@ void MTPResponder::sendObjectSegmented()
     MTPRxContainer *reqContainer = m_transactionSequence->reqContainer;
     MTPOperationCode opCode = reqContainer->code();
     bool sent = true;
+    const quint32 segSize = segmentSize();
 
     segDataOffset = m_segmentedSender.offset;
     segPayloadLength = m_segmentedSender.payloadLen;
@@ -2868,26 +2891,37 @@ void MTPResponder::sendObjectSegmented()
         }
         else
         {
+            // The subsequent segments have no header. They are read into
+            // a buffer of the ring while the transport is still sending
+            // the previous ones.
+            while(0 == (segPtr = m_segmentRing->acquire(segPayloadLength)))
+            {
+                QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents);
+                if(reqContainer != m_transactionSequence->reqContainer)
+                {
+                    // Transaction was canceled or session was closed
+                    return;
+                }
+            }
             qint32 bytesRead = segPayloadLength;
-            // The subsequent segments have no header
-            segPtr = new quint8[segPayloadLength];
             respCode = m_storageServer->readData(m_segmentedSender.objHandle, (char*)segPtr, bytesRead, segDataOffset);
             if(MTP_RESP_OK != respCode)
             {
                 m_segmentedSender.sendResp = true;
-                delete[] (segPtr);
+                m_segmentRing->release();
                 break;
             }
             m_segmentedSender.bytesSent += segPayloadLength;
-            // Directly call the transport method here
-            m_transporter->sendData(segPtr, segPayloadLength, (m_segmentedSender.totalDataLen - segDataOffset) <= BUFFER_MAX_LEN);
-            delete[] (segPtr);
+            m_transporter->sendDataQueued(segPtr, segPayloadLength, (m_segmentedSender.totalDataLen - segDataOffset) <= segSize,
+                                          SegmentRing::sent, m_segmentRing->context());
+            // Let a cancel request in before reading the next segment
+            QCoreApplication::processEvents();
         }
         // Prepare for the next segment to be sent
         segDataOffset += segPayloadLength;
-        if ((m_segmentedSender.totalDataLen - segDataOffset) > BUFFER_MAX_LEN )
+        if ((m_segmentedSender.totalDataLen - segDataOffset) > segSize )
         {
-            segPayloadLength = BUFFER_MAX_LEN;
+            segPayloadLength = segSize;
         }
         else
         {
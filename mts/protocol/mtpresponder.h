@@ -49,6 +49,7 @@ class ObjectPropertyCache;
 class MTPExtensionManager;
 class MTPTxContainer;
 class MTPRxContainer;
+class SegmentRing;
 typedef void (MTPResponder::*MTPCommandHandler)();
 }
 
@@ -158,6 +159,8 @@ class MTPResponder : public QObject
         quint32                                         m_resendBufferSize;
         QByteArray                                      m_storageWaitData;  ///< holding area for data arriving during WAIT_STORAGE
         bool                                            m_storageWaitDataComplete;  ///< m_storageWaitData holds a whole container
+        quint32                                         m_segmentSize;      ///< GetObject segment size from MTP_SEGMENT_SIZE; 0 follows the transport
+        SegmentRing                                     *m_segmentRing;     ///< Reusable buffers for the segments of a GetObject being streamed
 
         enum ResponderState
         {
@@ -423,6 +426,9 @@ class MTPResponder : public QObject
         /// Sends a large data packet in segments of max data packet size
         void sendObjectSegmented();
 
+        /// Returns the size of the data segments sent to the initiator
+        quint32 segmentSize() const;
+
         /// Constructs and sends a standard MTP response container
         /// It uses the transaction id from m_transactionSequence->reqContainer
         bool sendResponse(MTPResponseCode code);
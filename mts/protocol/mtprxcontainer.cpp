@@ -30,6 +30,7 @@
 */
 
 #include "mtprxcontainer.h"
+#include "bufferpool.h"
 using namespace meegomtp1dot0;
 
 MTPRxContainer::MTPRxContainer(const quint8 *buffer, quint32 len)
@@ -40,7 +41,7 @@ MTPRxContainer::MTPRxContainer(const quint8 *buffer, quint32 len)
     m_expectedLength = getl32(&containerTemp->containerLength);
     m_bufferCapacity = m_expectedLength;
     m_accumulatedLength = len;
-    m_buffer = static_cast<quint8*>(malloc(m_expectedLength));
+    m_buffer = BufferPool::instance()->allocate(m_expectedLength);
     memcpy(m_buffer, buffer, len);
     // Reassign the container structure to the newly allocated buffer
     m_container = reinterpret_cast<MTPUSBContainer*>(m_buffer);
@@ -52,7 +53,7 @@ MTPRxContainer::~MTPRxContainer()
 {
     if(0 != m_buffer)
     {
-        free(m_buffer);
+        BufferPool::instance()->release(m_buffer);
         m_buffer = 0;
     }
 }
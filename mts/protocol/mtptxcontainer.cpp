@@ -30,13 +30,13 @@
 */
 
 #include "mtptxcontainer.h"
+#include "bufferpool.h"
 using namespace meegomtp1dot0;
 
 MTPTxContainer::MTPTxContainer(MTPContainerType type, quint16 code, quint32 transactionID, quint32 bufferEstimate /*= 0*/) : MTPContainer()
 {
     // Allocate buffer for header + playload estimate
-    // Have to use malloc here, as we need to be able to realloc the buffer
-    m_buffer = static_cast<quint8*>(malloc(MTP_HEADER_SIZE + bufferEstimate));
+    m_buffer = BufferPool::instance()->allocate(MTP_HEADER_SIZE + bufferEstimate);
     m_container = reinterpret_cast<MTPUSBContainer*>(m_buffer);
     // Populate the buffer header
     // Container length is set to 0 now, it needs to be populated with the
@@ -54,7 +54,7 @@ MTPTxContainer::~MTPTxContainer()
 {
     if(0 != m_buffer)
     {
-        free(m_buffer);
+        BufferPool::instance()->release(m_buffer);
         m_buffer = 0;
     }
 }
@@ -478,10 +478,11 @@ void MTPTxContainer::serializeFormField(MTPDataType type, MtpFormFlag formFlag,
 
 void MTPTxContainer::expandBuffer(quint32 requiredSpace)
 {
-    // TODO: The optimal expansion step size needs to be figured out, should it
-    // be the page size??
+    // The pool rounds buffers up to its size classes, so most expansions
+    // fit in the buffer we already have and only moving to the next class
+    // copies.
     requiredSpace += EXPANSION_STEP_SIZE;
-    m_buffer = static_cast<quint8*>(realloc(m_buffer, m_bufferCapacity + requiredSpace));
+    m_buffer = BufferPool::instance()->reallocate(m_buffer, m_bufferCapacity + requiredSpace);
     m_bufferCapacity += requiredSpace;
     m_container = reinterpret_cast<MTPUSBContainer*>(m_buffer);
 }
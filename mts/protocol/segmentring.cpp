@@ -0,0 +1,116 @@
+/*
+* This file is part of libmeegomtp package
+*
+* Copyright (C) 2010 Nokia Corporation. All rights reserved.
+*
+* Contact: Deepak Kodihalli <deepak.kodihalli@nokia.com>
+*
+* Redistribution and use in source and binary forms, with or without modification,
+* are permitted provided that the following conditions are met:
+*
+* Redistributions of source code must retain the above copyright notice, this list
+* of conditions and the following disclaimer. Redistributions in binary form must
+* reproduce the above copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of Nokia Corporation nor the names of its contributors may be
+* used to endorse or promote products derived from this software without specific
+* prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+* INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+* BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+* LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+* OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+* OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#include <QtCore/QAtomicInt>
+
+#include "segmentring.h"
+#include "bufferpool.h"
+
+using namespace meegomtp1dot0;
+
+struct SegmentRing::Buffer
+{
+    quint8 *data;       ///< From the BufferPool
+    QAtomicInt held;    ///< Set by acquire(), cleared when the transport is done
+};
+
+SegmentRing::SegmentRing(int count) : m_next(0), m_last(0)
+{
+    if (count < 1)
+    {
+        count = 1;
+    }
+    m_buffers.reserve(count);
+    for (int i = 0; i < count; i++)
+    {
+        Buffer *buffer = new Buffer;
+        buffer->data = 0;
+        m_buffers.append(buffer);
+    }
+}
+
+SegmentRing::~SegmentRing()
+{
+    for (int i = 0; i < m_buffers.size(); i++)
+    {
+        BufferPool::instance()->release(m_buffers[i]->data);
+        delete m_buffers[i];
+    }
+}
+
+quint8* SegmentRing::acquire(quint32 size)
+{
+    Buffer *buffer = m_buffers[m_next];
+    if (buffer->held.loadAcquire())
+    {
+        return 0;
+    }
+
+    if (BufferPool::capacity(buffer->data) < size)
+    {
+        BufferPool::instance()->release(buffer->data);
+        buffer->data = BufferPool::instance()->allocate(size);
+    }
+    buffer->held.store(1);
+
+    m_last = m_next;
+    m_next = (m_next + 1) % m_buffers.size();
+    return buffer->data;
+}
+
+void* SegmentRing::context() const
+{
+    return m_buffers[m_last];
+}
+
+void SegmentRing::release()
+{
+    m_buffers[m_last]->held.storeRelease(0);
+}
+
+bool SegmentRing::idle() const
+{
+    for (int i = 0; i < m_buffers.size(); i++)
+    {
+        if (m_buffers[i]->held.loadAcquire())
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void SegmentRing::sent(void *context, bool /*result*/)
+{
+    // A failed segment is not retried; the initiator notices the short
+    // data phase, as it did when segments were sent synchronously.
+    static_cast<Buffer*>(context)->held.storeRelease(0);
+}
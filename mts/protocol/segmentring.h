@@ -0,0 +1,90 @@
+/*
+* This file is part of libmeegomtp package
+*
+* Copyright (C) 2010 Nokia Corporation. All rights reserved.
+*
+* Contact: Deepak Kodihalli <deepak.kodihalli@nokia.com>
+*
+* Redistribution and use in source and binary forms, with or without modification,
+* are permitted provided that the following conditions are met:
+*
+* Redistributions of source code must retain the above copyright notice, this list
+* of conditions and the following disclaimer. Redistributions in binary form must
+* reproduce the above copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of Nokia Corporation nor the names of its contributors may be
+* used to endorse or promote products derived from this software without specific
+* prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+* INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+* BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+* LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+* OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+* OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#ifndef SEGMENTRING_H
+#define SEGMENTRING_H
+
+#include <QtCore/QVector>
+
+#include "mtptypes.h"
+
+/// \brief SegmentRing is a small ring of reusable buffers for streaming object data to the transport.
+///
+/// The responder reads the next segment of an object into a free buffer of the ring and hands it to
+/// MTPTransporter::sendDataQueued(); the transport gives the buffer back through SegmentRing::sent() once
+/// it has been sent. This way reading from storage overlaps with sending the previous segments, and
+/// no memory is allocated per segment. A ring of one buffer makes streaming strictly serial.
+namespace meegomtp1dot0
+{
+class SegmentRing
+{
+    public:
+        /// The number of buffers the responder uses by default
+        static const int DEFAULT_COUNT = 4;
+
+        /// Creates a ring of count buffers. Buffers are allocated on first use.
+        explicit SegmentRing(int count = DEFAULT_COUNT);
+
+        /// Frees the buffers. None of them may still be held by the transport.
+        ~SegmentRing();
+
+        /// Returns the next buffer in ring order, with room for at least size bytes, or 0 if the
+        /// transport still holds it. The buffer is held from now on, until sent() is called with
+        /// context() or release() is called.
+        /// \param size [in] The number of bytes needed.
+        quint8* acquire(quint32 size);
+
+        /// Returns the completion context of the buffer last returned by acquire().
+        void* context() const;
+
+        /// Gives back the buffer last returned by acquire() without sending it.
+        void release();
+
+        /// Returns true if no buffer is held.
+        bool idle() const;
+
+        /// The MTPTransporter::SendCompletion for buffers of the ring; may be called from any thread.
+        static void sent(void *context, bool result);
+
+    private:
+        struct Buffer;
+
+        QVector<Buffer*> m_buffers; ///< The buffers, in ring order
+        int m_next;                 ///< Index of the buffer acquire() returns next
+        int m_last;                 ///< Index of the buffer acquire() returned last
+
+        // Not copyable
+        SegmentRing(const SegmentRing&);
+        SegmentRing& operator=(const SegmentRing&);
+};
+}
+
+#endif
@@ -35,6 +35,8 @@
 #include "mtptransporterdummy.h"
 #include "mtptxcontainer.h"
 #include "mtprxcontainer.h"
+#include "segmentring.h"
+#include "bufferpool.h"
 #include <limits>
 
 using namespace meegomtp1dot0;
@@ -63,6 +65,7 @@ void MTPResponder_test::initTestCase()
     m_responder = new MTPResponder();
     bool ok;
     ok = m_responder->initTransport(DUMMY);
+    m_transport = static_cast<MTPTransporterDummy*>(m_responder->m_transporter);
     QObject::connect( m_responder->m_transporter, SIGNAL(dataReceived(quint8*, quint32, bool, bool)),this, SLOT(processReceivedData(quint8*, quint32, bool, bool)) );
 
     /* Process events until storages are initialized. */
@@ -278,6 +281,152 @@ void MTPResponder_test::testGetObject()
     QCOMPARE( m_responseCode, (MTPResponseCode)MTP_RESP_OK );
 }
 
+void MTPResponder_test::testBufferPool()
+{
+    BufferPool *pool = BufferPool::instance();
+    pool->trim();
+    pool->resetStats();
+    // Buffers still held elsewhere, by the responder for instance
+    const quint64 inUse = pool->stats().bytesInUse;
+
+    // Sizes are rounded up to the size classes
+    quint8 *buffer = pool->allocate(1000);
+    QCOMPARE( BufferPool::capacity(buffer), (quint32)1024 );
+    memset( buffer, 0x42, 1000 );
+
+    // Growing within the class keeps the buffer, beyond it keeps the contents
+    QCOMPARE( pool->reallocate(buffer, 1024), buffer );
+    buffer = pool->reallocate(buffer, 3000);
+    QCOMPARE( BufferPool::capacity(buffer), (quint32)4096 );
+    QCOMPARE( buffer[0], (quint8)0x42 );
+    QCOMPARE( buffer[999], (quint8)0x42 );
+    pool->release(buffer);
+
+    // A released buffer is handed out again
+    quint8 *again = pool->allocate(4000);
+    QCOMPARE( again, buffer );
+    pool->release(again);
+
+    quint8 *oversized = pool->allocate(BufferPool::MAX_CLASS_SIZE + 1);
+    QCOMPARE( BufferPool::capacity(oversized), BufferPool::MAX_CLASS_SIZE + 1 );
+    pool->release(oversized);
+
+    BufferPool::Stats stats = pool->stats();
+    QCOMPARE( stats.allocations, (quint64)4 );
+    QCOMPARE( stats.hits, (quint64)1 );
+    QCOMPARE( stats.oversized, (quint64)1 );
+    QCOMPARE( stats.bytesInUse, inUse );
+    QCOMPARE( stats.peakBytesInUse, inUse + BufferPool::MAX_CLASS_SIZE + 1 );
+    QCOMPARE( stats.bytesCached, (quint64)(1024 + 4096) );
+}
+
+/// Time the dummy initiator takes for each GetObject segment, in microseconds
+static const unsigned long SEGMENT_WRITE_LATENCY = 100;
+
+void MTPResponder_test::benchmarkGetObject_data()
+{
+    QTest::addColumn<int>("buffers");
+    QTest::newRow("1 buffer") << 1;
+    QTest::newRow("4 buffers") << (int)SegmentRing::DEFAULT_COUNT;
+}
+
+void MTPResponder_test::benchmarkGetObject()
+{
+    QFETCH(int, buffers);
+    const quint32 objectSize = 16 * 1024 * 1024;
+
+    // The other tests work on the object created so far
+    quint32 storageId = m_storageId;
+    ObjHandle parentHandle = m_parentHandle;
+    ObjHandle objectHandle = m_objectHandle;
+
+    MTPTxContainer *reqContainer = new MTPTxContainer(MTP_CONTAINER_TYPE_COMMAND, MTP_OP_SendObjectInfo, nextTransactionId(), 2 * sizeof(quint32));
+    *reqContainer << (quint32)0x00010001 << (quint32)0xFFFFFFFF;
+    copyAndSendContainer(reqContainer);
+    MTPObjectInfo objInfo;
+    objInfo.mtpStorageId = 0x00010001;
+    objInfo.mtpObjectCompressedSize = objectSize;
+    objInfo.mtpThumbCompressedSize = 0;
+    objInfo.mtpThumbPixelWidth = 0;
+    objInfo.mtpThumbPixelHeight = 0;
+    objInfo.mtpImagePixelWidth = 0;
+    objInfo.mtpImagePixelHeight = 0;
+    objInfo.mtpImageBitDepth = 0;
+    objInfo.mtpParentObject = 0;
+    objInfo.mtpAssociationDescription = 0;
+    objInfo.mtpSequenceNumber = 0;
+    objInfo.mtpObjectFormat = MTP_OBF_FORMAT_Undefined;
+    objInfo.mtpProtectionStatus = 0;
+    objInfo.mtpThumbFormat = 0;
+    objInfo.mtpAssociationType = 0;
+    objInfo.mtpFileName = "benchfile";
+    objInfo.mtpCaptureDate = "20090101T230000";
+    objInfo.mtpModificationDate = "20090101T230000";
+    MTPTxContainer *dataContainer = new MTPTxContainer(MTP_CONTAINER_TYPE_DATA, MTP_OP_SendObjectInfo, m_transactionId, sizeof(MTPObjectInfo));
+    *dataContainer << objInfo;
+    m_opcode = MTP_OP_SendObjectInfo;
+    copyAndSendContainer(dataContainer);
+    QCOMPARE( m_responseCode, (MTPResponseCode)MTP_RESP_OK );
+
+    reqContainer = new MTPTxContainer(MTP_CONTAINER_TYPE_COMMAND, MTP_OP_SendObject, nextTransactionId());
+    copyAndSendContainer(reqContainer);
+    dataContainer = new MTPTxContainer(MTP_CONTAINER_TYPE_DATA, MTP_OP_SendObject, m_transactionId, objectSize);
+    QByteArray pattern( objectSize, 0 );
+    for( quint32 i = 0; i < objectSize; i++ )
+    {
+        pattern[i] = (char)( ( i * 7 ) ^ ( i >> 12 ) );
+    }
+    memcpy( dataContainer->payload(), pattern.constData(), objectSize );
+    dataContainer->seek(objectSize);
+    copyAndSendContainer(dataContainer);
+    QCOMPARE( m_responseCode, (MTPResponseCode)MTP_RESP_OK );
+
+    // The initiator takes its time with every segment, on a thread of its
+    // own, so storage reads can overlap with it given more than one buffer.
+    SegmentRing *segmentRing = m_responder->m_segmentRing;
+    m_responder->m_segmentRing = new SegmentRing(buffers);
+    m_transport->setWriteLatency(SEGMENT_WRITE_LATENCY);
+
+    QBENCHMARK
+    {
+        reqContainer = new MTPTxContainer(MTP_CONTAINER_TYPE_COMMAND, MTP_OP_GetObject, nextTransactionId(), sizeof(quint32));
+        *reqContainer << (quint32)m_objectHandle;
+        copyAndSendContainer(reqContainer);
+        QCOMPARE( m_responseCode, (MTPResponseCode)MTP_RESP_OK );
+    }
+
+    // The object arrives whole and in order, followed by the response.
+    // Once the pool is warmed up, streaming it doesn't touch the heap.
+    BufferPool::instance()->resetStats();
+    m_transport->startRecording();
+    reqContainer = new MTPTxContainer(MTP_CONTAINER_TYPE_COMMAND, MTP_OP_GetObject, nextTransactionId(), sizeof(quint32));
+    *reqContainer << (quint32)m_objectHandle;
+    copyAndSendContainer(reqContainer);
+    QCOMPARE( m_responseCode, (MTPResponseCode)MTP_RESP_OK );
+    BufferPool::Stats poolStats = BufferPool::instance()->stats();
+    QByteArray received = m_transport->takeRecording();
+    QCOMPARE( received.size(), (int)( MTP_HEADER_SIZE + objectSize + MTP_HEADER_SIZE ) );
+    QCOMPARE( MTPContainer::getl32( received.constData() ), (quint32)( MTP_HEADER_SIZE + objectSize ) );
+    QVERIFY( received.mid( (int)MTP_HEADER_SIZE, (int)objectSize ) == pattern );
+    QCOMPARE( MTPContainer::getl16( received.constData() + MTP_HEADER_SIZE + objectSize + 4 ),
+              (quint16)MTP_CONTAINER_TYPE_RESPONSE );
+    QCOMPARE( poolStats.hits, poolStats.allocations );
+
+    m_transport->setWriteLatency(0);
+    QVERIFY( m_responder->m_segmentRing->idle() );
+    delete m_responder->m_segmentRing;
+    m_responder->m_segmentRing = segmentRing;
+
+    reqContainer = new MTPTxContainer(MTP_CONTAINER_TYPE_COMMAND, MTP_OP_DeleteObject, nextTransactionId(), sizeof(quint32));
+    *reqContainer << (quint32)m_objectHandle;
+    copyAndSendContainer(reqContainer);
+    QCOMPARE( m_responseCode, (MTPResponseCode)MTP_RESP_OK );
+
+    m_storageId = storageId;
+    m_parentHandle = parentHandle;
+    m_objectHandle = objectHandle;
+}
+
 void MTPResponder_test::testGetObjectPropDesc()
 {
     MTPTxContainer *reqContainer = 0;
@@ -69,6 +69,9 @@ private slots:
     void testGetObjectInfo();
     void testGetObjectPropList();
     void testGetObject();
+    void testBufferPool();
+    void benchmarkGetObject_data();
+    void benchmarkGetObject();
     void testGetObjectPropDesc();
     void testGetDevicePropDesc();
     void testGetDevicePropValue();
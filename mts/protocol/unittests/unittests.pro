@@ -53,9 +53,12 @@ HEADERS += mtpresponder_test.h \
            ../mtptxcontainer.h \
            ../propertypod.h \
            ../objectpropertycache.h \
+           ../segmentring.h \
+           ../../common/bufferpool.h \
            ../mtpextensionmanager.h \
            ../extensions/mtpextension.h \
            ../extensions/mtpextension.h \
+           ../../platform/storage/eventscheduler.h \
            ../../platform/storage/storagefactory.h \
            ../../platform/storage/storageplugin.h \
            ../../platform/deviceinfo/xmlhandler.h \
@@ -76,7 +79,10 @@ SOURCES += mtpresponder_test.cpp \
            ../mtptxcontainer.cpp \
            ../propertypod.cpp \
            ../objectpropertycache.cpp \
+           ../segmentring.cpp \
+           ../../common/bufferpool.cpp \
            ../mtpextensionmanager.cpp \
+           ../../platform/storage/eventscheduler.cpp \
            ../../platform/storage/storagefactory.cpp \
            ../../platform/deviceinfo/xmlhandler.cpp \
            ../../platform/deviceinfo/deviceinfoprovider.cpp \
@@ -29,23 +29,177 @@
 *
 */
 
+#include <QCoreApplication>
+#include <QEvent>
+#include <QThread>
+
 #include "mtptransporterdummy.h"
 #include "mtpcontainerwrapper.h"
 
 using namespace meegomtp1dot0;
 
+/// Buffers queued ahead of the simulated initiator
+static const int MAX_QUEUED = 8;
+
+namespace meegomtp1dot0
+{
+class DummyInitiatorThread : public QThread
+{
+public:
+    explicit DummyInitiatorThread( MTPTransporterDummy *transporter ) : m_transporter(transporter) {}
+
+protected:
+    void run() { m_transporter->initiatorLoop(); }
+
+private:
+    MTPTransporterDummy *m_transporter;
+};
+}
+
 MTPTransporterDummy::MTPTransporterDummy() :
 m_currentTransactionPhase(eMTP_CONTAINER_TYPE_UNDEFINED), m_isNextChunkData(false),
-m_noOfDataChunksExpected(0), m_noOfDataChunksReceived(0), m_noOfDataChunksToFollow(0), m_transactionId(0xFFFFFFFF)
+m_noOfDataChunksExpected(0), m_noOfDataChunksReceived(0), m_noOfDataChunksToFollow(0), m_transactionId(0xFFFFFFFF),
+m_writeLatency(0), m_recording(false), m_initiator(0), m_stopInitiator(false)
 {
 }
 
 MTPTransporterDummy::~MTPTransporterDummy()
 {
+    if( m_initiator )
+    {
+        m_queueLock.lock();
+        m_stopInitiator = true;
+        m_queueWait.wakeAll();
+        m_queueLock.unlock();
+        m_initiator->wait();
+        delete m_initiator;
+    }
+    // Nobody will take what's left
+    foreach( const QueuedData &queued, m_queue )
+    {
+        queued.completion( queued.context, false );
+    }
 }
 
 bool MTPTransporterDummy::sendData( const quint8* data, quint32 len, bool /*sendZeroPacket*/ )
 {
+    // Goes out behind whatever is queued
+    waitForQueue();
+    return receiveData( data, len );
+}
+
+void MTPTransporterDummy::sendDataQueued( const quint8* data, quint32 len, bool sendZeroPacket,
+                                          SendCompletion completion, void *context )
+{
+    if( !m_writeLatency )
+    {
+        completion( context, sendData( data, len, sendZeroPacket ) );
+        return;
+    }
+
+    if( !m_initiator )
+    {
+        m_initiator = new DummyInitiatorThread( this );
+        m_initiator->start();
+    }
+
+    QueuedData queued = { data, len, sendZeroPacket, completion, context };
+    m_queueLock.lock();
+    while( m_queue.count() >= MAX_QUEUED )
+    {
+        m_queueLock.unlock();
+        QCoreApplication::processEvents( QEventLoop::WaitForMoreEvents );
+        m_queueLock.lock();
+    }
+    m_queue.append( queued );
+    m_queueWait.wakeAll();
+    m_queueLock.unlock();
+}
+
+bool MTPTransporterDummy::flushData()
+{
+    // Drops what the initiator hasn't started on
+    QList<QueuedData> dropped;
+    m_queueLock.lock();
+    while( m_queue.count() > 1 )
+    {
+        dropped.append( m_queue.takeLast() );
+    }
+    m_queueLock.unlock();
+    for( int i = dropped.count() - 1; i >= 0; --i )
+    {
+        dropped[i].completion( dropped[i].context, false );
+    }
+    waitForQueue();
+    return true;
+}
+
+void MTPTransporterDummy::startRecording()
+{
+    waitForQueue();
+    m_recorded.clear();
+    m_recording = true;
+}
+
+QByteArray MTPTransporterDummy::takeRecording()
+{
+    waitForQueue();
+    QByteArray recorded = m_recorded;
+    m_recorded.clear();
+    m_recording = false;
+    return recorded;
+}
+
+void MTPTransporterDummy::waitForQueue()
+{
+    m_queueLock.lock();
+    while( !m_queue.isEmpty() )
+    {
+        m_queueLock.unlock();
+        // The initiator posts an event after each buffer
+        QCoreApplication::processEvents( QEventLoop::WaitForMoreEvents );
+        m_queueLock.lock();
+    }
+    m_queueLock.unlock();
+}
+
+void MTPTransporterDummy::initiatorLoop()
+{
+    forever
+    {
+        m_queueLock.lock();
+        while( !m_stopInitiator && m_queue.isEmpty() )
+        {
+            m_queueWait.wait( &m_queueLock );
+        }
+        if( m_stopInitiator )
+        {
+            m_queueLock.unlock();
+            return;
+        }
+        QueuedData queued = m_queue.first();
+        m_queueLock.unlock();
+
+        QThread::usleep( m_writeLatency );
+        bool result = receiveData( queued.data, queued.len );
+
+        // flushData() leaves the head alone, so it's still first
+        m_queueLock.lock();
+        m_queue.removeFirst();
+        m_queueLock.unlock();
+        queued.completion( queued.context, result );
+        // Wakes up a main thread waiting in processEvents()
+        QCoreApplication::postEvent( this, new QEvent( QEvent::User ) );
+    }
+}
+
+bool MTPTransporterDummy::receiveData( const quint8* data, quint32 len )
+{
+    if( m_recording )
+    {
+        m_recorded.append( reinterpret_cast<const char*>(data), len );
+    }
+
     MTPContainerWrapper mtpHeader(const_cast<quint8*>(data));
     // Determine the phase
     if( !m_isNextChunkData )
@@ -105,8 +259,9 @@ bool MTPTransporterDummy::checkData( const quint8 *data, quint32 len )
        // Check how many bytes of data are present in the current packet
        quint32 currLength = len - MTP_HEADER_SIZE;
        // Determine how many chunks will follow; data may be segmented
-       m_noOfDataChunksToFollow = ( dataLength/currLength + dataLength%currLength ? 1 : 0 ) - 1;
+       m_noOfDataChunksToFollow = currLength ? ( dataLength/currLength + ( dataLength%currLength ? 1 : 0 ) ) - 1 : 0;
        m_noOfDataChunksExpected = m_noOfDataChunksToFollow;
+       m_noOfDataChunksReceived = 0;
        m_isNextChunkData = m_noOfDataChunksExpected ? true : false;
        return true;
    }
@@ -32,9 +32,16 @@
 #ifndef MTPTRANSPORTER_DUMMY_H
 #define MTPTRANSPORTER_DUMMY_H
 
+#include <QByteArray>
+#include <QList>
+#include <QMutex>
+#include <QWaitCondition>
+
 #include "mtptransporter.h"
 #include "mtptypes.h"
 
+class QThread;
+
 namespace meegomtp1dot0
 {
 class MTPContainerWrapper;
@@ -57,12 +64,27 @@ public:
     /// Checks data, if data is good, returns true
     bool sendData( const quint8* data, quint32 len, bool sendZeroPacket = true );
 
+    /// Without a write latency, checks data right away like sendData(). With one, the data is checked on a
+    /// thread standing in for the initiator, which takes the write latency for every buffer.
+    void sendDataQueued( const quint8* data, quint32 len, bool sendZeroPacket,
+                         SendCompletion completion, void *context );
+
+    /// Sets the time the simulated initiator spends on each queued buffer, in microseconds. 0 turns queueing off.
+    void setWriteLatency( unsigned long usecs ){ m_writeLatency = usecs; }
+
+    /// Starts recording the data sent to the initiator, dropping what was recorded before.
+    void startRecording();
+
+    /// Returns the data sent since startRecording(), in the order the initiator got it, and stops recording.
+    QByteArray takeRecording();
+
     /// Checks if event data is good, if so returns true
     bool sendEvent( const quint8* data, quint32 len, bool sendZeroPacket = true ) ;
 
     bool activate(){ return true; }
     bool deactivate(){ return true; }
-    bool flushData(){ return true; }
+    bool flushData();
+    quint32 transferSize() const { return 16 * 1024; }
     void reset(){}
     void disableRW(){}
     void enableRW(){}
@@ -70,6 +92,27 @@ public:
     void resume(){}
 
 private:
+    friend class DummyInitiatorThread;
+
+    /// A buffer given to sendDataQueued()
+    struct QueuedData
+    {
+        const quint8 *data;
+        quint32 len;
+        bool sendZeroPacket;
+        SendCompletion completion;
+        void *context;
+    };
+
+    /// Checks data the initiator got and records it.
+    bool receiveData( const quint8* data, quint32 len );
+
+    /// Body of the simulated initiator's thread.
+    void initiatorLoop();
+
+    /// Processes events until the simulated initiator has taken all queued data.
+    void waitForQueue();
+
     /// Checks if the mtp header received in sendData/Event is ok.
     bool checkHeader( MTPContainerWrapper *mtpHeader, quint32 len );
 
@@ -90,6 +133,14 @@ private:
     quint32 m_noOfDataChunksReceived; ///< The no. of data chunks that are finally received.
     quint32 m_noOfDataChunksToFollow; ///< The no. of data chunks that are yet to be received.
     quint32 m_transactionId; ///< The transaction id of the current MTP transaction ( read from the mtp packet revecied in sendData ).
+    unsigned long m_writeLatency; ///< Time the simulated initiator takes per queued buffer, in microseconds.
+    bool m_recording; ///< Data sent to the initiator goes to m_recorded.
+    QByteArray m_recorded; ///< Data sent since startRecording().
+    QThread *m_initiator; ///< The simulated initiator, started on the first queued buffer.
+    QMutex m_queueLock; ///< Protects m_queue and m_stopInitiator.
+    QWaitCondition m_queueWait; ///< Wakes up the simulated initiator.
+    QList<QueuedData> m_queue; ///< Queued buffers; the head stays while the initiator takes it.
+    bool m_stopInitiator; ///< Tells the simulated initiator to quit.
 
 Q_SIGNALS:
     void dummyDataReceived( quint8* data, quint32 len );
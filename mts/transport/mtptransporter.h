@@ -66,6 +66,25 @@ class MTPTransporter : public QObject
         /// \return Must return true if send was a success, else false.
         virtual bool sendData(const quint8* data, quint32 len, bool sendZeroPacket = true) = 0;
 
+        /// Called when a buffer given to sendDataQueued() has been sent (result is true) or dropped.
+        /// It may be called from another thread.
+        typedef void (*SendCompletion)(void *context, bool result);
+
+        /// Queues data (an MTP data container, or a part of one) to be sent to the initiator, without waiting for it to be sent.
+        /// Data queued this way and data given to sendData() reach the initiator in the order they were given. The transport
+        /// calls completion once it is done with the buffer and then wakes up the caller's event loop. The default
+        /// implementation simply sends synchronously.
+        /// \param data [in] The buffer of data to be sent. It must stay valid and unmodified until completion has been called.
+        /// \param len [in] The length of the data buffer in bytes.
+        /// \param sendZeroPacket [in] As for sendData().
+        /// \param completion [in] The function called with context and the send result once the buffer is done.
+        /// \param context [in] Passed on to completion.
+        virtual void sendDataQueued(const quint8* data, quint32 len, bool sendZeroPacket,
+                                    SendCompletion completion, void *context)
+        {
+            completion(context, sendData(data, len, sendZeroPacket));
+        }
+
         /// Sends data (an MTP event container) to the initiator. The function must be synchronous.
         /// \param data [in] The buffer of data to be sent. The buffer is assumed to be allocated by the caller, and will not be modified.
         /// \param len [in] The length of the data buffer in bytes.
@@ -89,9 +108,14 @@ class MTPTransporter : public QObject
         /// Enable the transport to read/write.
         virtual void enableRW() = 0;
 
-        /// Flush out all data
+        /// Drops the data queued for sending that hasn't gone out yet. The completions of buffers given to
+        /// sendDataQueued() run with false before this returns. Used when the initiator cancels a transaction.
         virtual bool flushData() = 0;
 
+        /// Returns the largest buffer the transport moves in one transfer.
+        /// The responder sizes its data segments to match it.
+        virtual quint32 transferSize() const = 0;
+
         /// Suspend the transport
         virtual void suspend() = 0;
 
@@ -66,11 +66,33 @@ static void catchUserSignal()
 }
 
 MTPTransporterUSB::MTPTransporterUSB() : m_ioState(SUSPENDED), m_containerReadLen(0),
-    m_ctrlFd(-1), m_intrFd(-1), m_inFd(-1), m_outFd(-1),
-    m_reader_busy(READER_FREE), m_writer_busy(false)
+    m_ctrlFd(-1), m_intrFd(-1), m_inFd(-1), m_outFd(-1), m_autoTune(false),
+    m_reader_busy(READER_FREE)
 {
     QObject::connect(&m_bulkRead, SIGNAL(dataReady()),
         this, SLOT(handleDataReady()), Qt::QueuedConnection);
+
+    // MTP_USB_AIO_DEPTH > 1 switches the bulk endpoints to AIO, keeping
+    // that many transfers queued on each of them.
+    int aioDepth = qgetenv("MTP_USB_AIO_DEPTH").toInt();
+    if (aioDepth > 1) {
+        MTP_LOG_INFO("Bulk endpoints use AIO, depth" << aioDepth);
+        m_bulkRead.setAioDepth(aioDepth);
+        m_bulkWrite.setAioDepth(aioDepth);
+    }
+
+    // MTP_USB_TRANSFER_SIZE sets the largest bulk request in bytes, or
+    // with "auto" probes the largest one the UDC takes after each bind.
+    // MTP_USB_READER_BUFFER_SIZE sets the receive buffer size.
+    QByteArray transferSize = qgetenv("MTP_USB_TRANSFER_SIZE");
+    if (transferSize == "auto") {
+        m_autoTune = true;
+    } else if (transferSize.toInt() > 0) {
+        m_bulkRead.setTransferSize(transferSize.toInt());
+    }
+    m_bulkRead.setBufferSize(qgetenv("MTP_USB_READER_BUFFER_SIZE").toInt());
+    MTP_LOG_INFO("Bulk transfer size" << (m_autoTune ? QByteArray("auto") :
+        QByteArray::number(m_bulkRead.transferSize())));
 }
 
 bool MTPTransporterUSB::writeMtpDescriptors()
@@ -158,11 +180,11 @@ bool MTPTransporterUSB::deactivate()
 
 bool MTPTransporterUSB::flushData()
 {
-    bool result = true;
+    MTP_LOG_INFO("flushData");
 
-    MTP_LOG_CRITICAL("flushData");
+    m_bulkWrite.flush();
 
-    return result;
+    return true;
 }
 
 void MTPTransporterUSB::disableRW()
@@ -187,6 +209,7 @@ void MTPTransporterUSB::reset()
     m_resetCount++;
 
     m_intrWrite.start();
+    m_bulkWrite.start();
     m_bulkRead.start();
 
     MTP_LOG_CRITICAL("reset");
@@ -197,35 +220,51 @@ MTPTransporterUSB::~MTPTransporterUSB()
     deactivate();
 }
 
+quint32 MTPTransporterUSB::transferSize() const
+{
+    return m_bulkRead.transferSize();
+}
+
+// Completion state for one sendData() buffer, set by the writer thread
+struct SentBuffer
+{
+    QAtomicInt done;
+    bool result;
+};
+
+static void bufferSent(void *context, bool result)
+{
+    SentBuffer *sent = static_cast<SentBuffer *>(context);
+    sent->result = result;
+    sent->done.storeRelease(1);
+}
+
 bool MTPTransporterUSB::sendData(const quint8* data, quint32 dataLen, bool isLastPacket)
 {
-    // TODO: can't handle re-entrant calls with the current design.
-    if(m_writer_busy)
-    {
-        MTP_LOG_WARNING("Refusing bulk write request during bulk write");
-        return false;
-    }
-    m_writer_busy = true;
+    // The bulk writer is a long-lived thread working through a queue
+    // of buffers. This call queues its buffer and processes events until
+    // it has been written, to remain responsive meanwhile; a sendData()
+    // made from one of those events simply queues up behind it.
+    SentBuffer sent;
+    sent.result = false;
+
+    sendDataQueued(data, dataLen, isLastPacket, bufferSent, &sent);
+    while (!sent.done.loadAcquire())
+        QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents);
 
-    // Unlike the other IO threads, the bulk writer is only alive
-    // while processing one buffer and then finishes. It all happens
-    // during this call. The reason for the extra thread is to
-    // remain responsive to events while the data is being written.
-    // That's done by calling processEvents while waiting.
+    return sent.result;
+}
 
-    m_bulkWrite.setData(data, dataLen, isLastPacket);
-    m_bulkWrite.start();
+void MTPTransporterUSB::sendDataQueued(const quint8* data, quint32 dataLen, bool isLastPacket,
+                                       SendCompletion completion, void *context)
+{
+    // The reader owns the transfer size, since it does the tuning
+    m_bulkWrite.setTransferSize(m_bulkRead.transferSize());
 
     // The bulk writer will make sure that processEvents is woken up
-    // when the result is ready.
-    while(!m_bulkWrite.resultReady()) {
+    // whenever a buffer is done.
+    while (!m_bulkWrite.enqueue(data, dataLen, isLastPacket, completion, context))
         QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents);
-    }
-    bool r = m_bulkWrite.getResult();
-
-    m_bulkWrite.wait();
-    m_writer_busy = false;
-    return r;
 }
 
 bool MTPTransporterUSB::sendEvent(const quint8* data, quint32 dataLen, bool isLastPacket)
@@ -347,6 +386,7 @@ void MTPTransporterUSB::openDevices()
         MTP_LOG_CRITICAL("Couldn't open IN endpoint file " << in_file);
     } else {
         m_bulkWrite.setFd(m_inFd);
+        m_bulkWrite.start();
     }
 
     m_outFd = open(out_file, O_RDWR);
@@ -355,6 +395,7 @@ void MTPTransporterUSB::openDevices()
         MTP_LOG_CRITICAL("Couldn't open OUT endpoint file " << out_file);
     } else {
         m_bulkRead.setFd(m_outFd);
+        m_bulkRead.setAutoTune(m_autoTune);
         m_bulkRead.start();
     }
 
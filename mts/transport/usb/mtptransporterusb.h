@@ -59,6 +59,11 @@ class MTPTransporterUSB : public MTPTransporter
         /// \return Returns true if write to the USB FD was a success, else false.
         bool sendData(const quint8* data, quint32 len, bool isLastPacket = true);
 
+        /// Queues data (an MTP data container, or a part of one) on the bulk writer thread and returns once it has been
+        /// accepted; completion is called from the writer thread. See MTPTransporter::sendDataQueued().
+        void sendDataQueued(const quint8* data, quint32 len, bool isLastPacket,
+                            SendCompletion completion, void *context);
+
         /// Sends data (an MTP event container) to the initiator. The function must be synchronous.
         /// \param data [in] The buffer of data to be sent. The buffer is assumed to be allocated by the caller, and will not be modified.
         /// \param len [in] The length of the data buffer in bytes.
@@ -76,6 +81,9 @@ class MTPTransporterUSB : public MTPTransporter
         /// Flush out all data
         bool flushData();
 
+        /// Returns the largest bulk request size, see MTP_USB_TRANSFER_SIZE
+        quint32 transferSize() const;
+
         /// Reset the transport to a default state.
         void reset();
 
@@ -117,12 +125,12 @@ class MTPTransporterUSB : public MTPTransporter
         int                     m_intrFd;
         int                     m_inFd;
         int                     m_outFd;
+        bool                    m_autoTune;     ///< Probe the transfer size after each bind
 
         ControlReaderThread     m_ctrl;         ///< Threaded IO for Control EP
         BulkReaderThread        m_bulkRead;     ///< Threaded Reader for Bulk Out EP
         ReaderBusyState         m_reader_busy;
         BulkWriterThread        m_bulkWrite;    ///< Threaded Writer for Bulk In EP
-        bool                    m_writer_busy;
         InterruptWriterThread   m_intrWrite;    ///< Threaded Writer for Interrupt EP
 
     public Q_SLOTS:
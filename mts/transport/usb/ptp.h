@@ -24,6 +24,7 @@
 #include <qglobal.h>
 
 /* device or driver specific */
+#define PTP_SS_DATA_PKT_SIZE	1024
 #define PTP_HS_DATA_PKT_SIZE	512
 #define PTP_HS_EVENT_PKT_SIZE	64
 
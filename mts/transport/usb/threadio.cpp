@@ -7,16 +7,28 @@
 #include <signal.h>
 #include <endian.h>
 #include <unistd.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <QVector>
 
 #include "trace.h"
+#include "bufferpool.h"
 
-const int MAX_DATA_IN_SIZE = 16 * 1024;  // Matches USB transfer size
+using meegomtp1dot0::BufferPool;
+
+// The defaults match the max request size in ci13xxx_udc.c; newer
+// controllers take much larger requests, see setTransferSize().
+const int DEFAULT_TRANSFER_SIZE = 16 * 1024;
+const int MAX_TRANSFER_SIZE = 1024 * 1024;
 const int MAX_CONTROL_IN_SIZE = 64;
 const int MAX_EVENTS_STORED = 16;
+// Lets the main thread prepare a few buffers ahead of the endpoint
+const int MAX_WRITES_QUEUED = 8;
 // Give BulkReaderThread some space to acquire chunks while the main
 // thread is working, but still small enough for the main thread to
 // process as one event.
-const int READER_BUFFER_SIZE = MAX_DATA_IN_SIZE * 16;
+const int DEFAULT_READER_BUFFER_SIZE = DEFAULT_TRANSFER_SIZE * 16;
+const int READER_BUFFER_TRANSFERS = 4;
 
 const struct ptp_device_status_data status_data[] = {
 /* OK     */ { htole16(0x0004),
@@ -27,6 +39,48 @@ const struct ptp_device_status_data status_data[] = {
                htole16(PTP_RC_TRANSACTION_CANCELLED), 0, 0 }
 };
 
+// Thin wrappers for the AIO syscalls; libaio would only add a dependency.
+static int sys_io_setup(unsigned nr, aio_context_t *ctx)
+{
+    return syscall(__NR_io_setup, nr, ctx);
+}
+
+static int sys_io_destroy(aio_context_t ctx)
+{
+    return syscall(__NR_io_destroy, ctx);
+}
+
+static int sys_io_submit(aio_context_t ctx, long nr, struct iocb **iocbs)
+{
+    return syscall(__NR_io_submit, ctx, nr, iocbs);
+}
+
+static int sys_io_getevents(aio_context_t ctx, long min_nr, long max_nr,
+                            struct io_event *events,
+                            struct timespec *timeout = NULL)
+{
+    return syscall(__NR_io_getevents, ctx, min_nr, max_nr, events, timeout);
+}
+
+static int sys_io_cancel(aio_context_t ctx, struct iocb *cb,
+                         struct io_event *result)
+{
+    return syscall(__NR_io_cancel, ctx, cb, result);
+}
+
+static void fillRequest(struct iocb *cb, int fd, quint16 opcode,
+                        char *buffer, quint32 len, quint64 offset,
+                        quint64 data)
+{
+    memset(cb, 0, sizeof *cb);
+    cb->aio_data = data;
+    cb->aio_lio_opcode = opcode;
+    cb->aio_fildes = fd;
+    cb->aio_buf = (quint64)(quintptr)buffer;
+    cb->aio_nbytes = len;
+    cb->aio_offset = offset;
+}
+
 static const char *const event_names[] = {
 "BIND",
 "UNBIND",
@@ -38,12 +92,57 @@ static const char *const event_names[] = {
 };
 
 IOThread::IOThread(QObject *parent)
-    : QThread(parent), m_fd(0), m_shouldExit(false), m_handle(0)
+    : QThread(parent), m_fd(0), m_shouldExit(false), m_aioDepth(1),
+      m_transferSize(DEFAULT_TRANSFER_SIZE), m_aioOffset(0), m_handle(0)
 {}
 
 void IOThread::setFd(int fd)
 {
     m_fd = fd;
+    m_aioOffset = 0;
+}
+
+void IOThread::setAioDepth(int depth)
+{
+    m_aioDepth = depth > 1 ? depth : 1;
+}
+
+int IOThread::aioDepth() const
+{
+    return m_aioDepth;
+}
+
+void IOThread::setTransferSize(int size)
+{
+    // Whole SuperSpeed packets, so that only the last write of a
+    // transfer can end in a short packet at any bus speed
+    size = qBound(PTP_SS_DATA_PKT_SIZE, size, MAX_TRANSFER_SIZE);
+    m_transferSize.store(size - size % PTP_SS_DATA_PKT_SIZE);
+}
+
+int IOThread::transferSize() const
+{
+    return m_transferSize.load();
+}
+
+bool IOThread::submitAio(aio_context_t ctx, struct iocb *cb, quint16 opcode,
+                         char *buffer, quint32 len, quint64 data)
+{
+    fillRequest(cb, m_fd, opcode, buffer, len, m_aioOffset, data);
+    // io_submit blocks until the endpoint is enabled; an interrupt from
+    // exitThread() must get us out of there.
+    while (sys_io_submit(ctx, 1, &cb) != 1) {
+        if (m_shouldExit)
+            return false;
+        if (errno != EINTR && errno != EAGAIN) {
+            MTP_LOG_CRITICAL("Can't queue AIO request: errno" << errno);
+            return false;
+        }
+        if (errno == EAGAIN)
+            msleep(1);
+    }
+    m_aioOffset += len;
+    return true;
 }
 
 void IOThread::interrupt()
@@ -222,9 +321,10 @@ void ControlReaderThread::setupRequest(void *data)
 
 
 BulkReaderThread::BulkReaderThread(QObject *parent)
-    : IOThread(parent)
+    : IOThread(parent), m_bufferSize(DEFAULT_READER_BUFFER_SIZE),
+      m_requestedBufferSize(0), m_autoTune(false)
 {
-    m_buffer = new char[READER_BUFFER_SIZE];
+    m_buffer = new char[m_bufferSize];
     resetData();
 }
 
@@ -241,14 +341,44 @@ void BulkReaderThread::resetData()
     m_dataSize2 = 0;
 }
 
-// Find a usable place in m_buffer to read MAX_DATA_IN_SIZE bytes.
+void BulkReaderThread::setBufferSize(int size)
+{
+    m_requestedBufferSize = size > 0 ? size : 0;
+}
+
+void BulkReaderThread::setAutoTune(bool enable)
+{
+    m_autoTune = enable;
+}
+
+// Runs in the reader thread before it starts reading
+void BulkReaderThread::allocateBuffer()
+{
+    int transfer = transferSize();
+    int size = m_requestedBufferSize;
+    if (!size)
+        size = qMax(DEFAULT_READER_BUFFER_SIZE, transfer * READER_BUFFER_TRANSFERS);
+    // Leave room for a read at either end of the buffer
+    size = qMax(size, transfer * 2);
+
+    QMutexLocker locker(&m_bufferLock);
+    if (size == m_bufferSize || m_dataSize1 || m_dataSize2)
+        return;
+    delete[] m_buffer;
+    m_buffer = new char[size];
+    m_bufferSize = size;
+    m_dataStart = 0;
+}
+
+// Find a usable place in m_buffer to read transferSize() bytes.
 // Return -1 if there's no space.
 int BulkReaderThread::_getOffset_locked()
 {
     // See the class definition for the story of how m_buffer is handled.
-    if (READER_BUFFER_SIZE - (m_dataStart + m_dataSize1) >= MAX_DATA_IN_SIZE)
+    int transfer = transferSize();
+    if (m_bufferSize - (m_dataStart + m_dataSize1) >= transfer)
         return m_dataStart + m_dataSize1;
-    if (m_dataStart - m_dataSize2 >= MAX_DATA_IN_SIZE)
+    if (m_dataStart - m_dataSize2 >= transfer)
         return m_dataSize2;
     return -1;
 }
@@ -270,23 +400,125 @@ bool BulkReaderThread::_markNewData(int offset, int size)
     return true;
 }
 
+int BulkReaderThread::waitForSpace()
+{
+    QMutexLocker locker(&m_bufferLock);
+    int offset = _getOffset_locked();
+    while (!m_shouldExit && offset < 0) {
+        m_wait.wait(&m_bufferLock);
+        offset = _getOffset_locked();
+    }
+    return m_shouldExit ? -1 : offset;
+}
+
+bool BulkReaderThread::deliver(const char *data, int size)
+{
+    int offset = waitForSpace();
+    if (offset < 0)
+        return false;
+    memcpy(m_buffer + offset, data, size);
+    if (!_markNewData(offset, size)) {
+        MTP_LOG_CRITICAL("BulkReaderThread bad offset" << offset << m_dataStart << m_dataSize1 << m_dataSize2);
+        return false;
+    }
+    emit dataReady();
+    return true;
+}
+
 void BulkReaderThread::execute()
+{
+    QByteArray received;
+    if (m_autoTune) {
+        m_autoTune = false;
+        autoTuneTransferSize(&received);
+    }
+    allocateBuffer();
+    if (!received.isEmpty() && !deliver(received.constData(), received.size()))
+        return;
+
+    if (m_aioDepth > 1)
+        executeAio();
+    else
+        executeBlocking();
+}
+
+// Queues one read of each candidate size and cancels it again; the
+// largest size the UDC takes becomes the transfer size. io_submit waits
+// until the host enables the endpoint, which is why this runs on the
+// reader thread rather than at bind. A command the host sends meanwhile
+// completes the probe read (commands are single short packets, so a
+// cancel can't cut one in half) and is passed on in *received.
+void BulkReaderThread::autoTuneTransferSize(QByteArray *received)
+{
+    aio_context_t ctx = 0;
+    if (sys_io_setup(1, &ctx) < 0) {
+        MTP_LOG_WARNING("Can't probe transfer size without AIO, errno" << errno);
+        return;
+    }
+
+    QByteArray buffer(MAX_TRANSFER_SIZE, Qt::Uninitialized);
+    int best = transferSize();
+    for (int size = best * 2; size <= MAX_TRANSFER_SIZE && !m_shouldExit; size *= 2) {
+        struct iocb cb;
+        struct iocb *cbp = &cb;
+        struct io_event event;
+        int count;
+
+        fillRequest(&cb, m_fd, IOCB_CMD_PREAD, buffer.data(), size, m_aioOffset, 0);
+        while ((count = sys_io_submit(ctx, 1, &cbp)) != 1 && errno == EINTR && !m_shouldExit)
+            ;
+        if (count != 1) {
+            if (!m_shouldExit)
+                MTP_LOG_INFO("UDC refused" << size << "byte requests, errno" << errno);
+            break;
+        }
+
+        // Older kernels return the result of a successful cancel right
+        // here; newer ones always deliver it as an event.
+        if (sys_io_cancel(ctx, &cb, &event) == 0) {
+            count = 1;
+        } else {
+            struct timespec timeout = { 1, 0 };
+            while ((count = sys_io_getevents(ctx, 1, 1, &event, &timeout)) < 0
+                   && errno == EINTR && !m_shouldExit)
+                ;
+        }
+        if (count != 1)
+            break; // still queued; io_destroy below takes care of it
+
+        if (event.res > 0) {
+            received->append(buffer.constData(), event.res);
+            m_aioOffset += event.res;
+            best = size;
+            break;
+        }
+        if (event.res < 0 && event.res != -ECONNRESET && event.res != -ECANCELED) {
+            MTP_LOG_INFO("UDC refused" << size << "byte requests, errno" << -event.res);
+            break;
+        }
+        best = size;
+    }
+
+    sys_io_destroy(ctx);
+    // Keeps regular file stand-ins for the endpoint in step; FunctionFS
+    // files don't seek and ignore this.
+    lseek(m_fd, m_aioOffset, SEEK_SET);
+    if (best != transferSize()) {
+        MTP_LOG_INFO("Bulk transfer size tuned to" << best);
+        setTransferSize(best);
+    }
+}
+
+void BulkReaderThread::executeBlocking()
 {
     int readSize;
 
     while (!m_shouldExit) {
-        int offset;
-        m_bufferLock.lock();
-        offset = _getOffset_locked();
-        while (!m_shouldExit && offset < 0) {
-            m_wait.wait(&m_bufferLock);
-            offset = _getOffset_locked();
-        }
-        m_bufferLock.unlock();
-        if (m_shouldExit)
+        int offset = waitForSpace();
+        if (offset < 0)
             break;
 
-        readSize = read(m_fd, m_buffer + offset, MAX_DATA_IN_SIZE);
+        readSize = read(m_fd, m_buffer + offset, transferSize());
         if (m_shouldExit)
             break;
         if (readSize == -1) {
@@ -310,6 +542,83 @@ void BulkReaderThread::execute()
     }
 }
 
+// Keeps m_aioDepth reads queued on the endpoint, so that the controller
+// always has a request to fill while earlier data is being processed.
+// The requests read into their own slots and complete in order on the
+// endpoint; each one is copied into m_buffer in submission order, which
+// keeps the buffer protocol with the main thread exactly as it is for
+// blocking reads.
+void BulkReaderThread::executeAio()
+{
+    aio_context_t ctx = 0;
+    if (sys_io_setup(m_aioDepth, &ctx) < 0) {
+        MTP_LOG_WARNING("BulkReaderThread can't set up AIO, errno" << errno);
+        executeBlocking();
+        return;
+    }
+
+    struct Slot {
+        struct iocb cb;
+        bool done;
+        qint64 result;
+    };
+    const int transfer = transferSize();
+    QVector<Slot> requests(m_aioDepth);
+    QByteArray buffers(m_aioDepth * transfer, Qt::Uninitialized);
+    QVector<struct io_event> events(m_aioDepth);
+    bool ok = true;
+
+    for (int i = 0; ok && i < m_aioDepth; i++) {
+        requests[i].done = false;
+        ok = submitAio(ctx, &requests[i].cb, IOCB_CMD_PREAD,
+                       buffers.data() + i * transfer, transfer, i);
+    }
+
+    int head = 0;
+    while (ok && !m_shouldExit) {
+        // Hand over finished reads in the order they were queued
+        while (ok && requests[head].done) {
+            Slot &slot = requests[head];
+            if (slot.result < 0) {
+                int error = -slot.result;
+                if (error != EINTR && error != EAGAIN && error != ESHUTDOWN) {
+                    MTP_LOG_CRITICAL("BulkReaderThread exiting: errno" << error);
+                    ok = false;
+                    break;
+                }
+                MTP_LOG_WARNING("BulkReaderThread delaying: errno" << error);
+                msleep(1);
+            } else if (!deliver(buffers.constData() + head * transfer, slot.result)) {
+                ok = false;
+                break;
+            }
+
+            slot.done = false;
+            ok = submitAio(ctx, &slot.cb, IOCB_CMD_PREAD,
+                           buffers.data() + head * transfer, transfer, head);
+            head = (head + 1) % m_aioDepth;
+        }
+        if (!ok || m_shouldExit)
+            break;
+
+        int count = sys_io_getevents(ctx, 1, m_aioDepth, events.data());
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            MTP_LOG_CRITICAL("BulkReaderThread exiting: io_getevents errno" << errno);
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            Slot &slot = requests[events[i].data];
+            slot.done = true;
+            slot.result = events[i].res;
+        }
+    }
+
+    // Cancels the reads still queued and waits for them
+    sys_io_destroy(ctx);
+}
+
 // Called by the main thread to request more data to process.
 // getData() should not be called again until all of it has been
 // released with releaseData().
@@ -360,31 +669,149 @@ void BulkReaderThread::interrupt() // Executed in main thread
 }
 
 BulkWriterThread::BulkWriterThread(QObject *parent)
-    : IOThread(parent)
+    : IOThread(parent), m_aioContext(0)
 {
-    // Connect the finished signal (emitted from the writer thread) to
+    // Connect the bufferDone signal (emitted from the writer thread) to
     // a do-nothing slot (received in the transporter's thread) in order to
     // make sure that sendData() in the transporter is woken up after the
     // result is ready. This way sendData doesn't have to poll.
-    connect(this, SIGNAL(finished()), SLOT(quit()), Qt::QueuedConnection);
+    connect(this, SIGNAL(bufferDone()), SLOT(quit()), Qt::QueuedConnection);
+    m_requests.reserve(MAX_WRITES_QUEUED);
+}
+
+BulkWriterThread::~BulkWriterThread()
+{
+    if (m_aioContext)
+        sys_io_destroy(m_aioContext);
+}
+
+bool BulkWriterThread::enqueue(const quint8 *buffer, quint32 dataLen,
+                               bool terminateTransfer,
+                               Completion completion, void *context)
+{
+    // This runs in the main thread.
+    Request request;
+    request.buffer = buffer;
+    request.dataLen = dataLen;
+    request.terminateTransfer = terminateTransfer;
+    request.completion = completion;
+    request.context = context;
+
+    m_lock.lock();
+    // Once the thread is on its way out, nothing would complete this
+    if (!isRunning() || m_shouldExit) {
+        m_lock.unlock();
+        if (completion)
+            completion(context, false);
+        return true;
+    }
+    if (m_requests.count() >= MAX_WRITES_QUEUED) {
+        m_lock.unlock();
+        return false;
+    }
+    if (m_requests.isEmpty())
+        m_wait.wakeAll(); // restart processing after m_lock is released
+    m_requests.append(request);
+    m_lock.unlock();
+    return true;
 }
 
-void BulkWriterThread::setData(const quint8 *buffer, quint32 dataLen, bool terminateTransfer)
+void BulkWriterThread::flush()
 {
-    // This runs in the main thread. The caller makes sure that the
-    // writer thread is not running yet.
+    // This runs in the main thread.
+    QVector<Request> dropped;
+
+    m_lock.lock();
+    if (!m_requests.isEmpty()) {
+        // Everything behind the head hasn't started yet
+        dropped = m_requests.mid(1);
+        m_requests.erase(m_requests.begin() + 1, m_requests.end());
+
+        // The head is stopped by the writer itself, interrupted out of
+        // a blocking write if need be.
+        m_flushing.storeRelease(1);
+        while (m_flushing.loadAcquire()) {
+            m_wait.wakeAll();
+            IOThread::interrupt();
+            m_flushed.wait(&m_lock, 1);
+        }
+    }
+    m_lock.unlock();
 
-    m_buffer = buffer;
-    m_dataLen = dataLen;
-    m_terminateTransfer = terminateTransfer;
-    m_result = false;
-    m_result_ready.store(0);
+    foreach (const Request &request, dropped) {
+        if (request.completion)
+            request.completion(request.context, false);
+    }
+    if (!dropped.isEmpty())
+        MTP_LOG_WARNING("BulkWriterThread flushed" << dropped.count() + 1 << "buffers");
 }
 
 void BulkWriterThread::execute()
 {
-    // Call setData before starting the thread.
+    while (!m_shouldExit) {
+        m_lock.lock();
+
+        while (!m_shouldExit && m_requests.isEmpty())
+            m_wait.wait(&m_lock); // will release the lock while waiting
+
+        if (m_shouldExit) { // may have been woken up by exitThread()
+            m_lock.unlock();
+            break;
+        }
+
+        const Request &request = m_requests.first();
+        m_buffer = request.buffer;
+        m_dataLen = request.dataLen;
+        m_terminateTransfer = request.terminateTransfer;
+        m_lock.unlock();
+
+        // After a failure the host won't expect the rest of the
+        // transfer either, so whatever was queued behind it is dropped.
+        bool result = writeBuffer();
+        completeRequests(result, !result);
+    }
+
+    // Nobody will write what's left
+    completeRequests(false, true);
+}
+
+// Pops the head request, or all of them, and runs their completions
+void BulkWriterThread::completeRequests(bool result, bool all)
+{
+    bool popped = false;
+    Request head;
+    QVector<Request> rest;
+
+    m_lock.lock();
+    if (!m_requests.isEmpty()) {
+        head = m_requests.first();
+        m_requests.remove(0); // keeps the reserved capacity
+        popped = true;
+    }
+    if (m_flushing.loadAcquire()) {
+        m_flushing.storeRelease(0);
+        m_flushed.wakeAll();
+    }
+    if (all && !m_requests.isEmpty()) {
+        rest = m_requests;
+        m_requests.clear();
+        m_requests.reserve(MAX_WRITES_QUEUED);
+    }
+    m_lock.unlock();
+
+    if (popped && head.completion)
+        head.completion(head.context, result);
+    foreach (const Request &request, rest) {
+        if (request.completion)
+            request.completion(request.context, result);
+    }
+    if (popped)
+        emit bufferDone();
+}
 
+// Writes m_buffer to the endpoint, returns true if all of it went out
+bool BulkWriterThread::writeBuffer()
+{
     int bytesWritten = 0;
     char *dataptr = (char*)m_buffer;
     // PTP compatibility requires that a transfer is terminated by a
@@ -398,8 +825,17 @@ void BulkWriterThread::execute()
     // TODO: Get the real packet size from the kernel
     bool zeropacket = m_terminateTransfer && m_dataLen % PTP_HS_DATA_PKT_SIZE == 0;
 
-    while ((m_dataLen || zeropacket) && !m_shouldExit) {
-        bytesWritten = write(m_fd, dataptr, m_dataLen);
+    // With AIO, the data goes out as several queued requests, and only
+    // the zero-length packet is left for the blocking loop below.
+    if (m_aioDepth > 1 && m_dataLen) {
+        if (!executeAio())
+            return false;
+        dataptr = (char*)m_buffer;
+    }
+
+    // The UDC may not take requests beyond the transfer size
+    while ((m_dataLen || zeropacket) && !m_shouldExit && !m_flushing.loadAcquire()) {
+        bytesWritten = write(m_fd, dataptr, qMin(m_dataLen, (quint32)transferSize()));
         if(bytesWritten == -1)
         {
             if(errno == EINTR)
@@ -414,10 +850,10 @@ void BulkWriterThread::execute()
             {
                 // After a shutdown, the host won't expect this data anymore,
                 // so drop it and report failure.
-                MTP_LOG_WARNING("BulkWriterThread exiting (endpoint shutdown)");
+                MTP_LOG_WARNING("BulkWriterThread dropping buffer (endpoint shutdown)");
                 break;
             }
-            MTP_LOG_CRITICAL("BulkWriterThread exiting: errno " << errno);
+            MTP_LOG_CRITICAL("BulkWriterThread write failed: errno " << errno);
             break;
         }
         if (m_dataLen == 0)
@@ -426,19 +862,88 @@ void BulkWriterThread::execute()
         m_dataLen -= bytesWritten;
     }
 
-    m_result = m_dataLen == 0;
-    m_result_ready.storeRelease(1);
+    return m_dataLen == 0;
 }
 
-bool BulkWriterThread::resultReady()
+void BulkWriterThread::interrupt()
 {
-    return m_result_ready.load() != 0;
+    IOThread::interrupt();  // wake up the thread if it's in write()
+    m_wait.wakeAll(); // wake up the thread if it's in m_wait.wait()
 }
 
-bool BulkWriterThread::getResult()
+bool BulkWriterThread::executeAio()
 {
-    // Check resultReady() before calling getResult()
-    return m_result;
+    if (!m_aioContext && sys_io_setup(m_aioDepth, &m_aioContext) < 0) {
+        MTP_LOG_WARNING("BulkWriterThread can't set up AIO, errno" << errno);
+        m_aioContext = 0;
+        m_aioDepth = 1; // don't try again for every transfer
+        return true;
+    }
+
+    // Split the buffer so that every request is busy at once. All but
+    // the last piece are whole packets, so the host sees one transfer.
+    // A multiple of 512 is not enough: on SuperSpeed the packets are
+    // 1024 bytes and a piece ending halfway through one ends the transfer.
+    quint32 pieceSize = m_dataLen / m_aioDepth;
+    pieceSize -= pieceSize % PTP_SS_DATA_PKT_SIZE;
+    pieceSize = qBound((quint32)PTP_SS_DATA_PKT_SIZE, pieceSize, (quint32)transferSize());
+
+    QVector<struct iocb> cbs(m_aioDepth);
+    QVector<struct io_event> events(m_aioDepth);
+    QVector<int> freeSlots;
+    for (int i = m_aioDepth - 1; i >= 0; i--)
+        freeSlots.append(i);
+
+    quint32 queued = 0;
+    int inFlight = 0;
+    bool ok = true;
+    while (ok && !m_shouldExit && !m_flushing.loadAcquire() && (queued < m_dataLen || inFlight)) {
+        while (queued < m_dataLen && !freeSlots.isEmpty()) {
+            int slot = freeSlots.takeLast();
+            quint32 len = qMin(pieceSize, m_dataLen - queued);
+            if (!submitAio(m_aioContext, &cbs[slot], IOCB_CMD_PWRITE,
+                           (char*)m_buffer + queued, len, slot)) {
+                ok = false;
+                break;
+            }
+            queued += len;
+            inFlight++;
+        }
+        if (!inFlight)
+            break;
+
+        int count = sys_io_getevents(m_aioContext, 1, m_aioDepth, events.data());
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            MTP_LOG_CRITICAL("BulkWriterThread io_getevents failed: errno " << errno);
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            int slot = events[i].data;
+            if (events[i].res != (qint64)cbs[slot].aio_nbytes) {
+                // Includes ESHUTDOWN: the host won't expect the rest either
+                MTP_LOG_WARNING("BulkWriterThread request failed: " << events[i].res);
+                ok = false;
+            }
+            freeSlots.append(slot);
+            inFlight--;
+        }
+    }
+
+    if (inFlight || !ok || m_shouldExit) {
+        // Cancel whatever is still queued before the buffer goes away;
+        // a fresh context is set up for the next transfer.
+        sys_io_destroy(m_aioContext);
+        m_aioContext = 0;
+        return false;
+    }
+    if (queued < m_dataLen)
+        return false; // flushed before all of it was queued
+
+    m_buffer += m_dataLen;
+    m_dataLen = 0;
+    return true;
 }
 
 InterruptWriterThread::InterruptWriterThread(QObject *parent)
@@ -453,25 +958,21 @@ InterruptWriterThread::~InterruptWriterThread()
 
 void InterruptWriterThread::addData(const quint8 *buffer, quint32 dataLen)
 {
-    QMutexLocker locker(&m_lock);
-
-    quint8 *copy = (quint8*)malloc(dataLen);
-    if(copy == NULL) {
-        MTP_LOG_CRITICAL("Couldn't allocate memory for events");
-        return;
-    }
+    quint8 *copy = BufferPool::instance()->allocate(dataLen);
     memcpy(copy, buffer, dataLen);
 
+    QMutexLocker locker(&m_lock);
+
     // This is here in case the interrupt writing thread cannot keep up
-    // with the events. It removes the oldest events.
-    while(m_buffers.count() >= MAX_EVENTS_STORED) {
-        QPair<quint8*,int> pair = m_buffers.takeFirst();
-        delete pair.first;
-    }
+    // with the events. It removes the oldest events; the storage event
+    // scheduler paces its output so this should only trigger when the
+    // host stops reading the interrupt endpoint altogether.
+    while(m_buffers.count() >= MAX_EVENTS_STORED)
+        BufferPool::instance()->release(m_buffers.takeFirst().first);
 
     if(m_buffers.empty())
         m_wait.wakeAll(); // restart processing after m_lock is released
-    m_buffers.append(QPair<quint8*,int>(copy, dataLen));
+    m_buffers.append(qMakePair(copy, dataLen));
 }
 
 void InterruptWriterThread::execute()
@@ -487,11 +988,11 @@ void InterruptWriterThread::execute()
             break;
         }
 
-        QPair<quint8*,int> pair = m_buffers.takeFirst();
+        QPair<quint8 *, quint32> event = m_buffers.takeFirst();
         m_lock.unlock();
 
-        quint8 *dataptr = pair.first;
-        int dataLen = pair.second;
+        const quint8 *dataptr = event.first;
+        int dataLen = event.second;
 
         while(dataLen && !m_shouldExit) {
             int bytesWritten = write(m_fd, dataptr, dataLen);
@@ -510,8 +1011,7 @@ void InterruptWriterThread::execute()
             dataptr += bytesWritten;
             dataLen -= bytesWritten;
         }
-
-        free(pair.first);
+        BufferPool::instance()->release(event.first);
     }
 }
 
@@ -519,11 +1019,8 @@ void InterruptWriterThread::reset()
 {
     QMutexLocker locker(&m_lock);
 
-    QPair<quint8*,int> item;
-    foreach(item, m_buffers) {
-        delete item.first;
-    }
-    m_buffers.clear();
+    while(!m_buffers.isEmpty())
+        BufferPool::instance()->release(m_buffers.takeFirst().first);
 }
 
 void InterruptWriterThread::interrupt()
@@ -5,9 +5,12 @@
 
 #include <QThread>
 #include <QMutex>
+#include <QByteArray>
 #include <QPair>
 #include <QList>
+#include <QVector>
 #include <QWaitCondition>
+#include <linux/aio_abi.h>
 
 enum mtpfs_status {
     MTPFS_STATUS_OK,
@@ -23,13 +26,33 @@ public:
     void exitThread();
     bool stall(bool dirIn);
 
+    // Number of transfers the bulk threads keep queued on their endpoint
+    // with Linux AIO. 1 (the default) means plain blocking read()/write().
+    // Only change this while the thread is not running.
+    void setAioDepth(int depth);
+    int aioDepth() const;
+
+    // Largest request the bulk threads queue on their endpoint, rounded
+    // down to whole packets. Only change this while the thread is not
+    // running.
+    void setTransferSize(int size);
+    int transferSize() const;
+
 protected:
     void run();
     // Implement this method in subclass.
     virtual void execute() = 0;
+    // Queue one request on m_fd at m_aioOffset; gives up on exit
+    bool submitAio(aio_context_t ctx, struct iocb *cb, quint16 opcode,
+                   char *buffer, quint32 len, quint64 data);
 
     int m_fd;
     bool m_shouldExit;
+    int m_aioDepth;
+    QAtomicInt m_transferSize; // the reader may tune it while running
+    // Running file offset for AIO requests. FunctionFS ignores it, but
+    // it lets regular files stand in for the endpoints in tests.
+    quint64 m_aioOffset;
 
 private:
     QMutex m_handleLock;
@@ -78,10 +101,26 @@ public:
     void resetData(); // discard all data in the buffer
     virtual void interrupt();
 
+    // Size of m_buffer; 0 (the default) sizes it from the transfer size.
+    // Takes effect the next time the thread starts with an empty buffer.
+    void setBufferSize(int size);
+    // Probe the largest request the UDC accepts the next time the thread
+    // starts, and use that as the transfer size.
+    void setAutoTune(bool enable);
+
 protected:
     virtual void execute();
 
 private:
+    void executeBlocking();
+    void executeAio();
+    void autoTuneTransferSize(QByteArray *received);
+    void allocateBuffer();
+    // Waits for room in m_buffer for one read, returns -1 on exit
+    int waitForSpace();
+    // Copies data read outside m_buffer into it and signals it
+    bool deliver(const char *data, int size);
+
     QWaitCondition m_wait;
     QMutex m_bufferLock;
     // The buffer logic:
@@ -110,7 +149,8 @@ private:
     // only grow the buffer space available to the other thread, never
     // shrink it, they can work in m_buffer at the same time.
     //
-    // m_buffer is allocated for the lifetime of this object.
+    // m_buffer is only reallocated by the reader thread while it holds
+    // no data, so the main thread never has a pointer into it then.
     //
     // Some diagrams:
     // The buffer some time after reader and main thread have been active:
@@ -128,6 +168,9 @@ private:
     // it was smaller than the minimum read size.
     //
     char *m_buffer;
+    int m_bufferSize; // size of m_buffer
+    int m_requestedBufferSize;
+    bool m_autoTune;
     int m_dataStart; // protected by m_bufferLock
     int m_dataSize1; // protected by m_bufferLock
     int m_dataSize2; // protected by m_bufferLock
@@ -142,20 +185,58 @@ class BulkWriterThread : public IOThread {
     Q_OBJECT
 public:
     explicit BulkWriterThread(QObject *parent = 0);
+    ~BulkWriterThread();
+
+    // Called on the writer thread once a queued buffer has been written
+    // (result true) or dropped, after which the buffer may be freed.
+    typedef void (*Completion)(void *context, bool result);
 
-    void setData(const quint8 *buffer, quint32 dataLen, bool terminateTransfer = false);
-    bool resultReady();
-    bool getResult();
+    // Queues a buffer for the bulk IN endpoint; the buffer must stay
+    // valid until its completion has been called. Returns false if the
+    // queue is full; wait for bufferDone() and try again. If the thread
+    // isn't running, completes right away with false.
+    bool enqueue(const quint8 *buffer, quint32 dataLen, bool terminateTransfer,
+                 Completion completion, void *context);
+    // Stops the buffer being written and drops the queued ones; all of
+    // them complete with false. Returns once the thread has let go of
+    // them, so that a buffer queued afterwards starts a fresh transfer.
+    void flush();
+    virtual void interrupt();
 
 protected:
     virtual void execute();
 
 private:
+    struct Request {
+        const quint8 *buffer;
+        quint32 dataLen;
+        bool terminateTransfer;
+        Completion completion;
+        void *context;
+    };
+
+    bool writeBuffer();
+    // Queues the buffer as up to m_aioDepth requests at a time;
+    // returns false if the transfer failed
+    bool executeAio();
+    void completeRequests(bool result, bool all);
+
+    QMutex m_lock; // protects m_requests and used with m_wait
+    QWaitCondition m_wait;
+    QWaitCondition m_flushed; // signalled when a flush has taken effect
+    QAtomicInt m_flushing; // set by flush() until the head is completed
+    // The head request stays in the queue while it's being written.
+    // Its capacity is reserved up front so that queueing doesn't allocate.
+    QVector<Request> m_requests;
+
+    // The buffer being written, taken from the head request
     const quint8 *m_buffer;
     quint32 m_dataLen;
-    QAtomicInt m_result_ready;
-    bool m_result;
     bool m_terminateTransfer;
+    aio_context_t m_aioContext; // kept across transfers, 0 if not set up
+signals:
+    // Emitted after each completion, to wake up a waiting main thread
+    void bufferDone();
 };
 
 class InterruptWriterThread : public IOThread {
@@ -175,7 +256,8 @@ private:
     QMutex m_lock; // protects m_buffers and used with m_wait
     QWaitCondition m_wait;
 
-    QList<QPair<quint8 *,int> > m_buffers;
+    // Events copied into BufferPool buffers, with their lengths
+    QList<QPair<quint8 *, quint32> > m_buffers;
 };
 
 #endif
@@ -0,0 +1,333 @@
+/*
+* This file is part of libmeegomtp package
+*
+* Copyright (C) 2010 Nokia Corporation. All rights reserved.
+*
+* Contact: Deepak Kodihalli <deepak.kodihalli@nokia.com>
+*
+* Redistribution and use in source and binary forms, with or without modification,
+* are permitted provided that the following conditions are met:
+*
+* Redistributions of source code must retain the above copyright notice, this list
+* of conditions and the following disclaimer. Redistributions in binary form must
+* reproduce the above copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of Nokia Corporation nor the names of its contributors may be
+* used to endorse or promote products derived from this software without specific
+* prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+* INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+* BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+* LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+* OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+* OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <QElapsedTimer>
+#include <QFile>
+#include "threadio_test.h"
+#include "threadio.h"
+
+using namespace meegomtp1dot0;
+
+// Regular files standing in for the bulk OUT and IN endpoint files
+static const char *const OUT_ENDPOINT = "/tmp/mtp-test-ep-out";
+static const char *const IN_ENDPOINT = "/tmp/mtp-test-ep-in";
+static const int PATTERN_SIZE = 8 * 1024 * 1024;
+static const int TIMEOUT_MS = 30000;
+
+// The threads are interrupted with SIGUSR1, which the transporter
+// normally catches.
+static void signalHandler(int)
+{
+}
+
+void ThreadIO_test::initTestCase()
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = signalHandler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = 0;
+    QVERIFY(sigaction(SIGUSR1, &action, NULL) == 0);
+
+    m_tunedTransferSize = 0;
+    m_pattern.resize(PATTERN_SIZE);
+    for (int i = 0; i < PATTERN_SIZE; i++)
+        m_pattern[i] = (char)((i * 7) ^ (i >> 12));
+
+    QFile file(OUT_ENDPOINT);
+    QVERIFY(file.open(QIODevice::WriteOnly | QIODevice::Truncate));
+    QCOMPARE(file.write(m_pattern), (qint64)PATTERN_SIZE);
+}
+
+void ThreadIO_test::cleanupTestCase()
+{
+    QFile::remove(OUT_ENDPOINT);
+    QFile::remove(IN_ENDPOINT);
+}
+
+void ThreadIO_test::addDepthColumns()
+{
+    QTest::addColumn<int>("depth");
+    QTest::addColumn<int>("transferSize");
+    QTest::newRow("blocking") << 1 << 16384;
+    QTest::newRow("aio depth 4") << 4 << 16384;
+    QTest::newRow("blocking, 256K transfers") << 1 << 262144;
+    QTest::newRow("aio depth 4, 256K transfers") << 4 << 262144;
+}
+
+// Drains the OUT endpoint through a BulkReaderThread the way the
+// transporter does, until the whole pattern has been received.
+bool ThreadIO_test::readEndpoint(int depth, int transferSize, QByteArray *received,
+                                 bool autoTune)
+{
+    int fd = open(OUT_ENDPOINT, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    BulkReaderThread reader;
+    reader.setFd(fd);
+    reader.setAioDepth(depth);
+    reader.setTransferSize(transferSize);
+    reader.setAutoTune(autoTune);
+    reader.start();
+
+    received->clear();
+    received->reserve(PATTERN_SIZE);
+    QElapsedTimer timer;
+    timer.start();
+    while (received->size() < PATTERN_SIZE && timer.elapsed() < TIMEOUT_MS) {
+        char *data;
+        int size;
+        reader.getData(&data, &size);
+        if (!size) {
+            QThread::yieldCurrentThread();
+            continue;
+        }
+        received->append(data, size);
+        reader.releaseData(size);
+    }
+
+    reader.exitThread();
+    close(fd);
+    m_tunedTransferSize = reader.transferSize();
+    return received->size() == PATTERN_SIZE;
+}
+
+// Counts the completions of the buffers queued on a BulkWriterThread
+struct WriteCompletions
+{
+    QAtomicInt done;
+    QAtomicInt failed;
+};
+
+static void bufferWritten(void *context, bool result)
+{
+    WriteCompletions *completions = static_cast<WriteCompletions *>(context);
+    if (!result)
+        completions->failed.ref();
+    completions->done.ref();
+}
+
+// Pushes the pattern to the IN endpoint through a BulkWriterThread in
+// chunks of chunkSize, terminating the transfer with the last one.
+bool ThreadIO_test::writeEndpoint(int depth, int transferSize, int chunkSize)
+{
+    int fd = open(IN_ENDPOINT, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+
+    BulkWriterThread writer;
+    writer.setFd(fd);
+    writer.setAioDepth(depth);
+    writer.setTransferSize(transferSize);
+
+    writer.start();
+
+    // Keeps the queue full, like a pipelined sender would
+    WriteCompletions completions;
+    int queued = 0;
+    QElapsedTimer timer;
+    timer.start();
+    for (int sent = 0; sent < PATTERN_SIZE && timer.elapsed() < TIMEOUT_MS; ) {
+        int len = qMin(chunkSize, PATTERN_SIZE - sent);
+        if (!writer.enqueue((const quint8 *)m_pattern.constData() + sent, len,
+                            sent + len == PATTERN_SIZE, bufferWritten, &completions)) {
+            QThread::yieldCurrentThread();
+            continue;
+        }
+        sent += len;
+        queued++;
+    }
+    while (completions.done.loadAcquire() < queued && timer.elapsed() < TIMEOUT_MS)
+        QThread::yieldCurrentThread();
+
+    writer.exitThread();
+    close(fd);
+    return completions.done.load() == queued && completions.failed.load() == 0;
+}
+
+void ThreadIO_test::testBulkRead_data()
+{
+    addDepthColumns();
+}
+
+void ThreadIO_test::testBulkRead()
+{
+    QFETCH(int, depth);
+    QFETCH(int, transferSize);
+
+    QByteArray received;
+    QVERIFY(readEndpoint(depth, transferSize, &received));
+    QVERIFY(received == m_pattern);
+}
+
+void ThreadIO_test::testBulkReadAutoTune_data()
+{
+    addDepthColumns();
+}
+
+void ThreadIO_test::testBulkReadAutoTune()
+{
+    QFETCH(int, depth);
+    QFETCH(int, transferSize);
+
+    // A file never refuses a request; the first probe read returns data
+    // instead, which stops the probe and must still reach the receiver.
+    QByteArray received;
+    QVERIFY(readEndpoint(depth, transferSize, &received, true));
+    QVERIFY(received == m_pattern);
+    QCOMPARE(m_tunedTransferSize, transferSize * 2);
+}
+
+void ThreadIO_test::testBulkWrite_data()
+{
+    addDepthColumns();
+}
+
+void ThreadIO_test::testBulkWrite()
+{
+    QFETCH(int, depth);
+    QFETCH(int, transferSize);
+
+    // An odd chunk size leaves a short piece at the end of every chunk
+    QVERIFY(writeEndpoint(depth, transferSize, 3 * transferSize + 100));
+
+    QFile file(IN_ENDPOINT);
+    QVERIFY(file.open(QIODevice::ReadOnly));
+    QVERIFY(file.readAll() == m_pattern);
+}
+
+void ThreadIO_test::testBulkWriterStopped()
+{
+    BulkWriterThread writer;
+    WriteCompletions completions;
+    char data[512];
+
+    // Nothing would ever write the buffer, so it fails right away
+    QVERIFY(writer.enqueue((const quint8 *)data, sizeof data, true,
+                           bufferWritten, &completions));
+    QCOMPARE(completions.done.load(), 1);
+    QCOMPARE(completions.failed.load(), 1);
+}
+
+void ThreadIO_test::testBulkWriterFlush()
+{
+    // A pipe nobody drains blocks the writer once it's full
+    int fds[2];
+    QVERIFY(pipe(fds) == 0);
+    BulkWriterThread writer;
+    writer.setFd(fds[1]);
+    writer.start();
+
+    WriteCompletions completions;
+    const int chunkSize = 256 * 1024;
+    for (int i = 0; i < 4; i++)
+        QVERIFY(writer.enqueue((const quint8 *)m_pattern.constData() + i * chunkSize, chunkSize,
+                               i == 3, bufferWritten, &completions));
+    QTest::qSleep(100);
+    QCOMPARE(completions.done.load(), 0);
+
+    // The one being written is stopped, the rest dropped
+    writer.flush();
+    QCOMPARE(completions.done.load(), 4);
+    QCOMPARE(completions.failed.load(), 4);
+
+    // What is queued afterwards goes out on its own
+    QVERIFY(fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0);
+    char sink[64 * 1024];
+    while (read(fds[0], sink, sizeof(sink)) > 0)
+        ;
+    WriteCompletions after;
+    QVERIFY(writer.enqueue((const quint8 *)m_pattern.constData(), 1000, true,
+                           bufferWritten, &after));
+    QElapsedTimer timer;
+    timer.start();
+    while (after.done.loadAcquire() < 1 && timer.elapsed() < TIMEOUT_MS)
+        QThread::yieldCurrentThread();
+    QCOMPARE(after.failed.load(), 0);
+    QByteArray written(1000, 0);
+    QCOMPARE(read(fds[0], written.data(), written.size()), (ssize_t)written.size());
+    QCOMPARE(written, m_pattern.left(written.size()));
+
+    writer.exitThread();
+    close(fds[0]);
+    close(fds[1]);
+}
+
+void ThreadIO_test::testTransferSizeRounding()
+{
+    BulkWriterThread writer;
+
+    // Only whole SuperSpeed packets, never an odd multiple of 512
+    writer.setTransferSize(3 * 1024 + 512);
+    QCOMPARE(writer.transferSize(), 3 * 1024);
+    writer.setTransferSize(512);
+    QCOMPARE(writer.transferSize(), 1024);
+    writer.setTransferSize(16384);
+    QCOMPARE(writer.transferSize(), 16384);
+}
+
+void ThreadIO_test::benchmarkBulkRead_data()
+{
+    addDepthColumns();
+}
+
+void ThreadIO_test::benchmarkBulkRead()
+{
+    QFETCH(int, depth);
+    QFETCH(int, transferSize);
+
+    QByteArray received;
+    QBENCHMARK {
+        QVERIFY(readEndpoint(depth, transferSize, &received));
+    }
+}
+
+void ThreadIO_test::benchmarkBulkWrite_data()
+{
+    addDepthColumns();
+}
+
+void ThreadIO_test::benchmarkBulkWrite()
+{
+    QFETCH(int, depth);
+    QFETCH(int, transferSize);
+
+    QBENCHMARK {
+        QVERIFY(writeEndpoint(depth, transferSize, transferSize * 4));
+    }
+}
+
+QTEST_MAIN(ThreadIO_test);
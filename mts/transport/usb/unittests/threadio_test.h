@@ -0,0 +1,75 @@
+/*
+* This file is part of libmeegomtp package
+*
+* Copyright (C) 2010 Nokia Corporation. All rights reserved.
+*
+* Contact: Deepak Kodihalli <deepak.kodihalli@nokia.com>
+*
+* Redistribution and use in source and binary forms, with or without modification,
+* are permitted provided that the following conditions are met:
+*
+* Redistributions of source code must retain the above copyright notice, this list
+* of conditions and the following disclaimer. Redistributions in binary form must
+* reproduce the above copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided with the distribution.
+* Neither the name of Nokia Corporation nor the names of its contributors may be
+* used to endorse or promote products derived from this software without specific
+* prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+* IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+* INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+* BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+* DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+* LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+* OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+* OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+#ifndef THREADIO_TEST_H
+#define THREADIO_TEST_H
+
+#include <QtTest/QtTest>
+#include <QObject>
+#include <QByteArray>
+
+namespace meegomtp1dot0
+{
+/// Exercises the bulk endpoint threads against regular files, which stand
+/// in for the FunctionFS endpoint files when no gadget hardware is around.
+class ThreadIO_test : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void cleanupTestCase();
+    void testBulkRead_data();
+    void testBulkRead();
+    void testBulkReadAutoTune_data();
+    void testBulkReadAutoTune();
+    void testBulkWrite_data();
+    void testBulkWrite();
+    void testBulkWriterStopped();
+    void testBulkWriterFlush();
+    void testTransferSizeRounding();
+    void benchmarkBulkRead_data();
+    void benchmarkBulkRead();
+    void benchmarkBulkWrite_data();
+    void benchmarkBulkWrite();
+
+private:
+    void addDepthColumns();
+    bool readEndpoint(int depth, int transferSize, QByteArray *received,
+                      bool autoTune = false);
+    bool writeEndpoint(int depth, int transferSize, int chunkSize);
+
+    QByteArray m_pattern;
+    int m_tunedTransferSize;
+};
+}
+
+#endif
@@ -0,0 +1,34 @@
+CONFIG += warn_off debug_and_release link_pkgconfig
+
+equals(QT_MAJOR_VERSION, 4): PKGCONFIG += buteosyncfw
+equals(QT_MAJOR_VERSION, 5): PKGCONFIG += buteosyncfw5
+
+TEMPLATE = app
+TARGET = transport-test
+QT += testlib
+QT -= gui
+DEFINES += UT_ON
+
+DEPENDPATH += . \
+              .. \
+              ../../../common
+
+INCLUDEPATH += . \
+               .. \
+               ../../.. \
+               ../../../common
+
+# Input
+HEADERS += threadio_test.h \
+           ../threadio.h \
+           ../../../common/bufferpool.h
+
+SOURCES += threadio_test.cpp \
+           ../threadio.cpp \
+           ../../../common/bufferpool.cpp
+
+target.path = /opt/tests/buteo-mtp/
+INSTALLS += target
+
+#clean
+QMAKE_CLEAN += $(TARGET)